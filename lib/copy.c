@@ -5,53 +5,907 @@
 
 #include "config.h"
 #include "copy.h"
+#include "probes.h"
+#include "xxh64.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#	include <sys/sendfile.h>
+#endif
 
 #ifdef HAVE_LIBATTR
 #	include <attr/libattr.h>
 #endif
 
-int ai_mv(const char *source, const char *dest) {
-	if (!rename(source, dest))
-		return 0;
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#ifndef AI_BUFSIZE
+#	define AI_BUFSIZE 65536
+#endif
+
+/**
+ * AI_COPY_CHUNK
+ *
+ * Maximal amount of data copied by a single in-kernel copying call.
+ */
+#define AI_COPY_CHUNK 0x40000000
+
+#ifndef AI_COPY_CHUNKED_MIN
+/**
+ * AI_COPY_CHUNKED_MIN
+ *
+ * Minimal size of a file to be copied in parallel, in chunks.
+ */
+#	define AI_COPY_CHUNKED_MIN (64 * 1024 * 1024)
+#endif
+
+#ifndef AI_COPY_CHUNKED_SIZE
+/**
+ * AI_COPY_CHUNKED_SIZE
+ *
+ * Size of a single chunk copied in parallel.
+ */
+#	define AI_COPY_CHUNKED_SIZE (8 * 1024 * 1024)
+#endif
+
+#ifndef AI_COPY_DROP_WINDOW
+/**
+ * AI_COPY_DROP_WINDOW
+ *
+ * Amount of data written before its writeback is started, when dropping
+ * the copied data from the page cache. It also limits a single in-kernel
+ * copying call when dropping or throttling.
+ */
+#	define AI_COPY_DROP_WINDOW (8 * 1024 * 1024)
+#endif
+
+#ifndef AI_COPY_DIRECT_MIN
+/**
+ * AI_COPY_DIRECT_MIN
+ *
+ * Minimal size of a file to be copied using O_DIRECT.
+ */
+#	define AI_COPY_DIRECT_MIN (16 * 1024 * 1024)
+#endif
+
+/**
+ * AI_COPY_DIRECT_ALIGN
+ *
+ * Alignment of the buffer, offsets and lengths used with O_DIRECT. It needs
+ * to be a multiple of the logical block size of the devices.
+ */
+#define AI_COPY_DIRECT_ALIGN 4096
+
+/**
+ * AI_COPY_DIRECT_BUFSIZE
+ *
+ * Size of the data buffer used with O_DIRECT.
+ */
+#define AI_COPY_DIRECT_BUFSIZE (1024 * 1024)
+
+/**
+ * AI_COPY_THROTTLE_BURST
+ *
+ * The time worth of I/O which can be performed at once when throttling,
+ * in microseconds.
+ */
+#define AI_COPY_THROTTLE_BURST 100000
+
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+#	define AI_COPY_HAVE_DIRECT 1
+#endif
+
+/**
+ * ai_copy_bucket
+ * @rate: number of tokens per second, or 0 for no limit
+ * @next: the time (in microseconds) when all the tokens taken so far are
+ *	refilled
+ *
+ * A token bucket, kept as the time its debt is paid off, so that no refill
+ * is necessary.
+ */
+struct ai_copy_bucket {
+	unsigned long long int rate;
+	unsigned long long int next;
+};
+
+/**
+ * ai_copy_throttle
+ * @buckets: the token buckets for bytes copied and metadata operations
+ * @lock: the lock protecting @buckets
+ *
+ * A set of I/O rate limits.
+ */
+struct ai_copy_throttle {
+	struct ai_copy_bucket buckets[2];
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+int ai_copy_throttle_new(unsigned long long int bandwidth,
+		unsigned long int iops, ai_copy_throttle_t *ret) {
+	struct ai_copy_throttle *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return errno;
+
+	t->buckets[0].rate = bandwidth;
+	t->buckets[1].rate = iops;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&t->lock, NULL);
+#endif
+
+	*ret = t;
+	return 0;
+}
+
+void ai_copy_throttle_free(ai_copy_throttle_t t) {
+	if (!t)
+		return;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&t->lock);
+#endif
+	free(t);
+}
+
+/**
+ * ai_copy_now
+ *
+ * Get the monotonic time, if possible.
+ *
+ * Returns: the current time in microseconds
+ */
+static unsigned long long int ai_copy_now(void) {
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+/**
+ * ai_copy_bucket_take
+ * @b: the token bucket
+ * @n: number of tokens to take
+ * @now: the current time in microseconds
+ *
+ * Take @n tokens from the bucket, possibly going into debt.
+ *
+ * Returns: the time to sleep until the debt is paid off, in microseconds
+ */
+static unsigned long long int ai_copy_bucket_take(struct ai_copy_bucket *b,
+		unsigned long long int n, unsigned long long int now) {
+	/* the unused tokens are kept for a short burst only */
+	if (b->next + AI_COPY_THROTTLE_BURST < now)
+		b->next = now - AI_COPY_THROTTLE_BURST;
+	b->next += n * 1000000 / b->rate;
+
+	return b->next > now ? b->next - now : 0;
+}
+
+void ai_copy_throttle(ai_copy_throttle_t t, unsigned long long int bytes,
+		unsigned long int ops) {
+	unsigned long long int now, delay = 0, d;
+	struct timespec ts;
+
+	if (!t || ((!t->buckets[0].rate || !bytes)
+			&& (!t->buckets[1].rate || !ops)))
+		return;
+
+	now = ai_copy_now();
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&t->lock);
+#endif
+	if (t->buckets[0].rate && bytes)
+		delay = ai_copy_bucket_take(&t->buckets[0], bytes, now);
+	if (t->buckets[1].rate && ops) {
+		d = ai_copy_bucket_take(&t->buckets[1], ops, now);
+		if (d > delay)
+			delay = d;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&t->lock);
+#endif
+
+	ts.tv_sec = delay / 1000000;
+	ts.tv_nsec = (delay % 1000000) * 1000;
+	while (delay && nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/**
+ * ai_copy_pair
+ * @source: device of the source directories
+ * @dest: device of the destination directories
+ * @link: 0 if link() and rename() between the devices fail with EXDEV,
+ *	2 if link() is known to work, 1 if not known yet
+ * @strategy: the strategy used to copy the file contents,
+ *	or %AI_COPY_NONE if not probed yet
+ *
+ * The cached copying strategies for a pair of devices.
+ */
+struct ai_copy_pair {
+	dev_t source, dest;
+	int link;
+	ai_copy_strategy_t strategy;
+};
+
+/**
+ * ai_copy_dir
+ * @path: the last directory looked up, or %NULL
+ * @len: length of @path
+ * @size: allocated size of @path
+ * @dev: device of @path
+ *
+ * The device of the last directory looked up, in order to stat() only
+ * the first file in each directory.
+ */
+struct ai_copy_dir {
+	char *path;
+	size_t len, size;
+	dev_t dev;
+};
+
+/**
+ * ai_copy_ctx
+ * @buf: the data buffer, or %NULL if not allocated yet
+ * @bufsize: size of @buf, allocated when first used
+ * @linkbuf: the symlink target buffer, or %NULL if not allocated yet
+ * @linkbufsize: allocated size of @linkbuf
+ * @pairs: the probed device pairs
+ * @npairs: number of entries in @pairs
+ * @sdir: the last source directory
+ * @ddir: the last destination directory
+ * @exdev: whether rename() failed with EXDEV already
+ * @hashing: whether the copied data is to be hashed
+ * @hashed: whether the last copying call has hashed the data
+ * @hash: the hashing state
+ * @dbuf: the aligned data buffer for O_DIRECT, AI_COPY_DIRECT_BUFSIZE long,
+ *	or %NULL if not allocated yet
+ * @pos: number of bytes of the current file copied sequentially
+ * @flushed: offset up to which the writeback of the current file was started
+ * @dropped: offset up to which the current file was dropped from the page cache
+ * @stats: the copying statistics
+ * @jobs: the number of threads copying a large file
+ * @cache_policy: the page cache policy for copying file contents
+ * @strategy_limit: the fastest strategy allowed, or %AI_COPY_NONE for no limit
+ * @throttle: the I/O rate limits, or %NULL
+ *
+ * The buffers, cached strategies, statistics and settings of a copying
+ * context.
+ */
+struct ai_copy_ctx {
+	char *buf;
+	size_t bufsize;
+	char *linkbuf;
+	size_t linkbufsize;
+
+	struct ai_copy_pair *pairs;
+	size_t npairs;
+	struct ai_copy_dir sdir, ddir;
+	int exdev;
+
+	int hashing, hashed;
+	ai_xxh64_t hash;
+
+	char *dbuf;
+	off_t pos, flushed, dropped;
+
+	ai_copy_stats_t stats;
+
+	unsigned int jobs;
+	ai_copy_cache_policy_t cache_policy;
+	ai_copy_strategy_t strategy_limit;
+	ai_copy_throttle_t throttle;
+};
+
+/**
+ * ai_copy_strategy_callback
+ *
+ * The function reporting the probed strategies, or %NULL.
+ */
+static ai_copy_strategy_callback_t ai_copy_strategy_callback = NULL;
+
+void ai_copy_set_strategy_callback(ai_copy_strategy_callback_t callback) {
+	ai_copy_strategy_callback = callback;
+}
+
+const char *ai_copy_strategy_name(ai_copy_strategy_t strategy) {
+	switch (strategy) {
+		case AI_COPY_LINK:
+			return "link";
+		case AI_COPY_REFLINK:
+			return "reflink";
+		case AI_COPY_FILE_RANGE:
+			return "copy_file_range";
+		case AI_COPY_SENDFILE:
+			return "sendfile";
+		case AI_COPY_READ_WRITE:
+			return "read/write";
+		default:
+			return "none";
+	}
+}
+
+/**
+ * ai_copy_dir_dev
+ * @d: the directory cache
+ * @path: file path
+ * @dev: location to store the device in
+ *
+ * Get the device of the directory containing @path. The device is cached,
+ * so that stat() is called only when the directory changes.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_copy_dir_dev(struct ai_copy_dir *d, const char *path, dev_t *dev) {
+	const char *slash = strrchr(path, '/');
+	const size_t len = !slash ? 0 : slash == path ? 1 : (size_t) (slash - path);
+	struct stat st;
+
+	if (d->path && len && d->len == len && !memcmp(d->path, path, len)) {
+		*dev = d->dev;
+		return 0;
+	}
+
+	if (d->size <= len) {
+		char *buf = realloc(d->path, len + 1);
+
+		if (!buf)
+			return errno;
+		d->path = buf;
+		d->size = len + 1;
+	}
+	memcpy(d->path, path, len);
+	d->path[len] = 0;
+
+	/* relative to the working directory, which may change */
+	d->len = 0;
+	if (stat(len ? d->path : ".", &st))
+		return errno;
+
+	d->len = len;
+	*dev = d->dev = st.st_dev;
+	return 0;
+}
+
+/**
+ * ai_copy_probes
+ *
+ * The strategies probed by all the copying contexts, used to initialize
+ * the device pairs of the new ones.
+ */
+static ai_copy_probe_t *ai_copy_probes = NULL;
+
+/**
+ * ai_copy_nprobes
+ *
+ * The number of entries in ai_copy_probes.
+ */
+static size_t ai_copy_nprobes = 0;
+
+#ifdef HAVE_PTHREAD
+/**
+ * ai_copy_probes_lock
+ *
+ * The lock protecting ai_copy_probes.
+ */
+static pthread_mutex_t ai_copy_probes_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * ai_copy_probe_find
+ * @source: the source device
+ * @dest: the destination device
+ *
+ * Find the probed strategies for the device pair. The caller must hold
+ * ai_copy_probes_lock.
+ *
+ * Returns: the probed device pair, or %NULL if not probed yet
+ */
+static ai_copy_probe_t *ai_copy_probe_find(dev_t source, dev_t dest) {
+	size_t i;
+
+	for (i = 0; i < ai_copy_nprobes; i++) {
+		if (ai_copy_probes[i].source == source
+				&& ai_copy_probes[i].dest == dest)
+			return &ai_copy_probes[i];
+	}
+	return NULL;
+}
+
+/**
+ * ai_copy_probe_store
+ * @probe: the probe result
+ *
+ * Merge the known parts of @probe into the probed strategies. The caller
+ * must hold ai_copy_probes_lock.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+static int ai_copy_probe_store(const ai_copy_probe_t *probe) {
+	ai_copy_probe_t *p = ai_copy_probe_find(probe->source, probe->dest);
+
+	if (!p) {
+		p = realloc(ai_copy_probes, (ai_copy_nprobes + 1) * sizeof(*p));
+		if (!p)
+			return errno;
+		ai_copy_probes = p;
+
+		p = &ai_copy_probes[ai_copy_nprobes++];
+		p->source = probe->source;
+		p->dest = probe->dest;
+		p->link = 1;
+		p->strategy = AI_COPY_NONE;
+	}
+
+	if (probe->link != 1)
+		p->link = probe->link;
+	if (probe->strategy != AI_COPY_NONE)
+		p->strategy = probe->strategy;
+	return 0;
+}
+
+size_t ai_copy_get_probes(ai_copy_probe_t *probes, size_t count) {
+	size_t ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_copy_probes_lock);
+#endif
+	ret = ai_copy_nprobes;
+	if (count > ret)
+		count = ret;
+	if (count)
+		memcpy(probes, ai_copy_probes, count * sizeof(*probes));
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_copy_probes_lock);
+#endif
+	return ret;
+}
+
+int ai_copy_add_probes(const ai_copy_probe_t *probes, size_t count) {
+	size_t i;
+	int ret = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_copy_probes_lock);
+#endif
+	for (i = 0; i < count && !ret; i++) {
+		if (probes[i].link < 0 || probes[i].link > 2
+				|| probes[i].strategy > AI_COPY_READ_WRITE)
+			ret = EINVAL;
+		else
+			ret = ai_copy_probe_store(&probes[i]);
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_copy_probes_lock);
+#endif
+	return ret;
+}
+
+void ai_copy_clear_probes(void) {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_copy_probes_lock);
+#endif
+	free(ai_copy_probes);
+	ai_copy_probes = NULL;
+	ai_copy_nprobes = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_copy_probes_lock);
+#endif
+}
+
+/**
+ * ai_copy_pair_get
+ * @c: the copying context
+ * @source: device of the source directory
+ * @dest: device of the destination directory
+ *
+ * Find the cached strategies for the device pair, adding a new entry if
+ * necessary.
+ *
+ * Returns: the device pair, or %NULL if memory can't be allocated
+ */
+static struct ai_copy_pair *ai_copy_pair_get(struct ai_copy_ctx *c,
+		dev_t source, dev_t dest) {
+	struct ai_copy_pair *p;
+	size_t i;
+
+	for (i = 0; i < c->npairs; i++) {
+		if (c->pairs[i].source == source && c->pairs[i].dest == dest)
+			return &c->pairs[i];
+	}
+
+	p = realloc(c->pairs, (c->npairs + 1) * sizeof(*p));
+	if (!p)
+		return NULL;
+	c->pairs = p;
+
+	p = &c->pairs[c->npairs++];
+	p->source = source;
+	p->dest = dest;
+	p->link = 1;
+	p->strategy = AI_COPY_NONE;
+
+	/* start with what the other contexts have found */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_copy_probes_lock);
+#endif
+	{
+		const ai_copy_probe_t *probe = ai_copy_probe_find(source, dest);
+
+		if (probe) {
+			p->link = probe->link;
+			p->strategy = probe->strategy;
+		}
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_copy_probes_lock);
+#endif
+	return p;
+}
+
+/**
+ * ai_copy_pair_publish
+ * @c: the copying context
+ * @p: the device pair
+ *
+ * Share the strategies cached for the device pair with the other contexts.
+ * The strategies chosen under a limit are not shared, since they could be
+ * slower than necessary.
+ */
+static void ai_copy_pair_publish(const struct ai_copy_ctx *c,
+		const struct ai_copy_pair *p) {
+	ai_copy_probe_t probe;
+
+	if (c->strategy_limit != AI_COPY_NONE)
+		return;
+
+	probe.source = p->source;
+	probe.dest = p->dest;
+	probe.link = p->link;
+	probe.strategy = p->strategy;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_copy_probes_lock);
+#endif
+	/* the probes are only a hint, so a failure is not fatal */
+	ai_copy_probe_store(&probe);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_copy_probes_lock);
+#endif
+}
+
+/**
+ * ai_copy_pair_paths
+ * @c: the copying context
+ * @source: source file path
+ * @dest: destination file path
+ *
+ * Find the cached strategies for copying between the directories containing
+ * @source and @dest.
+ *
+ * Returns: the device pair, or %NULL if it can't be determined
+ */
+static struct ai_copy_pair *ai_copy_pair_paths(struct ai_copy_ctx *c,
+		const char *source, const char *dest) {
+	dev_t sdev, ddev;
+
+	if (ai_copy_dir_dev(&c->sdir, source, &sdev)
+			|| ai_copy_dir_dev(&c->ddir, dest, &ddev))
+		return NULL;
+	return ai_copy_pair_get(c, sdev, ddev);
+}
+
+/**
+ * ai_copy_pair_set
+ * @c: the copying context
+ * @p: the device pair
+ * @strategy: the strategy which worked
+ *
+ * Cache and report the strategy for copying the file contents, or report
+ * that linking works.
+ */
+static void ai_copy_pair_set(const struct ai_copy_ctx *c,
+		struct ai_copy_pair *p, ai_copy_strategy_t strategy) {
+	if (strategy == AI_COPY_LINK) {
+		if (p->link == 2)
+			return;
+		/* the probe result is known */
+		p->link = 2;
+	} else if (p->strategy == strategy)
+		return;
+	else
+		p->strategy = strategy;
+	ai_copy_pair_publish(c, p);
+
+	AI_PROBE3(copy__strategy, (unsigned long int) p->source,
+			(unsigned long int) p->dest, (int) strategy);
+	if (ai_copy_strategy_callback)
+		ai_copy_strategy_callback(p->source, p->dest, strategy);
+}
+
+/**
+ * ai_copy_default
+ *
+ * The context used by the functions which don't take one, and when %NULL
+ * is passed as the context.
+ */
+static struct ai_copy_ctx ai_copy_default = {
+	.bufsize = AI_BUFSIZE,
+	.jobs = 1
+};
+
+int ai_copy_ctx_new(ai_copy_ctx_t *ret) {
+	struct ai_copy_ctx *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return errno;
+
+	c->bufsize = AI_BUFSIZE;
+	c->jobs = 1;
+	c->cache_policy = AI_COPY_CACHE_KEEP;
+	c->strategy_limit = AI_COPY_NONE;
+	c->throttle = NULL;
+
+	*ret = c;
+	return 0;
+}
+
+void ai_copy_ctx_free(ai_copy_ctx_t c) {
+	free(c->buf);
+	free(c->linkbuf);
+	free(c->dbuf);
+	free(c->pairs);
+	free(c->sdir.path);
+	free(c->ddir.path);
+	free(c);
+}
+
+int ai_copy_ctx_set_jobs(ai_copy_ctx_t c, unsigned int jobs) {
+	if (!jobs || jobs > AI_COPY_MAX_JOBS)
+		return EINVAL;
+#ifndef HAVE_PTHREAD
+	if (jobs > 1)
+		return ENOSYS;
+#endif
+	if (!c)
+		c = &ai_copy_default;
+
+	c->jobs = jobs;
+	return 0;
+}
+
+int ai_copy_ctx_set_cache_policy(ai_copy_ctx_t c,
+		ai_copy_cache_policy_t policy) {
+	switch (policy) {
+		case AI_COPY_CACHE_KEEP:
+		case AI_COPY_CACHE_DROP:
+			break;
+		case AI_COPY_CACHE_DIRECT:
+#ifndef AI_COPY_HAVE_DIRECT
+			return ENOSYS;
+#endif
+			break;
+		default:
+			return EINVAL;
+	}
+	if (!c)
+		c = &ai_copy_default;
+
+	c->cache_policy = policy;
+	return 0;
+}
+
+void ai_copy_ctx_set_bufsize(ai_copy_ctx_t c, size_t size) {
+	if (!c)
+		c = &ai_copy_default;
+	if (!size)
+		size = AI_BUFSIZE;
+
+	/* reallocated on the next copy */
+	if (size != c->bufsize) {
+		free(c->buf);
+		c->buf = NULL;
+		c->bufsize = size;
+	}
+}
+
+void ai_copy_ctx_set_throttle(ai_copy_ctx_t c, ai_copy_throttle_t t) {
+	if (!c)
+		c = &ai_copy_default;
+
+	c->throttle = t;
+}
+
+int ai_copy_ctx_set_strategy(ai_copy_ctx_t c, ai_copy_strategy_t strategy) {
+	if (strategy > AI_COPY_READ_WRITE)
+		return EINVAL;
+	if (!c)
+		c = &ai_copy_default;
+
+	c->strategy_limit = strategy;
+	return 0;
+}
+
+void ai_copy_ctx_set_hashing(ai_copy_ctx_t c, int enable) {
+	if (!c)
+		c = &ai_copy_default;
+
+	c->hashing = enable;
+	c->hashed = 0;
+}
+
+int ai_copy_ctx_get_hash(ai_copy_ctx_t c, unsigned long long int *hash) {
+	if (!c)
+		c = &ai_copy_default;
+
+	if (!c->hashed)
+		return ENOENT;
+
+	*hash = ai_xxh64_final(&c->hash);
+	return 0;
+}
+
+int ai_copy_hash_file(const char *path, unsigned long long int *hash) {
+	return ai_copy_ctx_hash_file(NULL, path, hash);
+}
+
+int ai_copy_ctx_hash_file(ai_copy_ctx_t c, const char *path,
+		unsigned long long int *hash) {
+	char buf[AI_BUFSIZE];
+	ai_xxh64_t h;
+	ssize_t ret;
+	int fd;
+
+	if (!c)
+		c = &ai_copy_default;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	ai_xxh64_init(&h);
+	while ((ret = read(fd, buf, sizeof(buf)))) {
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = errno;
+			close(fd);
+			return ret;
+		}
+		ai_xxh64_update(&h, buf, ret);
+	}
+#ifdef HAVE_POSIX_FADVISE
+	if (c->cache_policy != AI_COPY_CACHE_KEEP)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fd);
+
+	*hash = ai_xxh64_final(&h);
+	return 0;
+}
+
+void ai_copy_ctx_get_stats(ai_copy_ctx_t c, ai_copy_stats_t *st) {
+	if (!c)
+		c = &ai_copy_default;
+
+	*st = c->stats;
+}
+
+int ai_copy_ctx_mv(ai_copy_ctx_t c, const char *source, const char *dest) {
+	struct ai_copy_pair *p = NULL;
+	int ret;
+
+	if (!c)
+		c = &ai_copy_default;
+	c->hashed = 0;
+
+	/* the moves are usually within a single device, so don't look
+	 * the devices up until the first failure */
+	if (c->exdev)
+		p = ai_copy_pair_paths(c, source, dest);
+
+	if (!p || p->link) {
+		if (!rename(source, dest))
+			return 0;
+		if (errno != EXDEV)
+			return errno;
 
-	/* cross-device? try manually. */
-	if (errno == EXDEV) {
-		int ret = ai_cp_a(source, dest);
-		if (!ret)
-			unlink(source);
-		return ret;
+		AI_PROBE3(copy__fallback, dest, (int) AI_COPY_LINK, EXDEV);
+		c->exdev = 1;
+		if (!p)
+			p = ai_copy_pair_paths(c, source, dest);
+		if (p) {
+			p->link = 0;
+			ai_copy_pair_publish(c, p);
+		}
 	}
 
-	return errno;
+	/* cross-device, move manually. */
+	ret = ai_copy_ctx_cp_a(c, source, dest);
+	if (!ret)
+		unlink(source);
+	return ret;
 }
 
-int ai_cp_l(const char *source, const char *dest) {
+int ai_copy_ctx_cp_l(ai_copy_ctx_t c, const char *source, const char *dest) {
+	struct ai_copy_pair *p;
+
+	if (!c)
+		c = &ai_copy_default;
+	c->hashed = 0;
+
 	/* link() will not overwrite */
 	if (unlink(dest) && errno != ENOENT)
 		return errno;
 
-	if (!link(source, dest))
-		return 0;
+	p = ai_copy_pair_paths(c, source, dest);
+	if ((!p || p->link) && c->strategy_limit <= AI_COPY_LINK) {
+		if (!link(source, dest)) {
+			c->stats.links++;
+			if (p)
+				ai_copy_pair_set(c, p, AI_COPY_LINK);
+			return 0;
+		}
+
+		/* EACCES and EPERM depend on the file, so they aren't cached */
+		if (errno == EXDEV && p) {
+			p->link = 0;
+			ai_copy_pair_publish(c, p);
+		} else if (errno != EXDEV && errno != EACCES && errno != EPERM)
+			return errno;
+		AI_PROBE3(copy__fallback, dest, (int) AI_COPY_LINK, errno);
+	}
 
 	/* cross-device or not supported? try manually. */
-	if (errno == EXDEV || errno == EACCES || errno == EPERM)
-		return ai_cp_a(source, dest);
+	return ai_copy_ctx_cp_a(c, source, dest);
+}
+
+int ai_mv(const char *source, const char *dest) {
+	return ai_copy_ctx_mv(NULL, source, dest);
+}
+
+int ai_cp_l(const char *source, const char *dest) {
+	return ai_copy_ctx_cp_l(NULL, source, dest);
+}
 
-	return errno;
+int ai_cp_a(const char *source, const char *dest) {
+	return ai_copy_ctx_cp_a(NULL, source, dest);
 }
 
 /**
  * ai_cp_symlink
+ * @c: the copying context
  * @source: current file path
  * @dest: new complete file path
  * @symlen: symlink length (obligatory)
@@ -64,36 +918,91 @@ int ai_cp_l(const char *source, const char *dest) {
  *
  * Returns: 0 on success, errno on failure
  */
-static int ai_cp_symlink(const char *source, const char *dest, ssize_t symlen) {
-	static char *buf = NULL;
-	static ssize_t bufsize;
-
+static int ai_cp_symlink(struct ai_copy_ctx *c, const char *source,
+		const char *dest, ssize_t symlen) {
 	/* ensure buffer is at least symlen+1 long */
-	if (!buf || bufsize <= symlen) {
-		bufsize = symlen + 1;
-		buf = realloc(buf, bufsize);
+	if (!c->linkbuf || c->linkbufsize <= (size_t) symlen) {
+		char *buf = realloc(c->linkbuf, symlen + 1);
+
 		if (!buf)
 			return errno;
+		c->linkbuf = buf;
+		c->linkbufsize = symlen + 1;
 	}
 
 	/* ensure content length didn't change */
-	if (readlink(source, buf, bufsize) != symlen)
+	if (readlink(source, c->linkbuf, c->linkbufsize) != symlen)
 		return EINVAL; /* XXX? */
 
 	/* null terminate */
-	buf[symlen + 1] = 0;
+	c->linkbuf[symlen] = 0;
 
-	if (symlink(buf, dest))
+	if (symlink(c->linkbuf, dest))
 		return errno;
 	return 0;
 }
 
-#ifndef AI_BUFSIZE
-#	define AI_BUFSIZE 65536
+/**
+ * ai_copy_drop_range
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @off: offset of the range
+ * @len: length of the range
+ *
+ * Wait for the writeback of a copied range, and drop it from the page cache
+ * in both files.
+ */
+static void ai_copy_drop_range(int fd_in, int fd_out, off_t off, off_t len) {
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(fd_out, off, len, SYNC_FILE_RANGE_WAIT_BEFORE
+			| SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd_in, off, len, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd_out, off, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/**
+ * ai_copy_drop
+ * @c: the copying context
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @final: whether the file is copied completely
+ *
+ * Drop the data copied sequentially from the page cache, if the cache policy
+ * requests that. The writeback of every AI_COPY_DROP_WINDOW of data is started
+ * as soon as it is written, and the previous window is dropped then, so that
+ * copying doesn't wait for the disk most of the time. The remaining data is
+ * written back and dropped when @final is set.
+ */
+static void ai_copy_drop(struct ai_copy_ctx *c, int fd_in, int fd_out,
+		int final) {
+	off_t end;
+
+	if (c->cache_policy == AI_COPY_CACHE_KEEP
+			|| (!final && c->pos - c->flushed < AI_COPY_DROP_WINDOW))
+		return;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (c->pos > c->flushed)
+		sync_file_range(fd_out, c->flushed, c->pos - c->flushed,
+				SYNC_FILE_RANGE_WRITE);
+	end = final ? c->pos : c->flushed;
+#else
+	/* the dirty pages can't be dropped until written back */
+	end = final && !fdatasync(fd_out) ? c->pos : c->dropped;
 #endif
 
+	if (end > c->dropped)
+		ai_copy_drop_range(fd_in, fd_out, c->dropped, end - c->dropped);
+	c->flushed = c->pos;
+	c->dropped = end;
+}
+
 /**
  * ai_splice
+ * @c: the copying context, with the data buffer allocated
  * @fd_in: input fd
  * @fd_out: output fd
  *
@@ -102,18 +1011,22 @@ static int ai_cp_symlink(const char *source, const char *dest, ssize_t symlen) {
  * Returns: positive number on success, 0 on EOF, -1 on failure
  *	(and errno is set then)
  */
-static int ai_splice(int fd_in, int fd_out) {
-	static char buf[AI_BUFSIZE];
-	char *bufp = buf;
+static int ai_splice(struct ai_copy_ctx *c, int fd_in, int fd_out) {
+	char *bufp = c->buf;
 	ssize_t ret, wr = 0;
 
-	ret = read(fd_in, buf, sizeof(buf));
+	ret = read(fd_in, c->buf, c->bufsize);
 	if (ret == -1) {
 		if (errno == EINTR)
 			return 1;
 		else
 			return -1;
 	}
+	c->stats.bytes += ret;
+	c->pos += ret;
+	if (c->hashing)
+		ai_xxh64_update(&c->hash, c->buf, ret);
+	ai_copy_throttle(c->throttle, ret, 0);
 
 	while (ret > 0) {
 		wr = write(fd_out, bufp, ret);
@@ -129,8 +1042,453 @@ static int ai_splice(int fd_in, int fd_out) {
 	return wr;
 }
 
+/**
+ * ai_copy_kernel
+ * @c: the copying context
+ * @strategy: %AI_COPY_FILE_RANGE or %AI_COPY_SENDFILE
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @started: set to 1 when any data has been copied
+ *
+ * Copy the data from @fd_in to @fd_out using an in-kernel copying call.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_copy_kernel(struct ai_copy_ctx *c, ai_copy_strategy_t strategy,
+		int fd_in, int fd_out, int *started) {
+	/* stop at every window, in order to drop or throttle it */
+	const size_t chunk = c->cache_policy == AI_COPY_CACHE_KEEP
+			&& (!c->throttle || !c->throttle->buckets[0].rate)
+		? AI_COPY_CHUNK : AI_COPY_DROP_WINDOW;
+	ssize_t ret;
+
+	do {
+		switch (strategy) {
+#ifdef HAVE_COPY_FILE_RANGE
+			case AI_COPY_FILE_RANGE:
+				ret = copy_file_range(fd_in, NULL, fd_out, NULL,
+						chunk, 0);
+				break;
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+			case AI_COPY_SENDFILE:
+				ret = sendfile(fd_out, fd_in, NULL, chunk);
+				break;
+#endif
+			default:
+				errno = ENOSYS;
+				ret = -1;
+		}
+
+		if (ret == -1) {
+			if (errno != EINTR)
+				return errno;
+		} else if (ret > 0) {
+			c->stats.bytes += ret;
+			c->pos += ret;
+			*started = 1;
+			ai_copy_drop(c, fd_in, fd_out, 0);
+			ai_copy_throttle(c->throttle, ret, 0);
+		}
+	} while (ret);
+
+	return 0;
+}
+
+/**
+ * ai_copy_data
+ * @c: the copying context, with the data buffer allocated
+ * @strategy: the copying strategy
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @expsize: expected file length
+ * @started: set to 1 when any data has been copied
+ *
+ * Copy the data from @fd_in to @fd_out using @strategy. If @started is not
+ * set on failure, the data can be copied using another strategy.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_copy_data(struct ai_copy_ctx *c, ai_copy_strategy_t strategy,
+		int fd_in, int fd_out, off_t expsize, int *started) {
+	int splret;
+
+	switch (strategy) {
+		case AI_COPY_REFLINK:
+#ifdef FICLONE
+			if (ioctl(fd_out, FICLONE, fd_in))
+				return errno;
+			c->stats.bytes += expsize;
+			return 0;
+#else
+			return ENOSYS;
+#endif
+		case AI_COPY_FILE_RANGE:
+		case AI_COPY_SENDFILE:
+			return ai_copy_kernel(c, strategy, fd_in, fd_out, started);
+		default:
+			*started = 1;
+			do {
+				splret = ai_splice(c, fd_in, fd_out);
+
+				if (splret == -1)
+					return errno;
+				ai_copy_drop(c, fd_in, fd_out, 0);
+			} while (splret > 0);
+			return 0;
+	}
+}
+
+/**
+ * ai_copy_unsupported
+ * @err: the error returned by ai_copy_data()
+ *
+ * Check whether @err means that the strategy doesn't work for the files.
+ *
+ * Returns: 1 if another strategy should be tried, 0 otherwise
+ */
+static int ai_copy_unsupported(int err) {
+	return err == ENOSYS || err == EXDEV || err == EINVAL
+#ifdef EOPNOTSUPP /* POSIX-2008 */
+		|| err == EOPNOTSUPP
+#endif
+#ifdef ENOTSUP /* glibc */
+		|| err == ENOTSUP
+#endif
+		;
+}
+
+#ifdef HAVE_PTHREAD
+
+/**
+ * ai_copy_chunked
+ * @c: the copying context, read-only while copying
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @size: number of bytes to copy
+ * @next: offset of the next chunk to copy
+ * @use_range: whether copy_file_range() is to be used
+ * @used_range: whether copy_file_range() has copied any data
+ * @error: the first error, or 0
+ * @bytes: number of bytes copied
+ * @lock: the lock protecting the fields above
+ *
+ * The state of copying a large file in parallel.
+ */
+struct ai_copy_chunked {
+	const struct ai_copy_ctx *c;
+	int fd_in, fd_out;
+	off_t size, next;
+	int use_range, used_range;
+	int error;
+	unsigned long long int bytes;
+
+	pthread_mutex_t lock;
+};
+
+/**
+ * ai_copy_chunk_range
+ * @ch: the copying state
+ * @off: chunk offset
+ * @len: chunk length
+ * @done: location to store the number of bytes copied in
+ *
+ * Copy a single chunk using copy_file_range().
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_copy_chunk_range(struct ai_copy_chunked *ch, off_t off,
+		size_t len, size_t *done) {
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t off_in = off, off_out = off;
+
+	while (*done < len) {
+		const ssize_t ret = copy_file_range(ch->fd_in, &off_in,
+				ch->fd_out, &off_out, len - *done, 0);
+
+		if (ret == -1) {
+			if (errno != EINTR)
+				return errno;
+		} else if (ret == 0) /* EOF */
+			break;
+		else {
+			*done += ret;
+			ai_copy_throttle(ch->c->throttle, ret, 0);
+		}
+	}
+
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+/**
+ * ai_copy_chunk_rw
+ * @ch: the copying state
+ * @buf: the data buffer
+ * @bufsize: size of @buf
+ * @off: chunk offset
+ * @len: chunk length
+ * @done: location to store the number of bytes copied in
+ *
+ * Copy a single chunk using pread() and pwrite().
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_copy_chunk_rw(struct ai_copy_chunked *ch, char *buf,
+		size_t bufsize, off_t off, size_t len, size_t *done) {
+	while (*done < len) {
+		const size_t rdlen = len - *done < bufsize ? len - *done : bufsize;
+		ssize_t ret = pread(ch->fd_in, buf, rdlen, off + *done);
+		size_t wr = 0;
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		} else if (ret == 0) /* EOF */
+			break;
+		ai_copy_throttle(ch->c->throttle, ret, 0);
+
+		while (wr < (size_t) ret) {
+			const ssize_t wret = pwrite(ch->fd_out, buf + wr, ret - wr,
+					off + *done + wr);
+
+			if (wret == -1) {
+				if (errno != EINTR)
+					return errno;
+			} else
+				wr += wret;
+		}
+		*done += ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_copy_chunked_run
+ * @arg: the copying state
+ *
+ * Copy the chunks of a large file until all of them are taken, or copying
+ * fails.
+ *
+ * Returns: %NULL
+ */
+static void *ai_copy_chunked_run(void *arg) {
+	struct ai_copy_chunked *ch = arg;
+	const size_t bufsize = ch->c->bufsize;
+	char *buf = NULL;
+
+	while (1) {
+		off_t off;
+		size_t len, done = 0;
+		int use_range, ranged, ret;
+
+		pthread_mutex_lock(&ch->lock);
+		if (ch->error || ch->next >= ch->size) {
+			pthread_mutex_unlock(&ch->lock);
+			break;
+		}
+		off = ch->next;
+		len = ch->size - off < AI_COPY_CHUNKED_SIZE
+			? (size_t) (ch->size - off) : AI_COPY_CHUNKED_SIZE;
+		ch->next += len;
+		use_range = ch->use_range;
+		pthread_mutex_unlock(&ch->lock);
+
+		ret = use_range ? ai_copy_chunk_range(ch, off, len, &done) : ENOSYS;
+		ranged = !ret;
+
+		/* copy_file_range() doesn't work for the files */
+		if (ret && !done && ai_copy_unsupported(ret)) {
+			ret = 0;
+			if (!buf) {
+				buf = malloc(bufsize);
+				if (!buf)
+					ret = errno;
+			}
+			if (!ret)
+				ret = ai_copy_chunk_rw(ch, buf, bufsize, off, len, &done);
+		}
+
+		/* the chunks are not contiguous, drop each one separately */
+		if (done && ch->c->cache_policy != AI_COPY_CACHE_KEEP)
+			ai_copy_drop_range(ch->fd_in, ch->fd_out, off, done);
+
+		pthread_mutex_lock(&ch->lock);
+		ch->bytes += done;
+		if (ranged)
+			ch->used_range = 1;
+		else
+			ch->use_range = 0;
+		if (ret && !ch->error)
+			ch->error = ret;
+		pthread_mutex_unlock(&ch->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/**
+ * ai_cp_chunked
+ * @c: the copying context
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @size: expected file length
+ * @use_range: whether to try copy_file_range()
+ * @used_range: set to 1 if copy_file_range() was used
+ *
+ * Copy a large file in chunks, using up to @c->jobs threads. The part
+ * of the file past @size, if any, is copied sequentially afterwards.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_cp_chunked(struct ai_copy_ctx *c, int fd_in, int fd_out,
+		off_t size, int use_range, int *used_range) {
+	const off_t chunks = (size + AI_COPY_CHUNKED_SIZE - 1) / AI_COPY_CHUNKED_SIZE;
+	struct ai_copy_chunked ch;
+	pthread_t threads[AI_COPY_MAX_JOBS];
+	unsigned int n, i;
+	int ret;
+
+	ch.c = c;
+	ch.fd_in = fd_in;
+	ch.fd_out = fd_out;
+	ch.size = size;
+	ch.next = 0;
+	ch.use_range = use_range;
+	ch.used_range = 0;
+	ch.error = 0;
+	ch.bytes = 0;
+	pthread_mutex_init(&ch.lock, NULL);
+
+	/* the calling thread copies too */
+	for (n = 0; n < c->jobs - 1 && n + 1 < chunks; n++) {
+		if (pthread_create(&threads[n], NULL, ai_copy_chunked_run, &ch))
+			break;
+	}
+	ai_copy_chunked_run(&ch);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ch.lock);
+	c->stats.bytes += ch.bytes;
+	*used_range = ch.used_range;
+	if (ch.error)
+		return ch.error;
+
+	/* the file has grown? */
+	if (lseek(fd_in, size, SEEK_SET) == -1 || lseek(fd_out, size, SEEK_SET) == -1)
+		return errno;
+	c->pos = c->flushed = c->dropped = size;
+	do {
+		ret = ai_splice(c, fd_in, fd_out);
+		if (ret == -1)
+			return errno;
+		ai_copy_drop(c, fd_in, fd_out, 0);
+	} while (ret > 0);
+
+	return 0;
+}
+
+#endif /*HAVE_PTHREAD*/
+
+#ifdef AI_COPY_HAVE_DIRECT
+
+/**
+ * ai_cp_direct
+ * @c: the copying context
+ * @fd_in: input fd
+ * @fd_out: output fd
+ * @started: set to 1 when any data has been copied
+ *
+ * Copy the data from @fd_in to @fd_out bypassing the page cache, using
+ * O_DIRECT. The final block, if shorter than AI_COPY_DIRECT_ALIGN, is written
+ * through the page cache. The data past the first short read (i.e. appended
+ * while copying) is left for the caller.
+ *
+ * Returns: 0 on success, EINVAL if O_DIRECT is not supported for the files,
+ *	errno otherwise
+ */
+static int ai_cp_direct(struct ai_copy_ctx *c, int fd_in, int fd_out,
+		int *started) {
+	const int fl_in = fcntl(fd_in, F_GETFL);
+	const int fl_out = fcntl(fd_out, F_GETFL);
+	int ret = 0;
+
+	if (fl_in == -1 || fl_out == -1)
+		return errno;
+
+	if (!c->dbuf) {
+		void *buf;
+
+		ret = posix_memalign(&buf, AI_COPY_DIRECT_ALIGN, AI_COPY_DIRECT_BUFSIZE);
+		if (ret)
+			return ret;
+		c->dbuf = buf;
+	}
+
+	if (fcntl(fd_in, F_SETFL, fl_in | O_DIRECT)
+			|| fcntl(fd_out, F_SETFL, fl_out | O_DIRECT))
+		ret = errno;
+
+	while (!ret) {
+		ssize_t rd = read(fd_in, c->dbuf, AI_COPY_DIRECT_BUFSIZE);
+		char *bufp = c->dbuf;
+
+		if (rd == -1) {
+			if (errno != EINTR)
+				ret = errno;
+			continue;
+		} else if (rd == 0)
+			break;
+
+		*started = 1;
+		c->stats.bytes += rd;
+		c->pos += rd;
+		if (c->hashing)
+			ai_xxh64_update(&c->hash, c->dbuf, rd);
+		ai_copy_throttle(c->throttle, rd, 0);
+
+		/* O_DIRECT writes need to be aligned */
+		if (rd % AI_COPY_DIRECT_ALIGN && fcntl(fd_out, F_SETFL, fl_out)) {
+			ret = errno;
+			break;
+		}
+
+		while (rd > 0) {
+			const ssize_t wr = write(fd_out, bufp, rd);
+
+			if (wr == -1) {
+				if (errno != EINTR) {
+					ret = errno;
+					break;
+				}
+			} else {
+				rd -= wr;
+				bufp += wr;
+			}
+		}
+
+		/* short read, the whole file was copied */
+		if (bufp - c->dbuf < AI_COPY_DIRECT_BUFSIZE)
+			break;
+	}
+
+	fcntl(fd_in, F_SETFL, fl_in);
+	fcntl(fd_out, F_SETFL, fl_out);
+	return ret;
+}
+
+#endif /*AI_COPY_HAVE_DIRECT*/
+
 /**
  * ai_cp_reg
+ * @c: the copying context
+ * @p: the cached strategies, or %NULL
  * @source: current file path
  * @dest: new complete file path
  * @expsize: expected file length (for preallocation)
@@ -138,19 +1496,62 @@ static int ai_splice(int fd_in, int fd_out) {
  * Copies the contents of @source to a new file at @dest (@dest is unlinked
  * first).
  *
- * The destination file will be preallocated to size @expsize if possible.
- * However, this is no hard limit and the actual file length may be larger.
- * If it shorter, the file may be padded.
+ * The first non-empty file copied between a pair of devices is used to probe
+ * the fastest working strategy: reflink, copy_file_range(), sendfile(),
+ * or read() and write(). The following files use the cached strategy.
+ *
+ * Files larger than AI_COPY_CHUNKED_MIN which can't be reflinked are copied
+ * in chunks, in parallel, if ai_copy_ctx_set_jobs() allows that. The chunks are
+ * copied using copy_file_range() if it works for the device pair, and pread()
+ * and pwrite() otherwise.
+ *
+ * If the context is hashing, the data is always copied using read()
+ * and write(), and hashed as it passes through the buffer.
+ *
+ * Unless the cache policy is %AI_COPY_CACHE_KEEP, the copied data is dropped
+ * from the page cache behind the copy. With %AI_COPY_CACHE_DIRECT, the files
+ * larger than AI_COPY_DIRECT_MIN which can't be reflinked are copied using
+ * O_DIRECT, unless the filesystems don't support it.
+ *
+ * Unless the file is reflinked or copied by copy_file_range() sequentially
+ * (which may share the data), the destination file will be preallocated
+ * to size @expsize if possible. However, this is no hard limit and the actual
+ * file length may be larger. If it shorter, the file may be padded.
  *
  * Returns: 0 on success, errno on failure
  */
-static int ai_cp_reg(const char *source, const char *dest, off_t expsize) {
+static int ai_cp_reg(struct ai_copy_ctx *c, struct ai_copy_pair *p,
+		const char *source, const char *dest, off_t expsize) {
+	ai_copy_strategy_t strategy;
 	int fd_in, fd_out;
-	int ret = 0, splret;
+	int ret = 0, started = 0, allocated = 0, report = 1;
+#ifdef AI_COPY_HAVE_DIRECT
+	int direct = c->cache_policy == AI_COPY_CACHE_DIRECT
+		&& expsize >= AI_COPY_DIRECT_MIN;
+#endif
+
+	if (!c->buf) {
+		c->buf = malloc(c->bufsize);
+		if (!c->buf)
+			return errno;
+	}
+
+	/* empty files can't tell whether a strategy works, and the hashed
+	 * data needs to pass through the buffer */
+	if (!expsize || c->hashing)
+		strategy = AI_COPY_READ_WRITE;
+	else if (!p || p->strategy == AI_COPY_NONE)
+		strategy = AI_COPY_REFLINK;
+	else
+		strategy = p->strategy;
+	if (strategy < c->strategy_limit)
+		strategy = c->strategy_limit;
 
 	fd_in = open(source, O_RDONLY);
 	if (fd_in == -1)
 		return errno;
+	if (c->hashing)
+		ai_xxh64_init(&c->hash);
 
 	/* don't care about perms, will have to chmod anyway */
 	fd_out = creat(dest, 0666);
@@ -160,61 +1561,115 @@ static int ai_cp_reg(const char *source, const char *dest, off_t expsize) {
 		return tmp;
 	}
 
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	/* reading the whole file ahead would fill the page cache */
+	if (c->cache_policy == AI_COPY_CACHE_KEEP)
+		posix_fadvise(fd_in, 0, 0, POSIX_FADV_WILLNEED);
+	posix_fadvise(fd_out, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	c->pos = c->flushed = c->dropped = 0;
+
+	for (;; strategy++) {
+#ifdef AI_COPY_HAVE_DIRECT
+		/* large files bypass the page cache, unless they can be cloned */
+		if (direct && strategy > AI_COPY_REFLINK) {
+			direct = 0;
+#	ifdef HAVE_POSIX_FALLOCATE
+			ret = posix_fallocate(fd_out, 0, expsize);
+			if (ret)
+				break;
+			allocated = 1;
+#	endif
+			ret = ai_cp_direct(c, fd_in, fd_out, &started);
+			if (!ret)
+				ret = ai_copy_data(c, AI_COPY_READ_WRITE, fd_in, fd_out,
+						expsize, &started);
+			if (!ret || started || !ai_copy_unsupported(ret)) {
+				/* the other strategies were not probed */
+				report = 0;
+				break;
+			}
+		}
+#endif
+
+
+#ifdef HAVE_PTHREAD
+		/* large files are split into chunks, unless they can be cloned */
+		if (strategy > AI_COPY_REFLINK && c->jobs > 1
+				&& expsize >= AI_COPY_CHUNKED_MIN && !c->hashing) {
+			int used_range = 0;
+
 #ifdef HAVE_POSIX_FALLOCATE
-	if (expsize != 0)
-		ret = posix_fallocate(fd_out, 0, expsize);
+			ret = posix_fallocate(fd_out, 0, expsize);
+			if (ret)
+				break;
 #endif
+			ret = ai_cp_chunked(c, fd_in, fd_out, expsize,
+					strategy == AI_COPY_FILE_RANGE, &used_range);
 
-#ifdef HAVE_POSIX_FADVISE
-	posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED);
-	posix_fadvise(fd_out, 0, 0, POSIX_FADV_SEQUENTIAL);
+			/* the other strategies were not probed */
+			if (used_range)
+				strategy = AI_COPY_FILE_RANGE;
+			else
+				report = 0;
+			break;
+		}
 #endif
-	if (!ret) {
-		do {
-			splret = ai_splice(fd_in, fd_out);
 
-			if (splret == -1)
-				ret = errno;
-		} while (splret > 0);
+#ifdef HAVE_POSIX_FALLOCATE
+		if (expsize != 0 && strategy >= AI_COPY_SENDFILE && !allocated) {
+			ret = posix_fallocate(fd_out, 0, expsize);
+			if (ret)
+				break;
+			allocated = 1;
+		}
+#endif
+
+		ret = ai_copy_data(c, strategy, fd_in, fd_out, expsize, &started);
+		if (!ret || started || strategy == AI_COPY_READ_WRITE
+				|| !ai_copy_unsupported(ret))
+			break;
+		AI_PROBE3(copy__fallback, dest, (int) strategy, ret);
 	}
 
+	if (!ret && p && expsize && report && !c->hashing)
+		ai_copy_pair_set(c, p, strategy);
+	if (!ret)
+		ai_copy_drop(c, fd_in, fd_out, 1);
+
 	if (close(fd_out) && !ret)
 		ret = errno;
 	close(fd_in);
 
+	if (!ret) {
+		c->stats.files++;
+		c->hashed = c->hashing;
+	}
 	return ret;
 }
 
-/**
- * ai_cp_stat
- * @dest: destination file
- * @st: struct with lstat() results
- *
- * Set ownership, permissions and timestamps from @st to destination file @dest.
- *
- * Returns: 0 on success, errno on failure
- */
-static int ai_cp_stat(const char *dest, struct stat st) {
-	if (lchown(dest, st.st_uid, st.st_gid))
+int ai_cp_stat(const char *dest, const struct stat *st) {
+	if (lchown(dest, st->st_uid, st->st_gid))
 		return errno;
 
 	/* there's no point in copying directory mtime,
 	 * it will be modified when copying files anyway */
-	if (!S_ISDIR(st.st_mode)) {
+	if (!S_ISDIR(st->st_mode)) {
 #ifdef HAVE_UTIMENSAT
 		struct timespec ts[2];
 
-		ts[0] = st.st_atim;
-		ts[1] = st.st_mtim;
+		ts[0] = st->st_atim;
+		ts[1] = st->st_mtim;
 		if (utimensat(AT_FDCWD, dest, ts, AT_SYMLINK_NOFOLLOW))
 			return errno;
 #else
 		/* utime() can't handle touching symlinks */
-		if (!S_ISLNK(st.st_mode)) {
+		if (!S_ISLNK(st->st_mode)) {
 			struct utimbuf ts;
 
-			ts.actime = st.st_atime;
-			ts.modtime = st.st_mtime;
+			ts.actime = st->st_atime;
+			ts.modtime = st->st_mtime;
 			if (utime(dest, &ts))
 				return errno;
 		}
@@ -222,7 +1677,7 @@ static int ai_cp_stat(const char *dest, struct stat st) {
 	}
 
 #ifdef HAVE_FCHMODAT
-	if (!fchmodat(AT_FDCWD, dest, st.st_mode, AT_SYMLINK_NOFOLLOW));
+	if (!fchmodat(AT_FDCWD, dest, st->st_mode, AT_SYMLINK_NOFOLLOW));
 		/* fchmodat() may or may not support touching symlinks,
 		 * if it doesn't, fall back to chmod() */
 	else if (errno != EINVAL
@@ -236,8 +1691,8 @@ static int ai_cp_stat(const char *dest, struct stat st) {
 		return errno;
 	else
 #endif
-	if (!S_ISLNK(st.st_mode)) {
-		if (chmod(dest, st.st_mode & ~S_IFMT))
+	if (!S_ISLNK(st->st_mode)) {
+		if (chmod(dest, st->st_mode & ~S_IFMT))
 			return errno;
 	}
 
@@ -257,9 +1712,15 @@ static void ai_cp_attr(const char *source, const char *dest) {
 #endif
 }
 
-int ai_cp_a(const char *source, const char *dest) {
-	int ret;
+int ai_copy_ctx_cp_a(ai_copy_ctx_t c, const char *source, const char *dest) {
+	struct ai_copy_pair *p = NULL;
 	struct stat st;
+	dev_t ddev;
+	int ret;
+
+	if (!c)
+		c = &ai_copy_default;
+	c->hashed = 0;
 
 	/* First lstat() it, see what we got. */
 	if (lstat(source, &st))
@@ -272,9 +1733,12 @@ int ai_cp_a(const char *source, const char *dest) {
 
 	/* Is it a symlink? */
 	if (S_ISLNK(st.st_mode))
-		ret = ai_cp_symlink(source, dest, st.st_size);
-	else if (S_ISREG(st.st_mode))
-		ret = ai_cp_reg(source, dest, st.st_size);
+		ret = ai_cp_symlink(c, source, dest, st.st_size);
+	else if (S_ISREG(st.st_mode)) {
+		if (!ai_copy_dir_dev(&c->ddir, dest, &ddev))
+			p = ai_copy_pair_get(c, st.st_dev, ddev);
+		ret = ai_cp_reg(c, p, source, dest, st.st_size);
+	}
 	else {
 		if (S_ISDIR(st.st_mode)) {
 			ret = mkdir(dest, st.st_mode & ~S_IFMT);
@@ -299,11 +1763,13 @@ int ai_cp_a(const char *source, const char *dest) {
 	}
 
 	if (!ret) {
-		ret = ai_cp_stat(dest, st);
+		ret = ai_cp_stat(dest, &st);
 		if (!ret) {
 			ai_cp_attr(source, dest);
 		}
 	}
 
+	if (!ret && !S_ISREG(st.st_mode))
+		c->stats.others++;
 	return ret;
 }
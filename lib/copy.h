@@ -14,8 +14,21 @@
  *
  * libai-copy provides a few convenience functions to copy and move files,
  * preserving their ownership, permissions, mtimes and extended attributes.
+ *
+ * The copying functions keep their buffers, settings and statistics
+ * in a copying context. ai_mv(), ai_cp_l() and ai_cp_a() use the default
+ * context, and thus can't be called from multiple threads at the same time.
+ * Multithreaded callers should use a separate #ai_copy_ctx_t in each thread.
+ * The settings of a context affect only the copying done using it.
+ *
+ * The context probes the fastest working copying strategy once for each pair
+ * of source and destination devices, and caches it. This way, copying across
+ * devices doesn't try link() for every file.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 /**
  * ai_mv
  * @source: current file path
@@ -58,4 +71,417 @@ int ai_cp_l(const char *source, const char *dest);
  */
 int ai_cp_a(const char *source, const char *dest);
 
+/**
+ * ai_cp_stat
+ * @dest: destination file
+ * @st: struct with lstat() results
+ *
+ * Set ownership, permissions and timestamps from @st to destination file @dest.
+ * This is the attribute-setting part of ai_cp_a(), for files created by other
+ * means.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_cp_stat(const char *dest, const struct stat *st);
+
+/**
+ * AI_COPY_MAX_JOBS
+ *
+ * The maximal number of parallel jobs accepted by ai_copy_ctx_set_jobs().
+ */
+#define AI_COPY_MAX_JOBS 64
+
+/**
+ * ai_copy_cache_policy_t
+ * @AI_COPY_CACHE_KEEP: copy through the page cache, reading the source ahead
+ * @AI_COPY_CACHE_DROP: drop the copied data from the page cache behind
+ *	the copy
+ * @AI_COPY_CACHE_DIRECT: like %AI_COPY_CACHE_DROP, and copy large files
+ *	bypassing the page cache (using O_DIRECT)
+ *
+ * The page cache policies for copying file contents.
+ */
+typedef enum {
+	AI_COPY_CACHE_KEEP,
+	AI_COPY_CACHE_DROP,
+	AI_COPY_CACHE_DIRECT
+} ai_copy_cache_policy_t;
+
+/**
+ * ai_copy_throttle_t
+ *
+ * The type describing a set of I/O rate limits, shared by the copying
+ * contexts using it.
+ */
+typedef struct ai_copy_throttle *ai_copy_throttle_t;
+
+/**
+ * ai_copy_throttle_new
+ * @bandwidth: maximal number of bytes copied per second, or 0 for no limit
+ * @iops: maximal number of metadata operations per second, or 0 for no limit
+ * @ret: location to store the new limits in
+ *
+ * Create a set of I/O rate limits, in order to leave the disk bandwidth
+ * for other processes. The limits are enforced using token buckets shared
+ * by all the copying contexts and threads using them, allowing short bursts
+ * of up to 0.1 s worth of I/O.
+ *
+ * The copied data is accounted by the copying contexts the limits are set
+ * for (see ai_copy_ctx_set_throttle()), and the metadata operations by
+ * the merge steps, one per journal entry. Replacing files is not throttled,
+ * in order to keep the time during which the destination tree is inconsistent
+ * short.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_throttle_new(unsigned long long int bandwidth,
+		unsigned long int iops, ai_copy_throttle_t *ret);
+
+/**
+ * ai_copy_throttle_free
+ * @t: the limits
+ *
+ * Free the limits @t. They must not be used by any copying context anymore.
+ */
+void ai_copy_throttle_free(ai_copy_throttle_t t);
+
+/**
+ * ai_copy_throttle
+ * @t: the limits, or %NULL
+ * @bytes: number of bytes copied
+ * @ops: number of metadata operations performed
+ *
+ * Account for the I/O performed, and sleep if it exceeds the limits @t.
+ * It returns immediately if @t is %NULL or sets no limits.
+ */
+void ai_copy_throttle(ai_copy_throttle_t t, unsigned long long int bytes,
+		unsigned long int ops);
+
+/**
+ * ai_copy_ctx_t
+ *
+ * The type describing a copying context.
+ */
+typedef struct ai_copy_ctx *ai_copy_ctx_t;
+
+/**
+ * ai_copy_stats_t
+ * @files: number of regular files whose contents were copied
+ * @bytes: number of bytes copied
+ * @links: number of hardlinks created instead of copying
+ * @others: number of symlinks, directories and special files created
+ *
+ * The statistics of a copying context.
+ */
+typedef struct {
+	unsigned long int files;
+	unsigned long long int bytes;
+	unsigned long int links;
+	unsigned long int others;
+} ai_copy_stats_t;
+
+/**
+ * ai_copy_ctx_new
+ * @ret: location to store the new context in
+ *
+ * Create a new copying context. The buffers are allocated when first used,
+ * and reused afterwards.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_ctx_new(ai_copy_ctx_t *ret);
+
+/**
+ * ai_copy_ctx_free
+ * @c: the context
+ *
+ * Free the copying context @c, along with its buffers.
+ */
+void ai_copy_ctx_free(ai_copy_ctx_t c);
+
+/**
+ * ai_copy_ctx_get_stats
+ * @c: the context, or %NULL for the default context
+ * @st: location to store the statistics in
+ *
+ * Get the statistics of all copying done using @c.
+ */
+void ai_copy_ctx_get_stats(ai_copy_ctx_t c, ai_copy_stats_t *st);
+
+/**
+ * ai_copy_ctx_mv
+ * @c: the context, or %NULL for the default context
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * Move file like ai_mv() does, using the copying context @c.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_ctx_mv(ai_copy_ctx_t c, const char *source, const char *dest);
+
+/**
+ * ai_copy_ctx_cp_l
+ * @c: the context, or %NULL for the default context
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * Copy or link file like ai_cp_l() does, using the copying context @c.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_ctx_cp_l(ai_copy_ctx_t c, const char *source, const char *dest);
+
+/**
+ * ai_copy_ctx_cp_a
+ * @c: the context, or %NULL for the default context
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * Copy file like ai_cp_a() does, using the copying context @c.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_ctx_cp_a(ai_copy_ctx_t c, const char *source, const char *dest);
+
+/**
+ * ai_copy_ctx_set_hashing
+ * @c: the context, or %NULL for the default context
+ * @enable: whether to hash the copied data
+ *
+ * Enable or disable hashing the contents of regular files copied using @c.
+ * The hash is computed on the data as it is copied, so that the file doesn't
+ * need to be read again. However, the data needs to pass through the user
+ * space then, so the in-kernel copying strategies are not used.
+ */
+void ai_copy_ctx_set_hashing(ai_copy_ctx_t c, int enable);
+
+/**
+ * ai_copy_ctx_set_jobs
+ * @c: the context, or %NULL for the default context
+ * @jobs: number of parallel jobs
+ *
+ * Set the number of threads used by @c to copy a single large file. Such
+ * files are split into chunks copied concurrently, so that the throughput can
+ * scale with the storage queue depth.
+ *
+ * The default is 1, i.e. sequential copying.
+ *
+ * Returns: 0 on success, EINVAL if @jobs is out of range, ENOSYS if
+ *	libai-copy was built without thread support
+ */
+int ai_copy_ctx_set_jobs(ai_copy_ctx_t c, unsigned int jobs);
+
+/**
+ * ai_copy_ctx_set_cache_policy
+ * @c: the context, or %NULL for the default context
+ * @policy: the page cache policy
+ *
+ * Set how copying the file contents using @c uses the page cache. With
+ * %AI_COPY_CACHE_DROP, the writeback of the copied data is started as soon
+ * as it is written, and both the source and the destination pages are dropped
+ * from the page cache behind the copy. This keeps a large merge from evicting
+ * the working set of the other processes, at the cost of writing the data
+ * back synchronously.
+ *
+ * With %AI_COPY_CACHE_DIRECT, large files are additionally read and written
+ * using O_DIRECT where the filesystems support it, so that their data doesn't
+ * pass through the page cache at all.
+ *
+ * Reflinked and linked files share the data with the source, and are not
+ * affected. The default is %AI_COPY_CACHE_KEEP.
+ *
+ * Returns: 0 on success, EINVAL if @policy is invalid, ENOSYS if it is not
+ *	supported on this system
+ */
+int ai_copy_ctx_set_cache_policy(ai_copy_ctx_t c,
+		ai_copy_cache_policy_t policy);
+
+/**
+ * ai_copy_ctx_set_bufsize
+ * @c: the context, or %NULL for the default context
+ * @size: the buffer size in bytes, or 0 for the default
+ *
+ * Set the size of the buffer used by @c to copy the file contents using read()
+ * and write(). The default is AI_BUFSIZE (64 KiB unless overridden at build
+ * time). The buffer is reallocated on the next copy.
+ */
+void ai_copy_ctx_set_bufsize(ai_copy_ctx_t c, size_t size);
+
+/**
+ * ai_copy_ctx_set_throttle
+ * @c: the context, or %NULL for the default context
+ * @t: the limits, or %NULL for no limits
+ *
+ * Limit the rate of copying the file contents using @c to @t. The limits can
+ * be shared by multiple contexts, and need to stay valid while @c uses them.
+ *
+ * The default is no limits.
+ */
+void ai_copy_ctx_set_throttle(ai_copy_ctx_t c, ai_copy_throttle_t t);
+
+/**
+ * ai_copy_ctx_get_hash
+ * @c: the context, or %NULL for the default context
+ * @hash: location to store the hash in
+ *
+ * Get the hash of the file contents copied by the last call using @c,
+ * as computed by ai_copy_hash_file().
+ *
+ * Returns: 0 on success, ENOENT if the last call didn't copy file contents
+ *	(e.g. the file has been linked), or hashing is disabled
+ */
+int ai_copy_ctx_get_hash(ai_copy_ctx_t c, unsigned long long int *hash);
+
+/**
+ * ai_copy_hash_file
+ * @path: file path
+ * @hash: location to store the hash in
+ *
+ * Compute the XXH64 hash of the contents of file @path.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_hash_file(const char *path, unsigned long long int *hash);
+
+/**
+ * ai_copy_ctx_hash_file
+ * @c: the context, or %NULL for the default context
+ * @path: file path
+ * @hash: location to store the hash in
+ *
+ * Compute the hash like ai_copy_hash_file() does, reading the file according
+ * to the cache policy of @c.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_ctx_hash_file(ai_copy_ctx_t c, const char *path,
+		unsigned long long int *hash);
+
+/**
+ * ai_copy_strategy_t
+ * @AI_COPY_NONE: no strategy has been chosen yet
+ * @AI_COPY_LINK: the files are hardlinked (ai_cp_l() only)
+ * @AI_COPY_REFLINK: the files are cloned, sharing the data
+ * @AI_COPY_FILE_RANGE: the data is copied using copy_file_range()
+ * @AI_COPY_SENDFILE: the data is copied in kernel using sendfile()
+ * @AI_COPY_READ_WRITE: the data is copied using read() and write()
+ *
+ * An enumeration listing the copying strategies, from the fastest one.
+ */
+typedef enum {
+	AI_COPY_NONE,
+	AI_COPY_LINK,
+	AI_COPY_REFLINK,
+	AI_COPY_FILE_RANGE,
+	AI_COPY_SENDFILE,
+	AI_COPY_READ_WRITE
+} ai_copy_strategy_t;
+
+/**
+ * ai_copy_strategy_callback_t
+ * @source: the source device
+ * @dest: the destination device
+ * @strategy: the chosen strategy
+ *
+ * Strategy reporting callback function. Called when a copying context finds
+ * the strategy working for a pair of devices. If the link() works, it is
+ * called for %AI_COPY_LINK as well as for the strategy used to copy the files
+ * which can't be linked.
+ */
+typedef void (*ai_copy_strategy_callback_t)(
+		dev_t source,
+		dev_t dest,
+		ai_copy_strategy_t strategy);
+
+/**
+ * ai_copy_set_strategy_callback
+ * @callback: the callback function, or %NULL
+ *
+ * Set the function reporting the strategies chosen by all copying contexts.
+ * It can be called from multiple threads.
+ */
+void ai_copy_set_strategy_callback(ai_copy_strategy_callback_t callback);
+
+/**
+ * ai_copy_strategy_name
+ * @strategy: the strategy
+ *
+ * Get the human-readable name of @strategy.
+ *
+ * Returns: a static string
+ */
+const char *ai_copy_strategy_name(ai_copy_strategy_t strategy);
+
+/**
+ * ai_copy_ctx_set_strategy
+ * @c: the context, or %NULL for the default context
+ * @strategy: the fastest strategy to use, or %AI_COPY_NONE for no limit
+ *
+ * Restrict copying using @c to @strategy and the slower strategies, e.g.
+ * in order to compare their performance. If @strategy doesn't work for
+ * the files, the slower ones are tried as usual. With a limit of
+ * %AI_COPY_REFLINK or slower, ai_copy_ctx_cp_l() copies the files instead
+ * of linking them.
+ *
+ * The strategies already chosen by the context are kept if they are slower
+ * than @strategy, and the strategies chosen under a limit are not shared with
+ * the other contexts. The default is no limit.
+ *
+ * Returns: 0 on success, EINVAL if @strategy is invalid
+ */
+int ai_copy_ctx_set_strategy(ai_copy_ctx_t c, ai_copy_strategy_t strategy);
+
+/**
+ * ai_copy_probe_t
+ * @source: the source device
+ * @dest: the destination device
+ * @link: 0 if link() and rename() between the devices fail with EXDEV,
+ *	2 if link() is known to work, 1 if not known
+ * @strategy: the strategy used to copy the file contents,
+ *	or %AI_COPY_NONE if not known
+ *
+ * The strategies probed for a pair of devices.
+ */
+typedef struct {
+	dev_t source;
+	dev_t dest;
+	int link;
+	ai_copy_strategy_t strategy;
+} ai_copy_probe_t;
+
+/**
+ * ai_copy_get_probes
+ * @probes: the array to store the probed device pairs in
+ * @count: the size of @probes
+ *
+ * Get the strategies probed so far by all copying contexts. The new copying
+ * contexts start with them instead of probing the devices again, and the
+ * strategy callback is not called for them.
+ *
+ * Returns: the number of the probed device pairs, which can be larger than
+ *	@count
+ */
+size_t ai_copy_get_probes(ai_copy_probe_t *probes, size_t count);
+
+/**
+ * ai_copy_add_probes
+ * @probes: the probed device pairs
+ * @count: the number of @probes
+ *
+ * Add the strategies probed elsewhere, e.g. obtained by ai_copy_get_probes()
+ * in another process. The known parts replace the ones already probed.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_copy_add_probes(const ai_copy_probe_t *probes, size_t count);
+
+/**
+ * ai_copy_clear_probes
+ *
+ * Forget the strategies probed so far, so that the new copying contexts
+ * probe the devices again. The existing contexts keep theirs.
+ */
+void ai_copy_clear_probes(void);
+
 #endif /*_ATOMIC_INSTALL_COPY_H*/
@@ -43,6 +43,15 @@
  * Special filename bits used to identify end of filelist.
  */
 static const unsigned char AI_JOURNAL_EOF = 0xff;
+/**
+ * AI_JOURNAL_LAYER
+ *
+ * Special filename bits used to identify a layer entry. The path of a layer
+ * entry is the source tree of the following files, and the filename is empty.
+ * Layer entries are skipped by ai_journal_get_files() and
+ * ai_journal_file_next().
+ */
+static const unsigned char AI_JOURNAL_LAYER = 0x80;
 
 #pragma pack(push)
 #pragma pack(1)
@@ -57,7 +66,8 @@ static const unsigned char AI_JOURNAL_EOF = 0xff;
  * @maxpathlen: max length of path+filename in journal
  * @reserved.fd: used internally, must be -1 on closed journal file
  * @files: array of (flag + path + \0 + filename + \0), terminated
- *	by %AI_JOURNAL_EOF (on flag field)
+ *	by %AI_JOURNAL_EOF (on flag field); may contain %AI_JOURNAL_LAYER
+ *	entries
  *
  * The journal format.
  */
@@ -216,6 +226,13 @@ static void ai_journal_set_filename_prefix(char *out, long int bits) {
 	out[i] = 0;
 }
 
+/**
+ * ai_journal_seeded
+ *
+ * Whether the PRNG used for the filename prefixes was seeded already.
+ */
+static int ai_journal_seeded = 0;
+
 int ai_journal_create_start(const char *journal_path, const char *location,
 		ai_journal_t *ret) {
 	struct ai_journal *newj;
@@ -239,7 +256,11 @@ int ai_journal_create_start(const char *journal_path, const char *location,
 	newj->length = sizeof(*newj) + 1;
 	newj->maxpathlen = 0;
 
-	srandom(time(NULL));
+	/* reseeding would repeat the prefix within the same second */
+	if (!ai_journal_seeded) {
+		srandom(time(NULL) ^ getpid());
+		ai_journal_seeded = 1;
+	}
 	ai_journal_set_filename_prefix(newj->prefix, random());
 
 	newj->reserved.f = f;
@@ -254,8 +275,11 @@ int ai_journal_create_start(const char *journal_path, const char *location,
 		return errno;
 	}
 
-	retval = ai_traverse_tree(location, "", f, 1,
-			&newj->length, &newj->maxpathlen);
+	if (location)
+		retval = ai_traverse_tree(location, "", f, 1,
+				&newj->length, &newj->maxpathlen);
+	else
+		retval = 0;
 
 	if (!retval)
 		*ret = newj;
@@ -267,6 +291,232 @@ int ai_journal_create_start(const char *journal_path, const char *location,
 	return retval;
 }
 
+/**
+ * ai_journal_entry_next
+ * @f: a journal entry
+ *
+ * Get the entry following @f, without skipping layer entries.
+ *
+ * Returns: the next entry (possibly %AI_JOURNAL_EOF)
+ */
+static unsigned char *ai_journal_entry_next(unsigned char *f) {
+	const char *path = (const char*) f + 1;
+	const char *fn = path + strlen(path) + 1;
+
+	return (unsigned char*) fn + strlen(fn) + 1;
+}
+
+/**
+ * ai_journal_entry_hash
+ * @f: a journal entry
+ *
+ * Hash the complete path of journal entry @f.
+ *
+ * Returns: FNV-1a hash of the path and filename
+ */
+static uint32_t ai_journal_entry_hash(const unsigned char *f) {
+	const unsigned char *p = f + 1;
+	uint32_t h = 2166136261U;
+	int part;
+
+	for (part = 0; part < 2; part++, p++) {
+		for (; *p; p++)
+			h = (h ^ *p) * 16777619U;
+	}
+
+	return h;
+}
+
+/**
+ * ai_journal_read_layer
+ * @location: source tree location
+ * @buf: location to store the newly-allocated list in
+ * @len: location to store the list length in
+ *
+ * Traverse the source tree @location into a memory buffer, using the journal
+ * file list format (without the terminator).
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_journal_read_layer(const char *location, unsigned char **buf, size_t *len) {
+	uint64_t filelen = 0, maxpathlen = 0;
+	FILE *f = tmpfile();
+	int ret;
+
+	if (!f)
+		return errno;
+
+	ret = ai_traverse_tree(location, "", f, 1, &filelen, &maxpathlen);
+	if (!ret) {
+		*len = filelen;
+		*buf = malloc(filelen + 1);
+		if (!*buf)
+			ret = errno;
+		else {
+			rewind(f);
+			if (filelen && fread(*buf, filelen, 1, f) != 1)
+				ret = ferror(f) ? errno : EINVAL;
+			(*buf)[filelen] = AI_JOURNAL_EOF;
+
+			if (ret) {
+				free(*buf);
+				*buf = NULL;
+			}
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+int ai_journal_create_layers(const char *journal_path, const char *const *sources,
+		unsigned int count, ai_journal_t *ret) {
+	unsigned char **bufs;
+	size_t *lens;
+	unsigned char **set = NULL;
+	unsigned char *replaced = NULL;
+	char **roots = NULL;
+	size_t nfiles = 0, mask;
+	ai_journal_t j;
+	unsigned int i;
+	int retval = 0;
+
+	bufs = calloc(count, sizeof(*bufs));
+	lens = calloc(count, sizeof(*lens));
+	if (!bufs || !lens) {
+		free(bufs);
+		free(lens);
+		return errno;
+	}
+
+	for (i = 0; i < count && !retval; i++) {
+		unsigned char *p;
+
+		retval = ai_journal_read_layer(sources[i], &bufs[i], &lens[i]);
+		for (p = bufs[i]; !retval && *p != AI_JOURNAL_EOF; p = ai_journal_entry_next(p))
+			nfiles++;
+	}
+
+	if (!retval) {
+		for (mask = 16; mask < nfiles * 2; mask <<= 1);
+		set = calloc(mask, sizeof(*set));
+		/* whether the file is a non-directory in any of the later layers */
+		replaced = calloc(mask, sizeof(*replaced));
+		if (!set || !replaced)
+			retval = errno;
+		mask--;
+	}
+
+	/* later layers override earlier ones; keep the last occurrence
+	 * of each file, so that directories still follow their contents */
+	for (i = count; i > 0 && !retval; i--) {
+		unsigned char *p;
+		size_t nroots = 0, k;
+
+		for (p = bufs[i - 1]; *p != AI_JOURNAL_EOF; p = ai_journal_entry_next(p)) {
+			size_t h = ai_journal_entry_hash(p) & mask;
+
+			for (; set[h]; h = (h + 1) & mask) {
+				if (!strcmp((const char*) set[h] + 1, (const char*) p + 1)
+						&& !strcmp(ai_journal_file_name(set[h]),
+							ai_journal_file_name(p)))
+					break;
+			}
+
+			if (!set[h]) {
+				set[h] = p;
+				replaced[h] = !(*p & AI_MERGE_FILE_DIR);
+				continue;
+			}
+
+			/* a directory replaced by a later layer loses its contents */
+			if ((*p & AI_MERGE_FILE_DIR) && replaced[h]) {
+				const char *path = (const char*) p + 1;
+				const char *name = ai_journal_file_name(p);
+				char **newroots = realloc(roots, (nroots + 1) * sizeof(*roots));
+
+				if (!newroots) {
+					retval = errno;
+					break;
+				}
+				roots = newroots;
+				roots[nroots] = malloc(strlen(path) + strlen(name) + 2);
+				if (!roots[nroots]) {
+					retval = errno;
+					break;
+				}
+				sprintf(roots[nroots++], "%s%s/", path, name);
+			} else if (!(*p & AI_MERGE_FILE_DIR))
+				replaced[h] = 1;
+			*p = AI_JOURNAL_LAYER;
+		}
+
+		for (p = bufs[i - 1]; nroots && *p != AI_JOURNAL_EOF && !retval;
+				p = ai_journal_entry_next(p)) {
+			for (k = 0; k < nroots; k++) {
+				if (!strncmp((const char*) p + 1, roots[k], strlen(roots[k]))) {
+					*p = AI_JOURNAL_LAYER;
+					break;
+				}
+			}
+		}
+
+		for (k = 0; k < nroots; k++)
+			free(roots[k]);
+	}
+	free(roots);
+	free(replaced);
+	free(set);
+
+	if (!retval)
+		retval = ai_journal_create_start(journal_path, NULL, &j);
+
+	for (i = 0; i < count && !retval; i++) {
+		FILE *f = j->reserved.f;
+		unsigned char *p;
+		int first = 1;
+
+		for (p = bufs[i]; *p != AI_JOURNAL_EOF && !retval; p = ai_journal_entry_next(p)) {
+			const size_t len = ai_journal_entry_next(p) - p;
+
+			/* overridden by a later layer */
+			if (*p == AI_JOURNAL_LAYER)
+				continue;
+
+			if (first) {
+				const size_t slen = strlen(sources[i]) + 1;
+
+				if (fputc(AI_JOURNAL_LAYER, f) == EOF
+						|| fwrite(sources[i], slen, 1, f) != 1
+						|| fputc(0, f) == EOF)
+					retval = errno;
+				j->length += slen + 2;
+				first = 0;
+			}
+
+			if (!retval && fwrite(p, len, 1, f) != 1)
+				retval = errno;
+			j->length += len;
+			if (j->maxpathlen < len - 2)
+				j->maxpathlen = len - 2;
+		}
+
+		if (retval) {
+			fclose(f);
+			free(j);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		free(bufs[i]);
+	free(bufs);
+	free(lens);
+
+	if (!retval)
+		*ret = j;
+	return retval;
+}
+
 int ai_journal_create_append(ai_journal_t j, const char *filename, unsigned char file_flags) {
 	FILE *outf = j->reserved.f;
 	const char *slash = strrchr(filename, '/');
@@ -328,6 +578,62 @@ int ai_journal_create(const char *journal_path, const char *location) {
 	return ret;
 }
 
+int ai_journal_create_copy(const char *journal_path, ai_journal_t j) {
+	struct ai_journal newj;
+	ai_journal_file_t *pp;
+	FILE *f;
+
+	int ret = 0;
+
+	assert(!j->reserved.f);
+
+	f = fopen(journal_path, "wb");
+	if (!f)
+		return errno;
+
+#ifdef HAVE_FLOCK
+	flock(fileno(f), LOCK_EX);
+#endif
+
+	memcpy(&newj, j, sizeof(newj));
+	newj.flags = 0;
+	/* the PRNG is seeded already, so the prefix will differ */
+	ai_journal_set_filename_prefix(newj.prefix, random());
+	/* mark the journal incomplete until it is fully written */
+	newj.reserved.f = f;
+
+	if (fwrite(&newj, sizeof(newj), 1, f) < 1)
+		ret = errno;
+
+	for (pp = j->files; *pp != AI_JOURNAL_EOF && !ret; pp = ai_journal_entry_next(pp)) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		const size_t len = strlen(path) + strlen(name) + 2;
+		const unsigned char flags = *pp == AI_JOURNAL_LAYER ? AI_JOURNAL_LAYER
+			: *pp & (AI_MERGE_FILE_REMOVE | AI_MERGE_FILE_DIR);
+
+		/* keep only the flags describing the file */
+		if (fputc(flags, f) == EOF || fwrite(path, len, 1, f) != 1)
+			ret = errno;
+	}
+
+	if (!ret) {
+		newj.reserved.f = NULL;
+		if (fputc(AI_JOURNAL_EOF, f) == EOF)
+			ret = errno;
+		else {
+			rewind(f);
+			if (fwrite(&newj, sizeof(newj), 1, f) < 1)
+				ret = errno;
+		}
+	}
+
+	if (fclose(f) && !ret)
+		ret = errno;
+
+	return ret;
+}
+
 int ai_journal_open(const char *journal_path, ai_journal_t *ret) {
 	int fd;
 	struct stat st;
@@ -380,10 +686,36 @@ int ai_journal_close(ai_journal_t j) {
 	return 0;
 }
 
+/**
+ * ai_journal_skip_layers
+ * @f: a journal entry
+ * @source: location to store the last layer source in, or %NULL
+ *
+ * Skip the layer entries starting at @f. If @source is not %NULL, store
+ * the source tree path of the last skipped layer in it.
+ *
+ * Returns: the first file entry, or %NULL if none
+ */
+static ai_journal_file_t *ai_journal_skip_layers(unsigned char *f, const char **source) {
+	while (*f == AI_JOURNAL_LAYER) {
+		if (source)
+			*source = (const char*) f + 1;
+		f = ai_journal_entry_next(f);
+	}
+
+	return *f != AI_JOURNAL_EOF ? f : NULL;
+}
+
 ai_journal_file_t *ai_journal_get_files(ai_journal_t j) {
 	assert(!j->reserved.f);
 
-	return *(j->files) != AI_JOURNAL_EOF ? j->files : NULL;
+	return ai_journal_skip_layers(j->files, NULL);
+}
+
+ai_journal_file_t *ai_journal_get_files_layered(ai_journal_t j, const char **source) {
+	assert(!j->reserved.f);
+
+	return ai_journal_skip_layers(j->files, source);
 }
 
 int ai_journal_get_maxpathlen(ai_journal_t j) {
@@ -393,8 +725,6 @@ int ai_journal_get_maxpathlen(ai_journal_t j) {
 }
 
 const char *ai_journal_get_filename_prefix(ai_journal_t j) {
-	assert(!j->reserved.f);
-
 	return j->prefix;
 }
 
@@ -419,10 +749,11 @@ const char *ai_journal_file_name(ai_journal_file_t *f) {
 }
 
 ai_journal_file_t *ai_journal_file_next(ai_journal_file_t *f) {
-	const char *fn = ai_journal_file_name(f);
-	unsigned char *next = (unsigned char*) fn + strlen(fn) + 1;
+	return ai_journal_skip_layers(ai_journal_entry_next(f), NULL);
+}
 
-	return *next != AI_JOURNAL_EOF ? next : NULL;
+ai_journal_file_t *ai_journal_file_next_layered(ai_journal_file_t *f, const char **source) {
+	return ai_journal_skip_layers(ai_journal_entry_next(f), source);
 }
 
 unsigned long int ai_journal_get_flags(ai_journal_t j) {
@@ -431,11 +762,25 @@ unsigned long int ai_journal_get_flags(ai_journal_t j) {
 	return j->flags;
 }
 
+/**
+ * ai_journal_sync_func
+ *
+ * The function used to flush changes before setting journal flags.
+ */
+static ai_journal_sync_func_t ai_journal_sync_func = NULL;
+
+void ai_journal_set_sync_func(ai_journal_sync_func_t func) {
+	ai_journal_sync_func = func;
+}
+
 int ai_journal_set_flag(ai_journal_t j, unsigned long int new_flag) {
 	assert(!j->reserved.f);
 
+	if (ai_journal_sync_func)
+		ai_journal_sync_func();
 #ifdef HAVE_SYNC
-	sync();
+	else
+		sync();
 #endif
 
 	j->flags |= new_flag;
@@ -49,7 +49,8 @@ int ai_journal_create(const char *journal_path, const char *location);
  * @ret: location to write new ai_journal_t to
  *
  * Start creating a journal file. Fill the new journal with files from @location
- * but keep it open for appending.
+ * but keep it open for appending. If @location is %NULL, the journal is started
+ * empty.
  *
  * When successful, this function writes ai_journal_t for the new journal into
  * @ret. This journal needs to be finished using ai_journal_create_finish(); it
@@ -59,6 +60,30 @@ int ai_journal_create(const char *journal_path, const char *location);
  */
 int ai_journal_create_start(const char *journal_path, const char *location,
 		ai_journal_t *ret);
+/**
+ * ai_journal_create_layers
+ * @journal_path: path for the new journal file
+ * @sources: array of source tree locations
+ * @count: number of source trees
+ * @ret: location to write new ai_journal_t to
+ *
+ * Start creating a journal file covering multiple source trees (layers),
+ * to be merged in a single transaction. If a file is present in multiple
+ * layers, only the last one is listed, i.e. later layers override earlier
+ * ones. If a later layer replaces a directory with a non-directory, the files
+ * inside that directory in the earlier layers are not listed either.
+ * The journal remains open for appending, like with
+ * ai_journal_create_start().
+ *
+ * The source tree paths are stored in the journal. ai_journal_get_files() and
+ * ai_journal_file_next() iterate over the files of all layers; use
+ * ai_journal_get_files_layered() and ai_journal_file_next_layered() to find
+ * out their source trees.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_journal_create_layers(const char *journal_path, const char *const *sources,
+		unsigned int count, ai_journal_t *ret);
 /**
  * ai_journal_create_append
  * @j: journal returned by ai_journal_create_start()
@@ -89,6 +114,22 @@ int ai_journal_create_append(ai_journal_t j, const char *filename,
  */
 int ai_journal_create_finish(ai_journal_t j);
 
+/**
+ * ai_journal_create_copy
+ * @journal_path: path for the new journal file
+ * @j: an open journal
+ *
+ * Create a new journal file listing the same files as @j, without rescanning
+ * the source tree. The new journal gets a new filename prefix, and all flags
+ * except for %AI_MERGE_FILE_REMOVE and %AI_MERGE_FILE_DIR are cleared. This is
+ * useful to merge the same source tree into multiple destinations.
+ *
+ * This function doesn't open the newly-created journal; for that, use
+ * ai_journal_open() afterwards.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_journal_create_copy(const char *journal_path, ai_journal_t j);
 /**
  * ai_journal_open
  * @journal_path: path to the journal file
@@ -127,7 +168,8 @@ int ai_journal_get_maxpathlen(ai_journal_t j);
  * @j: an open journal
  *
  * Get the random prefix used for temporary files associated with this journal
- * (session).
+ * (session). This function can be used on a journal which is being created
+ * as well.
  *
  * Returns: a pointer to null-terminated prefix in the journal
  */
@@ -151,6 +193,29 @@ ai_journal_file_t *ai_journal_get_files(ai_journal_t j);
  * Returns: a pointer to #ai_journal_file_t, or %NULL if @f is last
  */
 ai_journal_file_t *ai_journal_file_next(ai_journal_file_t *f);
+/**
+ * ai_journal_get_files_layered
+ * @j: an open journal
+ * @source: location to store the source tree path in
+ *
+ * Like ai_journal_get_files(), but if the journal was created using
+ * ai_journal_create_layers(), store the source tree path of the first file
+ * in @source. Otherwise, @source is left unchanged.
+ *
+ * Returns: a pointer to the first file, or %NULL if no files
+ */
+ai_journal_file_t *ai_journal_get_files_layered(ai_journal_t j, const char **source);
+/**
+ * ai_journal_file_next_layered
+ * @f: the current file
+ * @source: location to store the source tree path in
+ *
+ * Like ai_journal_file_next(), but if the next file comes from a different
+ * layer, store its source tree path in @source.
+ *
+ * Returns: a pointer to the next file, or %NULL if @f was the last one
+ */
+ai_journal_file_t *ai_journal_file_next_layered(ai_journal_file_t *f, const char **source);
 
 /**
  * ai_journal_file_flags
@@ -212,4 +277,25 @@ unsigned long int ai_journal_get_flags(ai_journal_t j);
  */
 int ai_journal_set_flag(ai_journal_t j, unsigned long int new_flag);
 
+/**
+ * ai_journal_sync_func_t
+ *
+ * The type of function flushing the filesystem changes to disk before setting
+ * journal flags.
+ */
+typedef void (*ai_journal_sync_func_t)(void);
+/**
+ * ai_journal_set_sync_func
+ * @func: the new sync function, or %NULL to use sync()
+ *
+ * Set the function used by ai_journal_set_flag() to flush the changes made by
+ * the merge step to disk, before the journal flags are updated. This can be
+ * used to coordinate the flushes between multiple merges, e.g. committing them
+ * as a group.
+ *
+ * The function needs to ensure that all changes made prior to its call are
+ * flushed. The default is %NULL.
+ */
+void ai_journal_set_sync_func(ai_journal_sync_func_t func);
+
 #endif /*_ATOMIC_INSTALL_JOURNAL_H*/
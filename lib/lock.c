@@ -0,0 +1,275 @@
+/* atomic-install -- destination tree locking
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "journal.h"
+#include "lock.h"
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+/* open file description locks are not shared between the threads
+ * of a process, unlike the classic POSIX locks */
+#ifdef F_OFD_SETLK
+#	define AI_LOCK_SETLK F_OFD_SETLK
+#	define AI_LOCK_SETLKW F_OFD_SETLKW
+#else
+#	define AI_LOCK_SETLK F_SETLK
+#	define AI_LOCK_SETLKW F_SETLKW
+#endif
+
+/**
+ * ai_lock
+ * @fd: the lock file descriptor
+ *
+ * A set of held locks.
+ */
+struct ai_lock {
+	int fd;
+};
+
+/**
+ * ai_lock_slot
+ * @offset: the lock offset (path hash)
+ * @exclusive: whether the path needs to be locked exclusively
+ *
+ * A single path to be locked.
+ */
+struct ai_lock_slot {
+	uint32_t offset;
+	int exclusive;
+};
+
+/**
+ * AI_LOCK_MAX_PATHS
+ *
+ * Maximal number of journal entries to be locked one by one. Larger
+ * journals lock whole directories instead, as the cost of byte-range locking
+ * grows quadratically with the lock count.
+ */
+#define AI_LOCK_MAX_PATHS 1024
+
+/**
+ * AI_LOCK_MAX_SLOTS
+ *
+ * Maximal number of directories to be locked. Larger journals lock the whole
+ * destination tree.
+ */
+#define AI_LOCK_MAX_SLOTS 4096
+
+/**
+ * ai_lock_hash
+ * @path: directory part of the file path
+ * @name: file name, or %NULL to hash the directory itself
+ *
+ * Hash the complete file path, in order to obtain the lock offset.
+ * The trailing slash of @path is not hashed if @name is %NULL, so that
+ * the result matches the directory entry.
+ *
+ * Returns: FNV-1a hash of @path and @name, within a 32-bit off_t
+ */
+static uint32_t ai_lock_hash(const char *path, const char *name) {
+	const char *end = path + strlen(path) - (name ? 0 : 1);
+	uint32_t h = 2166136261U;
+
+	for (; path < end; path++)
+		h = (h ^ (unsigned char) *path) * 16777619U;
+	for (; name && *name; name++)
+		h = (h ^ (unsigned char) *name) * 16777619U;
+
+	return h & 0x7fffffffU;
+}
+
+/**
+ * ai_lock_slot_cmp
+ * @a: first slot
+ * @b: second slot
+ *
+ * Compare two slots for qsort(), by offset.
+ *
+ * Returns: negative, zero or positive, like strcmp()
+ */
+static int ai_lock_slot_cmp(const void *a, const void *b) {
+	const struct ai_lock_slot *sa = a;
+	const struct ai_lock_slot *sb = b;
+
+	if (sa->offset != sb->offset)
+		return sa->offset < sb->offset ? -1 : 1;
+	return 0;
+}
+
+/**
+ * ai_lock_slots
+ * @dest: path to the destination tree
+ * @j: an open journal
+ * @ret: location to store the newly-allocated slot array in
+ * @count: location to store the slot count in
+ *
+ * Collect the lock slots for paths listed in @j, sorted by offset and with
+ * duplicates merged. Each path is locked along with its parent directory,
+ * shared. If the journal is large, the files are covered by exclusive locks
+ * on their parent directories instead.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_lock_slots(const char *dest, ai_journal_t j,
+		struct ai_lock_slot **ret, size_t *count) {
+	const size_t destlen = strlen(dest);
+	struct ai_lock_slot *slots;
+	ai_journal_file_t *pp;
+	size_t n = 0, i, k;
+	int per_dir;
+	char *buf;
+
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp))
+		n++;
+	per_dir = n > AI_LOCK_MAX_PATHS;
+
+	slots = malloc((n ? n : 1) * 2 * sizeof(*slots));
+	if (!slots)
+		return errno;
+	buf = malloc(destlen + ai_journal_get_maxpathlen(j) + 1);
+	if (!buf) {
+		free(slots);
+		return errno;
+	}
+	memcpy(buf, dest, destlen);
+
+	for (pp = ai_journal_get_files(j), k = 0; pp; pp = ai_journal_file_next(pp)) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		const unsigned char flags = ai_journal_file_flags(pp);
+		int is_dir = 0;
+		struct stat st;
+
+		/* existing directories are shared with other merges */
+		if ((flags & AI_MERGE_FILE_DIR) && !(flags & AI_MERGE_FILE_REMOVE)) {
+			strcpy(buf + destlen, path);
+			strcat(buf + destlen, name);
+			is_dir = !lstat(buf, &st) && S_ISDIR(st.st_mode);
+		}
+
+		if (!per_dir || (flags & AI_MERGE_FILE_DIR)) {
+			slots[k].offset = ai_lock_hash(path, name);
+			slots[k++].exclusive = !is_dir;
+		}
+
+		slots[k].offset = ai_lock_hash(path, NULL);
+		slots[k++].exclusive = per_dir && !is_dir;
+	}
+	free(buf);
+
+	n = k;
+	qsort(slots, n, sizeof(*slots), ai_lock_slot_cmp);
+	for (i = 0, k = 0; i < n; i++) {
+		if (k && slots[k - 1].offset == slots[i].offset)
+			slots[k - 1].exclusive |= slots[i].exclusive;
+		else
+			slots[k++] = slots[i];
+	}
+
+	*ret = slots;
+	*count = k;
+	return 0;
+}
+
+int ai_lock_acquire(const char *lock_path, const char *dest, ai_journal_t j,
+		unsigned int flags, ai_lock_t *ret) {
+	const int cmd = flags & AI_LOCK_WAIT ? AI_LOCK_SETLKW : AI_LOCK_SETLK;
+	struct ai_lock_slot *slots = NULL;
+	struct ai_lock *l;
+	struct flock fl;
+	size_t count = 0, i;
+	int retval = 0;
+
+	if (!(flags & AI_LOCK_TREE)) {
+		retval = ai_lock_slots(dest, j, &slots, &count);
+		if (retval)
+			return retval;
+
+		if (count > AI_LOCK_MAX_SLOTS) {
+			free(slots);
+			slots = NULL;
+			flags |= AI_LOCK_TREE;
+		}
+	}
+
+	l = malloc(sizeof(*l));
+	if (!l) {
+		retval = errno;
+		free(slots);
+		return retval;
+	}
+
+	l->fd = open(lock_path, O_RDWR|O_CREAT, 0600);
+	if (l->fd == -1) {
+		retval = errno;
+		free(slots);
+		free(l);
+		return retval;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_whence = SEEK_SET;
+
+	if (flags & AI_LOCK_TREE) {
+		/* zero length covers the whole file */
+		fl.l_type = F_WRLCK;
+		while (fcntl(l->fd, cmd, &fl)) {
+			if (errno != EINTR) {
+				retval = errno;
+				break;
+			}
+		}
+	} else {
+		/* always lock in ascending order, so that the waiting merges
+		 * never hold locks wanted by the ones they wait for */
+		for (i = 0; i < count && !retval; ) {
+			size_t k = i + 1;
+
+			/* merge the adjacent slots of the same kind */
+			while (k < count && slots[k].offset == slots[k - 1].offset + 1
+					&& slots[k].exclusive == slots[i].exclusive)
+				k++;
+
+			fl.l_type = slots[i].exclusive ? F_WRLCK : F_RDLCK;
+			fl.l_start = slots[i].offset;
+			fl.l_len = k - i;
+			if (fcntl(l->fd, cmd, &fl)) {
+				if (errno != EINTR)
+					retval = errno;
+				continue;
+			}
+			i = k;
+		}
+	}
+	free(slots);
+
+	if (retval) {
+		close(l->fd);
+		free(l);
+		return retval == EACCES ? EAGAIN : retval;
+	}
+
+	*ret = l;
+	return 0;
+}
+
+void ai_lock_release(ai_lock_t l) {
+	/* closing the descriptor releases all the locks */
+	close(l->fd);
+	free(l);
+}
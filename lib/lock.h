@@ -0,0 +1,83 @@
+/* atomic-install -- destination tree locking
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_LOCK_H
+#define _ATOMIC_INSTALL_LOCK_H
+
+/**
+ * SECTION: lock
+ * @short_description: Path-level locks for concurrent merges
+ * @include: atomic-install/lock.h
+ *
+ * The journal lock protects a single merge only. In order to run multiple
+ * merges into the same destination tree concurrently, each of them locks
+ * the paths listed in its journal using a lock file shared by all merges into
+ * that tree. Merges touching different files can then run all their steps
+ * at the same time, while the overlapping ones are serialized.
+ *
+ * The paths are locked using byte-range locks on the lock file, at offsets
+ * given by the path hashes. Files and directories which don't exist yet in
+ * the destination tree are locked exclusively, and the existing directories
+ * are locked shared, along with the parent directories of all paths.
+ * For large journals, the files are covered by exclusive locks on their parent
+ * directories instead, and the largest ones lock the whole tree. The locks are
+ * always taken in the same order, so merges waiting for each other can't
+ * deadlock.
+ *
+ * The locks need to be held during the whole merge process, including
+ * the rollback.
+ */
+
+#include "journal.h"
+
+/**
+ * ai_lock_t
+ *
+ * The type describing a set of held locks.
+ */
+typedef struct ai_lock *ai_lock_t;
+
+/**
+ * ai_lock_flags_t
+ * @AI_LOCK_WAIT: wait for the conflicting locks to be released
+ * @AI_LOCK_TREE: lock the whole destination tree exclusively, e.g. when
+ *	the list of files is not known yet
+ *
+ * Flags controlling ai_lock_acquire().
+ */
+typedef enum {
+	AI_LOCK_WAIT = 1,
+	AI_LOCK_TREE = 2
+} ai_lock_flags_t;
+
+/**
+ * ai_lock_acquire
+ * @lock_path: path to the lock file, created if necessary
+ * @dest: path to the destination tree
+ * @j: an open journal, or %NULL with %AI_LOCK_TREE
+ * @flags: a bitwise OR of #ai_lock_flags_t values
+ * @ret: location to store the new #ai_lock_t in
+ *
+ * Lock the paths listed in @j within @dest. All merges into the same
+ * destination tree need to use the same lock file. It should not be removed
+ * while in use.
+ *
+ * Unless %AI_LOCK_WAIT is passed, the function fails if any of the paths is
+ * locked by another merge. No locks are held then.
+ *
+ * Returns: 0 on success, EAGAIN if locked by another merge, errno otherwise
+ */
+int ai_lock_acquire(const char *lock_path, const char *dest, ai_journal_t j,
+		unsigned int flags, ai_lock_t *ret);
+/**
+ * ai_lock_release
+ * @l: the held locks
+ *
+ * Release the locks and free @l.
+ */
+void ai_lock_release(ai_lock_t l);
+
+#endif /*_ATOMIC_INSTALL_LOCK_H*/
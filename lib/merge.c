@@ -7,6 +7,7 @@
 #include "copy.h"
 #include "journal.h"
 #include "merge.h"
+#include "probes.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,14 +16,701 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <time.h>
 
 #ifdef HAVE_STDINT_H
 #	include <stdint.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+/**
+ * ai_merge_stats
+ *
+ * The statistics to add to, or %NULL.
+ */
+static ai_merge_stats_t *ai_merge_stats = NULL;
+
+#ifdef HAVE_PTHREAD
+/**
+ * ai_merge_stats_lock
+ *
+ * The lock protecting ai_merge_stats.
+ */
+static pthread_mutex_t ai_merge_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void ai_merge_set_stats(ai_merge_stats_t *stats) {
+	ai_merge_stats = stats;
+}
+
+/**
+ * ai_merge_trace_size
+ *
+ * The number of records kept per thread, or 0 if not recording.
+ */
+static unsigned int ai_merge_trace_size = 0;
+
+const char *ai_merge_op_name(ai_merge_op_t op) {
+	switch (op) {
+		case AI_MERGE_OP_STAT:
+			return "stat";
+		case AI_MERGE_OP_COPY:
+			return "copy";
+		case AI_MERGE_OP_LINK:
+			return "backup";
+		case AI_MERGE_OP_MKDIR:
+			return "mkdir";
+		case AI_MERGE_OP_RENAME:
+			return "rename";
+		case AI_MERGE_OP_UNLINK:
+			return "unlink";
+		case AI_MERGE_OP_SYNC:
+			return "sync";
+		default:
+			return "unknown";
+	}
+}
+
+const char *ai_merge_phase_name(ai_merge_phase_t phase) {
+	switch (phase) {
+		case AI_MERGE_PHASE_COPY_NEW:
+			return "copy new";
+		case AI_MERGE_PHASE_BACKUP_OLD:
+			return "backup old";
+		case AI_MERGE_PHASE_REPLACE:
+			return "replace";
+		case AI_MERGE_PHASE_CLEANUP:
+			return "clean up";
+		case AI_MERGE_PHASE_ROLLBACK_REPLACE:
+			return "rollback replace";
+		case AI_MERGE_PHASE_ROLLBACK_OLD:
+			return "rollback old";
+		case AI_MERGE_PHASE_ROLLBACK_NEW:
+			return "rollback new";
+		default:
+			return "none";
+	}
+}
+
+/**
+ * ai_merge_clock
+ *
+ * Get the monotonic time if collecting statistics or recording the trace,
+ * for ai_merge_stats_op() and ai_merge_phase_end().
+ *
+ * Returns: the current time in microseconds, or 0 if not collecting statistics
+ *	nor recording
+ */
+static unsigned long long int ai_merge_clock(void) {
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+#else
+	struct timeval tv;
+#endif
+
+	if (!ai_merge_stats && !ai_merge_trace_size)
+		return 0;
+
+#ifdef HAVE_CLOCK_GETTIME
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+/**
+ * ai_merge_trace_ring
+ * @next: the next buffer in the list of all buffers
+ * @thread: number of the buffer
+ * @owned: whether the buffer is used by a running thread
+ * @entry: index of the journal entry being processed by the owner thread
+ * @total: number of records ever written
+ * @records: the ring of ai_merge_trace_alloc records
+ *
+ * A per-thread trace buffer. The buffers are never freed, so that they can
+ * be dumped at any time.
+ */
+struct ai_merge_trace_ring {
+	struct ai_merge_trace_ring *next;
+	unsigned int thread;
+	int owned;
+	unsigned int entry;
+	unsigned long long int total;
+	ai_merge_trace_record_t records[];
+};
+
+/**
+ * ai_merge_trace_rings
+ *
+ * The list of all trace buffers, newest first.
+ */
+static struct ai_merge_trace_ring *ai_merge_trace_rings = NULL;
+
+/**
+ * ai_merge_trace_alloc
+ *
+ * The size of the allocated trace buffers, or 0 if none were allocated yet.
+ */
+static unsigned int ai_merge_trace_alloc = 0;
+
+/**
+ * ai_merge_trace_phase
+ *
+ * The running phase, for the trace records.
+ */
+static ai_merge_phase_t ai_merge_trace_phase = AI_MERGE_PHASE_NONE;
+
+#ifdef HAVE_PTHREAD
+/**
+ * ai_merge_trace_lock
+ *
+ * The lock protecting the ownership of the trace buffers.
+ */
+static pthread_mutex_t ai_merge_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * ai_merge_trace_key
+ *
+ * The key holding the trace buffer of each thread.
+ */
+static pthread_key_t ai_merge_trace_key;
+
+/**
+ * ai_merge_trace_once
+ *
+ * Control for creating ai_merge_trace_key.
+ */
+static pthread_once_t ai_merge_trace_once = PTHREAD_ONCE_INIT;
+
+/**
+ * ai_merge_trace_release
+ * @arg: the trace buffer
+ *
+ * Release the buffer of a finished thread, so that it can be used by
+ * the next one.
+ */
+static void ai_merge_trace_release(void *arg) {
+	struct ai_merge_trace_ring *r = arg;
+
+	pthread_mutex_lock(&ai_merge_trace_lock);
+	r->owned = 0;
+	pthread_mutex_unlock(&ai_merge_trace_lock);
+}
+
+/**
+ * ai_merge_trace_init
+ *
+ * Create ai_merge_trace_key.
+ */
+static void ai_merge_trace_init(void) {
+	pthread_key_create(&ai_merge_trace_key, ai_merge_trace_release);
+}
+#endif
+
+void ai_merge_set_trace(unsigned int records) {
+	/* the buffers are not reallocated */
+	if (records && ai_merge_trace_alloc)
+		records = ai_merge_trace_alloc;
+	ai_merge_trace_size = records;
+}
+
+/**
+ * ai_merge_trace_get
+ *
+ * Get the trace buffer of the calling thread, taking over a released one
+ * or allocating a new one if necessary.
+ *
+ * Returns: the buffer, or %NULL if it can't be allocated
+ */
+static struct ai_merge_trace_ring *ai_merge_trace_get(void) {
+	struct ai_merge_trace_ring *r;
+
+#ifdef HAVE_PTHREAD
+	pthread_once(&ai_merge_trace_once, ai_merge_trace_init);
+	r = pthread_getspecific(ai_merge_trace_key);
+	if (r)
+		return r;
+
+	pthread_mutex_lock(&ai_merge_trace_lock);
+#endif
+	for (r = ai_merge_trace_rings; r && r->owned; r = r->next);
+	if (!r) {
+		if (!ai_merge_trace_alloc)
+			ai_merge_trace_alloc = ai_merge_trace_size;
+		r = calloc(1, sizeof(*r)
+				+ ai_merge_trace_alloc * sizeof(ai_merge_trace_record_t));
+		if (r) {
+			r->thread = ai_merge_trace_rings ? ai_merge_trace_rings->thread + 1 : 0;
+			r->next = ai_merge_trace_rings;
+			ai_merge_trace_rings = r;
+		}
+	}
+	if (r) {
+		r->owned = 1;
+		r->entry = -1;
+#ifdef HAVE_PTHREAD
+		pthread_setspecific(ai_merge_trace_key, r);
+#endif
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_merge_trace_lock);
+#endif
+
+	return r;
+}
+
+/**
+ * ai_merge_trace_entry
+ * @index: index of the journal entry, or (size_t) -1 when done with it
+ *
+ * Set the journal entry the calling thread is processing, for the trace
+ * records.
+ */
+static void ai_merge_trace_entry(size_t index) {
+	struct ai_merge_trace_ring *r;
+
+	if (!ai_merge_trace_size)
+		return;
+	r = ai_merge_trace_get();
+	if (r)
+		r->entry = index;
+}
+
+/**
+ * ai_merge_trace_op
+ * @op: the operation
+ * @start: the time the operation was started at
+ * @end: the time the operation finished at
+ * @result: 0 on success, errno otherwise
+ * @bytes: number of bytes copied
+ *
+ * Record an operation in the trace buffer of the calling thread.
+ */
+static void ai_merge_trace_op(ai_merge_op_t op, unsigned long long int start,
+		unsigned long long int end, int result, unsigned long long int bytes) {
+	struct ai_merge_trace_ring *r = ai_merge_trace_get();
+	ai_merge_trace_record_t *rec;
+
+	if (!r)
+		return;
+
+	rec = &r->records[r->total % ai_merge_trace_alloc];
+	rec->start_us = start;
+	rec->end_us = end;
+	rec->bytes = bytes;
+	rec->entry = r->entry;
+	rec->op = op;
+	rec->phase = ai_merge_trace_phase;
+	rec->result = result;
+	r->total++;
+}
+
+/**
+ * ai_merge_trace_write
+ * @fd: the file descriptor
+ * @buf: the data
+ * @len: length of @buf
+ *
+ * Write all of @buf to @fd, using write() only.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_trace_write(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+
+	while (len) {
+		const ssize_t wr = write(fd, p, len);
+
+		if (wr == -1) {
+			if (errno != EINTR)
+				return errno;
+			continue;
+		}
+		p += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+int ai_merge_trace_dump(int fd) {
+	const size_t recsize = sizeof(ai_merge_trace_record_t);
+	struct ai_merge_trace_ring *r;
+	ai_merge_trace_header_t h;
+	int ret;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AI_MERGE_TRACE_MAGIC, sizeof(AI_MERGE_TRACE_MAGIC));
+	h.version = AI_MERGE_TRACE_VERSION;
+	h.record_size = recsize;
+	ret = ai_merge_trace_write(fd, &h, sizeof(h));
+
+	for (r = ai_merge_trace_rings; r && !ret; r = r->next) {
+		const unsigned long long int total = r->total;
+		const size_t first = total < ai_merge_trace_alloc ? 0
+			: total % ai_merge_trace_alloc;
+		ai_merge_trace_ring_t rh;
+
+		memset(&rh, 0, sizeof(rh));
+		rh.thread = r->thread;
+		rh.records = total < ai_merge_trace_alloc ? total : ai_merge_trace_alloc;
+		rh.total = total;
+
+		/* oldest first, i.e. from the next one to be overwritten */
+		ret = ai_merge_trace_write(fd, &rh, sizeof(rh));
+		if (!ret)
+			ret = ai_merge_trace_write(fd, &r->records[first],
+					(rh.records - first) * recsize);
+		if (!ret)
+			ret = ai_merge_trace_write(fd, r->records, first * recsize);
+	}
+
+	return ret;
+}
+
+/**
+ * ai_merge_stats_op
+ * @op: the operation
+ * @start: the time the operation was started at, from ai_merge_clock()
+ * @ret: 0 on success, errno or -1 (with errno set) on failure
+ * @bytes: number of bytes copied by the operation
+ *
+ * Add an operation to the statistics and the trace. errno is preserved.
+ */
+static void ai_merge_stats_op(ai_merge_op_t op, unsigned long long int start,
+		int ret, unsigned long long int bytes) {
+	const int saved_errno = errno;
+	unsigned long long int end, us;
+	ai_merge_op_stats_t *s;
+	unsigned int bucket;
+
+	if (!start)
+		return;
+
+	end = ai_merge_clock();
+	if (ai_merge_trace_size)
+		ai_merge_trace_op(op, start, end, ret == -1 ? saved_errno : ret, bytes);
+	if (!ai_merge_stats) {
+		errno = saved_errno;
+		return;
+	}
+
+	us = end - start;
+	for (bucket = 0; bucket < AI_MERGE_STATS_BUCKETS - 1
+			&& us >> (bucket + 1); bucket++);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_merge_stats_lock);
+#endif
+	s = &ai_merge_stats->ops[op];
+	s->count++;
+	if (ret)
+		s->errors++;
+	else if (op == AI_MERGE_OP_RENAME)
+		ai_merge_stats->renamed++;
+	s->total_us += us;
+	if (us > s->max_us)
+		s->max_us = us;
+	s->histogram[bucket]++;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_merge_stats_lock);
+#endif
+
+	errno = saved_errno;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * ai_merge_status_lock
+ *
+ * The lock serializing the writers of the status paths.
+ */
+static pthread_mutex_t ai_merge_status_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the monitors may read the fields at any time */
+#ifdef __ATOMIC_RELAXED
+#	define AI_MERGE_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#	define AI_MERGE_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#	define AI_MERGE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#	define AI_MERGE_STORE(p, v) (*(volatile unsigned long long int *) (p) = (v))
+#	define AI_MERGE_ADD(p, v) (*(volatile unsigned long long int *) (p) += (v))
+#	define AI_MERGE_FENCE()
+#endif
+
+int ai_merge_status_open(const char *path, ai_merge_status_t **status) {
+	ai_merge_status_t *st;
+	int fd, ret;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		return errno;
+	/* the file is zero-filled */
+	if (ftruncate(fd, sizeof(*st))) {
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+
+	st = mmap(NULL, sizeof(*st), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	ret = st == MAP_FAILED ? errno : 0;
+	close(fd);
+	if (ret)
+		return ret;
+
+	AI_MERGE_STORE(&st->version, AI_MERGE_STATUS_VERSION);
+	*status = st;
+	return 0;
+}
+
+void ai_merge_status_close(ai_merge_status_t *status) {
+	if (status)
+		munmap(status, sizeof(*status));
+}
+
+/**
+ * ai_merge_status_entry
+ * @st: the status, or %NULL
+ * @path: directory part of the file path (inside the journal)
+ * @name: file name
+ *
+ * Publish the journal entry being started. If another thread is writing
+ * the path at the moment, the entry is skipped rather than waiting.
+ */
+static void ai_merge_status_entry(ai_merge_status_t *st, const char *path,
+		const char *name) {
+	unsigned long long int seq;
+	size_t len, namelen;
+
+	if (!st)
+		return;
+#ifdef HAVE_PTHREAD
+	if (pthread_mutex_trylock(&ai_merge_status_lock))
+		return;
+#endif
+
+	seq = st->sequence;
+	AI_MERGE_STORE(&st->sequence, seq + 1);
+	AI_MERGE_FENCE();
+
+	len = strlen(path);
+	if (len > AI_MERGE_STATUS_PATH_MAX - 1)
+		len = AI_MERGE_STATUS_PATH_MAX - 1;
+	memcpy(st->path, path, len);
+	namelen = strlen(name);
+	if (namelen > AI_MERGE_STATUS_PATH_MAX - 1 - len)
+		namelen = AI_MERGE_STATUS_PATH_MAX - 1 - len;
+	memcpy(st->path + len, name, namelen);
+	st->path[len + namelen] = 0;
+
+	AI_MERGE_FENCE();
+	AI_MERGE_STORE(&st->sequence, seq + 2);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_merge_status_lock);
+#endif
+}
+
+/**
+ * ai_merge_status_done
+ * @st: the status, or %NULL
+ * @ret: result of processing the entry
+ *
+ * Count a processed journal entry in the status.
+ */
+static void ai_merge_status_done(ai_merge_status_t *st, int ret) {
+	if (!st)
+		return;
+	AI_MERGE_ADD(&st->entries_done, 1);
+	if (ret)
+		AI_MERGE_ADD(&st->errors, 1);
+}
+
+/**
+ * ai_merge_phase_start
+ * @st: the status to publish the phase in, or %NULL
+ * @phase: the phase
+ * @j: the journal the phase runs over, or %NULL
+ *
+ * Fire the phase-start probe, publish the phase in the status, and get
+ * the time for ai_merge_phase_end().
+ *
+ * Returns: the current time, from ai_merge_clock()
+ */
+static unsigned long long int ai_merge_phase_start(ai_merge_status_t *st,
+		ai_merge_phase_t phase, ai_journal_t j) {
+	AI_PROBE1(phase__start, (int) phase);
+	ai_merge_trace_phase = phase;
+	if (st) {
+		unsigned long long int n = 0;
+		ai_journal_file_t *pp;
+
+		for (pp = j ? ai_journal_get_files(j) : NULL; pp;
+				pp = ai_journal_file_next(pp))
+			n++;
+		AI_MERGE_STORE(&st->entries_done, 0);
+		AI_MERGE_STORE(&st->entries_total, n);
+		if (phase == AI_MERGE_PHASE_COPY_NEW)
+			AI_MERGE_STORE(&st->bytes_done, 0);
+		AI_MERGE_STORE(&st->phase, phase);
+	}
+	return ai_merge_clock();
+}
+
+/**
+ * ai_merge_phase_end
+ * @st: the status the phase was published in, or %NULL
+ * @phase: the phase
+ * @start: the time the phase was started at, from ai_merge_phase_start()
+ * @ret: result of the phase
+ *
+ * Fire the phase-end probe, and add the wall time of the phase
+ * to the statistics.
+ */
+static void ai_merge_phase_end(ai_merge_status_t *st, ai_merge_phase_t phase,
+		unsigned long long int start, int ret) {
+	AI_PROBE2(phase__end, (int) phase, ret);
+	ai_merge_trace_phase = AI_MERGE_PHASE_NONE;
+	if (st)
+		AI_MERGE_STORE(&st->phase, AI_MERGE_PHASE_NONE);
+	if (!ai_merge_stats || !start)
+		return;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_merge_stats_lock);
+#endif
+	ai_merge_stats->phase_us[phase] += ai_merge_clock() - start;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_merge_stats_lock);
+#endif
+}
+
+/**
+ * ai_merge_stats_copy
+ * @c: a copying context about to be freed
+ * @new_files: whether @c has been used to copy the new files
+ *
+ * Add the bytes copied by @c to the statistics, and the files linked
+ * and copied if @new_files.
+ */
+static void ai_merge_stats_copy(ai_copy_ctx_t c, int new_files) {
+	ai_copy_stats_t st;
+
+	if (!ai_merge_stats)
+		return;
+
+	ai_copy_ctx_get_stats(c, &st);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ai_merge_stats_lock);
+#endif
+	ai_merge_stats->bytes += st.bytes;
+	if (new_files) {
+		ai_merge_stats->linked += st.links;
+		ai_merge_stats->copied += st.files;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ai_merge_stats_lock);
+#endif
+}
+
+/**
+ * ai_merge_lstat
+ * @path: file path
+ * @st: location to store the file status in
+ *
+ * lstat(), counted in the statistics.
+ *
+ * Returns: like lstat()
+ */
+static int ai_merge_lstat(const char *path, struct stat *st) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = lstat(path, st);
+
+	ai_merge_stats_op(AI_MERGE_OP_STAT, start, ret, 0);
+	return ret;
+}
+
+/**
+ * ai_merge_rename
+ * @from: current file path
+ * @to: new file path
+ *
+ * rename(), counted in the statistics.
+ *
+ * Returns: like rename()
+ */
+static int ai_merge_rename(const char *from, const char *to) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = rename(from, to);
+
+	ai_merge_stats_op(AI_MERGE_OP_RENAME, start, ret, 0);
+	return ret;
+}
+
+/**
+ * ai_merge_unlink
+ * @path: file path
+ *
+ * unlink(), counted in the statistics.
+ *
+ * Returns: like unlink()
+ */
+static int ai_merge_unlink(const char *path) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = unlink(path);
+
+	ai_merge_stats_op(AI_MERGE_OP_UNLINK, start, ret, 0);
+	return ret;
+}
+
+/**
+ * ai_merge_remove
+ * @path: file or directory path
+ *
+ * remove(), counted in the statistics.
+ *
+ * Returns: like remove()
+ */
+static int ai_merge_remove(const char *path) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = remove(path);
+
+	ai_merge_stats_op(AI_MERGE_OP_UNLINK, start, ret, 0);
+	return ret;
+}
+
+/**
+ * ai_merge_set_flag
+ * @j: an open journal
+ * @flag: the flag to set
+ *
+ * ai_journal_set_flag(), counted in the statistics and probed.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_set_flag(ai_journal_t j, unsigned long int flag) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = ai_journal_set_flag(j, flag);
+
+	ai_merge_stats_op(AI_MERGE_OP_SYNC, start, ret, 0);
+	AI_PROBE2(journal__flag, flag, ret);
+	return ret;
+}
+
 /**
  * ai_mkdir_cp
+ * @c: the copying context
  * @source: source tree path buffer
  * @dest: dest tree path buffer
  * @path: path relative to both trees
@@ -35,14 +723,15 @@
  *
  * Returns: 0 on success, errno on failure
  */
-static int ai_mkdir_cp(char *source, char *dest, const char *path,
-		ai_merge_progress_callback_t progress_callback) {
+static int ai_mkdir_cp(ai_copy_ctx_t c, char *source, char *dest,
+		const char *path, ai_merge_progress_callback_t progress_callback) {
 	char *sp = strrchr(source, '/') - strlen(path) + 1;
 	char *dp = strrchr(dest, '/') - strlen(path) + 1;
 
 	const char *relpath = sp;
 
 	while (sp) {
+		unsigned long long int start;
 		int ret;
 
 		*sp = 0;
@@ -51,7 +740,10 @@ static int ai_mkdir_cp(char *source, char *dest, const char *path,
 		if (progress_callback && *relpath)
 			progress_callback(relpath, 0, 0);
 		/* Try to copy the directory entry */
-		ret = ai_cp_a(source, dest);
+		start = ai_merge_clock();
+		ret = ai_copy_ctx_cp_a(c, source, dest);
+		ai_merge_stats_op(AI_MERGE_OP_MKDIR, start,
+				ret == EEXIST || ret == EISDIR ? 0 : ret, 0);
 
 		*sp = '/';
 		*dp = '/';
@@ -80,437 +772,3272 @@ static int ai_merge_constraint_flags(ai_journal_t j, uint32_t required, uint32_t
 	return (ai_journal_get_flags(j) & (required|unallowed)) == required;
 }
 
-typedef int (*copy_func_t)(const char*, const char*);
-
-int ai_merge_copy_new(const char *source, const char *dest, ai_journal_t j,
-		ai_merge_progress_callback_t progress_callback) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator */
-	const size_t oldpathlen = strlen(source) + maxpathlen + 1;
-	/* + .<fn-prefix>~ + .new */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
-
-	char *oldpathbuf, *newpathbuf;
-	ai_journal_file_t *pp;
-	const char *relpath;
+/**
+ * ai_merge_path
+ * @buf: the path buffer
+ * @rootlen: length of the tree root at the beginning of @buf
+ * @dirp: start of the directory part in @buf
+ * @namep: start of the filename part in @buf
+ * @fn_prefix: temporary file prefix
+ * @fn_prefixlen: length of @fn_prefix
+ *
+ * Incremental path builder used by the merge loops. The tree root is written
+ * only once, the directory part is rewritten only from the point where it
+ * differs from the previous one, and the filename is appended in place.
+ */
+struct ai_merge_path {
+	char *buf;
+	size_t rootlen;
+	char *dirp;
+	char *namep;
 
-	int ret = 0;
+	const char *fn_prefix;
+	size_t fn_prefixlen;
+};
 
-	if (!ai_merge_constraint_flags(j, 0, AI_MERGE_COPIED_NEW|AI_MERGE_ROLLBACK_STARTED))
-		return EINVAL;
+/**
+ * ai_merge_path_init
+ * @p: path builder to initialize
+ * @root: tree root path
+ * @j: an open journal
+ *
+ * Allocate the buffer for @p, large enough to hold any path from @j within
+ * @root, including temporary names and staged subtree names.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_path_init(struct ai_merge_path *p, const char *root,
+		ai_journal_t j) {
+	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
 
-	oldpathbuf = malloc(oldpathlen);
-	if (!oldpathbuf)
-		return errno;
+	p->fn_prefix = ai_journal_get_filename_prefix(j);
+	p->fn_prefixlen = strlen(p->fn_prefix);
+	p->rootlen = strlen(root);
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf) {
-		free(oldpathbuf);
+	/* maxpathlen covers path + filename, + 1 for null terminator
+	 * + .<fn-prefix>~ + .new, twice for files in staged subtrees */
+	p->buf = malloc(p->rootlen + 2 * (maxpathlen + 7 + p->fn_prefixlen));
+	if (!p->buf)
 		return errno;
-	}
 
-	relpath = oldpathbuf + strlen(source);
+	memcpy(p->buf, root, p->rootlen + 1);
+	p->dirp = p->namep = p->buf + p->rootlen;
+	return 0;
+}
 
+/**
+ * ai_merge_path_dir
+ * @p: path builder
+ * @path: new directory part, relative to the builder root
+ *
+ * Set the directory part of the path to @path. Only the part which differs
+ * from the current one is rewritten. The filename part becomes undefined.
+ */
+static void ai_merge_path_dir(struct ai_merge_path *p, const char *path) {
+	char *d = p->dirp;
+
+	while (d < p->namep && *d == *path) {
+		d++;
+		path++;
+	}
+
+	if (d != p->namep || *path) {
+		while ((*d = *path)) {
+			d++;
+			path++;
+		}
+		p->namep = d;
+	}
+}
+
+/**
+ * ai_merge_path_name
+ * @p: path builder
+ * @name: filename
+ *
+ * Set the filename part of the path to @name.
+ *
+ * Returns: the complete path
+ */
+static const char *ai_merge_path_name(struct ai_merge_path *p, const char *name) {
+	strcpy(p->namep, name);
+	return p->buf;
+}
+
+/**
+ * ai_merge_path_tmp
+ * @p: path builder
+ * @name: filename
+ * @suffix: temporary file suffix (".new" or ".old")
+ *
+ * Set the filename part of the path to the temporary name for @name.
+ *
+ * Returns: the complete path
+ */
+static const char *ai_merge_path_tmp(struct ai_merge_path *p, const char *name,
+		const char *suffix) {
+	char *out = p->namep;
+
+	*out++ = '.';
+	memcpy(out, p->fn_prefix, p->fn_prefixlen);
+	out += p->fn_prefixlen;
+	*out++ = '~';
+
+	while (*name)
+		*out++ = *name++;
+	strcpy(out, suffix);
+
+	return p->buf;
+}
+
+/**
+ * ai_merge_path_new_tree
+ * @p: path builder
+ * @root: staged subtree root path, with a trailing slash
+ *
+ * Set the base of @p to the temporary name of the staged subtree @root. Further
+ * directory parts will be relative to the staged subtree, and need to start
+ * with a slash.
+ *
+ * Returns: the staged subtree path
+ */
+static const char *ai_merge_path_new_tree(struct ai_merge_path *p,
+		const char *root) {
+	const char *end = root + strlen(root) - 1;
+	const char *name = end;
+	char *out = p->buf + p->rootlen;
+
+	while (name[-1] != '/')
+		name--;
+
+	/* parent directory + .<fn-prefix>~<name>.new */
+	memcpy(out, root, name - root);
+	out += name - root;
+	*out++ = '.';
+	memcpy(out, p->fn_prefix, p->fn_prefixlen);
+	out += p->fn_prefixlen;
+	*out++ = '~';
+	memcpy(out, name, end - name);
+	out += end - name;
+	strcpy(out, ".new");
+
+	p->dirp = p->namep = out + 4;
+	return p->buf;
+}
+
+/**
+ * ai_merge_path_free
+ * @p: path builder
+ *
+ * Free the buffer used by @p.
+ */
+static void ai_merge_path_free(struct ai_merge_path *p) {
+	free(p->buf);
+}
+
+/**
+ * ai_merge_find_new_tree
+ * @p: destination tree path builder
+ * @path: directory part of the file path
+ * @rootbuf: buffer to write the new subtree root to
+ *
+ * Find the topmost directory on @path which does not exist in the destination
+ * tree, and write it (with a trailing slash) to @rootbuf. If the destination
+ * tree root does not exist either, no subtree will be staged.
+ *
+ * The directory part of @p is set to @path.
+ *
+ * Returns: length of the subtree root path, or 0 if none was found
+ */
+static size_t ai_merge_find_new_tree(struct ai_merge_path *p,
+		const char *path, char *rootbuf) {
+	struct stat st;
+	char *s;
+	int missing;
+
+	ai_merge_path_dir(p, path);
+
+	*p->dirp = 0;
+	missing = ai_merge_lstat(p->buf, &st);
+	*p->dirp = '/';
+	if (missing)
+		return 0;
+
+	for (s = p->dirp + 1; s < p->namep; s++) {
+		if (*s != '/')
+			continue;
+
+		*s = 0;
+		missing = ai_merge_lstat(p->buf, &st) && errno == ENOENT;
+		*s = '/';
+
+		if (missing) {
+			const size_t rootlen = s - p->dirp + 1;
+
+			memcpy(rootbuf, path, rootlen);
+			rootbuf[rootlen] = 0;
+			return rootlen;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ai_merge_dir_root
+ * @rootbuf: output buffer
+ * @path: directory part of the directory path
+ * @name: directory name
+ *
+ * Write the subtree root path for directory @name in @path (with a trailing
+ * slash) to @rootbuf.
+ *
+ * Returns: length of the subtree root path
+ */
+static size_t ai_merge_dir_root(char *rootbuf, const char *path,
+		const char *name) {
+	const size_t pathlen = strlen(path);
+	const size_t namelen = strlen(name);
+
+	memcpy(rootbuf, path, pathlen);
+	memcpy(rootbuf + pathlen, name, namelen);
+	rootbuf[pathlen + namelen] = '/';
+	rootbuf[pathlen + namelen + 1] = 0;
+
+	return pathlen + namelen + 1;
+}
+
+/**
+ * ai_merge_dir_hash
+ * @path: directory part of the file path
+ *
+ * Hash the directory path, in order to assign entries to workers
+ * or to look up directory descriptors.
+ *
+ * Returns: FNV-1a hash of @path
+ */
+static uint32_t ai_merge_dir_hash(const char *path) {
+	uint32_t h = 2166136261U;
+
+	for (; *path; path++) {
+		h ^= (unsigned char) *path;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/**
+ * ai_merge_default_options
+ *
+ * The options used when %NULL is passed.
+ */
+static const ai_merge_options_t ai_merge_default_options = {
+	1, NULL, NULL, NULL,
+	1, AI_COPY_CACHE_KEEP, 0, AI_COPY_NONE, NULL
+};
+
+/**
+ * ai_merge_check_options
+ * @opts: the options passed by the caller, replaced with the defaults
+ *	if %NULL
+ *
+ * Validate the per-merge options.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_check_options(const ai_merge_options_t **opts) {
+	if (!*opts) {
+		*opts = &ai_merge_default_options;
+		return 0;
+	}
+
+	if ((*opts)->jobs > AI_MERGE_MAX_JOBS)
+		return EINVAL;
+#ifndef HAVE_PTHREAD
+	if ((*opts)->jobs > 1)
+		return ENOSYS;
+#endif
+	return 0;
+}
+
+/**
+ * ai_merge_copy_ctx_new
+ * @opts: the merge options
+ * @ret: location to store the new context in
+ *
+ * Create a copying context using the copy settings from @opts.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_copy_ctx_new(const ai_merge_options_t *opts,
+		ai_copy_ctx_t *ret) {
+	ai_copy_ctx_t c;
+	int err;
+
+	err = ai_copy_ctx_new(&c);
+	if (err)
+		return err;
+
+	err = ai_copy_ctx_set_jobs(c, opts->copy_jobs ? opts->copy_jobs : 1);
+	if (!err)
+		err = ai_copy_ctx_set_cache_policy(c, opts->cache_policy);
+	if (!err)
+		err = ai_copy_ctx_set_strategy(c, opts->strategy);
+	if (err) {
+		ai_copy_ctx_free(c);
+		return err;
+	}
+	ai_copy_ctx_set_bufsize(c, opts->bufsize);
+	ai_copy_ctx_set_throttle(c, opts->throttle);
+
+	*ret = c;
+	return 0;
+}
+
+/**
+ * ai_merge_cp_l
+ * @store: the object store, or %NULL
+ * @c: the copying context
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * Copy a new file, like ai_copy_ctx_cp_l() does, using the object store
+ * if one is set.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_cp_l(ai_store_t store, ai_copy_ctx_t c,
+		const char *source, const char *dest) {
+	if (store)
+		return ai_store_ctx_cp(store, c, source, dest);
+	return ai_copy_ctx_cp_l(c, source, dest);
+}
+
+struct ai_merge_exec;
+struct ai_merge_async;
+
+static void ai_merge_async_removed(struct ai_merge_async *a,
+		const char *relpath, int result);
+
+/**
+ * ai_merge_worker
+ * @oldp: path builder for temporary files
+ * @newp: path builder for destination files
+ * @treep: path builder for staged subtrees
+ * @rootbuf: buffer for the staged subtree root
+ * @rootlen: length of the staged subtree root in @rootbuf, or 0 if none
+ * @copy: the copying context
+ * @throttle: the I/O rate limits, or %NULL
+ * @status: the status to publish the entries in, or %NULL
+ * @removal_callback: callback function for removal progress reporting,
+ *	or %NULL
+ * @async: the asynchronous merge to report removals to, or %NULL
+ * @exec: the parallel executor, or %NULL when running serially
+ * @first: index of the first entry assigned to this worker, plus one
+ *
+ * The per-worker state of a metadata phase.
+ */
+struct ai_merge_worker {
+	struct ai_merge_path oldp, newp, treep;
+	char *rootbuf;
+	size_t rootlen;
+	ai_copy_ctx_t copy;
+	ai_copy_throttle_t throttle;
+	ai_merge_status_t *status;
+
+	ai_merge_removal_callback_t removal_callback;
+	struct ai_merge_async *async;
+
+	struct ai_merge_exec *exec;
+	size_t first;
+};
+
+/**
+ * ai_merge_entry_func_t
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Function processing a single journal entry in a metadata phase.
+ *
+ * Returns: 0 to proceed, errno to abort the phase
+ */
+typedef int (*ai_merge_entry_func_t)(struct ai_merge_worker *w,
+		ai_journal_file_t *pp);
+
+/**
+ * ai_merge_entry
+ * @w: the worker
+ * @func: the per-entry function
+ * @pp: the journal entry
+ * @index: index of @pp in the journal
+ *
+ * Call @func for a single journal entry, firing the entry probes around it
+ * and publishing it in the status and the trace.
+ *
+ * Returns: the result of @func
+ */
+static int ai_merge_entry(struct ai_merge_worker *w,
+		ai_merge_entry_func_t func, ai_journal_file_t *pp, size_t index) {
+	int ret;
+
+	ai_merge_trace_entry(index);
+	AI_PROBE2(entry__start, ai_journal_file_path(pp), ai_journal_file_name(pp));
+	ai_merge_status_entry(w->status, ai_journal_file_path(pp),
+			ai_journal_file_name(pp));
+	ret = func(w, pp);
+	ai_merge_trace_entry(-1);
+	ai_merge_status_done(w->status, ret);
+	AI_PROBE3(entry__end, ai_journal_file_path(pp), ai_journal_file_name(pp),
+			ret);
+	return ret;
+}
+
+/**
+ * ai_merge_worker_init
+ * @w: the worker to initialize
+ * @dest: path to the destination tree
+ * @j: an open journal
+ * @opts: the merge options
+ *
+ * Allocate the path buffers and the copying context for the worker @w.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_worker_init(struct ai_merge_worker *w, const char *dest,
+		ai_journal_t j, const ai_merge_options_t *opts) {
+	int ret;
+
+	ret = ai_merge_path_init(&w->oldp, dest, j);
+	if (ret)
+		return ret;
+
+	ret = ai_merge_path_init(&w->newp, dest, j);
+	if (ret) {
+		ai_merge_path_free(&w->oldp);
+		return ret;
+	}
+
+	ret = ai_merge_path_init(&w->treep, dest, j);
+	if (ret) {
+		ai_merge_path_free(&w->oldp);
+		ai_merge_path_free(&w->newp);
+		return ret;
+	}
+
+	w->rootbuf = malloc(ai_journal_get_maxpathlen(j) + 1);
+	if (!w->rootbuf) {
+		ai_merge_path_free(&w->oldp);
+		ai_merge_path_free(&w->newp);
+		ai_merge_path_free(&w->treep);
+		return errno;
+	}
+
+	ret = ai_merge_copy_ctx_new(opts, &w->copy);
+	if (ret) {
+		ai_merge_path_free(&w->oldp);
+		ai_merge_path_free(&w->newp);
+		ai_merge_path_free(&w->treep);
+		free(w->rootbuf);
+		return ret;
+	}
+
+	w->rootlen = 0;
+	w->throttle = opts->throttle;
+	w->status = opts->status;
+	w->removal_callback = NULL;
+	w->async = NULL;
+	w->exec = NULL;
+	w->first = 0;
+	return 0;
+}
+
+/**
+ * ai_merge_worker_free
+ * @w: the worker
+ *
+ * Free the path buffers and the copying context of the worker @w.
+ */
+static void ai_merge_worker_free(struct ai_merge_worker *w) {
+	ai_merge_path_free(&w->oldp);
+	ai_merge_path_free(&w->newp);
+	ai_merge_path_free(&w->treep);
+	free(w->rootbuf);
+	ai_merge_stats_copy(w->copy, 0);
+	ai_copy_ctx_free(w->copy);
+}
+
+/**
+ * ai_merge_worker_mv
+ * @w: the worker
+ * @source: current file path
+ * @dest: new file path
+ *
+ * Move a file using the copying context of @w, counted in the statistics.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_worker_mv(struct ai_merge_worker *w, const char *source,
+		const char *dest) {
+	const unsigned long long int start = ai_merge_clock();
+	const int ret = ai_copy_ctx_mv(w->copy, source, dest);
+
+	ai_merge_stats_op(AI_MERGE_OP_RENAME, start, ret, 0);
+	return ret;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * ai_merge_entry
+ * @f: the journal entry
+ * @next: index of the next entry for the same worker, plus one; 0 if last
+ *
+ * A journal entry assigned to a worker.
+ */
+struct ai_merge_entry {
+	ai_journal_file_t *f;
+	size_t next;
+};
+
+/**
+ * ai_merge_exec
+ * @lock: lock protecting @ret, callbacks and non-reentrant copying
+ * @ret: the first error reported by any worker
+ * @func: the per-entry function
+ * @entries: the journal entries, linked per worker
+ *
+ * The state shared by all workers of a parallel metadata phase.
+ */
+struct ai_merge_exec {
+	pthread_mutex_t lock;
+	int ret;
+
+	ai_merge_entry_func_t func;
+	struct ai_merge_entry *entries;
+};
+
+/**
+ * ai_merge_worker_run
+ * @arg: the worker
+ *
+ * Process all entries assigned to the worker @arg, in journal order. Stop
+ * as soon as any of the workers fails.
+ *
+ * Returns: %NULL
+ */
+static void *ai_merge_worker_run(void *arg) {
+	struct ai_merge_worker *w = arg;
+	struct ai_merge_exec *e = w->exec;
+	size_t i;
+
+	for (i = w->first; i; i = e->entries[i - 1].next) {
+		int ret;
+
+		pthread_mutex_lock(&e->lock);
+		ret = e->ret;
+		pthread_mutex_unlock(&e->lock);
+		if (ret)
+			break;
+
+		ret = ai_merge_entry(w, e->func, e->entries[i - 1].f, i - 1);
+		if (ret) {
+			pthread_mutex_lock(&e->lock);
+			if (!e->ret)
+				e->ret = ret;
+			pthread_mutex_unlock(&e->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * ai_merge_run_parallel
+ * @j: an open journal
+ * @dest: path to the destination tree
+ * @opts: the merge options
+ * @func: the per-entry function
+ * @deferred: file flags of entries which have to be processed after all
+ *	the others
+ * @removal_callback: callback function for removal progress reporting,
+ *	or %NULL
+ *
+ * Run @func over the journal entries using @opts->jobs workers. The entries
+ * are partitioned by their directory, so all operations in a single
+ * directory are performed by the same worker, in journal order. Entries
+ * matching @deferred are processed serially afterwards, in journal order.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_run_parallel(ai_journal_t j, const char *dest,
+		const ai_merge_options_t *opts, ai_merge_entry_func_t func,
+		unsigned char deferred, ai_merge_removal_callback_t removal_callback) {
+	const unsigned int jobs = opts->jobs;
+	struct ai_merge_worker w[AI_MERGE_MAX_JOBS + 1];
+	size_t tail[AI_MERGE_MAX_JOBS + 1];
+	pthread_t threads[AI_MERGE_MAX_JOBS];
+	int started[AI_MERGE_MAX_JOBS];
+
+	struct ai_merge_exec e;
+	ai_journal_file_t *pp;
+	size_t nfiles = 0, i;
+	unsigned int n;
+
+	int ret = 0;
+
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp))
+		nfiles++;
+	if (!nfiles)
+		return 0;
+
+	e.entries = malloc(nfiles * sizeof(*e.entries));
+	if (!e.entries)
+		return errno;
+
+	/* the last worker is the serial one, for deferred entries */
+	for (n = 0; n <= jobs; n++) {
+		ret = ai_merge_worker_init(&w[n], dest, j, opts);
+		if (ret) {
+			while (n > 0)
+				ai_merge_worker_free(&w[--n]);
+			free(e.entries);
+			return ret;
+		}
+		w[n].removal_callback = removal_callback;
+		w[n].exec = &e;
+		tail[n] = 0;
+	}
+
+	for (pp = ai_journal_get_files(j), i = 0; pp;
+			pp = ai_journal_file_next(pp), i++) {
+		n = ai_journal_file_flags(pp) & deferred ? jobs
+			: ai_merge_dir_hash(ai_journal_file_path(pp)) % jobs;
+
+		e.entries[i].f = pp;
+		e.entries[i].next = 0;
+		if (tail[n])
+			e.entries[tail[n] - 1].next = i + 1;
+		else
+			w[n].first = i + 1;
+		tail[n] = i + 1;
+	}
+
+	pthread_mutex_init(&e.lock, NULL);
+	e.ret = 0;
+	e.func = func;
+
+	for (n = 1; n < jobs; n++)
+		started[n] = !pthread_create(&threads[n], NULL,
+				ai_merge_worker_run, &w[n]);
+	ai_merge_worker_run(&w[0]);
+	for (n = 1; n < jobs; n++) {
+		/* couldn't start a thread? do its work here */
+		if (started[n])
+			pthread_join(threads[n], NULL);
+		else
+			ai_merge_worker_run(&w[n]);
+	}
+	ai_merge_worker_run(&w[jobs]);
+
+	ret = e.ret;
+	pthread_mutex_destroy(&e.lock);
+
+	for (n = 0; n <= jobs; n++)
+		ai_merge_worker_free(&w[n]);
+	free(e.entries);
+
+	return ret;
+}
+#endif
+
+/**
+ * ai_merge_run_serial
+ * @j: an open journal
+ * @dest: path to the destination tree
+ * @opts: the merge options
+ * @func: the per-entry function
+ * @removal_callback: callback function for removal progress reporting,
+ *	or %NULL
+ *
+ * Run @func over all the journal entries of a metadata phase serially,
+ * in journal order.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_run_serial(ai_journal_t j, const char *dest,
+		const ai_merge_options_t *opts, ai_merge_entry_func_t func,
+		ai_merge_removal_callback_t removal_callback) {
+	struct ai_merge_worker w;
+	ai_journal_file_t *pp;
+	size_t i;
+
+	int ret;
+
+	ret = ai_merge_worker_init(&w, dest, j, opts);
+	if (ret)
+		return ret;
+	w.removal_callback = removal_callback;
+
+	for (pp = ai_journal_get_files(j), i = 0; pp;
+			pp = ai_journal_file_next(pp), i++) {
+		ret = ai_merge_entry(&w, func, pp, i);
+		if (ret)
+			break;
+	}
+
+	ai_merge_worker_free(&w);
+
+	return ret;
+}
+
+/**
+ * ai_merge_run
+ * @j: an open journal
+ * @dest: path to the destination tree
+ * @opts: the merge options
+ * @func: the per-entry function
+ * @deferred: file flags of entries which have to be processed after all
+ *	the others when running in parallel
+ * @removal_callback: callback function for removal progress reporting,
+ *	or %NULL
+ *
+ * Run @func over all the journal entries of a metadata phase, either serially
+ * or in parallel (see #ai_merge_options_t).
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_run(ai_journal_t j, const char *dest,
+		const ai_merge_options_t *opts, ai_merge_entry_func_t func,
+		unsigned char deferred, ai_merge_removal_callback_t removal_callback) {
+#ifdef HAVE_PTHREAD
+	if (opts->jobs > 1)
+		return ai_merge_run_parallel(j, dest, opts, func, deferred,
+				removal_callback);
+#endif
+
+	return ai_merge_run_serial(j, dest, opts, func, removal_callback);
+}
+
+/**
+ * ai_merge_worker_lock
+ * @w: the worker
+ *
+ * Serialize with other workers, if running in parallel. Used around
+ * callbacks.
+ */
+static void ai_merge_worker_lock(struct ai_merge_worker *w) {
+#ifdef HAVE_PTHREAD
+	if (w->exec)
+		pthread_mutex_lock(&w->exec->lock);
+#endif
+}
+
+/**
+ * ai_merge_worker_unlock
+ * @w: the worker
+ *
+ * Release the lock taken by ai_merge_worker_lock().
+ */
+static void ai_merge_worker_unlock(struct ai_merge_worker *w) {
+#ifdef HAVE_PTHREAD
+	if (w->exec)
+		pthread_mutex_unlock(&w->exec->lock);
+#endif
+}
+
+/**
+ * ai_merge_worker_removed
+ * @w: the worker
+ * @relpath: relative path to the file
+ * @result: result of processing
+ *
+ * Call the removal callback, if any, serializing it with other workers.
+ * For asynchronous merges, queue the removal event instead.
+ */
+static void ai_merge_worker_removed(struct ai_merge_worker *w,
+		const char *relpath, int result) {
+	if (w->async) {
+		ai_merge_async_removed(w->async, relpath, result);
+		return;
+	}
+	if (!w->removal_callback)
+		return;
+
+	ai_merge_worker_lock(w);
+	w->removal_callback(relpath, result);
+	ai_merge_worker_unlock(w);
+}
+
+/**
+ * ai_merge_copier
+ * @newp: path builder for destination files
+ * @treep: path builder for staged subtrees
+ * @rootbuf: buffer for the staged subtree root
+ * @rootlen: length of the staged subtree root in @rootbuf, or 0 if none
+ * @copy: the copying context
+ * @throttle: the I/O rate limits, or %NULL
+ * @store: the object store, or %NULL
+ * @written: path of the file written for the last entry, or %NULL
+ *
+ * The state of copying new files into a single destination tree.
+ */
+struct ai_merge_copier {
+	struct ai_merge_path newp, treep;
+	char *rootbuf;
+	size_t rootlen;
+	ai_copy_ctx_t copy;
+	ai_copy_throttle_t throttle;
+	ai_store_t store;
+	const char *written;
+};
+
+/**
+ * ai_merge_copier_init
+ * @c: the copier to initialize
+ * @dest: path to the destination tree
+ * @j: the journal
+ * @opts: the merge options
+ *
+ * Initialize the copier for destination tree @dest.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_copier_init(struct ai_merge_copier *c, const char *dest,
+		ai_journal_t j, const ai_merge_options_t *opts) {
+	int ret;
+
+	ret = ai_merge_path_init(&c->newp, dest, j);
+	if (ret)
+		return ret;
+
+	ret = ai_merge_path_init(&c->treep, dest, j);
+	if (ret) {
+		ai_merge_path_free(&c->newp);
+		return ret;
+	}
+
+	c->rootbuf = malloc(ai_journal_get_maxpathlen(j) + 1);
+	if (!c->rootbuf) {
+		ai_merge_path_free(&c->newp);
+		ai_merge_path_free(&c->treep);
+		return errno;
+	}
+
+	ret = ai_merge_copy_ctx_new(opts, &c->copy);
+	if (ret) {
+		ai_merge_path_free(&c->newp);
+		ai_merge_path_free(&c->treep);
+		free(c->rootbuf);
+		return ret;
+	}
+
+	c->rootlen = 0;
+	c->throttle = opts->throttle;
+	c->store = opts->store;
+	c->written = NULL;
+	return 0;
+}
+
+/**
+ * ai_merge_copier_free
+ * @c: the copier
+ *
+ * Free the memory allocated for the copier.
+ */
+static void ai_merge_copier_free(struct ai_merge_copier *c) {
+	ai_merge_path_free(&c->newp);
+	ai_merge_path_free(&c->treep);
+	free(c->rootbuf);
+	ai_merge_stats_copy(c->copy, 1);
+	ai_copy_ctx_free(c->copy);
+}
+
+/**
+ * ai_merge_copy_file
+ * @c: the copier
+ * @flags: journal file flags
+ * @source: source tree file path
+ * @data: path to copy the file contents from
+ * @dest: new complete file path
+ *
+ * Copy a single new file. Directories are created with the attributes
+ * of @source, other files are copied (or linked) from @data.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_copy_file(struct ai_merge_copier *c, unsigned char flags,
+		const char *source, const char *data, const char *dest) {
+	const unsigned long long int start = ai_merge_clock();
+	ai_copy_stats_t st;
+	unsigned long long int bytes = 0;
+	int ret;
+
+	if (start) {
+		ai_copy_ctx_get_stats(c->copy, &st);
+		bytes = st.bytes;
+	}
+
+	if (flags & AI_MERGE_FILE_DIR)
+		ret = ai_copy_ctx_cp_a(c->copy, source, dest);
+	else
+		ret = ai_merge_cp_l(c->store, c->copy, data, dest);
+
+	if (start) {
+		ai_copy_ctx_get_stats(c->copy, &st);
+		bytes = st.bytes - bytes;
+	}
+	ai_merge_stats_op(AI_MERGE_OP_COPY, start, ret, bytes);
+	return ret;
+}
+
+/**
+ * ai_merge_copy_entry
+ * @c: the copier
+ * @pp: the journal entry
+ * @oldp: source tree path builder, set to the entry
+ * @data: path to copy the file contents from
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Copy the new file for journal entry @pp to the destination tree of @c. Store
+ * the path of the written file in @c->written.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_copy_entry(struct ai_merge_copier *c, ai_journal_file_t *pp,
+		struct ai_merge_path *oldp, const char *data,
+		ai_merge_progress_callback_t progress_callback) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+	const char *relpath = oldp->buf + oldp->rootlen;
+	int is_root = 0;
+	int ret;
+
+	c->written = NULL;
+	ai_copy_throttle(c->throttle, 0, 1);
+
+	if (flags & AI_MERGE_FILE_REMOVE) {
+		struct stat tmp;
+
+		/* file exists in sourcedir -> will be replaced -> ignore */
+		if (!ai_merge_lstat(oldp->buf, &tmp))
+			return ai_journal_file_set_flag(pp, AI_MERGE_FILE_IGNORE);
+		return 0;
+	}
+
+	if (c->rootlen) {
+		/* the subtree root comes after its contents */
+		is_root = !strncmp(relpath, c->rootbuf, c->rootlen - 1)
+			&& !relpath[c->rootlen - 1];
+		/* leaving the staged subtree? */
+		if (!is_root && strncmp(path, c->rootbuf, c->rootlen))
+			c->rootlen = 0;
+	} else if (flags & AI_MERGE_FILE_DIR) {
+		/* the subtree root, when resuming */
+		struct stat st;
+
+		ai_merge_dir_root(c->rootbuf, path, name);
+		ai_merge_path_new_tree(&c->treep, c->rootbuf);
+		if (!ai_merge_lstat(c->treep.buf, &st) && S_ISDIR(st.st_mode)) {
+			c->rootlen = strlen(c->rootbuf);
+			is_root = 1;
+		}
+	}
+
+	if (c->rootlen) {
+		ai_merge_path_dir(&c->treep, is_root ? "" : path + c->rootlen - 1);
+		ai_merge_path_name(&c->treep, is_root ? "" : name);
+
+		/* flag first, so that rollback knows where to look */
+		ret = ai_journal_file_set_flag(pp, is_root
+				? AI_MERGE_FILE_NEW_TREE : AI_MERGE_FILE_IN_NEW_TREE);
+		if (ret)
+			return ret;
+
+		if (progress_callback)
+			progress_callback(relpath, 0, 0);
+		ret = ai_merge_copy_file(c, flags, oldp->buf, data, c->treep.buf);
+
+		if (ret == ENOENT && !is_root) {
+			ret = ai_mkdir_cp(c->copy, oldp->buf, c->treep.buf,
+					path + c->rootlen - 1, NULL);
+			if (!ret)
+				ret = ai_merge_copy_file(c, flags, oldp->buf, data, c->treep.buf);
+		}
+
+		if (ret)
+			return ret;
+		c->written = c->treep.buf;
+		if (is_root)
+			c->rootlen = 0;
+		return 0;
+	}
+
+	ai_merge_path_dir(&c->newp, path);
+	if (flags & AI_MERGE_FILE_DIR)
+		ai_merge_path_name(&c->newp, name);
+	else
+		ai_merge_path_tmp(&c->newp, name, ".new");
+
+	if (progress_callback)
+		progress_callback(relpath, 0, 0);
+	ret = ai_merge_copy_file(c, flags, oldp->buf, data, c->newp.buf);
+
+	if (ret == ENOENT) {
+		/* stage the whole missing subtree if possible */
+		c->rootlen = ai_merge_find_new_tree(&c->newp, path, c->rootbuf);
+		if (c->rootlen) {
+			ai_merge_path_new_tree(&c->treep, c->rootbuf);
+			ai_merge_path_dir(&c->treep, path + c->rootlen - 1);
+			ai_merge_path_name(&c->treep, name);
+
+			ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_IN_NEW_TREE);
+			if (!ret)
+				ret = ai_mkdir_cp(c->copy, oldp->buf, c->treep.buf,
+						path + c->rootlen - 1, NULL);
+			if (!ret)
+				ret = ai_merge_copy_file(c, flags, oldp->buf, data, c->treep.buf);
+			if (!ret)
+				c->written = c->treep.buf;
+			return ret;
+		} else {
+			ret = ai_mkdir_cp(c->copy, oldp->buf, c->newp.buf, path,
+					progress_callback);
+			if (!ret)
+				ret = ai_merge_copy_file(c, flags, oldp->buf, data, c->newp.buf);
+		}
+	}
+
+	if (!ret)
+		c->written = c->newp.buf;
+	return ret;
+}
+
+/**
+ * ai_merge_file_hash
+ * @path: directory part of the file path
+ * @name: file name
+ *
+ * Hash the complete file path, in order to look up the journal entries.
+ *
+ * Returns: FNV-1a hash of @path and @name
+ */
+static uint32_t ai_merge_file_hash(const char *path, const char *name) {
+	uint32_t h = ai_merge_dir_hash(path);
+
+	for (; *name; name++) {
+		h ^= (unsigned char) *name;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+int ai_merge_mark_replaced(ai_journal_t j) {
+	ai_journal_file_t *pp, **set;
+	size_t count = 0, mask;
+
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp))
+		count++;
+
+	for (mask = 16; mask < count * 2; mask <<= 1);
+	set = calloc(mask, sizeof(*set));
+	if (!set)
+		return errno;
+	mask--;
+
+	/* the removals come after all the new files */
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		size_t i = ai_merge_file_hash(path, name) & mask;
+		int ret;
+
+		if (!(ai_journal_file_flags(pp) & AI_MERGE_FILE_REMOVE)) {
+			while (set[i])
+				i = (i + 1) & mask;
+			set[i] = pp;
+			continue;
+		}
+
+		for (; set[i]; i = (i + 1) & mask) {
+			if (!strcmp(ai_journal_file_path(set[i]), path)
+					&& !strcmp(ai_journal_file_name(set[i]), name)) {
+				ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_IGNORE);
+				if (ret) {
+					free(set);
+					return ret;
+				}
+				break;
+			}
+		}
+	}
+
+	free(set);
+	return 0;
+}
+
+/**
+ * ai_merge_copy_state
+ * @oldp: path builder for the source tree
+ * @copiers: the per-destination copiers
+ * @pps: the current journal entry, per destination
+ * @index: index of the current journal entry
+ * @js: the journals
+ * @count: number of destinations
+ * @ready: number of initialized copiers
+ * @source: the source tree of the current entry
+ * @root: the source tree @oldp is set up for
+ * @layered: whether the files come from multiple source trees
+ * @status: the status to publish the entries in, or %NULL
+ * @manifest: the verification manifest being written, or %NULL
+ *
+ * The state of copying new files into one or more destination trees.
+ */
+struct ai_merge_copy_state {
+	struct ai_merge_path oldp;
+	struct ai_merge_copier *copiers;
+	ai_journal_file_t **pps;
+	size_t index;
+	ai_journal_t *js;
+	unsigned int count, ready;
+
+	const char *source, *root;
+	int layered;
+	ai_merge_status_t *status;
+	FILE *manifest;
+};
+
+/**
+ * ai_merge_copy_begin
+ * @s: the state to initialize
+ * @source: path to the source tree
+ * @dests: array of paths to the destination trees
+ * @js: array of open journals, one for each destination
+ * @count: number of destinations
+ * @opts: the merge options
+ *
+ * Prepare copying the new files. ai_merge_copy_end() needs to be called
+ * afterwards, even if this function fails.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_copy_begin(struct ai_merge_copy_state *s, const char *source,
+		const char *const *dests, ai_journal_t *js, unsigned int count,
+		const ai_merge_options_t *opts) {
+	unsigned int i;
+	int ret;
+
+	s->oldp.buf = NULL;
+	s->copiers = NULL;
+	s->pps = NULL;
+	s->index = 0;
+	s->js = js;
+	s->count = count;
+	s->ready = 0;
+	s->source = s->root = source;
+	s->layered = 0;
+	s->status = opts->status;
+	s->manifest = NULL;
+
+	if (!count)
+		return EINVAL;
+	for (i = 0; i < count; i++) {
+		if (!ai_merge_constraint_flags(js[i], 0,
+					AI_MERGE_COPIED_NEW|AI_MERGE_ROLLBACK_STARTED)
+				|| ai_journal_get_maxpathlen(js[i])
+					!= ai_journal_get_maxpathlen(js[0]))
+			return EINVAL;
+	}
+
+	ret = ai_merge_path_init(&s->oldp, source, js[0]);
+	if (ret) {
+		s->oldp.buf = NULL;
+		return ret;
+	}
+
+	s->copiers = malloc(count * sizeof(*s->copiers));
+	s->pps = malloc(count * sizeof(*s->pps));
+	if (!s->copiers || !s->pps)
+		return errno;
+
+	for (; s->ready < count; s->ready++) {
+		ret = ai_merge_copier_init(&s->copiers[s->ready], dests[s->ready],
+				js[s->ready], opts);
+		if (ret)
+			return ret;
+		if (s->ready)
+			s->pps[s->ready] = ai_journal_get_files(js[s->ready]);
+		else
+			s->pps[s->ready] = ai_journal_get_files_layered(js[s->ready],
+					&s->source);
+	}
+
+	if (opts->manifest) {
+		s->manifest = fopen(opts->manifest, "w");
+		if (!s->manifest)
+			return errno;
+		ai_copy_ctx_set_hashing(s->copiers[0].copy, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * ai_merge_copy_step
+ * @s: the copying state
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Copy the new file for the current journal entry to all destinations,
+ * and proceed to the next entry. Copying is finished when @s->pps[0]
+ * becomes %NULL.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_copy_step(struct ai_merge_copy_state *s,
+		ai_merge_progress_callback_t progress_callback) {
+	const char *path = ai_journal_file_path(s->pps[0]);
+	const char *name = ai_journal_file_name(s->pps[0]);
+	unsigned int i;
+	int ret;
+
+	/* batch journal, entering the next source tree */
+	if (s->source != s->root) {
+		s->root = s->source;
+		ai_merge_path_free(&s->oldp);
+		ret = ai_merge_path_init(&s->oldp, s->root, s->js[0]);
+		if (ret) {
+			s->oldp.buf = NULL;
+			return ret;
+		}
+		s->layered = 1;
+	}
+
+	ai_merge_path_dir(&s->oldp, path);
+	ai_merge_path_name(&s->oldp, name);
+
+	for (i = 0; i < s->count; i++) {
+		const char *data = s->oldp.buf;
+
+		if (i) {
+			/* the journals need to list the same files */
+			if (!s->pps[i] || strcmp(ai_journal_file_path(s->pps[i]), path)
+					|| strcmp(ai_journal_file_name(s->pps[i]), name))
+				return EINVAL;
+
+			/* read the source file only once */
+			if (s->copiers[0].written)
+				data = s->copiers[0].written;
+		}
+
+		AI_PROBE2(entry__start, path, name);
+		if (!i) {
+			ai_merge_trace_entry(s->index);
+			ai_merge_status_entry(s->status, path, name);
+		}
+		ret = ai_merge_copy_entry(&s->copiers[i], s->pps[i], &s->oldp, data,
+				i ? NULL : progress_callback);
+		if (!i && s->status) {
+			ai_copy_stats_t st;
+
+			ai_merge_status_done(s->status, ret);
+			ai_copy_ctx_get_stats(s->copiers[0].copy, &st);
+			AI_MERGE_STORE(&s->status->bytes_done, st.bytes);
+		}
+		AI_PROBE3(entry__end, path, name, ret);
+		if (ret)
+			return ret;
+
+		if (!i && s->manifest && s->copiers[0].written) {
+			unsigned long long int hash;
+
+			/* the linked files share the data with the source */
+			if (!ai_copy_ctx_get_hash(s->copiers[0].copy, &hash)
+					&& fprintf(s->manifest, "%016llx %s%c", hash,
+						s->copiers[0].written + s->copiers[0].newp.rootlen,
+						0) < 0)
+				return errno;
+		}
+		if (i)
+			s->pps[i] = ai_journal_file_next(s->pps[i]);
+		else
+			s->pps[i] = ai_journal_file_next_layered(s->pps[i], &s->source);
+	}
+
+	ai_merge_trace_entry(-1);
+	s->index++;
+	return 0;
+}
+
+/**
+ * ai_merge_copy_end
+ * @s: the copying state
+ * @ret: result of copying
+ *
+ * Free the copying state and close the manifest. If copying succeeded, mark
+ * the journals as done.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_copy_end(struct ai_merge_copy_state *s, int ret) {
+	unsigned int i;
+
+	for (i = 1; !ret && i < s->count; i++) {
+		if (s->pps[i])
+			ret = EINVAL;
+	}
+
+	if (s->manifest && fclose(s->manifest) && !ret)
+		ret = errno;
+
+	for (i = 0; i < s->ready; i++)
+		ai_merge_copier_free(&s->copiers[i]);
+	free(s->copiers);
+	free(s->pps);
+	ai_merge_path_free(&s->oldp);
+
+	/* the removals were checked against the last source tree only */
+	for (i = 0; !ret && s->layered && i < s->count; i++)
+		ret = ai_merge_mark_replaced(s->js[i]);
+
+	/* Mark as done. */
+	for (i = 0; !ret && i < s->count; i++)
+		ret = ai_merge_set_flag(s->js[i], AI_MERGE_COPIED_NEW);
+
+	return ret;
+}
+
+int ai_merge_verify(const char *dest, ai_journal_t j, const char *manifest) {
+	const size_t destlen = strlen(dest);
+	unsigned long long int expected, hash;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	FILE *f;
+	int ret = 0;
+
+	/* Already done? */
+	if (ai_journal_get_flags(j) & AI_MERGE_VERIFIED)
+		return 0;
+	if (!ai_merge_constraint_flags(j, AI_MERGE_COPIED_NEW,
+				AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	f = fopen(manifest, "r");
+	if (!f)
+		return errno;
+
+	/* <hash> <path>\0 */
+	while (!ret && fscanf(f, "%16llx ", &expected) == 1) {
+		ssize_t len = getdelim(&buf, &bufsize, 0, f);
+		char *path;
+
+		if (len <= 0 || buf[len - 1]) {
+			ret = EINVAL;
+			break;
+		}
+
+		path = malloc(destlen + len);
+		if (!path) {
+			ret = errno;
+			break;
+		}
+		memcpy(path, dest, destlen);
+		memcpy(path + destlen, buf, len);
+
+		ret = ai_copy_hash_file(path, &hash);
+		/* a missing file doesn't match either */
+		if (ret == ENOENT || (!ret && hash != expected))
+			ret = EIO;
+		free(path);
+	}
+
+	if (!ret && ferror(f))
+		ret = EIO;
+	else if (!ret && !feof(f))
+		ret = EINVAL;
+
+	free(buf);
+	fclose(f);
+
+	/* Mark as done. */
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_VERIFIED);
+	return ret;
+}
+
+int ai_merge_plan(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, ai_merge_plan_t *plan) {
+	struct ai_merge_path oldp, newp;
+	ai_journal_file_t *pp;
+	const char *root = source, *lastdir = NULL;
+	unsigned long long int blocksize, copied = 0;
+	struct statvfs vfs;
+	struct stat st;
+	dev_t dev;
+	int parent = 0;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j, 0,
+				AI_MERGE_COPIED_NEW|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+	if (stat(dest, &st) || statvfs(dest, &vfs))
+		return errno;
+
+	dev = st.st_dev;
+	blocksize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+	memset(plan, 0, sizeof(*plan));
+	plan->avail_bytes = (unsigned long long int) vfs.f_bavail * blocksize;
+	/* e.g. btrfs allocates inodes dynamically */
+	plan->avail_inodes = vfs.f_files ? vfs.f_favail : (unsigned long long int) -1;
+
+	pp = ai_journal_get_files_layered(j, &source);
+	ret = ai_merge_path_init(&oldp, source, j);
+	if (ret)
+		return ret;
+	ret = ai_merge_path_init(&newp, dest, j);
+	if (ret) {
+		ai_merge_path_free(&oldp);
+		return ret;
+	}
+
+	for (; pp; pp = ai_journal_file_next_layered(pp, &source)) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		const unsigned char flags = ai_journal_file_flags(pp);
+		struct stat dst;
+		int exists;
+
+		/* batch journal, entering the next source tree */
+		if (source != root) {
+			root = source;
+			ai_merge_path_free(&oldp);
+			ret = ai_merge_path_init(&oldp, root, j);
+			if (ret) {
+				ai_merge_path_free(&newp);
+				return ret;
+			}
+		}
+
+		ai_merge_path_dir(&oldp, path);
+		ai_merge_path_name(&oldp, name);
+		ai_merge_path_dir(&newp, path);
+
+		/* the entries come grouped by their directory */
+		if (!lastdir || strcmp(path, lastdir)) {
+			ai_merge_path_name(&newp, "");
+			parent = !stat(newp.buf, &dst) && S_ISDIR(dst.st_mode);
+			lastdir = path;
+		}
+		ai_merge_path_name(&newp, name);
+		exists = !lstat(newp.buf, &dst);
+
+		if (flags & AI_MERGE_FILE_REMOVE) {
+			/* replaced by a new file, rather than removed */
+			if (!exists || !lstat(oldp.buf, &st))
+				continue;
+
+			plan->removed++;
+			/* the directories are removed when cleaning up */
+			if (!S_ISDIR(dst.st_mode))
+				plan->replace_ops++;
+			continue;
+		}
+
+		if (lstat(oldp.buf, &st)) {
+			ret = errno;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (exists && S_ISDIR(dst.st_mode))
+				continue;
+
+			plan->dirs++;
+			plan->inodes++;
+			plan->bytes += blocksize;
+			/* the topmost new directory is the staged subtree root */
+			if (parent)
+				plan->replace_ops++;
+			continue;
+		}
+
+		if (parent)
+			plan->replace_ops++;
+		if (exists)
+			plan->backups++;
+
+		if (!S_ISREG(st.st_mode)) {
+			plan->others++;
+			plan->inodes++;
+		} else if (st.st_dev == dev)
+			plan->linked++;
+		else {
+			plan->copied++;
+			plan->inodes++;
+			/* the files are preallocated, even if sparse */
+			plan->bytes += (st.st_size + blocksize - 1) / blocksize * blocksize;
+			copied += st.st_size;
+		}
+	}
+
+	if (!ret && opts->status)
+		AI_MERGE_STORE(&opts->status->bytes_total, copied);
+
+	ai_merge_path_free(&oldp);
+	ai_merge_path_free(&newp);
+
+	if (!ret && (plan->bytes > plan->avail_bytes
+				|| plan->inodes > plan->avail_inodes))
+		ret = ENOSPC;
+	return ret;
+}
+
+int ai_merge_copy_new(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts,
+		ai_merge_progress_callback_t progress_callback) {
+	return ai_merge_copy_new_multi(source, &dest, &j, 1, opts,
+			progress_callback);
+}
+
+int ai_merge_copy_new_multi(const char *source, const char *const *dests,
+		ai_journal_t *js, unsigned int count, const ai_merge_options_t *opts,
+		ai_merge_progress_callback_t progress_callback) {
+	struct ai_merge_copy_state s;
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_COPY_NEW,
+			count ? js[0] : NULL);
+	ret = ai_merge_copy_begin(&s, source, dests, js, count, opts);
+	while (!ret && s.pps[0])
+		ret = ai_merge_copy_step(&s, progress_callback);
+
+	ret = ai_merge_copy_end(&s, ret);
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_COPY_NEW, start, ret);
+	return ret;
+}
+
+/**
+ * ai_merge_rollback_new_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Remove the new copy of a single file or directory.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_rollback_new_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+	const char *newpath;
+
+	if (flags & AI_MERGE_FILE_REMOVE)
+		return 0;
+	ai_copy_throttle(w->throttle, 0, 1);
+
+	if (flags & AI_MERGE_FILE_NEW_TREE) {
+		ai_merge_dir_root(w->rootbuf, path, name);
+		newpath = ai_merge_path_new_tree(&w->treep, w->rootbuf);
+		w->rootlen = 0;
+	} else if (flags & AI_MERGE_FILE_IN_NEW_TREE) {
+		if (!w->rootlen || strncmp(path, w->rootbuf, w->rootlen)) {
+			w->rootlen = ai_merge_find_new_tree(&w->newp, path, w->rootbuf);
+			/* staged subtree was never created */
+			if (!w->rootlen)
+				return 0;
+			ai_merge_path_new_tree(&w->treep, w->rootbuf);
+		}
+
+		ai_merge_path_dir(&w->treep, path + w->rootlen - 1);
+		newpath = ai_merge_path_name(&w->treep, name);
+	} else {
+		ai_merge_path_dir(&w->newp, path);
+		if (flags & AI_MERGE_FILE_DIR)
+			newpath = ai_merge_path_name(&w->newp, name);
+		else
+			newpath = ai_merge_path_tmp(&w->newp, name, ".new");
+	}
+
+	if (!ai_merge_remove(newpath))
+		return 0;
+	if (errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST)
+		return errno;
+
+	/* a directory of a staged subtree whose root was not copied yet */
+	if (errno == ENOENT && (flags & (AI_MERGE_FILE_DIR
+					|AI_MERGE_FILE_NEW_TREE|AI_MERGE_FILE_IN_NEW_TREE))
+				== AI_MERGE_FILE_DIR) {
+		w->rootlen = ai_merge_find_new_tree(&w->newp, path, w->rootbuf);
+		if (w->rootlen) {
+			ai_merge_path_new_tree(&w->treep, w->rootbuf);
+			ai_merge_path_dir(&w->treep, path + w->rootlen - 1);
+			newpath = ai_merge_path_name(&w->treep, name);
+		} else {
+			ai_merge_dir_root(w->rootbuf, path, name);
+			newpath = ai_merge_path_new_tree(&w->treep, w->rootbuf);
+		}
+		w->rootlen = 0;
+
+		if (ai_merge_remove(newpath) && errno != ENOENT
+				&& errno != ENOTEMPTY && errno != EEXIST)
+			return errno;
+	}
+
+	/* XXX: remove new directories */
+	return 0;
+}
+
+int ai_merge_rollback_new(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	/* Mark rollback as started. */
+	ret = ai_merge_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	if (ret)
+		return ret;
+
+	/* directories can be removed only after their contents */
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_ROLLBACK_NEW, j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_rollback_new_entry,
+			AI_MERGE_FILE_DIR|AI_MERGE_FILE_NEW_TREE, NULL);
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_ROLLBACK_NEW, start, ret);
+	return ret;
+}
+
+/**
+ * ai_merge_backup_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Backup a single file which will be replaced or removed.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_backup_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+	unsigned long long int start;
+	int ret;
+
+	if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR
+				|AI_MERGE_FILE_IN_NEW_TREE))
+		return 0;
+	ai_copy_throttle(w->throttle, 0, 1);
+
+	ai_merge_path_dir(&w->oldp, path);
+	ai_merge_path_name(&w->oldp, name);
+
+	if (flags & AI_MERGE_FILE_REMOVE) {
+		struct stat st;
+
+		/* omit directories */
+		if (!ai_merge_lstat(w->oldp.buf, &st) && S_ISDIR(st.st_mode))
+			return ai_journal_file_set_flag(pp, AI_MERGE_FILE_DIR);
+	}
+
+	ai_merge_path_dir(&w->newp, path);
+	ai_merge_path_tmp(&w->newp, name, ".old");
+
+	start = ai_merge_clock();
+	ret = ai_copy_ctx_cp_l(w->copy, w->oldp.buf, w->newp.buf);
+	ai_merge_stats_op(AI_MERGE_OP_LINK, start, ret, 0);
+	if (!ret)
+		ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_BACKED_UP);
+
+	/* no file to backup */
+	return ret == ENOENT ? 0 : ret;
+}
+
+int ai_merge_backup_old(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	/* Already done? */
+	/* AI_MERGE_COPIED_NEW required due to AI_MERGE_FILE_REMOVE marking. */
+	if (!ai_merge_constraint_flags(j, AI_MERGE_COPIED_NEW,
+				AI_MERGE_BACKED_OLD_UP|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_BACKUP_OLD, j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_backup_entry, 0, NULL);
+
+	/* Mark as done. */
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_BACKED_OLD_UP);
+
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_BACKUP_OLD, start, ret);
+	return ret;
+}
+
+/**
+ * ai_merge_rollback_old_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Remove the backup copy of a single file.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_rollback_old_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+
+	if (ai_journal_file_flags(pp) & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR
+				|AI_MERGE_FILE_IN_NEW_TREE))
+		return 0;
+	ai_copy_throttle(w->throttle, 0, 1);
+
+	ai_merge_path_dir(&w->newp, path);
+	ai_merge_path_tmp(&w->newp, name, ".old");
+
+	if (ai_merge_unlink(w->newp.buf) && errno != ENOENT)
+		return errno;
+
+	/* XXX: remove new directories */
+	return 0;
+}
+
+int ai_merge_rollback_old(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	/* replace could be started already; we need to rollback that instead */
+	if (!ai_merge_constraint_flags(j, 0, AI_MERGE_BACKED_OLD_UP))
+		return EINVAL;
+
+	/* Mark rollback as started. */
+	ret = ai_merge_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	if (ret)
+		return ret;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_ROLLBACK_OLD, j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_rollback_old_entry, 0, NULL);
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_ROLLBACK_OLD, start, ret);
+	return ret;
+}
+
+/**
+ * ai_merge_replaced_already
+ * @p: destination tree path builder
+ * @pp: the journal entry
+ * @ret: result of moving the new file into place
+ *
+ * Check whether a failure to move a new file into place means it has been
+ * moved already, by an interrupted ai_merge_replace() being resumed. That is
+ * the case if the destination file exists and it is no longer the same file
+ * as its backup copy (which is a hardlink until the file is replaced).
+ *
+ * Returns: 0 if the file has been replaced already, @ret otherwise
+ */
+static int ai_merge_replaced_already(struct ai_merge_path *p,
+		ai_journal_file_t *pp, int ret) {
+	const char *name = ai_journal_file_name(pp);
+	struct stat st, oldst;
+
+	if (ret != ENOENT)
+		return ret;
+
+	ai_merge_path_dir(p, ai_journal_file_path(pp));
+	ai_merge_path_name(p, name);
+	if (ai_merge_lstat(p->buf, &st))
+		return ret;
+	if (!(ai_journal_file_flags(pp) & AI_MERGE_FILE_BACKED_UP))
+		return 0;
+
+	ai_merge_path_tmp(p, name, ".old");
+	if (ai_merge_lstat(p->buf, &oldst)
+			|| (st.st_dev == oldst.st_dev && st.st_ino == oldst.st_ino))
+		return ret;
+	return 0;
+}
+
+/**
+ * ai_merge_replace_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Replace a single file with its new copy, remove it or move a staged subtree
+ * into place.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_replace_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+
+	/* move the whole staged subtree at once */
+	if (flags & AI_MERGE_FILE_NEW_TREE) {
+		ai_merge_dir_root(w->rootbuf, path, name);
+		ai_merge_path_new_tree(&w->treep, w->rootbuf);
+		ai_merge_path_dir(&w->newp, path);
+		ai_merge_path_name(&w->newp, name);
+
+		if (ai_merge_rename(w->treep.buf, w->newp.buf))
+			return ai_merge_replaced_already(&w->oldp, pp, errno);
+		return 0;
+	}
+
+	if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR
+				|AI_MERGE_FILE_IN_NEW_TREE))
+		return 0;
+
+	ai_merge_path_dir(&w->newp, path);
+	ai_merge_path_name(&w->newp, name);
+
+	if (flags & AI_MERGE_FILE_REMOVE) {
+		if (ai_merge_unlink(w->newp.buf) && errno != ENOENT)
+			return errno;
+		return 0;
+	}
+
+	ai_merge_path_dir(&w->oldp, path);
+	ai_merge_path_tmp(&w->oldp, name, ".new");
+	return ai_merge_replaced_already(&w->oldp, pp,
+			ai_merge_worker_mv(w, w->oldp.buf, w->newp.buf));
+}
+
+int ai_merge_replace(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j,
+				AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
+				AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_REPLACE, j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_replace_entry, 0, NULL);
+
+	/* Mark as done. */
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_REPLACED);
+
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_REPLACE, start, ret);
+	return ret;
+}
+#if defined(HAVE_FSTATAT) && defined(HAVE_RENAMEAT) && defined(HAVE_UNLINKAT)
+/**
+ * ai_merge_dirfd
+ * @path: directory part of the file path (inside the journal)
+ * @fd: open directory descriptor
+ * @dev: device the directory resides on
+ *
+ * An open destination directory, in a hash table keyed by @path.
+ */
+struct ai_merge_dirfd {
+	const char *path;
+	int fd;
+	dev_t dev;
+};
+
+/**
+ * ai_merge_swap
+ * @pp: the journal entry
+ * @dir: the directory containing both files
+ * @from: temporary name to rename, or %NULL to unlink @to
+ * @to: final name
+ *
+ * A single precomputed operation of the replace window.
+ */
+struct ai_merge_swap {
+	ai_journal_file_t *pp;
+	struct ai_merge_dirfd *dir;
+	const char *from;
+	const char *to;
+};
+
+/**
+ * ai_merge_open_dir
+ * @dirs: the directory hash table
+ * @mask: hash table size, minus one
+ * @p: destination tree path builder
+ * @path: directory part of the file path
+ *
+ * Look up the directory @path in @dirs, opening it if necessary.
+ *
+ * Returns: the directory entry, or %NULL on failure (errno is set then)
+ */
+static struct ai_merge_dirfd *ai_merge_open_dir(struct ai_merge_dirfd *dirs,
+		size_t mask, struct ai_merge_path *p, const char *path) {
+	size_t i;
+	struct stat st;
+
+	for (i = ai_merge_dir_hash(path) & mask; dirs[i].path; i = (i + 1) & mask) {
+		if (!strcmp(dirs[i].path, path))
+			return &dirs[i];
+	}
+
+	ai_merge_path_dir(p, path);
+	ai_merge_path_name(p, "");
+	dirs[i].fd = open(p->buf, O_RDONLY
+#ifdef O_DIRECTORY
+			| O_DIRECTORY
+#endif
+			);
+	if (dirs[i].fd == -1)
+		return NULL;
+
+	if (fstat(dirs[i].fd, &st)) {
+		const int tmp = errno;
+		close(dirs[i].fd);
+		errno = tmp;
+		return NULL;
+	}
+
+	dirs[i].path = path;
+	dirs[i].dev = st.st_dev;
+	return &dirs[i];
+}
+
+int ai_merge_replace_prepared(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, unsigned long int *window_us) {
+	const char *fn_prefix = ai_journal_get_filename_prefix(j);
+	const size_t fn_prefixlen = strlen(fn_prefix);
+	unsigned long long int phase_start;
+
+	struct ai_merge_path p;
+	struct ai_merge_dirfd *dirs;
+	struct ai_merge_swap *swaps, *sp, *swapend, *listend;
+	char *names, *np;
+	size_t nfiles = 0, namelen = 0, mask, i;
+	unsigned long int renamed = 0;
+	ai_journal_file_t *pp;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec start, stop;
+#else
+	struct timeval start, stop;
+#endif
+
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j,
+				AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
+				AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	/* count the operations and temporary name lengths */
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
+		const unsigned char flags = ai_journal_file_flags(pp);
+
+		nfiles++;
+		/* + .<fn-prefix>~ + .new + null terminator */
+		if ((flags & AI_MERGE_FILE_NEW_TREE) || !(flags & (AI_MERGE_FILE_IGNORE
+						|AI_MERGE_FILE_DIR|AI_MERGE_FILE_IN_NEW_TREE
+						|AI_MERGE_FILE_REMOVE)))
+			namelen += strlen(ai_journal_file_name(pp)) + fn_prefixlen + 7;
+	}
+
+	for (mask = 1; mask < 2 * nfiles; mask <<= 1);
+	mask--;
+
+	ret = ai_merge_path_init(&p, dest, j);
+	if (ret)
+		return ret;
+
+	dirs = calloc(mask + 1, sizeof(*dirs));
+	swaps = malloc((nfiles + 1) * sizeof(*swaps));
+	names = malloc(namelen + 1);
+	if (!dirs || !swaps || !names) {
+		ret = errno;
+		free(dirs);
+		free(swaps);
+		free(names);
+		ai_merge_path_free(&p);
+		return ret;
+	}
+	phase_start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_REPLACE, j);
+
+	/* open the directories and precompute all names */
+	sp = swaps;
+	np = names;
 	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
 		const char *path = ai_journal_file_path(pp);
 		const char *name = ai_journal_file_name(pp);
 		const unsigned char flags = ai_journal_file_flags(pp);
-		copy_func_t copy_func;
 
-		sprintf(oldpathbuf, "%s%s%s", source, path, name);
-		if (flags & AI_MERGE_FILE_DIR) {
-			sprintf(newpathbuf, "%s%s%s", dest, path, name);
-			copy_func = ai_cp_a;
-		} else {
-			sprintf(newpathbuf, "%s%s.%s~%s.new", dest, path, fn_prefix, name);
-			copy_func = ai_cp_l;
+		if (!(flags & AI_MERGE_FILE_NEW_TREE) && (flags & (AI_MERGE_FILE_IGNORE
+						|AI_MERGE_FILE_DIR|AI_MERGE_FILE_IN_NEW_TREE)))
+			continue;
+
+		sp->dir = ai_merge_open_dir(dirs, mask, &p, path);
+		if (!sp->dir) {
+			/* nothing to remove, like in ai_merge_replace_entry() */
+			if (errno == ENOENT && (flags & AI_MERGE_FILE_REMOVE))
+				continue;
+			ret = errno;
+			break;
+		}
+
+		sp->pp = pp;
+		sp->to = name;
+		if (flags & AI_MERGE_FILE_REMOVE)
+			sp->from = NULL;
+		else {
+			sp->from = np;
+			*np++ = '.';
+			memcpy(np, fn_prefix, fn_prefixlen);
+			np += fn_prefixlen;
+			*np++ = '~';
+			while (*name)
+				*np++ = *name++;
+			memcpy(np, ".new", 5);
+			np += 5;
+		}
+		sp++;
+	}
+	listend = sp;
+
+	/* ensure that no rename would need to fall back to copying,
+	 * and drop the files replaced already by an interrupted run */
+	for (sp = swaps, swapend = swaps; !ret && sp < listend; sp++) {
+		struct stat st;
+
+		if (!sp->from) {
+			*swapend++ = *sp;
+			continue;
+		}
+
+		if (fstatat(sp->dir->fd, sp->from, &st, AT_SYMLINK_NOFOLLOW)) {
+			ret = ai_merge_replaced_already(&p, sp->pp, errno);
+			continue;
+		}
+		*swapend++ = *sp;
+		if (st.st_dev != sp->dir->dev)
+			ret = EXDEV;
+		else if (!fstatat(sp->dir->fd, sp->to, &st, AT_SYMLINK_NOFOLLOW)
+				&& st.st_dev != sp->dir->dev)
+			ret = EXDEV;
+	}
+
+	if (!ret) {
+#ifdef HAVE_CLOCK_GETTIME
+		clock_gettime(CLOCK_MONOTONIC, &start);
+#else
+		gettimeofday(&start, NULL);
+#endif
+
+		for (sp = swaps; sp < swapend; sp++) {
+			if (sp->from) {
+				if (renameat(sp->dir->fd, sp->from, sp->dir->fd, sp->to)) {
+					ret = errno;
+					break;
+				}
+				renamed++;
+			} else if (unlinkat(sp->dir->fd, sp->to, 0) && errno != ENOENT) {
+				ret = errno;
+				break;
+			}
+		}
+
+#ifdef HAVE_CLOCK_GETTIME
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		if (window_us)
+			*window_us = (stop.tv_sec - start.tv_sec) * 1000000
+				+ (stop.tv_nsec - start.tv_nsec) / 1000;
+#else
+		gettimeofday(&stop, NULL);
+		if (window_us)
+			*window_us = (stop.tv_sec - start.tv_sec) * 1000000
+				+ (stop.tv_usec - start.tv_usec);
+#endif
+	}
+
+	for (i = 0; i <= mask; i++) {
+		if (dirs[i].path)
+			close(dirs[i].fd);
+	}
+	free(dirs);
+	free(swaps);
+	free(names);
+	ai_merge_path_free(&p);
+
+	/* the loop runs in this thread only */
+	if (ai_merge_stats)
+		ai_merge_stats->renamed += renamed;
+	if (opts->status && !ret)
+		AI_MERGE_STORE(&opts->status->entries_done, nfiles);
+
+	/* Mark as done. */
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_REPLACED);
+
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_REPLACE, phase_start, ret);
+	return ret;
+}
+#else
+int ai_merge_replace_prepared(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, unsigned long int *window_us) {
+	return ENOSYS;
+}
+#endif
+
+
+/**
+ * ai_merge_rollback_replace_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Restore the backup copy of a single file, or move a staged subtree back.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_rollback_replace_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+	int ret = 0;
+
+	/* move the staged subtree back, unless it was not moved */
+	if (flags & AI_MERGE_FILE_NEW_TREE) {
+		struct stat st;
+
+		ai_merge_dir_root(w->rootbuf, path, name);
+		ai_merge_path_new_tree(&w->treep, w->rootbuf);
+		ai_merge_path_dir(&w->newp, path);
+		ai_merge_path_name(&w->newp, name);
+
+		if (ai_merge_lstat(w->treep.buf, &st) && ai_merge_rename(w->newp.buf, w->treep.buf)
+				&& errno != ENOENT)
+			return errno;
+		return 0;
+	}
+
+	if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR
+				|AI_MERGE_FILE_IN_NEW_TREE))
+		return 0; /* ignore duplicates */
+
+	ai_merge_path_dir(&w->newp, path);
+	ai_merge_path_name(&w->newp, name);
+
+	/* if backed up, then restore */
+	if (flags & AI_MERGE_FILE_BACKED_UP) {
+		ai_merge_path_dir(&w->oldp, path);
+		ai_merge_path_tmp(&w->oldp, name, ".old");
+
+		ret = ai_merge_worker_mv(w, w->oldp.buf, w->newp.buf);
+		/* rename() does nothing if the file was not replaced yet,
+		 * as the backup is its hardlink */
+		if (!ret && ai_merge_unlink(w->oldp.buf) && errno != ENOENT)
+			ret = errno;
+	} else { /* just unlink the new one */
+		if (ai_merge_unlink(w->newp.buf))
+			ret = errno;
+	}
+
+	return ret == ENOENT ? 0 : ret;
+}
+
+int ai_merge_rollback_replace(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j,
+				AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
+				AI_MERGE_REPLACED))
+		return EINVAL;
+
+	/* Mark rollback as started. */
+	ret = ai_merge_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	if (ret)
+		return ret;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_ROLLBACK_REPLACE,
+			j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_rollback_replace_entry, 0, NULL);
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_ROLLBACK_REPLACE, start,
+			ret);
+	return ret;
+}
+
+/**
+ * ai_merge_cleanup_entry
+ * @w: the worker
+ * @pp: the journal entry
+ *
+ * Remove the backup copy of a single file, and report removal of files
+ * from the old version.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_cleanup_entry(struct ai_merge_worker *w,
+		ai_journal_file_t *pp) {
+	const char *path = ai_journal_file_path(pp);
+	const char *name = ai_journal_file_name(pp);
+	const unsigned char flags = ai_journal_file_flags(pp);
+	const char *relpath = w->newp.buf + w->newp.rootlen;
+
+	ai_merge_path_dir(&w->newp, path);
+
+	if ((w->removal_callback || w->async) && (flags & AI_MERGE_FILE_REMOVE)) {
+		ai_merge_path_name(&w->newp, name);
+		if (flags & AI_MERGE_FILE_IGNORE)
+			ai_merge_worker_removed(w, relpath, EEXIST);
+		else if (!(flags & (AI_MERGE_FILE_BACKED_UP|AI_MERGE_FILE_DIR)))
+			ai_merge_worker_removed(w, relpath, ENOENT);
+	}
+
+	if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
+		return 0;
+	ai_copy_throttle(w->throttle, 0, 1);
+
+	if (flags & AI_MERGE_FILE_DIR)
+		ai_merge_path_name(&w->newp, name);
+	else if (flags & AI_MERGE_FILE_BACKED_UP)
+		ai_merge_path_tmp(&w->newp, name, ".old");
+	else
+		return 0;
+
+	if (ai_merge_remove(w->newp.buf)) {
+		if (errno == EEXIST)
+			errno = ENOTEMPTY;
+		else if (errno != ENOENT && errno != ENOTEMPTY)
+			return errno;
+	} else
+		errno = 0;
+
+	if ((w->removal_callback || w->async) && (flags & AI_MERGE_FILE_REMOVE)) {
+		const int result = errno;
+
+		ai_merge_path_name(&w->newp, name);
+		ai_merge_worker_removed(w, relpath, result);
+	}
+
+	return 0;
+}
+
+int ai_merge_cleanup(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts,
+		ai_merge_removal_callback_t removal_callback) {
+	unsigned long long int start;
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j, AI_MERGE_REPLACED, 0))
+		return EINVAL;
+
+	start = ai_merge_phase_start(opts->status, AI_MERGE_PHASE_CLEANUP, j);
+	ret = ai_merge_run(j, dest, opts, ai_merge_cleanup_entry, 0,
+			removal_callback);
+	ai_merge_phase_end(opts->status, AI_MERGE_PHASE_CLEANUP, start, ret);
+	return ret;
+}
+
+/**
+ * ai_merge_link_tree
+ * @c: the copying context
+ * @source: source directory path
+ * @dest: destination directory path
+ *
+ * Recreate the directory tree @source at @dest, hardlinking the files where
+ * possible (and copying them otherwise).
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_link_tree(ai_copy_ctx_t c, const char *source,
+		const char *dest) {
+	const size_t sourcelen = strlen(source);
+	const size_t destlen = strlen(dest);
+	DIR *dir;
+	struct dirent *dent;
+	int ret;
+
+	ret = ai_copy_ctx_cp_a(c, source, dest);
+	if (ret)
+		return ret;
+
+	dir = opendir(source);
+	if (!dir)
+		return errno;
+
+	errno = 0;
+	while ((dent = readdir(dir))) {
+		const size_t len = strlen(dent->d_name);
+		char *sfn, *dfn;
+		int is_dir = -1;
+
+		/* Omit . & .. */
+		if (dent->d_name[0] == '.' && (!dent->d_name[1]
+					|| (dent->d_name[1] == '.' && !dent->d_name[2])))
+			continue;
+
+#ifdef DT_DIR
+		if (dent->d_type == DT_DIR)
+			is_dir = 1;
+		else if (dent->d_type != DT_UNKNOWN)
+			is_dir = 0;
+#endif
+
+		sfn = malloc(sourcelen + len + 2);
+		dfn = malloc(destlen + len + 2);
+		if (!sfn || !dfn) {
+			ret = errno;
+			free(sfn);
+			break;
+		}
+		sprintf(sfn, "%s/%s", source, dent->d_name);
+		sprintf(dfn, "%s/%s", dest, dent->d_name);
+
+		if (is_dir == -1) {
+			struct stat st;
+
+			if (ai_merge_lstat(sfn, &st))
+				ret = errno;
+			else
+				is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (!ret)
+			ret = is_dir ? ai_merge_link_tree(c, sfn, dfn)
+				: ai_copy_ctx_cp_l(c, sfn, dfn);
+
+		free(sfn);
+		free(dfn);
+		if (ret)
+			break;
+
+		errno = 0;
+	}
+	if (!ret)
+		ret = errno;
+
+	if (closedir(dir) && !ret)
+		ret = errno;
+	return ret;
+}
+
+/**
+ * ai_merge_remove_tree
+ * @path: path to remove
+ *
+ * Remove @path, recursively if it is a directory.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_remove_tree(const char *path) {
+	const size_t pathlen = strlen(path);
+	struct stat st;
+	DIR *dir;
+	struct dirent *dent;
+	int ret = 0;
+
+	if (ai_merge_lstat(path, &st))
+		return errno;
+	if (!S_ISDIR(st.st_mode))
+		return ai_merge_unlink(path) ? errno : 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return errno;
+
+	errno = 0;
+	while ((dent = readdir(dir))) {
+		char *fn;
+
+		/* Omit . & .. */
+		if (dent->d_name[0] == '.' && (!dent->d_name[1]
+					|| (dent->d_name[1] == '.' && !dent->d_name[2])))
+			continue;
+
+		fn = malloc(pathlen + strlen(dent->d_name) + 2);
+		if (!fn) {
+			ret = errno;
+			break;
 		}
+		sprintf(fn, "%s/%s", path, dent->d_name);
+
+		ret = ai_merge_remove_tree(fn);
+		free(fn);
+		if (ret && ret != ENOENT)
+			break;
+
+		ret = 0;
+		errno = 0;
+	}
+	if (!ret)
+		ret = errno;
+
+	if (closedir(dir) && !ret)
+		ret = errno;
+	if (!ret && rmdir(path))
+		ret = errno;
+	return ret;
+}
+
+/**
+ * ai_merge_switch_paths
+ * @root: path to the versioned root
+ * @j: an open journal
+ * @current: location to store the path to the 'current' symlink in
+ * @version: location to store the path to the new version in
+ * @newlink: location to store the path to the new symlink in
+ * @oldlink: location to store the path to the backup symlink in
+ *
+ * Allocate and fill in the paths used by the versioned root switch. The paths
+ * are allocated as a single block, and @current has to be freed afterwards.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_merge_switch_paths(const char *root, ai_journal_t j,
+		char **current, char **version, char **newlink, char **oldlink) {
+	const char *fn_prefix = ai_journal_get_filename_prefix(j);
+	/* /.<fn-prefix>~current.new + null terminator */
+	const size_t len = strlen(root) + strlen(fn_prefix) + 15;
+
+	*current = malloc(4 * len);
+	if (!*current)
+		return errno;
+
+	*version = *current + len;
+	*newlink = *version + len;
+	*oldlink = *newlink + len;
+
+	sprintf(*current, "%s/current", root);
+	sprintf(*version, "%s/version-%s", root, fn_prefix);
+	sprintf(*newlink, "%s/.%s~current.new", root, fn_prefix);
+	sprintf(*oldlink, "%s/.%s~current.old", root, fn_prefix);
+	return 0;
+}
+
+/**
+ * ai_merge_switch_target
+ * @link: path to the symlink
+ * @root: path to the versioned root
+ *
+ * Read the target of symlink @link, and return it as a path relative to
+ * the current directory (i.e. prepended with @root if relative).
+ *
+ * Returns: newly-allocated path, or %NULL on failure (errno is set then)
+ */
+static char *ai_merge_switch_target(const char *link, const char *root) {
+	const size_t rootlen = strlen(root);
+	struct stat st;
+	char *buf;
+	ssize_t len;
+
+	if (ai_merge_lstat(link, &st))
+		return NULL;
+	if (!S_ISLNK(st.st_mode)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	buf = malloc(rootlen + st.st_size + 2);
+	if (!buf)
+		return NULL;
+
+	len = readlink(link, buf + rootlen + 1, st.st_size + 1);
+	if (len == -1 || len > st.st_size) {
+		if (len != -1)
+			errno = EINVAL;
+		free(buf);
+		return NULL;
+	}
+	buf[rootlen + 1 + len] = 0;
+
+	if (buf[rootlen + 1] == '/')
+		memmove(buf, buf + rootlen + 1, len + 1);
+	else {
+		memcpy(buf, root, rootlen);
+		buf[rootlen] = '/';
+	}
+
+	return buf;
+}
+
+int ai_merge_switch_prepare(const char *source, const char *root,
+		ai_journal_t j, const ai_merge_options_t *opts,
+		ai_merge_progress_callback_t progress_callback) {
+	struct ai_merge_path oldp, newp;
+	char *current, *version, *newlink, *oldlink;
+	char *oldversion;
+	ai_journal_file_t *pp;
+	const char *relpath;
+	ai_copy_ctx_t copy;
+
+	int ret;
+
+	ret = ai_merge_check_options(&opts);
+	if (ret)
+		return ret;
+	if (!ai_merge_constraint_flags(j, 0, AI_MERGE_COPIED_NEW
+				|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	/* batch journals have no single source tree to start with */
+	relpath = NULL;
+	ai_journal_get_files_layered(j, &relpath);
+	if (relpath)
+		return EINVAL;
+
+	ret = ai_merge_set_flag(j, AI_MERGE_VERSIONED_ROOT);
+	if (ret)
+		return ret;
+
+	ret = ai_merge_switch_paths(root, j, &current, &version, &newlink, &oldlink);
+	if (ret)
+		return ret;
+
+	ret = ai_merge_copy_ctx_new(opts, &copy);
+	if (ret) {
+		free(current);
+		return ret;
+	}
+
+	/* start with the current version, if there is one */
+	oldversion = ai_merge_switch_target(current, root);
+	if (oldversion) {
+		/* prefix collision, we can't reuse the current version */
+		if (!strcmp(oldversion, version))
+			ret = EEXIST;
+		else
+			ret = ai_merge_link_tree(copy, oldversion, version);
+		free(oldversion);
+	} else if (errno == ENOENT) {
+		ret = ai_copy_ctx_cp_a(copy, source, version);
+	} else
+		ret = errno;
+
+	if (!ret)
+		ret = ai_merge_path_init(&oldp, source, j);
+	if (ret) {
+		ai_copy_ctx_free(copy);
+		free(current);
+		return ret;
+	}
+
+	ret = ai_merge_path_init(&newp, version, j);
+	if (ret) {
+		ai_merge_path_free(&oldp);
+		ai_copy_ctx_free(copy);
+		free(current);
+		return ret;
+	}
+
+	relpath = oldp.buf + oldp.rootlen;
+
+	/* then apply the new files and removals on top of it */
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		const unsigned char flags = ai_journal_file_flags(pp);
+		unsigned long long int start;
+
+		ai_merge_path_dir(&oldp, path);
+		ai_merge_path_name(&oldp, name);
+		ai_merge_path_dir(&newp, path);
+		ai_merge_path_name(&newp, name);
+		ai_copy_throttle(opts->throttle, 0, 1);
 
 		if (flags & AI_MERGE_FILE_REMOVE) {
 			struct stat tmp;
 
 			/* file exists in sourcedir -> will be replaced -> ignore */
-			if (!lstat(oldpathbuf, &tmp)) {
+			if (!ai_merge_lstat(oldp.buf, &tmp))
 				ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_IGNORE);
-				if (ret)
-					break;
-			}
+			else if (ai_merge_remove(newp.buf) && errno != ENOENT
+					&& errno != ENOTEMPTY && errno != EEXIST)
+				ret = errno;
+
+			if (ret)
+				break;
 			continue;
 		}
 
 		if (progress_callback)
 			progress_callback(relpath, 0, 0);
-		ret = copy_func(oldpathbuf, newpathbuf);
+		start = ai_merge_clock();
+		ret = flags & AI_MERGE_FILE_DIR
+			? ai_copy_ctx_cp_a(copy, oldp.buf, newp.buf)
+			: ai_merge_cp_l(opts->store, copy, oldp.buf, newp.buf);
+		ai_merge_stats_op(AI_MERGE_OP_COPY, start, ret, 0);
 
 		if (ret == ENOENT) {
-			ret = ai_mkdir_cp(oldpathbuf, newpathbuf, path, progress_callback);
-			if (!ret)
-				ret = copy_func(oldpathbuf, newpathbuf);
+			ret = ai_mkdir_cp(copy, oldp.buf, newp.buf, path,
+					progress_callback);
+			if (!ret) {
+				start = ai_merge_clock();
+				ret = flags & AI_MERGE_FILE_DIR
+					? ai_copy_ctx_cp_a(copy, oldp.buf, newp.buf)
+					: ai_merge_cp_l(opts->store, copy, oldp.buf, newp.buf);
+				ai_merge_stats_op(AI_MERGE_OP_COPY, start, ret, 0);
+			}
 		}
 
 		if (ret)
 			break;
 	}
 
-	free(oldpathbuf);
-	free(newpathbuf);
+	ai_merge_path_free(&oldp);
+	ai_merge_path_free(&newp);
+
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_COPIED_NEW);
+
+	/* back the current symlink up, for rollback */
+	if (!ret) {
+		ret = ai_copy_ctx_cp_a(copy, current, oldlink);
+		if (ret == ENOENT)
+			ret = 0;
+	}
+	ai_merge_stats_copy(copy, 0);
+	ai_copy_ctx_free(copy);
 
-	/* Mark as done. */
 	if (!ret)
-		ret = ai_journal_set_flag(j, AI_MERGE_COPIED_NEW);
+		ret = ai_merge_set_flag(j, AI_MERGE_BACKED_OLD_UP);
 
+	free(current);
 	return ret;
 }
 
-int ai_merge_rollback_new(const char *dest, ai_journal_t j) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* + .<fn-prefix>~ + .new */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
+int ai_merge_switch(const char *root, ai_journal_t j) {
+	char *current, *version, *newlink, *oldlink;
 
-	char *newpathbuf;
-	ai_journal_file_t *pp;
+	int ret;
 
-	int ret = 0;
+	if (!ai_merge_constraint_flags(j, AI_MERGE_VERSIONED_ROOT
+				|AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
+				AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
 
-	/* Mark rollback as started. */
-	ret = ai_journal_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	ret = ai_merge_switch_paths(root, j, &current, &version, &newlink, &oldlink);
 	if (ret)
 		return ret;
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf)
-		return errno;
-
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-		const unsigned char flags = ai_journal_file_flags(pp);
-
-		if (flags & AI_MERGE_FILE_REMOVE)
-			continue;
-
-		if (flags & AI_MERGE_FILE_DIR)
-			sprintf(newpathbuf, "%s%s%s", dest, path, name);
-		else
-			sprintf(newpathbuf, "%s%s.%s~%s.new", dest, path, fn_prefix, name);
-
-		if (remove(newpathbuf) && errno != ENOENT
-				&& errno != ENOTEMPTY && errno != EEXIST) {
-			ret = errno;
-			break;
-		}
+	/* the target is relative to the root */
+	if ((ai_merge_unlink(newlink) && errno != ENOENT)
+			|| symlink(strrchr(version, '/') + 1, newlink)
+			|| ai_merge_rename(newlink, current))
+		ret = errno;
 
-		/* XXX: remove new directories */
-	}
+	free(current);
 
-	free(newpathbuf);
+	/* Mark as done. */
+	if (!ret)
+		ret = ai_merge_set_flag(j, AI_MERGE_REPLACED);
 
 	return ret;
 }
 
-int ai_merge_backup_old(const char *dest, ai_journal_t j) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator */
-	const size_t oldpathlen = strlen(dest) + maxpathlen + 1;
-	/* + .<fn-prefix>~ + .old */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
-
-	char *oldpathbuf, *newpathbuf;
-	ai_journal_file_t *pp;
+int ai_merge_switch_rollback(const char *root, ai_journal_t j) {
+	char *current, *version, *newlink, *oldlink;
+	struct stat st;
 
-	int ret = 0;
+	int ret;
 
-	/* Already done? */
-	/* AI_MERGE_COPIED_NEW required due to AI_MERGE_FILE_REMOVE marking. */
-	if (!ai_merge_constraint_flags(j, AI_MERGE_COPIED_NEW,
-				AI_MERGE_BACKED_OLD_UP|AI_MERGE_ROLLBACK_STARTED))
+	if (!ai_merge_constraint_flags(j, AI_MERGE_VERSIONED_ROOT,
+				AI_MERGE_REPLACED))
 		return EINVAL;
 
-	oldpathbuf = malloc(oldpathlen);
-	if (!oldpathbuf)
-		return errno;
-
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf) {
-		free(oldpathbuf);
-		return errno;
-	}
-
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-		unsigned char flags = ai_journal_file_flags(pp);
-
-		if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
-			continue;
+	/* Mark rollback as started. */
+	ret = ai_merge_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	if (ret)
+		return ret;
 
-		sprintf(oldpathbuf, "%s%s%s", dest, path, name);
+	ret = ai_merge_switch_paths(root, j, &current, &version, &newlink, &oldlink);
+	if (ret)
+		return ret;
 
-		if (flags & AI_MERGE_FILE_REMOVE) {
-			struct stat st;
+	/* switch back to the old version, or remove the link if there was none */
+	if (!ai_merge_lstat(oldlink, &st)) {
+		if (ai_merge_rename(oldlink, current))
+			ret = errno;
+	} else if (errno != ENOENT)
+		ret = errno;
+	else if (ai_journal_get_flags(j) & AI_MERGE_BACKED_OLD_UP) {
+		char *target = ai_merge_switch_target(current, root);
 
-			/* omit directories */
-			if (!lstat(oldpathbuf, &st) && S_ISDIR(st.st_mode)) {
-				ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_DIR);
-				if (ret)
-					break;
-				continue;
-			}
+		if (target) {
+			if (!strcmp(target, version) && ai_merge_unlink(current))
+				ret = errno;
+			free(target);
 		}
-
-		sprintf(newpathbuf, "%s%s.%s~%s.old", dest, path, fn_prefix, name);
-
-		ret = ai_cp_l(oldpathbuf, newpathbuf);
-		if (!ret)
-			ret = ai_journal_file_set_flag(pp, AI_MERGE_FILE_BACKED_UP);
-		if (ret && ret != ENOENT)
-			break;
 	}
 
-	free(oldpathbuf);
-	free(newpathbuf);
+	if (!ret && ai_merge_unlink(newlink) && errno != ENOENT)
+		ret = errno;
 
-	/* Mark as done. */
-	if (!ret || ret == ENOENT)
-		ret = ai_journal_set_flag(j, AI_MERGE_BACKED_OLD_UP);
+	if (!ret) {
+		ret = ai_merge_remove_tree(version);
+		if (ret == ENOENT)
+			ret = 0;
+	}
 
+	free(current);
 	return ret;
 }
 
-int ai_merge_rollback_old(const char *dest, ai_journal_t j) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator
-	 * + .<fn-prefix>~ + .old */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
-
-	char *newpathbuf;
-	ai_journal_file_t *pp;
+int ai_merge_switch_cleanup(const char *root, ai_journal_t j) {
+	char *current, *version, *newlink, *oldlink;
+	char *oldversion;
 
-	int ret = 0;
+	int ret;
 
-	/* replace could be started already; we need to rollback that instead */
-	if (!ai_merge_constraint_flags(j, 0, AI_MERGE_BACKED_OLD_UP))
+	if (!ai_merge_constraint_flags(j, AI_MERGE_VERSIONED_ROOT
+				|AI_MERGE_REPLACED, 0))
 		return EINVAL;
 
-	/* Mark rollback as started. */
-	ret = ai_journal_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
+	ret = ai_merge_switch_paths(root, j, &current, &version, &newlink, &oldlink);
 	if (ret)
 		return ret;
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf)
-		return errno;
-
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-
-		if (ai_journal_file_flags(pp) & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
-			continue;
-
-		sprintf(newpathbuf, "%s%s.%s~%s.old", dest, path, fn_prefix, name);
-
-		if (unlink(newpathbuf) && errno != ENOENT) {
-			ret = errno;
-			break;
+	/* remove the old version, if it lives in the root */
+	oldversion = ai_merge_switch_target(oldlink, root);
+	if (oldversion) {
+		const char *name = oldversion + strlen(root) + 1;
+
+		if (!strncmp(oldversion, root, strlen(root))
+				&& oldversion[strlen(root)] == '/'
+				&& !strchr(name, '/') && strcmp(oldversion, version)) {
+			ret = ai_merge_remove_tree(oldversion);
+			if (ret == ENOENT)
+				ret = 0;
 		}
+		free(oldversion);
+	} else if (errno != ENOENT && errno != EINVAL)
+		ret = errno;
 
-		/* XXX: remove new directories */
-	}
-
-	free(newpathbuf);
+	if (!ret && ai_merge_unlink(oldlink) && errno != ENOENT)
+		ret = errno;
 
+	free(current);
 	return ret;
 }
 
-int ai_merge_replace(const char *dest, ai_journal_t j) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 1;
-	/* + .<fn-prefix>~ + .new */
-	const size_t oldpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
+/**
+ * ai_merge_async
+ * @source: path to the source tree
+ * @dest: path to the destination tree
+ * @j: the journal
+ * @opts: the merge options
+ * @flags: the #ai_merge_async_flags_t
+ * @fds: the readiness pipe
+ * @ready: whether a byte has been written to the pipe
+ * @phase: the running phase, or %AI_MERGE_PHASE_NONE between phases
+ * @next: the phase to start next, or %AI_MERGE_PHASE_NONE to choose it using
+ *	the journal flags
+ * @started: the time the running phase was started at, for the statistics
+ * @rollback: whether the merge is being rolled back
+ * @finished: whether the merge has finished
+ * @error: the first error
+ * @copy: the copying state, in %AI_MERGE_PHASE_COPY_NEW
+ * @w: the worker, in the metadata phases
+ * @pp: the next journal entry, in the metadata phases
+ * @index: index of @pp in the journal
+ * @func: the per-entry function, in the metadata phases
+ * @events: the event queue
+ * @head: index of the oldest event in @events
+ * @tail: index past the newest event in @events
+ * @size: allocated size of @events
+ * @path: path of the last event taken, to be freed
+ *
+ * The state of an asynchronous merge.
+ */
+struct ai_merge_async {
+	const char *source, *dest;
+	ai_journal_t j;
+	ai_merge_options_t opts;
+	unsigned int flags;
+
+	int fds[2];
+	int ready;
 
-	char *oldpathbuf, *newpathbuf;
+	ai_merge_phase_t phase, next;
+	unsigned long long int started;
+	int rollback, finished, error;
+
+	struct ai_merge_copy_state copy;
+	struct ai_merge_worker w;
 	ai_journal_file_t *pp;
+	size_t index;
+	ai_merge_entry_func_t func;
 
-	int ret = 0;
+	ai_merge_event_t *events;
+	size_t head, tail, size;
+	char *path;
+};
 
-	if (!ai_merge_constraint_flags(j,
-				AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
-				AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED))
-		return EINVAL;
+/**
+ * ai_merge_async_push
+ * @a: the merge
+ * @type: the event type
+ * @phase: the phase the event comes from
+ * @path: relative path to the file, or %NULL
+ * @error: result, in form of errno
+ *
+ * Append an event to the queue. The event is dropped if memory can't be
+ * allocated.
+ */
+static void ai_merge_async_push(struct ai_merge_async *a,
+		ai_merge_event_type_t type, ai_merge_phase_t phase,
+		const char *path, int error) {
+	ai_merge_event_t *ev;
+
+	if (a->tail == a->size) {
+		if (a->head && a->head >= a->size / 2) {
+			/* reuse the space of the events taken already */
+			memmove(a->events, a->events + a->head,
+					(a->tail - a->head) * sizeof(*a->events));
+			a->tail -= a->head;
+			a->head = 0;
+		} else {
+			const size_t size = a->size ? a->size * 2 : 16;
 
-	oldpathbuf = malloc(oldpathlen);
-	if (!oldpathbuf)
-		return errno;
+			ev = realloc(a->events, size * sizeof(*ev));
+			if (!ev)
+				return;
+			a->events = ev;
+			a->size = size;
+		}
+	}
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf) {
-		free(oldpathbuf);
-		return errno;
+	ev = &a->events[a->tail];
+	ev->type = type;
+	ev->phase = phase;
+	ev->path = NULL;
+	ev->error = error;
+	if (path) {
+		ev->path = strdup(path);
+		if (!ev->path)
+			return;
 	}
+	a->tail++;
+}
 
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-		const unsigned char flags = ai_journal_file_flags(pp);
+/**
+ * ai_merge_async_removed
+ * @a: the merge
+ * @relpath: relative path to the file
+ * @result: result of processing
+ *
+ * Queue the removal event for ai_merge_worker_removed().
+ */
+static void ai_merge_async_removed(struct ai_merge_async *a,
+		const char *relpath, int result) {
+	ai_merge_async_push(a, AI_MERGE_EVENT_REMOVAL, a->phase, relpath, result);
+}
 
-		if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
-			continue;
+/**
+ * ai_merge_async_update
+ * @a: the merge
+ *
+ * Make the pipe readable if there is work to do or events to take, and drain
+ * it otherwise.
+ */
+static void ai_merge_async_update(struct ai_merge_async *a) {
+	const int ready = !a->finished || a->head < a->tail;
+	char c = 0;
+
+	if (ready == a->ready)
+		return;
+
+	if (ready) {
+		if (write(a->fds[1], &c, 1) == 1)
+			a->ready = 1;
+	} else {
+		if (read(a->fds[0], &c, 1) == 1)
+			a->ready = 0;
+	}
+}
+
+/**
+ * ai_merge_async_abandon
+ * @a: the merge
+ * @ret: the reason
+ *
+ * Free the state of the running phase, without marking it as done.
+ */
+static void ai_merge_async_abandon(struct ai_merge_async *a, int ret) {
+	if (a->phase == AI_MERGE_PHASE_COPY_NEW)
+		ai_merge_copy_end(&a->copy, ECANCELED);
+	else if (a->phase != AI_MERGE_PHASE_NONE)
+		ai_merge_worker_free(&a->w);
+
+	if (a->phase != AI_MERGE_PHASE_NONE)
+		ai_merge_phase_end(a->opts.status, a->phase, a->started, ret);
+	a->phase = AI_MERGE_PHASE_NONE;
+}
 
-		sprintf(newpathbuf, "%s%s%s", dest, path, name);
+/**
+ * ai_merge_async_finish
+ * @a: the merge
+ * @ret: the final result
+ *
+ * Finish the merge, and queue %AI_MERGE_EVENT_DONE.
+ */
+static void ai_merge_async_finish(struct ai_merge_async *a, int ret) {
+	a->finished = 1;
+	ai_merge_async_push(a, AI_MERGE_EVENT_DONE, AI_MERGE_PHASE_NONE, NULL, ret);
+}
 
-		if (flags & AI_MERGE_FILE_REMOVE) {
-			if (flags & AI_MERGE_FILE_DIR)
-				continue;
-			if (unlink(newpathbuf) && errno != ENOENT)
-				ret = errno;
-		} else {
-			sprintf(oldpathbuf, "%s%s.%s~%s.new", dest, path, fn_prefix, name);
-			ret = ai_mv(oldpathbuf, newpathbuf);
+/**
+ * ai_merge_async_fail
+ * @a: the merge
+ * @phase: the failed phase
+ * @ret: the error
+ *
+ * Abandon the failed phase. Roll back if replacing failed, and finish
+ * the merge otherwise.
+ */
+static void ai_merge_async_fail(struct ai_merge_async *a,
+		ai_merge_phase_t phase, int ret) {
+	ai_merge_async_push(a, AI_MERGE_EVENT_FAILED, phase, NULL, ret);
+	ai_merge_async_abandon(a, ret);
+	if (!a->error)
+		a->error = ret;
+
+	if (phase == AI_MERGE_PHASE_REPLACE)
+		a->rollback = 1;
+	else
+		ai_merge_async_finish(a, a->error);
+}
+
+/**
+ * ai_merge_async_next
+ * @a: the merge
+ *
+ * Choose the next phase, like the synchronous functions would be called.
+ *
+ * Returns: the next phase, or %AI_MERGE_PHASE_NONE if the merge is done
+ */
+static ai_merge_phase_t ai_merge_async_next(struct ai_merge_async *a) {
+	const uint32_t flags = ai_journal_get_flags(a->j);
+	const ai_merge_phase_t next = a->next;
+
+	a->next = AI_MERGE_PHASE_NONE;
+	if (next != AI_MERGE_PHASE_NONE)
+		return next;
+
+	if (a->rollback || (flags & AI_MERGE_ROLLBACK_STARTED)) {
+		/* too late */
+		if (flags & AI_MERGE_REPLACED) {
+			if (!a->error)
+				a->error = EINVAL;
+			return AI_MERGE_PHASE_NONE;
 		}
 
-		if (ret)
+		a->rollback = 1;
+		if (flags & AI_MERGE_BACKED_OLD_UP)
+			return AI_MERGE_PHASE_ROLLBACK_REPLACE;
+		return AI_MERGE_PHASE_ROLLBACK_OLD;
+	}
+
+	if (flags & AI_MERGE_REPLACED)
+		return AI_MERGE_PHASE_CLEANUP;
+	if (flags & AI_MERGE_BACKED_OLD_UP) {
+		if (a->flags & AI_MERGE_ASYNC_NO_REPLACE)
+			return AI_MERGE_PHASE_NONE;
+		return AI_MERGE_PHASE_REPLACE;
+	}
+	if (flags & AI_MERGE_COPIED_NEW)
+		return AI_MERGE_PHASE_BACKUP_OLD;
+	return AI_MERGE_PHASE_COPY_NEW;
+}
+
+/**
+ * ai_merge_async_begin
+ * @a: the merge
+ * @phase: the phase to start
+ *
+ * Check the journal flags and set up the state for @phase, like
+ * the corresponding synchronous function does.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_async_begin(struct ai_merge_async *a,
+		ai_merge_phase_t phase) {
+	uint32_t required = 0, unallowed = 0, flag = 0;
+	int ret;
+
+	ai_merge_async_push(a, AI_MERGE_EVENT_PHASE, phase, NULL, 0);
+
+	switch (phase) {
+		case AI_MERGE_PHASE_COPY_NEW:
+			/* ai_merge_copy_end() is needed even on failure */
+			a->phase = phase;
+			a->started = ai_merge_phase_start(a->opts.status, phase, a->j);
+			return ai_merge_copy_begin(&a->copy, a->source, &a->dest,
+					&a->j, 1, &a->opts);
+		case AI_MERGE_PHASE_BACKUP_OLD:
+			required = AI_MERGE_COPIED_NEW;
+			unallowed = AI_MERGE_BACKED_OLD_UP|AI_MERGE_ROLLBACK_STARTED;
+			a->func = ai_merge_backup_entry;
+			break;
+		case AI_MERGE_PHASE_REPLACE:
+			required = AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP;
+			unallowed = AI_MERGE_REPLACED|AI_MERGE_ROLLBACK_STARTED;
+			a->func = ai_merge_replace_entry;
 			break;
+		case AI_MERGE_PHASE_CLEANUP:
+			required = AI_MERGE_REPLACED;
+			a->func = ai_merge_cleanup_entry;
+			break;
+		case AI_MERGE_PHASE_ROLLBACK_REPLACE:
+			required = AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP;
+			unallowed = AI_MERGE_REPLACED;
+			flag = AI_MERGE_ROLLBACK_STARTED;
+			a->func = ai_merge_rollback_replace_entry;
+			break;
+		case AI_MERGE_PHASE_ROLLBACK_OLD:
+			unallowed = AI_MERGE_BACKED_OLD_UP;
+			flag = AI_MERGE_ROLLBACK_STARTED;
+			a->func = ai_merge_rollback_old_entry;
+			break;
+		case AI_MERGE_PHASE_ROLLBACK_NEW:
+			flag = AI_MERGE_ROLLBACK_STARTED;
+			a->func = ai_merge_rollback_new_entry;
+			break;
+		default:
+			return EINVAL;
 	}
 
-	free(oldpathbuf);
-	free(newpathbuf);
+	if (!ai_merge_constraint_flags(a->j, required, unallowed))
+		return EINVAL;
+	if (flag) {
+		ret = ai_merge_set_flag(a->j, flag);
+		if (ret)
+			return ret;
+	}
 
-	/* Mark as done. */
-	if (!ret)
-		ret = ai_journal_set_flag(j, AI_MERGE_REPLACED);
+	ret = ai_merge_worker_init(&a->w, a->dest, a->j, &a->opts);
+	if (ret)
+		return ret;
+	a->w.async = a;
+	a->pp = ai_journal_get_files(a->j);
+	a->index = 0;
+	a->phase = phase;
+	a->started = ai_merge_phase_start(a->opts.status, phase, a->j);
 
-	return ret;
+	return 0;
 }
 
-int ai_merge_rollback_replace(const char *dest, ai_journal_t j) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 1;
-	/* + .<fn-prefix>~ + .old */
-	const size_t oldpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
+/**
+ * ai_merge_async_end
+ * @a: the merge
+ *
+ * Free the state of the finished phase, and mark it as done in the journal.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_async_end(struct ai_merge_async *a) {
+	const ai_merge_phase_t phase = a->phase;
 
-	char *oldpathbuf, *newpathbuf;
-	ai_journal_file_t *pp;
+	a->phase = AI_MERGE_PHASE_NONE;
+	if (phase == AI_MERGE_PHASE_COPY_NEW) {
+		const int ret = ai_merge_copy_end(&a->copy, 0);
 
-	int ret = 0;
+		ai_merge_phase_end(a->opts.status, phase, a->started, ret);
+		return ret;
+	}
 
-	if (!ai_merge_constraint_flags(j,
-				AI_MERGE_COPIED_NEW|AI_MERGE_BACKED_OLD_UP,
-				AI_MERGE_REPLACED))
-		return EINVAL;
+	ai_merge_worker_free(&a->w);
+	ai_merge_phase_end(a->opts.status, phase, a->started, 0);
+	switch (phase) {
+		case AI_MERGE_PHASE_BACKUP_OLD:
+			return ai_merge_set_flag(a->j, AI_MERGE_BACKED_OLD_UP);
+		case AI_MERGE_PHASE_REPLACE:
+			return ai_merge_set_flag(a->j, AI_MERGE_REPLACED);
+		case AI_MERGE_PHASE_ROLLBACK_REPLACE:
+		case AI_MERGE_PHASE_ROLLBACK_OLD:
+			a->next = AI_MERGE_PHASE_ROLLBACK_NEW;
+			return 0;
+		case AI_MERGE_PHASE_CLEANUP:
+		case AI_MERGE_PHASE_ROLLBACK_NEW:
+			ai_merge_async_finish(a, a->error);
+			return 0;
+		default:
+			return 0;
+	}
+}
 
-	oldpathbuf = malloc(oldpathlen);
-	if (!oldpathbuf)
-		return errno;
+/**
+ * ai_merge_async_entry
+ * @a: the merge
+ *
+ * Process a single journal entry of the running phase.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int ai_merge_async_entry(struct ai_merge_async *a) {
+	int ret;
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf) {
-		free(oldpathbuf);
-		return errno;
-	}
+	if (a->phase == AI_MERGE_PHASE_COPY_NEW) {
+		const unsigned char flags = ai_journal_file_flags(a->copy.pps[0]);
 
-	/* Mark rollback as started. */
-	ret = ai_journal_set_flag(j, AI_MERGE_ROLLBACK_STARTED);
-	if (ret)
+		ret = ai_merge_copy_step(&a->copy, NULL);
+		if (!ret && !(flags & AI_MERGE_FILE_REMOVE))
+			ai_merge_async_push(a, AI_MERGE_EVENT_PROGRESS, a->phase,
+					a->copy.oldp.buf + a->copy.oldp.rootlen, 0);
 		return ret;
+	}
 
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-		const unsigned char flags = ai_journal_file_flags(pp);
-
-		if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
-			continue; /* ignore duplicates */
+	ret = ai_merge_entry(&a->w, a->func, a->pp, a->index++);
+	a->pp = ai_journal_file_next(a->pp);
+	return ret;
+}
 
-		/* if backed up, then restore */
-		if (flags & AI_MERGE_FILE_BACKED_UP) {
-			sprintf(oldpathbuf, "%s%s.%s~%s.old", dest, path, fn_prefix, name);
-			sprintf(newpathbuf, "%s%s%s", dest, path, name);
+int ai_merge_async_start(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, unsigned int flags,
+		ai_merge_async_t *ret) {
+	struct ai_merge_async *a;
+	int i, err;
 
-			ret = ai_mv(oldpathbuf, newpathbuf);
-		} else { /* just unlink the new one */
-			if (unlink(newpathbuf))
-				ret = errno;
-		}
+	err = ai_merge_check_options(&opts);
+	if (err)
+		return err;
+	if (!ai_merge_constraint_flags(j, 0, AI_MERGE_VERSIONED_ROOT))
+		return EINVAL;
 
-		if (ret && ret != ENOENT)
-			break;
+	a = malloc(sizeof(*a));
+	if (!a)
+		return errno;
+	if (pipe(a->fds)) {
+		err = errno;
+		free(a);
+		return err;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(a->fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(a->fds[i], F_SETFL, O_NONBLOCK);
 	}
 
-	free(oldpathbuf);
-	free(newpathbuf);
+	a->source = source;
+	a->dest = dest;
+	a->j = j;
+	a->opts = *opts;
+	a->flags = flags;
+	a->ready = 0;
+	a->phase = a->next = AI_MERGE_PHASE_NONE;
+	a->rollback = !!(flags & AI_MERGE_ASYNC_ROLLBACK);
+	a->finished = 0;
+	a->error = 0;
+	a->events = NULL;
+	a->head = a->tail = a->size = 0;
+	a->path = NULL;
+
+	ai_merge_async_update(a);
+	*ret = a;
+	return 0;
+}
 
-	return ret == ENOENT ? 0 : ret;
+int ai_merge_async_get_fd(ai_merge_async_t a) {
+	return a->fds[0];
 }
 
-int ai_merge_cleanup(const char *dest, ai_journal_t j,
-		ai_merge_removal_callback_t removal_callback) {
-	const uint64_t maxpathlen = ai_journal_get_maxpathlen(j);
-	const char *fn_prefix = ai_journal_get_filename_prefix(j);
-	/* maxpathlen covers path + filename, + 1 for null terminator
-	 * + .<fn-prefix>~ + .old */
-	const size_t newpathlen = strlen(dest) + maxpathlen + 7 + strlen(fn_prefix);
+int ai_merge_async_step(ai_merge_async_t a, unsigned int max_entries) {
+	unsigned int n;
+	int ret;
 
-	char *newpathbuf;
-	ai_journal_file_t *pp;
+	if (!a->finished && a->phase == AI_MERGE_PHASE_NONE) {
+		const ai_merge_phase_t phase = ai_merge_async_next(a);
 
-	int ret = 0;
+		if (phase == AI_MERGE_PHASE_NONE)
+			ai_merge_async_finish(a, a->error);
+		else {
+			ret = ai_merge_async_begin(a, phase);
+			if (ret)
+				ai_merge_async_fail(a, phase, ret);
+		}
+	}
 
-	if (!ai_merge_constraint_flags(j, AI_MERGE_REPLACED, 0))
-		return EINVAL;
+	for (n = 0; a->phase != AI_MERGE_PHASE_NONE && n < max_entries; n++) {
+		const ai_merge_phase_t phase = a->phase;
 
-	newpathbuf = malloc(newpathlen);
-	if (!newpathbuf)
-		return errno;
+		if (phase == AI_MERGE_PHASE_COPY_NEW ? !a->copy.pps[0] : !a->pp) {
+			ret = ai_merge_async_end(a);
+			if (ret)
+				ai_merge_async_fail(a, phase, ret);
+			break;
+		}
 
-	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
-		const char *path = ai_journal_file_path(pp);
-		const char *name = ai_journal_file_name(pp);
-		const unsigned char flags = ai_journal_file_flags(pp);
+		ret = ai_merge_async_entry(a);
+		if (ret)
+			ai_merge_async_fail(a, phase, ret);
+	}
 
-		if (removal_callback && (flags & AI_MERGE_FILE_REMOVE)) {
-			sprintf(newpathbuf, "%s%s", path, name);
-			if (flags & AI_MERGE_FILE_IGNORE)
-				removal_callback(newpathbuf, EEXIST);
-			else if (!(flags & (AI_MERGE_FILE_BACKED_UP|AI_MERGE_FILE_DIR)))
-				removal_callback(newpathbuf, ENOENT);
-		}
+	ai_merge_async_update(a);
+	return !a->finished;
+}
 
-		if (flags & (AI_MERGE_FILE_IGNORE|AI_MERGE_FILE_DIR))
-			continue;
+int ai_merge_async_get_event(ai_merge_async_t a, ai_merge_event_t *ev) {
+	free(a->path);
+	a->path = NULL;
 
-		if (flags & AI_MERGE_FILE_DIR)
-			sprintf(newpathbuf, "%s%s%s", dest, path, name);
-		else if (flags & AI_MERGE_FILE_BACKED_UP)
-			sprintf(newpathbuf, "%s%s.%s~%s.old", dest, path, fn_prefix, name);
-		else
-			continue;
+	if (a->head == a->tail)
+		return 0;
 
-		if (remove(newpathbuf)) {
-			if (errno == EEXIST)
-				errno = ENOTEMPTY;
-			else if (errno != ENOENT && errno != ENOTEMPTY) {
-				ret = errno;
-				break;
-			}
-		} else
-			errno = 0;
+	*ev = a->events[a->head++];
+	a->path = (char *) ev->path;
+	if (a->head == a->tail)
+		a->head = a->tail = 0;
 
-		if (removal_callback && (flags & AI_MERGE_FILE_REMOVE)) {
-			sprintf(newpathbuf, "%s%s", path, name);
-			removal_callback(newpathbuf, errno);
-		}
+	ai_merge_async_update(a);
+	return 1;
+}
+
+int ai_merge_async_rollback(ai_merge_async_t a) {
+	if (a->finished || a->phase == AI_MERGE_PHASE_CLEANUP
+			|| !ai_merge_constraint_flags(a->j, 0, AI_MERGE_REPLACED))
+		return EINVAL;
+
+	if (!a->rollback) {
+		/* the rollback phases start from the journal flags */
+		ai_merge_async_abandon(a, ECANCELED);
+		a->rollback = 1;
 	}
 
-	free(newpathbuf);
+	return 0;
+}
+
+void ai_merge_async_free(ai_merge_async_t a) {
+	ai_merge_async_abandon(a, ECANCELED);
 
-	return ret;
+	for (; a->head < a->tail; a->head++)
+		free((char *) a->events[a->head].path);
+	free(a->events);
+	free(a->path);
+
+	close(a->fds[0]);
+	close(a->fds[1]);
+	free(a);
 }
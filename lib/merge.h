@@ -18,7 +18,9 @@
  * Note: the API is unstable right now, and will be undergoing changes.
  */
 
+#include "copy.h"
 #include "journal.h"
+#include "store.h"
 
 /**
  * ai_merge_flags_t
@@ -29,6 +31,10 @@
  *	were replaced by .new
  * @AI_MERGE_ROLLBACK_STARTED: any kind of rollback has been started, and thus
  *	proceeding is no longer allowed
+ * @AI_MERGE_VERSIONED_ROOT: the merge is performed by switching versions
+ *	of a versioned root (see ai_merge_switch_prepare())
+ * @AI_MERGE_VERIFIED: the staged files have been verified against
+ *	the manifest (see ai_merge_verify())
  *
  * An enumeration listing global flags used by libai-merge.
  */
@@ -36,7 +42,9 @@ typedef enum {
 	AI_MERGE_COPIED_NEW = 1,
 	AI_MERGE_BACKED_OLD_UP = 2,
 	AI_MERGE_REPLACED = 4,
-	AI_MERGE_ROLLBACK_STARTED = 8
+	AI_MERGE_ROLLBACK_STARTED = 8,
+	AI_MERGE_VERSIONED_ROOT = 16,
+	AI_MERGE_VERIFIED = 32
 } ai_merge_flags_t;
 
 /**
@@ -47,6 +55,11 @@ typedef enum {
  *	be either replaced or removed (i.e. belongs to an older version)
  * @AI_MERGE_FILE_IGNORE: ignore the file entry (e.g. duplicate)
  * @AI_MERGE_FILE_DIR: directory to be removed
+ * @AI_MERGE_FILE_NEW_TREE: the directory did not exist in the destination tree,
+ *	and it has been staged as a whole; it will be moved into place with
+ *	a single rename
+ * @AI_MERGE_FILE_IN_NEW_TREE: the file belongs to a staged directory, and will
+ *	be moved along with it
  *
  * An enumeration listing file flags used by libai-merge.
  */
@@ -54,7 +67,9 @@ typedef enum {
 	AI_MERGE_FILE_BACKED_UP = 1,
 	AI_MERGE_FILE_REMOVE = 2,
 	AI_MERGE_FILE_IGNORE = 4,
-	AI_MERGE_FILE_DIR = 8
+	AI_MERGE_FILE_DIR = 8,
+	AI_MERGE_FILE_NEW_TREE = 16,
+	AI_MERGE_FILE_IN_NEW_TREE = 32
 } ai_merge_file_flags_t;
 
 /**
@@ -94,16 +109,208 @@ typedef void (*ai_merge_removal_callback_t)(
 		const char *path,
 		int result);
 
+/**
+ * AI_MERGE_MAX_JOBS
+ *
+ * The maximal number of parallel jobs in #ai_merge_options_t.
+ */
+#define AI_MERGE_MAX_JOBS 64
+
+/**
+ * AI_MERGE_STATUS_VERSION
+ *
+ * The version of the #ai_merge_status_t layout, changed whenever it changes.
+ */
+#define AI_MERGE_STATUS_VERSION 1
+
+/**
+ * AI_MERGE_STATUS_PATH_MAX
+ *
+ * The size of the path buffer in #ai_merge_status_t. Longer paths are
+ * truncated.
+ */
+#define AI_MERGE_STATUS_PATH_MAX 1024
+
+/**
+ * ai_merge_status_t
+ * @version: %AI_MERGE_STATUS_VERSION
+ * @sequence: odd while @path is being written
+ * @phase: the running #ai_merge_phase_t, or %AI_MERGE_PHASE_NONE between
+ *	phases
+ * @errors: number of journal entries which failed
+ * @entries_done: number of journal entries processed by the running phase
+ * @entries_total: number of journal entries
+ * @bytes_done: number of bytes copied by the copying phase
+ * @bytes_total: number of bytes to be copied, as estimated by
+ *	ai_merge_plan(), or 0 if not planned
+ * @path: the last journal entry started, relative to the tree,
+ *	null-terminated
+ *
+ * The live merge status, as published in the status file. All the counters
+ * are native-endian 64-bit integers, updated using relaxed atomic stores.
+ * In order to read a consistent @path, read @sequence before and after it,
+ * and retry if it was odd or changed.
+ */
+typedef struct {
+	unsigned long long int version;
+	unsigned long long int sequence;
+	unsigned long long int phase;
+	unsigned long long int errors;
+	unsigned long long int entries_done;
+	unsigned long long int entries_total;
+	unsigned long long int bytes_done;
+	unsigned long long int bytes_total;
+	char path[AI_MERGE_STATUS_PATH_MAX];
+} ai_merge_status_t;
+
+/**
+ * ai_merge_options_t
+ * @jobs: number of parallel jobs used by the metadata phases, or 0 for 1
+ * @store: an open object store, or %NULL
+ * @manifest: path to the verification manifest, or %NULL
+ * @status: the status to publish, from ai_merge_status_open(), or %NULL
+ * @copy_jobs: number of threads copying a single large file, or 0 for 1
+ * @cache_policy: the page cache policy for copying file contents
+ * @bufsize: the size of the copying buffers, or 0 for the default
+ * @strategy: the fastest copying strategy to use, or %AI_COPY_NONE
+ *	for no limit
+ * @throttle: the I/O rate limits, or %NULL for no limits
+ *
+ * The per-merge options, passed to the merge steps. %NULL can be passed
+ * instead for the defaults, i.e. all fields zero. The same options should be
+ * passed to all the steps of a single merge.
+ *
+ * @jobs parallel jobs are used by the metadata phases: ai_merge_backup_old(),
+ * ai_merge_replace(), ai_merge_cleanup(), ai_merge_rollback_replace(),
+ * ai_merge_rollback_old() and ai_merge_rollback_new(). The journal entries are
+ * partitioned by their directory, so all operations within a single directory
+ * are still performed in journal order. The journal flags are set only after
+ * all jobs finish, so resuming and rolling back work as with a single job.
+ * The steps fail with EINVAL if @jobs exceeds %AI_MERGE_MAX_JOBS, and with
+ * ENOSYS if it is more than 1 and libai-merge was built without thread
+ * support.
+ *
+ * @store is used when copying new files in ai_merge_copy_new() and
+ * ai_merge_switch_prepare(). Files which can't be hardlinked from the source
+ * tree are then reflinked (or hardlinked) from the store objects (see
+ * ai_store_cp()). It needs to stay open while it is used.
+ *
+ * If @manifest is set, the contents of the files copied into the first
+ * destination tree by ai_merge_copy_new() and ai_merge_copy_new_multi() are
+ * hashed while copying, and the hashes are written to @manifest along with
+ * the staged file paths. The manifest can be used by ai_merge_verify()
+ * to re-check the staged files before replacing. Files linked from the source
+ * tree or the object store share their data with the source, and are not
+ * listed. Hashing disables the kernel-side copying.
+ *
+ * @copy_jobs, @cache_policy, @bufsize and @strategy are applied to all
+ * the copying contexts used by the merge steps (see ai_copy_ctx_set_jobs(),
+ * ai_copy_ctx_set_cache_policy(), ai_copy_ctx_set_bufsize() and
+ * ai_copy_ctx_set_strategy()), so that concurrent merges can use different
+ * settings. The steps fail with the errors of these functions if the settings
+ * are invalid.
+ *
+ * @throttle limits the copied data, and the metadata operations performed
+ * by the merge steps, one per journal entry (see ai_copy_throttle_new()).
+ * It can be shared by multiple merges, and needs to stay valid while it is
+ * used.
+ *
+ * The statistics and the trace (see ai_merge_set_stats() and
+ * ai_merge_set_trace()) are still collected process-wide.
+ */
+typedef struct {
+	unsigned int jobs;
+	ai_store_t store;
+	const char *manifest;
+	ai_merge_status_t *status;
+
+	unsigned int copy_jobs;
+	ai_copy_cache_policy_t cache_policy;
+	size_t bufsize;
+	ai_copy_strategy_t strategy;
+	ai_copy_throttle_t throttle;
+} ai_merge_options_t;
+
+/**
+ * ai_merge_plan_t
+ * @linked: number of regular files to be hardlinked from the source tree
+ * @copied: number of regular files to be copied
+ * @others: number of symlinks and special files to be created
+ * @dirs: number of directories to be created
+ * @removed: number of files to be removed from the destination tree
+ * @backups: number of existing files to be backed up
+ * @replace_ops: number of renames and unlinks performed while replacing
+ * @bytes: number of bytes to be written, rounded up to whole blocks
+ * @inodes: number of inodes to be allocated
+ * @avail_bytes: number of bytes available in the destination filesystem
+ * @avail_inodes: number of inodes available in the destination filesystem,
+ *	or (unsigned long long int) -1 if the filesystem doesn't limit them
+ *
+ * The estimated cost of a merge.
+ */
+typedef struct {
+	unsigned long int linked;
+	unsigned long int copied;
+	unsigned long int others;
+	unsigned long int dirs;
+	unsigned long int removed;
+	unsigned long int backups;
+	unsigned long int replace_ops;
+
+	unsigned long long int bytes;
+	unsigned long long int inodes;
+	unsigned long long int avail_bytes;
+	unsigned long long int avail_inodes;
+} ai_merge_plan_t;
+
+/**
+ * ai_merge_plan
+ * @source: path to the source tree
+ * @dest: path to the destination tree
+ * @j: an open journal, not copied yet
+ * @opts: the merge options, or %NULL
+ * @plan: location to store the estimate in
+ *
+ * Estimate the cost of merging the files listed in @j, without modifying
+ * anything. The files on the same device as @dest are expected to be linked,
+ * and the others copied. The new directories whose parents exist are expected
+ * to be staged as subtrees, and moved into place with a single rename.
+ *
+ * The estimate is then compared with the space and inodes available
+ * in the destination filesystem, so that a merge which wouldn't fit can fail
+ * before ai_merge_copy_new() is called. Removed files don't free any space
+ * until ai_merge_cleanup(), and the backups are hardlinks, so neither of them
+ * is taken into account.
+ *
+ * Layered journals are handled like in ai_merge_copy_new(). If a status is set
+ * in @opts, the number of bytes to be copied is published in it.
+ *
+ * Returns: 0 on success, ENOSPC if the merge wouldn't fit in the destination
+ *	filesystem (@plan is filled in then), EINVAL if copying was started
+ *	already, errno otherwise
+ */
+int ai_merge_plan(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, ai_merge_plan_t *plan);
+
 /**
  * ai_merge_copy_new
  * @source: path to the source tree
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  * @progress_callback: callback function for progress reporting, or %NULL
  *
  * Copy files from the source tree at @source to the destination tree at @dest.
  * The new files will be written as temporary files with .new suffix.
  *
+ * If a directory from the source tree does not exist in the destination tree,
+ * the whole subtree is staged in a temporary directory with .new suffix
+ * instead, and the files inside it are written with their final names.
+ * ai_merge_replace() will then move it into place with a single rename.
+ *
+ * If the journal was created using ai_journal_create_layers(), the files are
+ * copied from the source trees stored in it, and @source is ignored.
+ *
  * If all files are copied successfully, the %AI_MERGE_COPIED_NEW flag will be
  * set on journal. Otherwise, the copying process can be either resumed by
  * calling ai_merge_copy_new() again or rolled back using
@@ -112,11 +319,50 @@ typedef void (*ai_merge_removal_callback_t)(
  * Returns: 0 on success, errno otherwise
  */
 int ai_merge_copy_new(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts,
+		ai_merge_progress_callback_t progress_callback);
+/**
+ * ai_merge_copy_new_multi
+ * @source: path to the source tree
+ * @dests: array of paths to the destination trees
+ * @js: array of open journals, one for each destination
+ * @count: number of destinations
+ * @opts: the merge options, or %NULL
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Copy files from the source tree at @source to @count destination trees
+ * at once, like ai_merge_copy_new() does for each of them. The source tree
+ * is read only once: the files for the following destinations are linked
+ * (or copied) from the ones written to the first destination.
+ *
+ * All the journals need to list the same files, e.g. by creating them using
+ * ai_journal_create_copy(). The remaining merge steps are performed separately
+ * for each destination.
+ *
+ * The progress is reported for the first destination only.
+ *
+ * Returns: 0 on success, errno otherwise (EINVAL if the journals don't match)
+ */
+int ai_merge_copy_new_multi(const char *source, const char *const *dests,
+		ai_journal_t *js, unsigned int count, const ai_merge_options_t *opts,
 		ai_merge_progress_callback_t progress_callback);
+/**
+ * ai_merge_mark_replaced
+ * @j: an open journal
+ *
+ * Set the %AI_MERGE_FILE_IGNORE flag on the removal entries for files which
+ * are listed as new files in @j as well. ai_merge_copy_new() does that
+ * by looking at the source tree; this function is used when there is no single
+ * source tree to look at.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_mark_replaced(ai_journal_t j);
 /**
  * ai_merge_backup_old
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  *
  * Backup files in the destination tree which will be replaced during the merge
  * process. The backup copies will be named as temporary files with .old suffix.
@@ -132,11 +378,33 @@ int ai_merge_copy_new(const char *source, const char *dest, ai_journal_t j,
  *
  * Returns: 0 on success, errno otherwise
  */
-int ai_merge_backup_old(const char *dest, ai_journal_t j);
+int ai_merge_backup_old(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts);
+/**
+ * ai_merge_verify
+ * @dest: path to the destination tree
+ * @j: an open journal
+ * @manifest: path to the manifest written by ai_merge_copy_new()
+ *
+ * Verify the files staged in @dest against the hashes in @manifest (see
+ * #ai_merge_options_t). It should be called after ai_merge_copy_new()
+ * and before ai_merge_replace(), in order to catch files damaged or modified
+ * since they were copied.
+ *
+ * On success, the %AI_MERGE_VERIFIED flag is set on the journal, and
+ * the verification is not repeated when resuming (the staged files are gone
+ * once replacing has started).
+ *
+ * Returns: 0 on success, EIO if any of the files doesn't match, ENOENT if
+ *	@manifest doesn't exist, EINVAL if the files have been replaced already,
+ *	errno otherwise
+ */
+int ai_merge_verify(const char *dest, ai_journal_t j, const char *manifest);
 /**
  * ai_merge_replace
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  *
  * Perform the actual merge in the destination tree replacing any existing
  * files.
@@ -146,18 +414,47 @@ int ai_merge_backup_old(const char *dest, ai_journal_t j);
  *
  * If all files are merged successfully, the %AI_MERGE_REPLACED flag will be set
  * on journal. Otherwise, ai_merge_rollback_replace() needs to be called ASAP to
- * restore old files. Resuming is not possible.
+ * restore old files. If the process is interrupted, the function can be called
+ * again to resume; the files moved into place already are skipped.
  *
  * After this function succeeds, it is no longer possible to rollback.
  * ai_merge_cleanup() should be called instead to remove stale temporary files.
  *
  * Returns: 0 on success, errno otherwise
  */
-int ai_merge_replace(const char *dest, ai_journal_t j);
+int ai_merge_replace(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts);
+/**
+ * ai_merge_replace_prepared
+ * @dest: path to the destination tree
+ * @j: an open journal
+ * @opts: the merge options, or %NULL
+ * @window_us: location to store the replace window duration (in microseconds)
+ *	in, or %NULL
+ *
+ * Perform the actual merge like ai_merge_replace() does, minimizing the time
+ * during which the destination tree is inconsistent.
+ *
+ * Before touching the destination tree, this function opens all the affected
+ * directories, precomputes all the temporary names and ensures that every
+ * rename can be performed within a single filesystem. If any of that fails,
+ * the destination tree is left untouched and ai_merge_replace() can be used
+ * instead. Otherwise, all the files are replaced in a tight loop, and its
+ * duration is stored in @window_us.
+ *
+ * The journal flags, resuming and the rollback procedure are the same as with
+ * ai_merge_replace().
+ *
+ * Returns: 0 on success, EXDEV if a rename would cross filesystems, ENOSYS if
+ *	the *at() functions are not supported, errno otherwise
+ */
+int ai_merge_replace_prepared(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, unsigned long int *window_us);
 /**
  * ai_merge_cleanup
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  * @removal_callback: callback function for removal progress reporting, or %NULL
  *
  * Remove stale temporary files in the destination tree after replacement
@@ -166,12 +463,14 @@ int ai_merge_replace(const char *dest, ai_journal_t j);
  * Returns: 0 on success, errno otherwise
  */
 int ai_merge_cleanup(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts,
 		ai_merge_removal_callback_t removal_callback);
 
 /**
  * ai_merge_rollback_old
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  *
  * Rollback backing up existing files in the destination tree -- in other words,
  * remove the backup copies.
@@ -186,11 +485,13 @@ int ai_merge_cleanup(const char *dest, ai_journal_t j,
  *
  * Returns: 0 on success, errno otherwise
  */
-int ai_merge_rollback_old(const char *dest, ai_journal_t j);
+int ai_merge_rollback_old(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts);
 /**
  * ai_merge_rollback_new
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  *
  * Rollback copying new files to the destination tree -- in other words,
  * remove the .new-suffixed temporary files.
@@ -201,11 +502,13 @@ int ai_merge_rollback_old(const char *dest, ai_journal_t j);
  *
  * Returns: 0 on success, errno otherwise
  */
-int ai_merge_rollback_new(const char *dest, ai_journal_t j);
+int ai_merge_rollback_new(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts);
 /**
  * ai_merge_rollback_replace
  * @dest: path to the destination tree
  * @j: an open journal
+ * @opts: the merge options, or %NULL
  *
  * Rollback started replacement process by restoring their backup copies.
  * The backup copies will be removed as well.
@@ -220,6 +523,486 @@ int ai_merge_rollback_new(const char *dest, ai_journal_t j);
  *
  * Returns: 0 on success, errno otherwise
  */
-int ai_merge_rollback_replace(const char *dest, ai_journal_t j);
+int ai_merge_rollback_replace(const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts);
+
+/**
+ * ai_merge_switch_prepare
+ * @source: path to the source tree
+ * @root: path to the versioned root
+ * @j: an open journal
+ * @opts: the merge options, or %NULL
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Prepare a merge into a versioned root. A versioned root is a directory
+ * owned completely by atomic-install, containing complete version trees
+ * and a 'current' symlink pointing to one of them.
+ *
+ * This function creates a new version tree named 'version-<prefix>' in @root.
+ * Files from the version 'current' points to are hardlinked into it (or copied
+ * if linking is not possible), then files from the source tree at @source
+ * are copied on top of them and files listed for removal are removed.
+ * Afterwards, the 'current' symlink is backed up for rollback.
+ *
+ * This function sets %AI_MERGE_VERSIONED_ROOT flag on journal, and then
+ * %AI_MERGE_COPIED_NEW and %AI_MERGE_BACKED_OLD_UP flags when done. It can be
+ * resumed by calling it again, or rolled back using ai_merge_switch_rollback().
+ *
+ * Journals created using ai_journal_create_layers() are not supported.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_switch_prepare(const char *source, const char *root,
+		ai_journal_t j, const ai_merge_options_t *opts,
+		ai_merge_progress_callback_t progress_callback);
+/**
+ * ai_merge_switch
+ * @root: path to the versioned root
+ * @j: an open journal
+ *
+ * Switch the 'current' symlink in @root to the version prepared using
+ * ai_merge_switch_prepare(). The switch is performed using a single rename,
+ * and thus takes constant time independently of the tree size.
+ *
+ * If the switch succeeds, the %AI_MERGE_REPLACED flag will be set on journal,
+ * and ai_merge_switch_cleanup() should be called afterwards. Otherwise,
+ * ai_merge_switch_rollback() should be used.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_switch(const char *root, ai_journal_t j);
+/**
+ * ai_merge_switch_cleanup
+ * @root: path to the versioned root
+ * @j: an open journal
+ *
+ * Remove the symlink backup, and the previous version tree if it resides
+ * directly in @root. This function can be used only after successful
+ * ai_merge_switch().
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_switch_cleanup(const char *root, ai_journal_t j);
+/**
+ * ai_merge_switch_rollback
+ * @root: path to the versioned root
+ * @j: an open journal
+ *
+ * Switch the 'current' symlink back to the previous version (or remove it if
+ * there was none), and remove the new version tree.
+ *
+ * This function can be called at any point before ai_merge_switch() succeeds.
+ * It sets %AI_MERGE_ROLLBACK_STARTED flag on journal -- which means that it is
+ * no longer possible to call any non-rollback functions after using it.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_switch_rollback(const char *root, ai_journal_t j);
+
+/**
+ * ai_merge_async_t
+ *
+ * The type describing an asynchronous merge.
+ */
+typedef struct ai_merge_async *ai_merge_async_t;
+
+/**
+ * ai_merge_async_flags_t
+ * @AI_MERGE_ASYNC_ROLLBACK: roll the merge back instead of proceeding
+ * @AI_MERGE_ASYNC_NO_REPLACE: stop after the files are copied and backed up;
+ *	the merge can be finished by starting it again
+ *
+ * Flags controlling ai_merge_async_start().
+ */
+typedef enum {
+	AI_MERGE_ASYNC_ROLLBACK = 1,
+	AI_MERGE_ASYNC_NO_REPLACE = 2
+} ai_merge_async_flags_t;
+
+/**
+ * ai_merge_phase_t
+ * @AI_MERGE_PHASE_NONE: no phase is running
+ * @AI_MERGE_PHASE_COPY_NEW: copying the new files, see ai_merge_copy_new()
+ * @AI_MERGE_PHASE_BACKUP_OLD: backing up the old files,
+ *	see ai_merge_backup_old()
+ * @AI_MERGE_PHASE_REPLACE: replacing the files, see ai_merge_replace()
+ * @AI_MERGE_PHASE_CLEANUP: removing the backups, see ai_merge_cleanup()
+ * @AI_MERGE_PHASE_ROLLBACK_REPLACE: restoring the old files,
+ *	see ai_merge_rollback_replace()
+ * @AI_MERGE_PHASE_ROLLBACK_OLD: removing the backups,
+ *	see ai_merge_rollback_old()
+ * @AI_MERGE_PHASE_ROLLBACK_NEW: removing the new files,
+ *	see ai_merge_rollback_new()
+ *
+ * An enumeration listing the phases of a merge, as reported by the asynchronous
+ * merge and the statistics.
+ */
+typedef enum {
+	AI_MERGE_PHASE_NONE,
+	AI_MERGE_PHASE_COPY_NEW,
+	AI_MERGE_PHASE_BACKUP_OLD,
+	AI_MERGE_PHASE_REPLACE,
+	AI_MERGE_PHASE_CLEANUP,
+	AI_MERGE_PHASE_ROLLBACK_REPLACE,
+	AI_MERGE_PHASE_ROLLBACK_OLD,
+	AI_MERGE_PHASE_ROLLBACK_NEW
+} ai_merge_phase_t;
+
+/**
+ * ai_merge_event_type_t
+ * @AI_MERGE_EVENT_PHASE: a new phase has been started
+ * @AI_MERGE_EVENT_PROGRESS: a new file has been copied, @path is set
+ * @AI_MERGE_EVENT_REMOVAL: a file from the old version has been processed
+ *	during cleanup, @path and @error are set like for
+ *	#ai_merge_removal_callback_t
+ * @AI_MERGE_EVENT_FAILED: the phase has failed with @error; failed replace
+ *	is followed by a rollback
+ * @AI_MERGE_EVENT_DONE: the merge has finished; @error is 0 if it has been
+ *	completed (or rolled back, if requested), errno otherwise
+ *
+ * An enumeration listing the asynchronous merge events.
+ */
+typedef enum {
+	AI_MERGE_EVENT_PHASE,
+	AI_MERGE_EVENT_PROGRESS,
+	AI_MERGE_EVENT_REMOVAL,
+	AI_MERGE_EVENT_FAILED,
+	AI_MERGE_EVENT_DONE
+} ai_merge_event_type_t;
+
+/**
+ * ai_merge_event_t
+ * @type: the event type
+ * @phase: the phase the event comes from
+ * @path: relative path to the file, or %NULL
+ * @error: result, in form of errno
+ *
+ * An event of an asynchronous merge.
+ */
+typedef struct {
+	ai_merge_event_type_t type;
+	ai_merge_phase_t phase;
+	const char *path;
+	int error;
+} ai_merge_event_t;
+
+/**
+ * ai_merge_async_start
+ * @source: path to the source tree
+ * @dest: path to the destination tree
+ * @j: an open journal
+ * @opts: the merge options, or %NULL; copied, but the pointers need to stay
+ *	valid
+ * @flags: a bitwise OR of #ai_merge_async_flags_t values
+ * @ret: location to store the new #ai_merge_async_t in
+ *
+ * Start an asynchronous merge of @source into @dest. No work is done until
+ * ai_merge_async_step() is called. The merge resumes from the phase recorded
+ * in the journal, and proceeds like the synchronous functions called in order
+ * would, including the rollback after failed replace. The phases are always
+ * run serially, whatever @opts->jobs is. Versioned roots are not supported.
+ *
+ * @source, @dest and @j need to stay valid until ai_merge_async_free().
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_async_start(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts, unsigned int flags,
+		ai_merge_async_t *ret);
+
+/**
+ * ai_merge_async_get_fd
+ * @a: the merge
+ *
+ * Get a file descriptor which polls readable as long as ai_merge_async_step()
+ * has work to do, or there are events waiting in the queue. It is meant
+ * to be added to the caller's event loop, and must not be read or closed.
+ *
+ * Returns: the file descriptor
+ */
+int ai_merge_async_get_fd(ai_merge_async_t a);
+
+/**
+ * ai_merge_async_step
+ * @a: the merge
+ * @max_entries: maximal number of journal entries to process
+ *
+ * Perform a bounded amount of work: process up to @max_entries journal
+ * entries, within a single phase. The results are reported as events.
+ *
+ * Returns: 1 if there is more work to do, 0 if the merge has finished
+ */
+int ai_merge_async_step(ai_merge_async_t a, unsigned int max_entries);
+
+/**
+ * ai_merge_async_get_event
+ * @a: the merge
+ * @ev: location to store the event in
+ *
+ * Take the oldest event from the queue. @ev->path stays valid until the next
+ * call.
+ *
+ * Returns: 1 if an event has been stored, 0 if the queue is empty
+ */
+int ai_merge_async_get_event(ai_merge_async_t a, ai_merge_event_t *ev);
+
+/**
+ * ai_merge_async_rollback
+ * @a: the merge
+ *
+ * Abort the running merge, and roll it back on the following steps.
+ *
+ * Returns: 0 on success, EINVAL if the files have been replaced already
+ */
+int ai_merge_async_rollback(ai_merge_async_t a);
+
+/**
+ * ai_merge_async_free
+ * @a: the merge
+ *
+ * Free the merge. If it has not finished, the phase in progress is abandoned,
+ * and the merge can be resumed (or rolled back) using the journal later.
+ */
+void ai_merge_async_free(ai_merge_async_t a);
+
+/**
+ * ai_merge_op_t
+ * @AI_MERGE_OP_STAT: lstat() and stat()
+ * @AI_MERGE_OP_COPY: copying (or linking) a new file or directory
+ * @AI_MERGE_OP_LINK: backing an old file up (usually a hardlink)
+ * @AI_MERGE_OP_MKDIR: creating the missing parent directories of a new file
+ * @AI_MERGE_OP_RENAME: rename() and moving files
+ * @AI_MERGE_OP_UNLINK: unlink() and remove()
+ * @AI_MERGE_OP_SYNC: committing the journal, with sync() and msync()
+ *
+ * An enumeration listing the filesystem operations timed by the statistics.
+ */
+typedef enum {
+	AI_MERGE_OP_STAT,
+	AI_MERGE_OP_COPY,
+	AI_MERGE_OP_LINK,
+	AI_MERGE_OP_MKDIR,
+	AI_MERGE_OP_RENAME,
+	AI_MERGE_OP_UNLINK,
+	AI_MERGE_OP_SYNC
+} ai_merge_op_t;
+
+/**
+ * AI_MERGE_OPS
+ *
+ * The number of #ai_merge_op_t values.
+ */
+#define AI_MERGE_OPS 7
+
+/**
+ * AI_MERGE_PHASES
+ *
+ * The number of #ai_merge_phase_t values.
+ */
+#define AI_MERGE_PHASES 8
+
+/**
+ * AI_MERGE_STATS_BUCKETS
+ *
+ * The number of latency histogram buckets. The bucket N counts
+ * the operations taking 2^N to 2^(N+1) microseconds (the first one, less than
+ * 2 microseconds, and the last one, anything longer).
+ */
+#define AI_MERGE_STATS_BUCKETS 24
+
+/**
+ * ai_merge_op_stats_t
+ * @count: number of operations performed
+ * @errors: number of operations which failed (including the expected
+ *	failures, e.g. ENOENT)
+ * @total_us: total time spent, in microseconds
+ * @max_us: the longest operation, in microseconds
+ * @histogram: the latency histogram, see %AI_MERGE_STATS_BUCKETS
+ *
+ * The statistics of a single filesystem operation type.
+ */
+typedef struct {
+	unsigned long long int count;
+	unsigned long long int errors;
+	unsigned long long int total_us;
+	unsigned long long int max_us;
+	unsigned long long int histogram[AI_MERGE_STATS_BUCKETS];
+} ai_merge_op_stats_t;
+
+/**
+ * ai_merge_stats_t
+ * @linked: number of new files hardlinked instead of copying
+ * @copied: number of new files whose contents were copied
+ * @renamed: number of files and staged subtrees renamed
+ * @bytes: number of bytes copied
+ * @ops: the operation statistics, indexed by #ai_merge_op_t
+ * @phase_us: the wall time of the phases, indexed by #ai_merge_phase_t,
+ *	in microseconds
+ *
+ * The statistics collected by the merge steps.
+ */
+typedef struct {
+	unsigned long int linked;
+	unsigned long int copied;
+	unsigned long int renamed;
+	unsigned long long int bytes;
+
+	ai_merge_op_stats_t ops[AI_MERGE_OPS];
+	unsigned long long int phase_us[AI_MERGE_PHASES];
+} ai_merge_stats_t;
+
+/**
+ * ai_merge_set_stats
+ * @stats: the statistics to add to, or %NULL
+ *
+ * Set the structure the merge steps add their statistics to, both
+ * the synchronous and the asynchronous ones. It is not cleared, so that
+ * the statistics can be collected over multiple steps or merges. All threads
+ * add to the same structure; it must not be read while a step is running.
+ *
+ * Timing the operations costs two clock reads each, so the default is %NULL,
+ * i.e. no statistics. The tight replace loop of ai_merge_replace_prepared()
+ * is not timed per operation, only its renames are counted.
+ */
+void ai_merge_set_stats(ai_merge_stats_t *stats);
+
+/**
+ * ai_merge_op_name
+ * @op: the operation
+ *
+ * Get a short name for @op, for reporting.
+ *
+ * Returns: a static string
+ */
+const char *ai_merge_op_name(ai_merge_op_t op);
+
+/**
+ * ai_merge_phase_name
+ * @phase: the phase
+ *
+ * Get a short name for @phase, for reporting.
+ *
+ * Returns: a static string
+ */
+const char *ai_merge_phase_name(ai_merge_phase_t phase);
+
+/**
+ * ai_merge_status_open
+ * @path: path to the status file
+ * @status: location to store the mapped status in
+ *
+ * Create (or truncate) the status file at @path, and map it into memory
+ * as an #ai_merge_status_t. When passed in #ai_merge_options_t, all merge
+ * steps update it as they proceed, so that it can be read by monitors at any
+ * rate, without any system calls in the merge. The versioned root switching is
+ * not reported.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_status_open(const char *path, ai_merge_status_t **status);
+/**
+ * ai_merge_status_close
+ * @status: the status returned by ai_merge_status_open(), or %NULL
+ *
+ * Unmap the status file, leaving the last status in it. It must not be used
+ * by a running merge anymore.
+ */
+void ai_merge_status_close(ai_merge_status_t *status);
+
+/**
+ * AI_MERGE_TRACE_MAGIC
+ *
+ * The magic string starting a trace file, including the null terminator.
+ */
+#define AI_MERGE_TRACE_MAGIC "AITRACE"
+
+/**
+ * AI_MERGE_TRACE_VERSION
+ *
+ * The version of the trace file format, changed whenever it changes.
+ */
+#define AI_MERGE_TRACE_VERSION 1
+
+/**
+ * ai_merge_trace_header_t
+ * @magic: %AI_MERGE_TRACE_MAGIC
+ * @version: %AI_MERGE_TRACE_VERSION
+ * @record_size: size of #ai_merge_trace_record_t
+ *
+ * The header of a trace file. It is followed by the per-thread buffers, each
+ * consisting of an #ai_merge_trace_ring_t and its records, up to the end
+ * of the file. All integers are native-endian.
+ */
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+} ai_merge_trace_header_t;
+
+/**
+ * ai_merge_trace_ring_t
+ * @thread: number of the buffer, each one used by a single thread at a time
+ * @records: number of records following, oldest first
+ * @total: number of records ever written to the buffer, including the ones
+ *	overwritten already
+ *
+ * The header of a single per-thread buffer in a trace file.
+ */
+typedef struct {
+	unsigned int thread;
+	unsigned int records;
+	unsigned long long int total;
+} ai_merge_trace_ring_t;
+
+/**
+ * ai_merge_trace_record_t
+ * @start_us: monotonic time the operation was started at, in microseconds
+ * @end_us: monotonic time the operation finished at, in microseconds
+ * @bytes: number of bytes copied by the operation
+ * @entry: index of the journal entry being processed, or (unsigned int) -1
+ *	outside of them (e.g. when committing the journal flags)
+ * @op: the #ai_merge_op_t
+ * @phase: the #ai_merge_phase_t
+ * @result: 0 on success, errno otherwise
+ *
+ * A single traced file operation.
+ */
+typedef struct {
+	unsigned long long int start_us;
+	unsigned long long int end_us;
+	unsigned long long int bytes;
+	unsigned int entry;
+	unsigned char op;
+	unsigned char phase;
+	short int result;
+} ai_merge_trace_record_t;
+
+/**
+ * ai_merge_set_trace
+ * @records: size of the per-thread buffers, in records, or 0
+ *
+ * Record the file operations performed by the merge steps (the same ones as
+ * counted in the statistics) in per-thread ring buffers, keeping the last
+ * @records of each thread. The buffers are allocated when each thread
+ * performs its first operation, and reused by the later threads.
+ *
+ * Passing 0 stops recording, keeping the buffers for ai_merge_trace_dump().
+ * The buffer size can't be changed once they have been allocated. The default
+ * is 0, i.e. no recording.
+ */
+void ai_merge_set_trace(unsigned int records);
+
+/**
+ * ai_merge_trace_dump
+ * @fd: the file descriptor to write to
+ *
+ * Write the recorded operations to @fd, in the trace file format (see
+ * #ai_merge_trace_header_t). The function only uses write(), so it can be
+ * called from a signal handler, even while the merge is running (the records
+ * being written at the moment may be inconsistent then).
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_merge_trace_dump(int fd);
 
 #endif /*_ATOMIC_INSTALL_MERGE_H*/
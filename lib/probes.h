@@ -0,0 +1,50 @@
+/* atomic-install -- USDT probe points
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_PROBES_H
+#define _ATOMIC_INSTALL_PROBES_H
+
+/*
+ * With --enable-sdt, the libraries contain USDT probes of the
+ * 'atomic_install' provider. They compile to a single nop each, so they cost
+ * nothing unless a tracer is attached. Without it, the macros expand to
+ * nothing.
+ *
+ * libai-copy probes:
+ *
+ * copy-strategy(source_dev, dest_dev, strategy): a new #ai_copy_strategy_t
+ * has been chosen for copying between the devices (like the strategy
+ * callback).
+ *
+ * copy-fallback(path, strategy, errno): @strategy failed for the file
+ * at @path, and another one is going to be tried. %AI_COPY_LINK stands for
+ * both link() and rename(), falling back to copying.
+ *
+ * libai-merge probes:
+ *
+ * phase-start(phase), phase-end(phase, result): a merge phase
+ * (#ai_merge_phase_t) has been started or finished.
+ *
+ * entry-start(path, name), entry-end(path, name, result): a single journal
+ * entry is processed by the running phase, in the calling thread.
+ *
+ * journal-flag(flag, result): a global journal flag has been committed.
+ */
+
+#ifdef HAVE_SDT
+#	include <sys/sdt.h>
+
+#	define AI_PROBE1(name, a) DTRACE_PROBE1(atomic_install, name, a)
+#	define AI_PROBE2(name, a, b) DTRACE_PROBE2(atomic_install, name, a, b)
+#	define AI_PROBE3(name, a, b, c) \
+		DTRACE_PROBE3(atomic_install, name, a, b, c)
+#else
+#	define AI_PROBE1(name, a) do { } while (0)
+#	define AI_PROBE2(name, a, b) do { } while (0)
+#	define AI_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /*_ATOMIC_INSTALL_PROBES_H*/
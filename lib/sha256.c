@@ -0,0 +1,148 @@
+/* atomic-install -- SHA-256 implementation
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "sha256.h"
+
+#include <string.h>
+
+/**
+ * ai_sha256_k
+ *
+ * The SHA-256 round constants.
+ */
+static const uint32_t ai_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define AI_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * ai_sha256_block
+ * @ctx: the context
+ * @p: a 64-byte input block
+ *
+ * Process a single input block.
+ */
+static void ai_sha256_block(ai_sha256_t *ctx, const unsigned char *p) {
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+			| (uint32_t) p[2] << 8 | p[3];
+	for (; i < 64; i++) {
+		const uint32_t s0 = AI_ROR(w[i - 15], 7) ^ AI_ROR(w[i - 15], 18)
+			^ (w[i - 15] >> 3);
+		const uint32_t s1 = AI_ROR(w[i - 2], 17) ^ AI_ROR(w[i - 2], 19)
+			^ (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (i = 0; i < 64; i++) {
+		const uint32_t t1 = h + (AI_ROR(e, 6) ^ AI_ROR(e, 11) ^ AI_ROR(e, 25))
+			+ ((e & f) ^ (~e & g)) + ai_sha256_k[i] + w[i];
+		const uint32_t t2 = (AI_ROR(a, 2) ^ AI_ROR(a, 13) ^ AI_ROR(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+void ai_sha256_init(ai_sha256_t *ctx) {
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->count = 0;
+}
+
+void ai_sha256_update(ai_sha256_t *ctx, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t used = ctx->count % 64;
+
+	ctx->count += len;
+
+	if (used) {
+		const size_t fill = 64 - used < len ? 64 - used : len;
+
+		memcpy(ctx->block + used, p, fill);
+		p += fill;
+		len -= fill;
+		if (used + fill < 64)
+			return;
+		ai_sha256_block(ctx, ctx->block);
+	}
+
+	for (; len >= 64; p += 64, len -= 64)
+		ai_sha256_block(ctx, p);
+
+	memcpy(ctx->block, p, len);
+}
+
+void ai_sha256_final(ai_sha256_t *ctx, char *out) {
+	static const char hex[] = "0123456789abcdef";
+	const uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count % 64;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		ai_sha256_block(ctx, ctx->block);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->block[56 + i] = bits >> (56 - i * 8);
+	ai_sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < 32; i++) {
+		const unsigned char byte = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+
+		out[i * 2] = hex[byte >> 4];
+		out[i * 2 + 1] = hex[byte & 0x0f];
+	}
+	out[AI_SHA256_HEXLEN] = 0;
+}
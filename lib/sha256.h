@@ -0,0 +1,64 @@
+/* atomic-install -- SHA-256 implementation
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_SHA256_H
+#define _ATOMIC_INSTALL_SHA256_H
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+/**
+ * AI_SHA256_HEXLEN
+ *
+ * Length of a hex-encoded SHA-256 digest, not including the null terminator.
+ */
+#define AI_SHA256_HEXLEN 64
+
+/**
+ * ai_sha256_t
+ * @state: hash state words
+ * @count: number of bytes hashed so far
+ * @block: partial input block
+ *
+ * The SHA-256 hashing context.
+ */
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char block[64];
+} ai_sha256_t;
+
+/**
+ * ai_sha256_init
+ * @ctx: the context
+ *
+ * Initialize the context for hashing a new message.
+ */
+void ai_sha256_init(ai_sha256_t *ctx);
+
+/**
+ * ai_sha256_update
+ * @ctx: the context
+ * @data: input data
+ * @len: length of @data
+ *
+ * Feed @len bytes of @data into the hash.
+ */
+void ai_sha256_update(ai_sha256_t *ctx, const void *data, size_t len);
+
+/**
+ * ai_sha256_final
+ * @ctx: the context
+ * @out: output buffer, at least %AI_SHA256_HEXLEN + 1 bytes long
+ *
+ * Finish hashing and write the null-terminated hex digest to @out.
+ */
+void ai_sha256_final(ai_sha256_t *ctx, char *out);
+
+#endif /*_ATOMIC_INSTALL_SHA256_H*/
@@ -0,0 +1,383 @@
+/* atomic-install -- content-addressed object store
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "copy.h"
+#include "sha256.h"
+#include "store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#ifdef HAVE_SYS_XATTR_H
+#	include <sys/xattr.h>
+#endif
+
+#ifndef AI_BUFSIZE
+#	define AI_BUFSIZE 65536
+#endif
+
+/**
+ * AI_STORE_NAMELEN
+ *
+ * Maximal length of an object name within the store directory.
+ */
+#define AI_STORE_NAMELEN (3 + AI_SHA256_HEXLEN + 96)
+
+/**
+ * ai_store
+ * @obj: object path buffer
+ * @base: content object path buffer
+ * @tmp: temporary file path buffer
+ * @pathlen: length of the store path (prefix of the buffers)
+ * @buf: %AI_BUFSIZE-long data buffer
+ * @disabled: set when the store can't be used for the destination
+ * @link: whether the installed files are hardlinked to the objects
+ *
+ * The object store state.
+ */
+struct ai_store {
+	char *obj;
+	char *base;
+	char *tmp;
+	size_t pathlen;
+
+	char *buf;
+	int disabled;
+	int link;
+};
+
+int ai_store_open(const char *path, ai_store_t *ret) {
+	struct ai_store *s;
+	struct stat st;
+	const size_t len = strlen(path);
+	const size_t bufsize = len + AI_STORE_NAMELEN + 1;
+
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return errno;
+	if (stat(path, &st))
+		return errno;
+	if (!S_ISDIR(st.st_mode))
+		return ENOTDIR;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		return errno;
+
+	s->obj = malloc(bufsize * 3 + AI_BUFSIZE);
+	if (!s->obj) {
+		free(s);
+		return errno;
+	}
+	s->base = s->obj + bufsize;
+	s->tmp = s->base + bufsize;
+	s->buf = s->tmp + bufsize;
+
+	memcpy(s->obj, path, len);
+	memcpy(s->base, path, len);
+	memcpy(s->tmp, path, len);
+	s->pathlen = len;
+	s->disabled = 0;
+	s->link = 0;
+
+	*ret = s;
+	return 0;
+}
+
+void ai_store_close(ai_store_t s) {
+	free(s->obj);
+	free(s);
+}
+
+void ai_store_set_link(ai_store_t s, int enable) {
+	s->link = enable;
+	/* reflinks may have been unsupported */
+	s->disabled = 0;
+}
+
+/**
+ * ai_store_hash
+ * @s: the store
+ * @path: file path
+ * @out: output buffer, at least %AI_SHA256_HEXLEN + 1 bytes long
+ *
+ * Hash the contents of file @path.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_store_hash(struct ai_store *s, const char *path, char *out) {
+	ai_sha256_t ctx;
+	ssize_t rd;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	ai_sha256_init(&ctx);
+	while ((rd = read(fd, s->buf, AI_BUFSIZE))) {
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = errno;
+			break;
+		}
+		ai_sha256_update(&ctx, s->buf, rd);
+	}
+	ai_sha256_final(&ctx, out);
+
+	close(fd);
+	return ret;
+}
+
+/**
+ * ai_store_names
+ * @s: the store
+ * @hash: hex digest of the file contents
+ * @st: the file attributes
+ *
+ * Fill the object, content object and temporary file path buffers for a file
+ * with contents @hash and attributes @st.
+ */
+static void ai_store_names(struct ai_store *s, const char *hash, const struct stat *st) {
+	snprintf(s->base + s->pathlen, AI_STORE_NAMELEN + 1, "/%.2s/%s", hash, hash);
+	snprintf(s->obj + s->pathlen, AI_STORE_NAMELEN + 1, "/%.2s/%s.%lo-%lu-%lu-%lld.%09ld",
+			hash, hash, (unsigned long int) (st->st_mode & 07777),
+			(unsigned long int) st->st_uid, (unsigned long int) st->st_gid,
+			(long long int) st->st_mtim.tv_sec, (long int) st->st_mtim.tv_nsec);
+	snprintf(s->tmp + s->pathlen, AI_STORE_NAMELEN + 1, "/%.2s/.%s.%ld",
+			hash, hash, (long int) getpid());
+}
+
+/**
+ * ai_store_valid
+ * @s: the store, with path buffers filled in by ai_store_names()
+ * @st: expected file attributes
+ * @hash: expected hex digest of the file contents
+ *
+ * Check whether the object exists and was not modified since it was added.
+ * An object linked to the installed files could have been modified through
+ * them while keeping its attributes, so its contents are hashed again.
+ *
+ * Returns: 1 if the object is valid, 0 otherwise
+ */
+static int ai_store_valid(struct ai_store *s, const struct stat *st,
+		const char *hash) {
+	char ohash[AI_SHA256_HEXLEN + 1];
+	struct stat ost;
+
+	if (lstat(s->obj, &ost) || !S_ISREG(ost.st_mode)
+			|| ost.st_size != st->st_size
+			|| ost.st_mtim.tv_sec != st->st_mtim.tv_sec
+			|| ost.st_mtim.tv_nsec != st->st_mtim.tv_nsec
+			|| ost.st_mode != st->st_mode
+			|| ost.st_uid != st->st_uid
+			|| ost.st_gid != st->st_gid)
+		return 0;
+
+	if (ost.st_nlink > 1 && (ai_store_hash(s, s->obj, ohash)
+				|| strcmp(ohash, hash)))
+		return 0;
+	return 1;
+}
+
+/**
+ * ai_store_has_xattrs
+ * @s: the store
+ * @path: file path
+ *
+ * Check whether file @path has extended attributes which would need to be
+ * preserved.
+ *
+ * Returns: 1 if it does, 0 otherwise
+ */
+static int ai_store_has_xattrs(struct ai_store *s, const char *path) {
+#if defined(HAVE_SYS_XATTR_H) && defined(HAVE_LLISTXATTR)
+	const ssize_t len = llistxattr(path, s->buf, AI_BUFSIZE);
+	const char *p;
+
+	if (len == -1)
+		return errno == ERANGE;
+
+	/* the SELinux label is assigned by policy, not copied */
+	for (p = s->buf; p < s->buf + len; p += strlen(p) + 1) {
+		if (strcmp(p, "security.selinux"))
+			return 1;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * ai_store_reflink
+ * @source: current file path
+ * @dest: new file path
+ *
+ * Create @dest as a reflink (a copy-on-write clone) of @source.
+ *
+ * Returns: 0 on success, errno on failure (ENOSYS if not supported)
+ */
+static int ai_store_reflink(const char *source, const char *dest) {
+#ifdef FICLONE
+	int fd_in, fd_out, ret = 0;
+
+	fd_in = open(source, O_RDONLY);
+	if (fd_in == -1)
+		return errno;
+
+	fd_out = open(dest, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd_out == -1) {
+		ret = errno;
+		close(fd_in);
+		return ret;
+	}
+
+	if (ioctl(fd_out, FICLONE, fd_in))
+		ret = errno;
+
+	if (close(fd_out) && !ret)
+		ret = errno;
+	close(fd_in);
+
+	if (ret)
+		unlink(dest);
+	return ret;
+#else
+	return ENOSYS;
+#endif
+}
+
+/**
+ * ai_store_add
+ * @s: the store, with path buffers filled in by ai_store_names()
+ * @c: the copying context
+ * @source: file to add
+ * @st: attributes of @source
+ *
+ * Add the object for file @source to the store, replacing the existing one
+ * if any. If the contents are known already, try to reflink them. Otherwise,
+ * copy the file and keep a private reflink of the contents for the future
+ * objects.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_store_add(struct ai_store *s, ai_copy_ctx_t c,
+		const char *source, const struct stat *st) {
+	struct stat bst;
+	char *slash = strrchr(s->obj, '/');
+	int ret;
+
+	*slash = 0;
+	ret = mkdir(s->obj, 0755) && errno != EEXIST ? errno : 0;
+	*slash = '/';
+	if (ret)
+		return ret;
+
+	if (!lstat(s->base, &bst) && bst.st_size == st->st_size
+			&& !ai_store_reflink(s->base, s->tmp))
+		ret = ai_cp_stat(s->tmp, st);
+	else
+		ret = ai_copy_ctx_cp_a(c, source, s->tmp);
+
+	if (!ret && rename(s->tmp, s->obj))
+		ret = errno;
+	if (ret) {
+		unlink(s->tmp);
+		return ret;
+	}
+
+	/* the content object is never linked out, so it can't get modified */
+	if (lstat(s->base, &bst) && errno == ENOENT
+			&& !ai_store_reflink(s->obj, s->tmp)) {
+		if (chmod(s->tmp, 0444) || rename(s->tmp, s->base))
+			unlink(s->tmp);
+	}
+
+	return 0;
+}
+
+int ai_store_cp(ai_store_t s, const char *source, const char *dest) {
+	return ai_store_ctx_cp(s, NULL, source, dest);
+}
+
+int ai_store_ctx_cp(ai_store_t s, ai_copy_ctx_t c, const char *source,
+		const char *dest) {
+	char hash[AI_SHA256_HEXLEN + 1];
+	struct stat st;
+	int ret;
+
+	if (s->disabled)
+		return ai_copy_ctx_cp_l(c, source, dest);
+
+	if (lstat(source, &st))
+		return errno;
+	if (!S_ISREG(st.st_mode) || ai_store_has_xattrs(s, source))
+		return ai_copy_ctx_cp_l(c, source, dest);
+
+	/* link() will not overwrite */
+	if (unlink(dest) && errno != ENOENT)
+		return errno;
+
+	/* on the same filesystem, the store is not necessary */
+	if (!link(source, dest))
+		return 0;
+	if (errno != EXDEV && errno != EACCES && errno != EPERM)
+		return errno;
+
+	ret = ai_store_hash(s, source, hash);
+	if (ret)
+		return ret;
+
+	ai_store_names(s, hash, &st);
+	if (!ai_store_valid(s, &st, hash))
+		ret = ai_store_add(s, c, source, &st);
+
+	if (!ret && s->link) {
+		if (link(s->obj, dest))
+			ret = errno;
+	} else if (!ret) {
+		/* a private copy sharing the data with the object */
+		ret = ai_store_reflink(s->obj, dest);
+		if (!ret) {
+			ret = ai_cp_stat(dest, &st);
+			if (ret)
+				unlink(dest);
+		} else if (ret == ENOSYS || ret == EINVAL
+#ifdef EOPNOTSUPP /* POSIX-2008 */
+				|| ret == EOPNOTSUPP
+#endif
+#ifdef ENOTSUP /* glibc */
+				|| ret == ENOTSUP
+#endif
+				)
+			/* no reflinks, the store is of no use then */
+			ret = EXDEV;
+	}
+
+	if (ret == EXDEV || ret == EMLINK || ret == EACCES || ret == EPERM) {
+		if (ret == EXDEV)
+			s->disabled = 1;
+		return ai_copy_ctx_cp_a(c, source, dest);
+	}
+
+	return ret;
+}
@@ -0,0 +1,116 @@
+/* atomic-install -- content-addressed object store
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_STORE_H
+#define _ATOMIC_INSTALL_STORE_H
+
+#include "copy.h"
+
+/**
+ * SECTION: store
+ * @short_description: Content-addressed object store for deduplicated copies
+ * @include: atomic-install/store.h
+ *
+ * The object store keeps copies of regular files in a local directory, indexed
+ * by the SHA-256 hash of their contents and by their attributes (permissions,
+ * ownership and mtime). When a file can't be hardlinked from the source, it is
+ * created as a reflink of a matching store object instead. The file contents
+ * are written only if no matching object exists yet. The store needs to be
+ * on the same filesystem as the destination tree, and the filesystem needs
+ * to support reflinks; otherwise, the files are copied as usual.
+ *
+ * The store also keeps a private copy of each content. Objects for a known
+ * content with different attributes are created as reflinks of it, without
+ * writing the data again.
+ *
+ * With ai_store_set_link(), the installed files are hardlinked to the store
+ * objects instead, and share their inodes. This works without reflinks, but
+ * modifying any of the installed files in place modifies all the others.
+ * The linked objects are hashed again before reuse, and are replaced if they
+ * were modified. Linked objects whose link count is 1 are no longer used,
+ * and can be removed.
+ *
+ * Files with extended attributes (other than security.selinux) are not stored,
+ * and are copied as usual.
+ */
+
+/**
+ * ai_store_t
+ *
+ * The type describing an open object store.
+ */
+typedef struct ai_store *ai_store_t;
+
+/**
+ * ai_store_open
+ * @path: path to the store directory
+ * @ret: location to store the new ai_store_t in
+ *
+ * Open the object store at @path. If the directory does not exist, it is
+ * created.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_store_open(const char *path, ai_store_t *ret);
+
+/**
+ * ai_store_close
+ * @s: an open store
+ *
+ * Close the object store and free the memory allocated for it.
+ */
+void ai_store_close(ai_store_t s);
+
+/**
+ * ai_store_set_link
+ * @s: an open store
+ * @enable: whether to hardlink the installed files to the objects
+ *
+ * Enable or disable sharing the store objects with the installed files using
+ * hardlinks. A single inode is then shared by all the files with the same
+ * contents and attributes, so an in-place modification of one of them
+ * (e.g. by a package's post-install script) affects all of them. It is meant
+ * for read-only trees, and the filesystems without reflink support.
+ *
+ * The default is to create private reflinks of the objects.
+ */
+void ai_store_set_link(ai_store_t s, int enable);
+
+/**
+ * ai_store_cp
+ * @s: an open store
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * The equivalent of ai_cp_l() using the object store @s. If @source can't be
+ * hardlinked to @dest, @dest is created as a reflink of a store object
+ * matching @source instead (or hardlinked to it, see ai_store_set_link()).
+ * If no matching object exists, it is added to the store first.
+ *
+ * If the store can't be used for @dest (e.g. it is on a different
+ * filesystem, or reflinks are not supported), the file is copied using
+ * ai_cp_a(), and the store is not used for the following files.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_store_cp(ai_store_t s, const char *source, const char *dest);
+
+/**
+ * ai_store_ctx_cp
+ * @s: an open store
+ * @c: the copying context, or %NULL for the default context
+ * @source: current file path
+ * @dest: new complete file path
+ *
+ * Copy the file like ai_store_cp() does, using the copying context @c
+ * for the copies.
+ *
+ * Returns: 0 on success, errno value on failure.
+ */
+int ai_store_ctx_cp(ai_store_t s, ai_copy_ctx_t c, const char *source,
+		const char *dest);
+
+#endif /*_ATOMIC_INSTALL_STORE_H*/
@@ -0,0 +1,1298 @@
+/* atomic-install -- tar archive support
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "copy.h"
+#include "journal.h"
+#include "merge.h"
+#include "tar.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(MAJOR_IN_MKDEV)
+#	include <sys/mkdev.h>
+#elif defined(MAJOR_IN_SYSMACROS)
+#	include <sys/sysmacros.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+/**
+ * AI_TAR_BLOCKSIZE
+ *
+ * The tar record block size.
+ */
+#define AI_TAR_BLOCKSIZE 512
+
+/**
+ * AI_TAR_SIZE_MAX
+ *
+ * The largest member size whose padded length still fits in off_t.
+ */
+#define AI_TAR_SIZE_MAX ((((((uintmax_t) 1 << (sizeof(off_t) * 8 - 2)) - 1) << 1) + 1) \
+		- (AI_TAR_BLOCKSIZE - 1))
+
+#ifndef AI_BUFSIZE
+#	define AI_BUFSIZE 65536
+#endif
+
+/**
+ * ai_tar
+ * @fd: archive file descriptor
+ * @seekable: whether @fd supports lseek()
+ * @filesize: archive file size (if @seekable)
+ * @buf: %AI_BUFSIZE-long data buffer
+ * @path: normalized path of the current member ('/'-prefixed)
+ * @pathsize: allocated size of @path
+ * @link: symlink target or normalized hardlink target of the current member
+ * @linksize: allocated size of @link
+ * @hardlink: whether the current member is a hardlink
+ * @st: attributes of the current member
+ * @left: bytes of data (including padding) left for the current member
+ * @xpath: pending path override (GNU longname or pax)
+ * @xlink: pending link target override (GNU longlink or pax)
+ * @xsize: pending pax size override, or -1
+ * @xmtime: pending pax mtime override (if @xmtime_set)
+ * @xmtime_set: whether @xmtime is set
+ * @xuid: pending pax uid override, or -1
+ * @xgid: pending pax gid override, or -1
+ *
+ * The tar archive reader state.
+ */
+struct ai_tar {
+	int fd;
+	int seekable;
+	off_t filesize;
+	char *buf;
+
+	char *path;
+	size_t pathsize;
+	char *link;
+	size_t linksize;
+	int hardlink;
+	struct stat st;
+	off_t left;
+
+	char *xpath;
+	char *xlink;
+	intmax_t xsize;
+	struct timespec xmtime;
+	int xmtime_set;
+	intmax_t xuid;
+	intmax_t xgid;
+};
+
+/**
+ * ai_tar_dest
+ * @dest: destination tree path
+ * @destlen: length of @dest
+ * @prefix: journal filename prefix
+ * @prefixlen: length of @prefix
+ * @buf: output path buffer
+ * @bufsize: allocated size of @buf
+ * @linkbuf: hardlink target path buffer
+ * @linkbufsize: allocated size of @linkbuf
+ *
+ * The destination tree state.
+ */
+struct ai_tar_dest {
+	const char *dest;
+	size_t destlen;
+	const char *prefix;
+	size_t prefixlen;
+
+	char *buf;
+	size_t bufsize;
+	char *linkbuf;
+	size_t linkbufsize;
+};
+
+/**
+ * ai_tar_init
+ * @t: the reader state to initialize
+ * @fd: archive file descriptor
+ *
+ * Initialize the tar reader reading from @fd.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_init(struct ai_tar *t, int fd) {
+	struct stat st;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = fd;
+	t->xsize = t->xuid = t->xgid = -1;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)
+			&& lseek(fd, 0, SEEK_CUR) != -1) {
+		t->seekable = 1;
+		t->filesize = st.st_size;
+	}
+
+	t->buf = malloc(AI_BUFSIZE);
+	if (!t->buf)
+		return errno;
+	return 0;
+}
+
+/**
+ * ai_tar_free
+ * @t: the reader state
+ *
+ * Free the memory allocated by the tar reader.
+ */
+static void ai_tar_free(struct ai_tar *t) {
+	free(t->buf);
+	free(t->path);
+	free(t->link);
+	free(t->xpath);
+	free(t->xlink);
+}
+
+/**
+ * ai_tar_read
+ * @t: the reader state
+ * @buf: output buffer
+ * @len: number of bytes to read
+ * @eof: location to store EOF flag in, or %NULL
+ *
+ * Read exactly @len bytes from the archive. If @eof is not %NULL and the archive
+ * ends before any byte is read, set *@eof to 1.
+ *
+ * Returns: 0 on success, errno on failure (EINVAL on unexpected EOF)
+ */
+static int ai_tar_read(struct ai_tar *t, char *buf, size_t len, int *eof) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rd = read(t->fd, buf + done, len - done);
+
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		} else if (rd == 0) {
+			if (eof && !done) {
+				*eof = 1;
+				return 0;
+			}
+			return EINVAL;
+		}
+
+		done += rd;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_tar_skip
+ * @t: the reader state
+ *
+ * Skip the remaining data of the current member.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_skip(struct ai_tar *t) {
+	off_t left = t->left;
+
+	t->left = 0;
+	if (t->seekable && left) {
+		off_t pos = lseek(t->fd, left, SEEK_CUR);
+
+		if (pos == -1)
+			return errno;
+		if (pos > t->filesize)
+			return EINVAL;
+		return 0;
+	}
+
+	while (left > 0) {
+		const size_t len = left > AI_BUFSIZE ? AI_BUFSIZE : left;
+		int ret = ai_tar_read(t, t->buf, len, NULL);
+
+		if (ret)
+			return ret;
+		left -= len;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_tar_number
+ * @field: numeric header field
+ * @len: field length
+ * @out: location to store the value in
+ *
+ * Parse a numeric tar header field, either octal or GNU base-256.
+ *
+ * Returns: 0 on success, EINVAL if the field is invalid
+ */
+static int ai_tar_number(const char *field, size_t len, uintmax_t *out) {
+	const unsigned char *p = (const unsigned char*) field;
+	uintmax_t v = 0;
+	size_t i = 0;
+
+	if (*p & 0x80) {
+		/* negative numbers are not useful here */
+		if (*p & 0x40)
+			return EINVAL;
+
+		v = *p & 0x3f;
+		for (i = 1; i < len; i++) {
+			if (v >> (sizeof(v) * 8 - 8))
+				return EINVAL;
+			v = (v << 8) | p[i];
+		}
+	} else {
+		while (i < len && p[i] == ' ')
+			i++;
+		for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+			v = (v << 3) | (p[i] - '0');
+		if (i < len && p[i] != ' ' && p[i] != 0)
+			return EINVAL;
+	}
+
+	*out = v;
+	return 0;
+}
+
+/**
+ * ai_tar_set_path
+ * @out: location of the output buffer
+ * @outsize: location of the output buffer size
+ * @name: the archive member name
+ * @len: length of @name
+ *
+ * Normalize the archive member name @name and store it in *@out, reallocating
+ * it if necessary. The resulting path is always prefixed with a slash, and has
+ * leading './' and trailing slashes removed. The root directory is stored as
+ * a single slash.
+ *
+ * Returns: 0 on success, errno on failure (EINVAL if @name contains '..' or
+ *	empty components)
+ */
+static int ai_tar_set_path(char **out, size_t *outsize, const char *name, size_t len) {
+	const char *p, *end;
+
+	while (len > 0) {
+		if (*name == '/') {
+			name++;
+			len--;
+		} else if (len >= 2 && name[0] == '.' && name[1] == '/') {
+			name += 2;
+			len -= 2;
+		} else if (len == 1 && name[0] == '.') {
+			name++;
+			len--;
+		} else
+			break;
+	}
+	while (len > 0 && name[len - 1] == '/')
+		len--;
+
+	/* refuse to write outside the destination */
+	for (p = name, end = name + len; p < end;) {
+		const char *slash = memchr(p, '/', end - p);
+		const size_t clen = (slash ? slash : end) - p;
+
+		if (clen == 0 || (clen == 1 && p[0] == '.')
+				|| (clen == 2 && p[0] == '.' && p[1] == '.'))
+			return EINVAL;
+		if (!slash)
+			break;
+		p = slash + 1;
+	}
+
+	if (*outsize < len + 2) {
+		char *newbuf = realloc(*out, len + 2);
+
+		if (!newbuf)
+			return errno;
+		*out = newbuf;
+		*outsize = len + 2;
+	}
+
+	(*out)[0] = '/';
+	memcpy(*out + 1, name, len);
+	(*out)[len + 1] = 0;
+	return 0;
+}
+
+/**
+ * ai_tar_set_link
+ * @t: the reader state
+ * @name: the link target
+ * @len: length of @name
+ *
+ * Store the symlink target @name for the current member.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_set_link(struct ai_tar *t, const char *name, size_t len) {
+	if (t->linksize < len + 1) {
+		char *newbuf = realloc(t->link, len + 1);
+
+		if (!newbuf)
+			return errno;
+		t->link = newbuf;
+		t->linksize = len + 1;
+	}
+
+	memcpy(t->link, name, len);
+	t->link[len] = 0;
+	return 0;
+}
+
+/**
+ * ai_tar_read_meta
+ * @t: the reader state
+ * @size: data size
+ * @out: location to store the newly-allocated data in
+ *
+ * Read the data of a metadata member (GNU longname/longlink, pax header)
+ * into a newly-allocated, null-terminated buffer. Skip the padding.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_read_meta(struct ai_tar *t, uintmax_t size, char **out) {
+	int ret;
+
+	/* the contents are kept in memory, so be reasonable */
+	if (size > 1024 * 1024)
+		return EINVAL;
+
+	free(*out);
+	*out = malloc(size + 1);
+	if (!*out)
+		return errno;
+
+	ret = ai_tar_read(t, *out, size, NULL);
+	if (ret)
+		return ret;
+	(*out)[size] = 0;
+
+	t->left -= size;
+	return ai_tar_skip(t);
+}
+
+/**
+ * ai_tar_pax_number
+ * @val: the pax record value
+ * @max: the largest allowed value
+ * @out: location to store the value in
+ *
+ * Parse a non-negative decimal pax record value.
+ *
+ * Returns: 0 on success, EINVAL if the value is invalid or larger than @max
+ */
+static int ai_tar_pax_number(const char *val, uintmax_t max, uintmax_t *out) {
+	uintmax_t v = 0;
+
+	if (!*val)
+		return EINVAL;
+	for (; *val; val++) {
+		const unsigned int d = *val - '0';
+
+		if (*val < '0' || *val > '9' || v > (max - d) / 10)
+			return EINVAL;
+		v = v * 10 + d;
+	}
+
+	*out = v;
+	return 0;
+}
+
+/**
+ * ai_tar_pax
+ * @t: the reader state
+ * @data: the pax extended header data (null-terminated)
+ * @len: length of @data
+ *
+ * Parse the pax extended header records, and store the overrides
+ * for the following member.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_pax(struct ai_tar *t, char *data, size_t len) {
+	char *p = data;
+	char *const end = data + len;
+
+	while (p < end) {
+		char *sp, *key, *val, *eq, *rend;
+		unsigned long int rlen = strtoul(p, &sp, 10);
+
+		if (sp == p || *sp != ' ' || rlen > (unsigned long int) (end - p)
+				|| p + rlen <= sp + 1)
+			return EINVAL;
+
+		rend = p + rlen - 1;
+		if (*rend != '\n')
+			return EINVAL;
+		*rend = 0;
+
+		key = sp + 1;
+		eq = strchr(key, '=');
+		if (!eq)
+			return EINVAL;
+		*eq = 0;
+		val = eq + 1;
+
+		if (!strcmp(key, "path") || !strcmp(key, "linkpath")) {
+			char **x = key[0] == 'p' ? &t->xpath : &t->xlink;
+
+			free(*x);
+			*x = strdup(val);
+			if (!*x)
+				return errno;
+		} else if (!strcmp(key, "size") || !strcmp(key, "uid")
+				|| !strcmp(key, "gid")) {
+			intmax_t *x = key[0] == 's' ? &t->xsize
+				: key[0] == 'u' ? &t->xuid : &t->xgid;
+			uintmax_t v;
+
+			if (ai_tar_pax_number(val, key[0] == 's' ? AI_TAR_SIZE_MAX
+						: (uintmax_t) INTMAX_MAX, &v))
+				return EINVAL;
+			*x = v;
+		} else if (!strcmp(key, "mtime")) {
+			char *frac;
+
+			t->xmtime.tv_sec = strtoll(val, &frac, 10);
+			t->xmtime.tv_nsec = 0;
+			if (*frac == '.') {
+				long int mult = 100000000;
+
+				for (frac++; *frac >= '0' && *frac <= '9' && mult; frac++) {
+					t->xmtime.tv_nsec += (*frac - '0') * mult;
+					mult /= 10;
+				}
+			}
+			t->xmtime_set = 1;
+		}
+
+		p = rend + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_tar_next
+ * @t: the reader state
+ * @eof: location to store EOF flag in
+ *
+ * Skip the remaining data of the current member and read the header of the next
+ * one. Handle metadata members transparently. Skip the root directory entry.
+ *
+ * If the end of archive is reached, *@eof is set to 1.
+ *
+ * Returns: 0 on success, errno on failure (EINVAL if the archive is invalid)
+ */
+static int ai_tar_next(struct ai_tar *t, int *eof) {
+	char hdr[AI_TAR_BLOCKSIZE];
+
+	*eof = 0;
+
+	while (1) {
+		uintmax_t size, mode, uid, gid, mtime, chksum, major, minor;
+		unsigned long int sum = 0;
+		long int ssum = 0;
+		int i, ret;
+
+		ret = ai_tar_skip(t);
+		if (ret)
+			return ret;
+		ret = ai_tar_read(t, hdr, sizeof(hdr), eof);
+		if (ret || *eof)
+			return ret;
+
+		for (i = 0; i < AI_TAR_BLOCKSIZE; i++) {
+			const char c = (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+			sum += (unsigned char) c;
+			ssum += (signed char) c;
+		}
+
+		/* zero block terminates the archive */
+		if (sum == 8 * ' ') {
+			*eof = 1;
+			return 0;
+		}
+
+		if (ai_tar_number(hdr + 148, 8, &chksum)
+				|| (chksum != sum && chksum != (unsigned long int) ssum)
+				|| ai_tar_number(hdr + 124, 12, &size)
+				|| ai_tar_number(hdr + 100, 8, &mode)
+				|| ai_tar_number(hdr + 108, 8, &uid)
+				|| ai_tar_number(hdr + 116, 8, &gid)
+				|| ai_tar_number(hdr + 136, 12, &mtime)
+				|| ai_tar_number(hdr + 329, 8, &major)
+				|| ai_tar_number(hdr + 337, 8, &minor))
+			return EINVAL;
+
+		if (t->xsize != -1)
+			size = t->xsize;
+		/* the padded size must fit in off_t */
+		if (size > AI_TAR_SIZE_MAX)
+			return EINVAL;
+		t->left = (size + AI_TAR_BLOCKSIZE - 1) & ~((uintmax_t) AI_TAR_BLOCKSIZE - 1);
+
+		switch (hdr[156]) {
+			case 'L':
+				ret = ai_tar_read_meta(t, size, &t->xpath);
+				if (ret)
+					return ret;
+				continue;
+			case 'K':
+				ret = ai_tar_read_meta(t, size, &t->xlink);
+				if (ret)
+					return ret;
+				continue;
+			case 'x':
+				{
+					char *data = NULL;
+
+					ret = ai_tar_read_meta(t, size, &data);
+					if (!ret)
+						ret = ai_tar_pax(t, data, size);
+					free(data);
+					if (ret)
+						return ret;
+					/* size applies to the next member */
+					continue;
+				}
+			case 'g':
+				continue;
+		}
+
+		memset(&t->st, 0, sizeof(t->st));
+		t->hardlink = 0;
+		switch (hdr[156]) {
+			case '0':
+			case '\0':
+			case '7':
+				t->st.st_mode = S_IFREG;
+				break;
+			case '1':
+				t->st.st_mode = S_IFREG;
+				t->hardlink = 1;
+				break;
+			case '2':
+				t->st.st_mode = S_IFLNK;
+				break;
+			case '3':
+				t->st.st_mode = S_IFCHR;
+				break;
+			case '4':
+				t->st.st_mode = S_IFBLK;
+				break;
+			case '5':
+				t->st.st_mode = S_IFDIR;
+				break;
+			case '6':
+				t->st.st_mode = S_IFIFO;
+				break;
+			default:
+				return EINVAL;
+		}
+
+		t->st.st_mode |= mode & 07777;
+		t->st.st_uid = t->xuid != -1 ? t->xuid : uid;
+		t->st.st_gid = t->xgid != -1 ? t->xgid : gid;
+		t->st.st_size = size;
+		t->st.st_rdev = makedev(major, minor);
+		if (t->xmtime_set)
+			t->st.st_mtim = t->xmtime;
+		else
+			t->st.st_mtim.tv_sec = mtime;
+		t->st.st_atim = t->st.st_mtim;
+
+		if (t->xpath)
+			ret = ai_tar_set_path(&t->path, &t->pathsize, t->xpath, strlen(t->xpath));
+		else if (!memcmp(hdr + 257, "ustar", 6) && hdr[345]) {
+			char name[155 + 1 + 100];
+			const size_t plen = strnlen(hdr + 345, 155);
+			const size_t nlen = strnlen(hdr, 100);
+
+			memcpy(name, hdr + 345, plen);
+			name[plen] = '/';
+			memcpy(name + plen + 1, hdr, nlen);
+			ret = ai_tar_set_path(&t->path, &t->pathsize, name, plen + 1 + nlen);
+		} else
+			ret = ai_tar_set_path(&t->path, &t->pathsize, hdr, strnlen(hdr, 100));
+
+		if (!ret) {
+			const char *link = t->xlink ? t->xlink : hdr + 157;
+			const size_t len = t->xlink ? strlen(t->xlink) : strnlen(hdr + 157, 100);
+
+			if (t->hardlink)
+				ret = ai_tar_set_path(&t->link, &t->linksize, link, len);
+			else if (S_ISLNK(t->st.st_mode))
+				ret = ai_tar_set_link(t, link, len);
+		}
+
+		free(t->xpath);
+		free(t->xlink);
+		t->xpath = t->xlink = NULL;
+		t->xsize = t->xuid = t->xgid = -1;
+		t->xmtime_set = 0;
+
+		if (ret)
+			return ret;
+
+		/* the root directory is not merged */
+		if (t->path[1])
+			return 0;
+		if (!S_ISDIR(t->st.st_mode))
+			return EINVAL;
+	}
+}
+
+/**
+ * ai_tar_dest_init
+ * @d: the destination state to initialize
+ * @dest: destination tree path
+ * @j: the journal
+ *
+ * Initialize the destination tree state.
+ */
+static void ai_tar_dest_init(struct ai_tar_dest *d, const char *dest, ai_journal_t j) {
+	memset(d, 0, sizeof(*d));
+	d->dest = dest;
+	d->destlen = strlen(dest);
+	d->prefix = ai_journal_get_filename_prefix(j);
+	d->prefixlen = strlen(d->prefix);
+}
+
+/**
+ * ai_tar_dest_free
+ * @d: the destination state
+ *
+ * Free the memory allocated for the destination tree state.
+ */
+static void ai_tar_dest_free(struct ai_tar_dest *d) {
+	free(d->buf);
+	free(d->linkbuf);
+}
+
+/**
+ * ai_tar_dest_path
+ * @d: the destination state
+ * @buf: location of the output buffer
+ * @bufsize: location of the output buffer size
+ * @path: normalized member path
+ * @tmp: whether to use the temporary .new name
+ *
+ * Build the destination path for the archive member @path in *@buf,
+ * reallocating it if necessary.
+ *
+ * Returns: the output buffer, or %NULL on failure (with errno set)
+ */
+static char *ai_tar_dest_path(struct ai_tar_dest *d, char **buf, size_t *bufsize,
+		const char *path, int tmp) {
+	const size_t len = d->destlen + strlen(path) + d->prefixlen + 7;
+	const char *name;
+	char *p;
+
+	if (*bufsize < len) {
+		char *newbuf = realloc(*buf, len);
+
+		if (!newbuf)
+			return NULL;
+		*buf = newbuf;
+		*bufsize = len;
+	}
+
+	p = *buf;
+	memcpy(p, d->dest, d->destlen);
+	p += d->destlen;
+
+	if (!tmp) {
+		strcpy(p, path);
+		return *buf;
+	}
+
+	name = strrchr(path, '/') + 1;
+	memcpy(p, path, name - path);
+	p += name - path;
+	sprintf(p, ".%s~%s.new", d->prefix, name);
+	return *buf;
+}
+
+/**
+ * ai_tar_mkdirs
+ * @path: destination path (writable)
+ * @rootlen: length of the destination tree path
+ *
+ * Create the missing parent directories of @path, below the destination tree.
+ * The directories are created with default permissions.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_mkdirs(char *path, size_t rootlen) {
+	char *p = path + rootlen;
+
+	while ((p = strchr(p + 1, '/'))) {
+		int ret = 0;
+
+		*p = 0;
+		if (mkdir(path, 0755) && errno != EEXIST)
+			ret = errno;
+		*p = '/';
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_tar_write
+ * @t: the reader state
+ * @path: destination file path
+ *
+ * Write the data of the current (regular file) member to a new file at @path.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_write(struct ai_tar *t, const char *path) {
+	off_t left = t->st.st_size;
+	int fd, ret = 0;
+
+	/* don't care about perms, will have to chmod anyway */
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	if (fd == -1)
+		return errno;
+
+#ifdef HAVE_POSIX_FALLOCATE
+	if (left != 0)
+		ret = posix_fallocate(fd, 0, left);
+#endif
+
+	while (!ret && left > 0) {
+		const size_t len = left > AI_BUFSIZE ? AI_BUFSIZE : left;
+		const char *bufp = t->buf;
+		size_t wleft = len;
+
+		ret = ai_tar_read(t, t->buf, len, NULL);
+		while (!ret && wleft > 0) {
+			ssize_t wr = write(fd, bufp, wleft);
+
+			if (wr == -1) {
+				if (errno != EINTR)
+					ret = errno;
+			} else {
+				wleft -= wr;
+				bufp += wr;
+			}
+		}
+
+		left -= len;
+		t->left -= len;
+	}
+
+	if (close(fd) && !ret)
+		ret = errno;
+
+	return ret;
+}
+
+/**
+ * ai_tar_create
+ * @t: the reader state
+ * @d: the destination state
+ * @path: destination path
+ *
+ * Create the current member at @path.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_create(struct ai_tar *t, struct ai_tar_dest *d, const char *path) {
+	const mode_t mode = t->st.st_mode;
+
+	/* ensure to remove destination file before proceeding;
+	 * otherwise, we could rewrite hardlinked file */
+	if (!S_ISDIR(mode) && unlink(path) && errno != ENOENT)
+		return errno;
+
+	if (t->hardlink) {
+		/* the target has been merged already, so link the new copy */
+		const char *target = ai_tar_dest_path(d, &d->linkbuf,
+				&d->linkbufsize, t->link, 1);
+
+		if (!target || link(target, path))
+			return errno;
+		return 0;
+	} else if (S_ISREG(mode))
+		return ai_tar_write(t, path);
+	else if (S_ISDIR(mode)) {
+		if (mkdir(path, mode & ~S_IFMT) && errno != EEXIST)
+			return errno;
+	} else if (S_ISLNK(mode)) {
+		if (symlink(t->link, path))
+			return errno;
+	} else if (S_ISFIFO(mode)) {
+		if (mkfifo(path, mode & ~S_IFMT))
+			return errno;
+	} else if (mknod(path, mode, t->st.st_rdev))
+		return errno;
+
+	return 0;
+}
+
+/**
+ * ai_tar_extract
+ * @t: the reader state
+ * @d: the destination state
+ *
+ * Write the current member to the destination tree. Directories are created
+ * with their final names, other files using temporary .new names.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_extract(struct ai_tar *t, struct ai_tar_dest *d) {
+	char *path;
+	int ret;
+
+	path = ai_tar_dest_path(d, &d->buf, &d->bufsize, t->path,
+			!S_ISDIR(t->st.st_mode));
+	if (!path)
+		return errno;
+
+	ret = ai_tar_create(t, d, path);
+	if (ret == ENOENT) {
+		/* parent directories not listed in the archive */
+		ret = ai_tar_mkdirs(path, d->destlen);
+		if (!ret)
+			ret = ai_tar_create(t, d, path);
+	}
+
+	if (!ret && !t->hardlink)
+		ret = ai_cp_stat(path, &t->st);
+
+	return ret;
+}
+
+/**
+ * ai_tar_emit_func_t
+ * @data: callback data
+ * @path: normalized member path
+ * @is_dir: whether the member is a directory
+ *
+ * The type of a function called for archive members, in the journal order.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+typedef int (*ai_tar_emit_func_t)(void *data, const char *path, int is_dir);
+
+/**
+ * ai_tar_dirs
+ * @buf: path of the innermost open directory
+ * @bufsize: allocated size of @buf
+ * @lens: path lengths of the open directories, outermost first
+ * @count: number of open directories
+ * @alloc: allocated size of @lens
+ *
+ * The stack of directories whose entries are postponed until all the members
+ * inside them are processed. Archives list directories before their contents,
+ * while the journal lists them afterwards (like ai_journal_create() does).
+ */
+struct ai_tar_dirs {
+	char *buf;
+	size_t bufsize;
+	size_t *lens;
+	size_t count;
+	size_t alloc;
+};
+
+/**
+ * ai_tar_dirs_pop
+ * @s: the directory stack
+ * @path: the member path, or %NULL to pop all directories
+ * @emit: function to call for popped directories
+ * @data: data for @emit
+ *
+ * Pop all directories which do not contain @path from the stack.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_dirs_pop(struct ai_tar_dirs *s, const char *path,
+		ai_tar_emit_func_t emit, void *data) {
+	while (s->count) {
+		const size_t len = s->lens[s->count - 1];
+		int ret;
+
+		if (path && !strncmp(path, s->buf, len) && path[len] == '/')
+			break;
+
+		s->buf[len] = 0;
+		ret = emit(data, s->buf, 1);
+		if (ret)
+			return ret;
+		s->count--;
+	}
+
+	return 0;
+}
+
+/**
+ * ai_tar_dirs_push
+ * @s: the directory stack
+ * @path: the directory path
+ *
+ * Push the directory @path onto the stack. It needs to be inside the current
+ * innermost directory.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_dirs_push(struct ai_tar_dirs *s, const char *path) {
+	const size_t len = strlen(path);
+
+	if (s->bufsize < len + 1) {
+		char *newbuf = realloc(s->buf, len + 1);
+
+		if (!newbuf)
+			return errno;
+		s->buf = newbuf;
+		s->bufsize = len + 1;
+	}
+
+	if (s->count == s->alloc) {
+		const size_t newalloc = s->alloc ? s->alloc * 2 : 16;
+		size_t *newlens = realloc(s->lens, newalloc * sizeof(*newlens));
+
+		if (!newlens)
+			return errno;
+		s->lens = newlens;
+		s->alloc = newalloc;
+	}
+
+	memcpy(s->buf, path, len + 1);
+	s->lens[s->count++] = len;
+	return 0;
+}
+
+/**
+ * ai_tar_walk
+ * @t: the reader state
+ * @d: the destination state, or %NULL to not extract
+ * @progress_callback: callback function for progress reporting, or %NULL
+ * @emit: function to call for members, in the journal order
+ * @data: data for @emit
+ *
+ * Read all the archive members, extracting them to the destination tree if @d
+ * is not %NULL. Call @emit for them in the journal order.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_walk(struct ai_tar *t, struct ai_tar_dest *d,
+		ai_merge_progress_callback_t progress_callback,
+		ai_tar_emit_func_t emit, void *data) {
+	struct ai_tar_dirs s;
+	int ret = 0, eof;
+
+	memset(&s, 0, sizeof(s));
+
+	while (!ret) {
+		ret = ai_tar_next(t, &eof);
+		if (ret || eof)
+			break;
+
+		ret = ai_tar_dirs_pop(&s, t->path, emit, data);
+		if (!ret && d) {
+			if (progress_callback)
+				progress_callback(t->path, 0, 0);
+			ret = ai_tar_extract(t, d);
+		}
+
+		if (ret)
+			break;
+		else if (S_ISDIR(t->st.st_mode))
+			ret = ai_tar_dirs_push(&s, t->path);
+		else
+			ret = emit(data, t->path, 0);
+	}
+
+	if (!ret)
+		ret = ai_tar_dirs_pop(&s, NULL, emit, data);
+
+	free(s.buf);
+	free(s.lens);
+	return ret;
+}
+
+/**
+ * ai_tar_list
+ * @buf: the entries, each one a type byte followed by the null-terminated path
+ * @len: used length of @buf
+ * @bufsize: allocated size of @buf
+ * @offsets: offsets of the entries in @buf
+ * @count: number of entries
+ * @alloc: allocated size of @offsets
+ *
+ * The archive members in the journal order, collected in order to drop
+ * the duplicates before they are emitted.
+ */
+struct ai_tar_list {
+	char *buf;
+	size_t len;
+	size_t bufsize;
+	size_t *offsets;
+	size_t count;
+	size_t alloc;
+};
+
+/**
+ * ai_tar_emit_list
+ * @data: the member list
+ * @path: normalized member path
+ * @is_dir: whether the member is a directory
+ *
+ * Append the member to the list.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_emit_list(void *data, const char *path, int is_dir) {
+	struct ai_tar_list *l = data;
+	const size_t len = strlen(path) + 2;
+
+	if (l->bufsize < l->len + len) {
+		size_t newsize = l->bufsize ? l->bufsize : AI_BUFSIZE;
+		char *newbuf;
+
+		while (newsize < l->len + len)
+			newsize *= 2;
+		newbuf = realloc(l->buf, newsize);
+		if (!newbuf)
+			return errno;
+		l->buf = newbuf;
+		l->bufsize = newsize;
+	}
+
+	if (l->count == l->alloc) {
+		const size_t newalloc = l->alloc ? l->alloc * 2 : 256;
+		size_t *newoffsets = realloc(l->offsets, newalloc * sizeof(*newoffsets));
+
+		if (!newoffsets)
+			return errno;
+		l->offsets = newoffsets;
+		l->alloc = newalloc;
+	}
+
+	l->offsets[l->count++] = l->len;
+	l->buf[l->len] = is_dir ? 'd' : 'f';
+	memcpy(l->buf + l->len + 1, path, len - 1);
+	l->len += len;
+	return 0;
+}
+
+/**
+ * ai_tar_list_emit
+ * @l: the member list
+ * @emit: function to call for members
+ * @data: data for @emit
+ *
+ * Call @emit for the listed members, in order. If a member occurs multiple
+ * times in the archive, only its last occurrence is used (like tar extracts
+ * it), so that directories still follow all their contents. A member changing
+ * its type between a directory and a non-directory is rejected, as the earlier
+ * one has been extracted already.
+ *
+ * Returns: 0 on success, EINVAL if a duplicate member changes its type,
+ *	errno on failure
+ */
+static int ai_tar_list_emit(struct ai_tar_list *l, ai_tar_emit_func_t emit,
+		void *data) {
+	const char **set;
+	size_t mask, i;
+	int ret = 0;
+
+	for (mask = 16; mask < l->count * 2; mask <<= 1);
+	set = calloc(mask, sizeof(*set));
+	if (!set)
+		return errno;
+	mask--;
+
+	for (i = l->count; i > 0 && !ret; i--) {
+		char *e = l->buf + l->offsets[i - 1];
+		const char *p;
+		uint32_t h = 2166136261U;
+
+		for (p = e + 1; *p; p++)
+			h = (h ^ (unsigned char) *p) * 16777619U;
+
+		for (h &= mask; set[h]; h = (h + 1) & mask) {
+			if (!strcmp(set[h] + 1, e + 1))
+				break;
+		}
+
+		if (!set[h])
+			set[h] = e;
+		else if (*set[h] != *e)
+			ret = EINVAL;
+		else /* overridden by a later occurrence */
+			*e = 0;
+	}
+	free(set);
+
+	for (i = 0; i < l->count && !ret; i++) {
+		const char *e = l->buf + l->offsets[i];
+
+		if (*e)
+			ret = emit(data, e + 1, *e == 'd');
+	}
+
+	return ret;
+}
+
+/**
+ * ai_tar_emit_journal
+ * @data: the journal being created
+ * @path: normalized member path
+ * @is_dir: whether the member is a directory
+ *
+ * Append the member to the journal.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_emit_journal(void *data, const char *path, int is_dir) {
+	return ai_journal_create_append(data, path, is_dir ? AI_MERGE_FILE_DIR : 0);
+}
+
+/**
+ * ai_tar_emit_match
+ * @data: location of the current journal entry pointer
+ * @path: normalized member path
+ * @is_dir: whether the member is a directory
+ *
+ * Check whether the current journal entry refers to the member, and advance
+ * to the next entry.
+ *
+ * Returns: 0 if it does, EINVAL otherwise
+ */
+static int ai_tar_emit_match(void *data, const char *path, int is_dir) {
+	ai_journal_file_t **pp = data;
+	const char *jpath;
+	size_t len;
+
+	if (!*pp || (ai_journal_file_flags(*pp) & AI_MERGE_FILE_REMOVE))
+		return EINVAL;
+
+	jpath = ai_journal_file_path(*pp);
+	len = strlen(jpath);
+	if (strncmp(path, jpath, len) || strcmp(path + len, ai_journal_file_name(*pp)))
+		return EINVAL;
+
+	*pp = ai_journal_file_next(*pp);
+	return 0;
+}
+
+/**
+ * ai_tar_journal_run
+ * @j: journal being created
+ * @fd: archive file descriptor
+ * @dest: destination tree path, or %NULL to not extract
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Append the archive members to the journal, extracting them if @dest is not
+ * %NULL.
+ *
+ * Returns: 0 on success, errno on failure
+ */
+static int ai_tar_journal_run(ai_journal_t j, int fd, const char *dest,
+		ai_merge_progress_callback_t progress_callback) {
+	struct ai_tar t;
+	struct ai_tar_dest d;
+	struct ai_tar_list l;
+	int ret;
+
+	memset(&l, 0, sizeof(l));
+	ret = ai_tar_init(&t, fd);
+	if (!ret) {
+		if (dest)
+			ai_tar_dest_init(&d, dest, j);
+		ret = ai_tar_walk(&t, dest ? &d : NULL, progress_callback,
+				ai_tar_emit_list, &l);
+		if (dest)
+			ai_tar_dest_free(&d);
+	}
+	if (!ret)
+		ret = ai_tar_list_emit(&l, ai_tar_emit_journal, j);
+
+	ai_tar_free(&t);
+	free(l.buf);
+	free(l.offsets);
+	return ret;
+}
+
+int ai_tar_journal_append(ai_journal_t j, int fd) {
+	return ai_tar_journal_run(j, fd, NULL, NULL);
+}
+
+int ai_tar_journal_copy(ai_journal_t j, int fd, const char *dest,
+		ai_merge_progress_callback_t progress_callback) {
+	return ai_tar_journal_run(j, fd, dest, progress_callback);
+}
+
+int ai_tar_copy_new(int fd, const char *dest, ai_journal_t j,
+		ai_merge_progress_callback_t progress_callback) {
+	struct ai_tar t;
+	struct ai_tar_dest d;
+	struct ai_tar_list l;
+	ai_journal_file_t *pp;
+	int ret;
+
+	if (ai_journal_get_flags(j) & (AI_MERGE_COPIED_NEW | AI_MERGE_ROLLBACK_STARTED))
+		return EINVAL;
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return errno;
+
+	memset(&l, 0, sizeof(l));
+	ret = ai_tar_init(&t, fd);
+	if (!ret) {
+		ai_tar_dest_init(&d, dest, j);
+		ret = ai_tar_walk(&t, &d, progress_callback, ai_tar_emit_list, &l);
+		ai_tar_dest_free(&d);
+	}
+
+	/* the archive needs to match the journal exactly */
+	if (!ret) {
+		pp = ai_journal_get_files(j);
+		ret = ai_tar_list_emit(&l, ai_tar_emit_match, &pp);
+		if (!ret && pp && !(ai_journal_file_flags(pp) & AI_MERGE_FILE_REMOVE))
+			ret = EINVAL;
+	}
+	ai_tar_free(&t);
+	free(l.buf);
+	free(l.offsets);
+
+	if (!ret)
+		ret = ai_tar_copy_done(j);
+	return ret;
+}
+
+int ai_tar_copy_done(ai_journal_t j) {
+	/* with no source tree, the files to be replaced are found using
+	 * the archive members */
+	int ret = ai_merge_mark_replaced(j);
+
+	if (ret)
+		return ret;
+	return ai_journal_set_flag(j, AI_MERGE_COPIED_NEW);
+}
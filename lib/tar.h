@@ -0,0 +1,101 @@
+/* atomic-install -- tar archive support
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_TAR_H
+#define _ATOMIC_INSTALL_TAR_H
+
+/**
+ * SECTION: tar
+ * @short_description: Functions to merge directly from tar archives
+ * @include: atomic-install/tar.h
+ *
+ * libai-tar provides functions to use an uncompressed tar archive as the source
+ * of a merge, without extracting it first. The journal is built from the tar
+ * headers, and the file contents are written straight to the .new temporary
+ * files in the destination tree. The remaining merge steps are performed
+ * using libai-merge as usual.
+ *
+ * ustar, GNU (long names) and pax (path, linkpath, size, mtime, uid, gid)
+ * headers are supported. The numeric owner ids are used. Parent directories
+ * which are not listed in the archive are created with default permissions,
+ * and are not removed on rollback. If a member occurs multiple times,
+ * the last occurrence is used; changing it between a directory
+ * and a non-directory is rejected as invalid.
+ */
+
+#include "journal.h"
+#include "merge.h"
+
+/**
+ * ai_tar_journal_append
+ * @j: journal returned by ai_journal_create_start()
+ * @fd: file descriptor to read the archive from
+ *
+ * Add all the members of the tar archive read from @fd to the journal being
+ * created. The file contents are skipped; if @fd is seekable, they are not read
+ * at all. The journal should be started with %NULL location.
+ *
+ * Afterwards, ai_tar_copy_new() should be used instead of ai_merge_copy_new().
+ *
+ * Returns: 0 on success, errno otherwise (EINVAL if the archive is invalid)
+ */
+int ai_tar_journal_append(ai_journal_t j, int fd);
+
+/**
+ * ai_tar_journal_copy
+ * @j: journal returned by ai_journal_create_start()
+ * @fd: file descriptor to read the archive from
+ * @dest: path to the destination tree
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * Add all the members of the tar archive read from @fd to the journal being
+ * created, and write them to the destination tree at @dest at once, like
+ * ai_tar_copy_new() does. This reads the archive only once, and therefore
+ * works with non-seekable streams (e.g. pipes). The journal should be started
+ * with %NULL location.
+ *
+ * After the journal is finished and opened, ai_tar_copy_done() needs to be
+ * called to complete the copying step. Note that if this function fails
+ * or the process is interrupted before the journal is finished, the already
+ * written .new files are not listed in any valid journal.
+ *
+ * Returns: 0 on success, errno otherwise (EINVAL if the archive is invalid)
+ */
+int ai_tar_journal_copy(ai_journal_t j, int fd, const char *dest,
+		ai_merge_progress_callback_t progress_callback);
+
+/**
+ * ai_tar_copy_new
+ * @fd: file descriptor to read the archive from
+ * @dest: path to the destination tree
+ * @j: an open journal, created using ai_tar_journal_append()
+ * @progress_callback: callback function for progress reporting, or %NULL
+ *
+ * The equivalent of ai_merge_copy_new() for tar archives. Read the archive
+ * from the beginning of (seekable) @fd, and write its members to
+ * the destination tree at @dest as temporary files with .new suffix.
+ *
+ * If the archive does not match the journal, EINVAL is returned. On success,
+ * ai_tar_copy_done() is called implicitly.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_tar_copy_new(int fd, const char *dest, ai_journal_t j,
+		ai_merge_progress_callback_t progress_callback);
+
+/**
+ * ai_tar_copy_done
+ * @j: an open journal
+ *
+ * Complete the copying step. Mark files listed for removal which are present
+ * in the archive as replaced (%AI_MERGE_FILE_IGNORE), and set
+ * the %AI_MERGE_COPIED_NEW flag on journal.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int ai_tar_copy_done(ai_journal_t j);
+
+#endif /*_ATOMIC_INSTALL_TAR_H*/
@@ -0,0 +1,148 @@
+/* atomic-install -- XXH64 implementation
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "xxh64.h"
+
+#include <string.h>
+
+#define AI_XXH64_P1 0x9E3779B185EBCA87ULL
+#define AI_XXH64_P2 0xC2B2AE3D27D4EB4FULL
+#define AI_XXH64_P3 0x165667B19E3779F9ULL
+#define AI_XXH64_P4 0x85EBCA77C2B2AE63ULL
+#define AI_XXH64_P5 0x27D4EB2F165667C5ULL
+
+#define AI_ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/**
+ * ai_xxh64_read64
+ * @p: input bytes
+ *
+ * Read a little-endian 64-bit word.
+ *
+ * Returns: the word
+ */
+static uint64_t ai_xxh64_read64(const unsigned char *p) {
+	return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16
+		| (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32
+		| (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48
+		| (uint64_t) p[7] << 56;
+}
+
+/**
+ * ai_xxh64_round
+ * @acc: the accumulator
+ * @input: input word
+ *
+ * Mix an input word into the accumulator.
+ *
+ * Returns: the new accumulator value
+ */
+static uint64_t ai_xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * AI_XXH64_P2;
+	acc = AI_ROL64(acc, 31);
+	return acc * AI_XXH64_P1;
+}
+
+/**
+ * ai_xxh64_merge
+ * @h: the hash
+ * @acc: an accumulator
+ *
+ * Merge an accumulator into the hash.
+ *
+ * Returns: the new hash value
+ */
+static uint64_t ai_xxh64_merge(uint64_t h, uint64_t acc) {
+	h ^= ai_xxh64_round(0, acc);
+	return h * AI_XXH64_P1 + AI_XXH64_P4;
+}
+
+/**
+ * ai_xxh64_stripe
+ * @ctx: the context
+ * @p: a 32-byte input stripe
+ *
+ * Process a single input stripe.
+ */
+static void ai_xxh64_stripe(ai_xxh64_t *ctx, const unsigned char *p) {
+	int i;
+
+	for (i = 0; i < 4; i++)
+		ctx->acc[i] = ai_xxh64_round(ctx->acc[i], ai_xxh64_read64(p + i * 8));
+}
+
+void ai_xxh64_init(ai_xxh64_t *ctx) {
+	ctx->acc[0] = AI_XXH64_P1 + AI_XXH64_P2;
+	ctx->acc[1] = AI_XXH64_P2;
+	ctx->acc[2] = 0;
+	ctx->acc[3] = -AI_XXH64_P1;
+	ctx->count = 0;
+}
+
+void ai_xxh64_update(ai_xxh64_t *ctx, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t fill = ctx->count % 32;
+
+	ctx->count += len;
+
+	if (fill) {
+		size_t n = 32 - fill;
+
+		if (n > len)
+			n = len;
+		memcpy(ctx->block + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 32)
+			return;
+		ai_xxh64_stripe(ctx, ctx->block);
+	}
+
+	for (; len >= 32; p += 32, len -= 32)
+		ai_xxh64_stripe(ctx, p);
+
+	memcpy(ctx->block, p, len);
+}
+
+uint64_t ai_xxh64_final(ai_xxh64_t *ctx) {
+	const unsigned char *p = ctx->block;
+	size_t len = ctx->count % 32;
+	uint64_t h;
+	int i;
+
+	if (ctx->count >= 32) {
+		h = AI_ROL64(ctx->acc[0], 1) + AI_ROL64(ctx->acc[1], 7)
+			+ AI_ROL64(ctx->acc[2], 12) + AI_ROL64(ctx->acc[3], 18);
+		for (i = 0; i < 4; i++)
+			h = ai_xxh64_merge(h, ctx->acc[i]);
+	} else
+		h = AI_XXH64_P5;
+
+	h += ctx->count;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		h ^= ai_xxh64_round(0, ai_xxh64_read64(p));
+		h = AI_ROL64(h, 27) * AI_XXH64_P1 + AI_XXH64_P4;
+	}
+	if (len >= 4) {
+		h ^= ((uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16
+				| (uint64_t) p[3] << 24) * AI_XXH64_P1;
+		h = AI_ROL64(h, 23) * AI_XXH64_P2 + AI_XXH64_P3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; p++, len--) {
+		h ^= *p * AI_XXH64_P5;
+		h = AI_ROL64(h, 11) * AI_XXH64_P1;
+	}
+
+	h ^= h >> 33;
+	h *= AI_XXH64_P2;
+	h ^= h >> 29;
+	h *= AI_XXH64_P3;
+	h ^= h >> 32;
+	return h;
+}
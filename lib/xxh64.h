@@ -0,0 +1,59 @@
+/* atomic-install -- XXH64 implementation
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_XXH64_H
+#define _ATOMIC_INSTALL_XXH64_H
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+/**
+ * ai_xxh64_t
+ * @acc: the stripe accumulators
+ * @count: number of bytes hashed so far
+ * @block: partial input stripe
+ *
+ * The XXH64 hashing context. XXH64 is a fast non-cryptographic hash, used
+ * to detect corrupted copies.
+ */
+typedef struct {
+	uint64_t acc[4];
+	uint64_t count;
+	unsigned char block[32];
+} ai_xxh64_t;
+
+/**
+ * ai_xxh64_init
+ * @ctx: the context
+ *
+ * Initialize the context for hashing a new message, with seed 0.
+ */
+void ai_xxh64_init(ai_xxh64_t *ctx);
+
+/**
+ * ai_xxh64_update
+ * @ctx: the context
+ * @data: input data
+ * @len: length of @data
+ *
+ * Feed @len bytes of @data into the hash.
+ */
+void ai_xxh64_update(ai_xxh64_t *ctx, const void *data, size_t len);
+
+/**
+ * ai_xxh64_final
+ * @ctx: the context
+ *
+ * Finish hashing.
+ *
+ * Returns: the hash
+ */
+uint64_t ai_xxh64_final(ai_xxh64_t *ctx);
+
+#endif /*_ATOMIC_INSTALL_XXH64_H*/
@@ -0,0 +1,100 @@
+/* atomic-install -- benchmark helpers
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#ifdef HAVE_CLOCK_GETTIME
+#	include <time.h>
+#else
+#	include <sys/time.h>
+#endif
+
+static char bench_buf[0x10000];
+
+void bench_fill(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof(bench_buf); i++)
+		bench_buf[i] = rand();
+}
+
+unsigned long long int bench_clock(void) {
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+int bench_write(const char *path, unsigned long long int size) {
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		return errno;
+
+	while (size > 0) {
+		const size_t len = size > sizeof(bench_buf) ? sizeof(bench_buf) : size;
+		const ssize_t wr = write(fd, bench_buf, len);
+
+		if (wr == -1) {
+			ret = errno;
+			break;
+		}
+		size -= wr;
+	}
+
+	if (close(fd) && !ret)
+		ret = errno;
+	return ret;
+}
+
+static int bench_unlink(const char *path, const struct stat *st, int type,
+		struct FTW *ftw) {
+	return remove(path) ? errno : 0;
+}
+
+int bench_rmtree(const char *path) {
+	const int ret = nftw(path, bench_unlink, 16, FTW_DEPTH|FTW_PHYS);
+
+	return ret == -1 ? errno : ret;
+}
+
+int bench_parse_size(const char *arg, char **end, unsigned long long int *size) {
+	*size = strtoull(arg, end, 10);
+	if (*end == arg)
+		return EINVAL;
+
+	switch (**end) {
+		case 'G':
+			*size *= 1024;
+			/* fallthrough */
+		case 'M':
+			*size *= 1024;
+			/* fallthrough */
+		case 'K':
+			*size *= 1024;
+			(*end)++;
+	}
+
+	return 0;
+}
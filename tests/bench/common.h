@@ -0,0 +1,59 @@
+/* atomic-install -- benchmark helpers
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_BENCH_COMMON_H
+#define _ATOMIC_INSTALL_BENCH_COMMON_H
+
+/**
+ * bench_fill
+ *
+ * Fill the data buffer used by bench_write() with rand() output. Call
+ * srand() first to get repeatable data.
+ */
+void bench_fill(void);
+
+/**
+ * bench_clock
+ *
+ * Returns: current monotonic time in microseconds
+ */
+unsigned long long int bench_clock(void);
+
+/**
+ * bench_write
+ * @path: path to the new file
+ * @size: file size
+ *
+ * Create a new file of @size bytes, filled with the data buffer.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int bench_write(const char *path, unsigned long long int size);
+
+/**
+ * bench_rmtree
+ * @path: path to the directory
+ *
+ * Remove the directory @path along with its contents.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+int bench_rmtree(const char *path);
+
+/**
+ * bench_parse_size
+ * @arg: the string to parse
+ * @end: location to store the pointer past the parsed size in
+ * @size: location to store the size in
+ *
+ * Parse a size given on the command-line, with an optional K, M or G
+ * suffix.
+ *
+ * Returns: 0 on success, EINVAL if @arg doesn't start with a number
+ */
+int bench_parse_size(const char *arg, char **end, unsigned long long int *size);
+
+#endif /*_ATOMIC_INSTALL_BENCH_COMMON_H*/
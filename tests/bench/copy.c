@@ -0,0 +1,476 @@
+/* atomic-install -- copying strategy benchmark
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "copy.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+static const struct option opts[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+
+	{ "sizes", required_argument, NULL, 's' },
+	{ "bufsizes", required_argument, NULL, 'b' },
+	{ "strategies", required_argument, NULL, 'm' },
+	{ "total", required_argument, NULL, 't' },
+	{ "files", required_argument, NULL, 'n' },
+
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "cache", required_argument, NULL, 'C' },
+	{ "runs", required_argument, NULL, 'R' },
+	{ 0, 0, 0, 0 }
+};
+
+static void print_help(const char *argv0) {
+	printf("Usage: %s [options] directory [dest-directory]\n"
+"\n"
+"Copy files of different sizes from directory to dest-directory (default:\n"
+"the same one) using each copying strategy and buffer size, and print\n"
+"a tab-separated line of results for each combination.\n"
+"\n"
+"The copying time includes a sync() of the copied data. The read/write\n"
+"syscall counts come from /proc/self/io, and are '-' if it is not available.\n"
+"\n"
+"Options:\n"
+"    --help, -h          this help message\n"
+"    --version, -V       print program version\n"
+"\n"
+"    --sizes LIST, -s LIST\n"
+"                        comma-separated file sizes (default: 4K,1M,64M)\n"
+"    --bufsizes LIST, -b LIST\n"
+"                        comma-separated buffer sizes for read/write copying\n"
+"                        (default: 16K,64K,256K,1M)\n"
+"    --strategies LIST, -m LIST\n"
+"                        comma-separated strategies, of: link, reflink,\n"
+"                        copy_file_range, sendfile, read/write (default: all)\n"
+"    --total SIZE, -t SIZE\n"
+"                        amount of data copied per combination (default: 256M)\n"
+"    --files N, -n N     the maximal number of files per combination\n"
+"                        (default: 1000)\n"
+"\n"
+"    --jobs N, -j N      use N threads to copy large files\n"
+"    --cache POLICY, -C POLICY\n"
+"                        page cache policy: keep, drop or direct\n"
+"    --runs N, -R N      repeat the benchmark N times (default: 1)\n"
+"", argv0);
+}
+
+/**
+ * bench_list
+ * @values: the list elements
+ * @count: number of elements
+ *
+ * A list of sizes given on the command-line.
+ */
+struct bench_list {
+	unsigned long long int values[32];
+	unsigned int count;
+};
+
+/**
+ * bench_usage
+ * @usec: wall clock time, in microseconds
+ * @user_usec: user CPU time, in microseconds
+ * @sys_usec: system CPU time, in microseconds
+ * @syscr: number of read syscalls, or -1 if unknown
+ * @syscw: number of write syscalls, or -1 if unknown
+ *
+ * The resource usage of the process at some point.
+ */
+struct bench_usage {
+	unsigned long long int usec, user_usec, sys_usec;
+	long long int syscr, syscw;
+};
+
+/**
+ * bench_strategy
+ *
+ * The last strategy reported by libai-copy.
+ */
+static ai_copy_strategy_t bench_strategy;
+
+/**
+ * bench_jobs
+ *
+ * The number of threads copying a single large file.
+ */
+static unsigned int bench_jobs = 1;
+
+/**
+ * bench_cache_policy
+ *
+ * The page cache policy used for copying.
+ */
+static ai_copy_cache_policy_t bench_cache_policy = AI_COPY_CACHE_KEEP;
+
+static void bench_strategy_callback(dev_t source, dev_t dest,
+		ai_copy_strategy_t strategy) {
+	bench_strategy = strategy;
+}
+
+/**
+ * bench_get_usage
+ * @u: location to store the usage in
+ *
+ * Get the current resource usage of the process (including all threads).
+ */
+static void bench_get_usage(struct bench_usage *u) {
+	struct rusage ru;
+	char buf[512];
+	const char *p;
+	int fd;
+	ssize_t len;
+
+	u->syscr = u->syscw = -1;
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd != -1) {
+		len = read(fd, buf, sizeof(buf) - 1);
+		if (len > 0) {
+			buf[len] = 0;
+			p = strstr(buf, "syscr: ");
+			if (p)
+				u->syscr = strtoll(p + 7, NULL, 10);
+			p = strstr(buf, "syscw: ");
+			if (p)
+				u->syscw = strtoll(p + 7, NULL, 10);
+		}
+		close(fd);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	u->user_usec = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+	u->sys_usec = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+	u->usec = bench_clock();
+}
+
+/**
+ * bench_create
+ * @dir: directory to create the files in
+ * @files: number of files
+ * @size: file size
+ *
+ * Create @files files of @size bytes, named with their numbers.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_create(const char *dir, unsigned long int files,
+		unsigned long long int size) {
+	char path[PATH_MAX];
+	unsigned long int i;
+	int ret = 0;
+
+	for (i = 0; !ret && i < files; i++) {
+		if (snprintf(path, sizeof(path), "%s/%lu", dir, i) >= sizeof(path))
+			ret = ENAMETOOLONG;
+		else
+			ret = bench_write(path, size);
+		if (ret)
+			fprintf(stderr, "Writing %s failed: %s\n", path, strerror(ret));
+	}
+
+	return ret;
+}
+
+/**
+ * bench_remove
+ * @dir: directory containing the files
+ * @files: number of files
+ *
+ * Remove the files created by bench_create() or copied by bench_run().
+ */
+static void bench_remove(const char *dir, unsigned long int files) {
+	char path[PATH_MAX];
+	unsigned long int i;
+
+	for (i = 0; i < files; i++) {
+		if (snprintf(path, sizeof(path), "%s/%lu", dir, i) < sizeof(path))
+			unlink(path);
+	}
+}
+
+/**
+ * bench_run
+ * @source: directory containing the source files
+ * @dest: directory to copy the files into
+ * @files: number of files
+ * @size: file size
+ * @strategy: the strategy to use
+ * @bufsize: buffer size, or 0 for the default one
+ *
+ * Copy the files using @strategy (ai_cp_l() for %AI_COPY_LINK, ai_cp_a()
+ * otherwise), print the results and remove the copies.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_run(const char *source, const char *dest, unsigned long int files,
+		unsigned long long int size, ai_copy_strategy_t strategy,
+		unsigned long int bufsize) {
+	char spath[PATH_MAX], dpath[PATH_MAX];
+	struct bench_usage start, end;
+	unsigned long long int usec;
+	ai_copy_ctx_t c;
+	unsigned long int i;
+	int ret;
+
+	ret = ai_copy_ctx_new(&c);
+	if (ret)
+		return ret;
+
+	ret = ai_copy_ctx_set_jobs(c, bench_jobs);
+	if (!ret)
+		ret = ai_copy_ctx_set_cache_policy(c, bench_cache_policy);
+	if (!ret)
+		ret = ai_copy_ctx_set_strategy(c,
+				strategy == AI_COPY_LINK ? AI_COPY_NONE : strategy);
+	if (ret) {
+		ai_copy_ctx_free(c);
+		return ret;
+	}
+	ai_copy_ctx_set_bufsize(c, bufsize);
+
+	/* probe each combination from scratch */
+	ai_copy_clear_probes();
+	bench_strategy = AI_COPY_NONE;
+
+#ifdef HAVE_SYNC
+	sync();
+#endif
+	bench_get_usage(&start);
+	for (i = 0; i < files; i++) {
+		snprintf(spath, sizeof(spath), "%s/%lu", source, i);
+		snprintf(dpath, sizeof(dpath), "%s/%lu", dest, i);
+
+		if (strategy == AI_COPY_LINK)
+			ret = ai_copy_ctx_cp_l(c, spath, dpath);
+		else
+			ret = ai_copy_ctx_cp_a(c, spath, dpath);
+		if (ret) {
+			fprintf(stderr, "Copying %s failed: %s\n", spath, strerror(ret));
+			break;
+		}
+	}
+#ifdef HAVE_SYNC
+	sync();
+#endif
+	bench_get_usage(&end);
+
+	ai_copy_ctx_free(c);
+
+	if (!ret) {
+		usec = end.usec - start.usec;
+		printf("%llu\t", size);
+		if (bufsize)
+			printf("%lu\t", bufsize);
+		else
+			printf("-\t");
+		printf("%s\t%s\t%lu\t%llu\t%llu\t%.1f\t%llu\t%llu\t",
+				ai_copy_strategy_name(strategy),
+				ai_copy_strategy_name(bench_strategy),
+				files, size * files, usec,
+				usec ? (double) size * files / usec : 0.0,
+				end.user_usec - start.user_usec,
+				end.sys_usec - start.sys_usec);
+		if (start.syscr != -1 && end.syscr != -1)
+			printf("%lld\t%lld\n", end.syscr - start.syscr,
+					end.syscw - start.syscw);
+		else
+			printf("-\t-\n");
+		fflush(stdout);
+	}
+
+	bench_remove(dest, files);
+	return ret;
+}
+
+static int parse_list(const char *arg, struct bench_list *l) {
+	char *end;
+
+	l->count = 0;
+	do {
+		if (l->count == sizeof(l->values) / sizeof(*l->values)
+				|| bench_parse_size(arg, &end, &l->values[l->count++]))
+			return EINVAL;
+		arg = end + 1;
+	} while (*end == ',');
+
+	return *end ? EINVAL : 0;
+}
+
+static int parse_strategies(const char *arg, int *enabled) {
+	ai_copy_strategy_t s;
+	size_t len;
+
+	for (s = AI_COPY_LINK; s <= AI_COPY_READ_WRITE; s++)
+		enabled[s] = 0;
+
+	while (*arg) {
+		len = strcspn(arg, ",");
+		for (s = AI_COPY_LINK; s <= AI_COPY_READ_WRITE; s++) {
+			const char *name = ai_copy_strategy_name(s);
+
+			if (strlen(name) == len && !strncmp(arg, name, len))
+				break;
+		}
+		if (s > AI_COPY_READ_WRITE)
+			return EINVAL;
+		enabled[s] = 1;
+
+		arg += len;
+		if (*arg == ',')
+			arg++;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int ret = 0;
+
+	struct bench_list sizes = { { 4096, 1024 * 1024, 64 * 1024 * 1024 }, 3 };
+	struct bench_list bufsizes = { { 16384, 65536, 262144, 1024 * 1024 }, 4 };
+	int enabled[AI_COPY_READ_WRITE + 1] = { 0, 1, 1, 1, 1, 1 };
+	unsigned long long int total = 256 * 1024 * 1024;
+	unsigned long int maxfiles = 1000, files;
+	unsigned int runs = 1, run, si, bi;
+	ai_copy_strategy_t s;
+	const char *sdir, *ddir;
+	char source[PATH_MAX], dest[PATH_MAX];
+	char *end;
+
+	while ((opt = getopt_long(argc, argv, "hVb:C:j:m:n:R:s:t:", opts, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				if (parse_list(optarg, &sizes)) {
+					printf("Invalid size list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if (parse_list(optarg, &bufsizes)) {
+					printf("Invalid buffer size list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'm':
+				if (parse_strategies(optarg, enabled)) {
+					printf("Invalid strategy list: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 't':
+				if (bench_parse_size(optarg, &end, &total) || *end) {
+					printf("Invalid size: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'n':
+				maxfiles = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				bench_jobs = strtoul(optarg, NULL, 10);
+				ret = ai_copy_ctx_set_jobs(NULL, bench_jobs);
+				if (ret) {
+					printf("Setting jobs failed: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
+			case 'C':
+				if (!strcmp(optarg, "keep"))
+					bench_cache_policy = AI_COPY_CACHE_KEEP;
+				else if (!strcmp(optarg, "drop"))
+					bench_cache_policy = AI_COPY_CACHE_DROP;
+				else if (!strcmp(optarg, "direct"))
+					bench_cache_policy = AI_COPY_CACHE_DIRECT;
+				else {
+					printf("Invalid cache policy: %s\n", optarg);
+					return 1;
+				}
+				ret = ai_copy_ctx_set_cache_policy(NULL, bench_cache_policy);
+				if (ret) {
+					printf("Setting cache policy failed: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
+			case 'R':
+				runs = strtoul(optarg, NULL, 10);
+				break;
+			case 'V':
+				printf("%s\n", PACKAGE_STRING);
+				return 0;
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	if (argc - optind < 1) {
+		printf("Synopsis: bench/copy [options] directory [dest-directory]\n");
+		return 0;
+	}
+	sdir = argv[optind];
+	ddir = argc - optind > 1 ? argv[optind + 1] : sdir;
+
+	snprintf(source, sizeof(source), "%s/ai-copy-bench.XXXXXX", sdir);
+	snprintf(dest, sizeof(dest), "%s/ai-copy-bench.XXXXXX", ddir);
+	if (!mkdtemp(source) || !mkdtemp(dest)) {
+		fprintf(stderr, "Temporary directory creation failed: %s\n",
+				strerror(errno));
+		return 1;
+	}
+
+	bench_fill();
+	ai_copy_set_strategy_callback(bench_strategy_callback);
+
+	printf("# size\tbufsize\tstrategy\tused\tfiles\tbytes\tusec\tMBps"
+			"\tuser_usec\tsys_usec\tsyscr\tsyscw\n");
+
+	for (si = 0; !ret && si < sizes.count; si++) {
+		const unsigned long long int size = sizes.values[si];
+
+		files = size ? total / size : maxfiles;
+		if (files > maxfiles)
+			files = maxfiles;
+		else if (!files)
+			files = 1;
+
+		ret = bench_create(source, files, size);
+
+		for (run = 0; !ret && run < runs; run++) {
+			for (s = AI_COPY_LINK; !ret && s <= AI_COPY_READ_WRITE; s++) {
+				if (!enabled[s])
+					continue;
+
+				if (s != AI_COPY_READ_WRITE)
+					ret = bench_run(source, dest, files, size, s, 0);
+				for (bi = 0; !ret && s == AI_COPY_READ_WRITE
+						&& bi < bufsizes.count; bi++)
+					ret = bench_run(source, dest, files, size, s,
+							bufsizes.values[bi]);
+			}
+		}
+
+		bench_remove(source, files);
+	}
+
+	if (bench_rmtree(source) || bench_rmtree(dest))
+		fprintf(stderr, "Removing the temporary directories failed\n");
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,525 @@
+/* atomic-install -- end-to-end merge benchmark
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "journal.h"
+#include "merge.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+static const struct option opts[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+
+	{ "files", required_argument, NULL, 'n' },
+	{ "size", required_argument, NULL, 's' },
+	{ "depth", required_argument, NULL, 'd' },
+	{ "width", required_argument, NULL, 'w' },
+	{ "hardlinks", required_argument, NULL, 'l' },
+	{ "existing", required_argument, NULL, 'x' },
+	{ "remove", required_argument, NULL, 'r' },
+
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "fast-replace", no_argument, NULL, 'F' },
+	{ "runs", required_argument, NULL, 'R' },
+	{ "seed", required_argument, NULL, 'S' },
+	{ "keep", no_argument, NULL, 'k' },
+	{ 0, 0, 0, 0 }
+};
+
+static void print_help(const char *argv0) {
+	printf("Usage: %s [options] [directory]\n"
+"\n"
+"Generate a synthetic source and destination tree in a temporary directory\n"
+"inside of directory (default: $TMPDIR or /tmp), merge them and print\n"
+"the time taken by each step, one 'run<TAB>step<TAB>usec' line per step.\n"
+"Each run starts with a 'run<TAB>source-bytes<TAB>size' line.\n"
+"\n"
+"Options:\n"
+"    --help, -h          this help message\n"
+"    --version, -V       print program version\n"
+"\n"
+"    --files N, -n N     number of files in the source tree (default: 1000)\n"
+"    --size MIN:MAX, -s MIN:MAX\n"
+"                        file size range, sizes are distributed evenly\n"
+"                        among the powers of two (default: 0:64K)\n"
+"    --depth N, -d N     directory nesting level (default: 3)\n"
+"    --width N, -w N     subdirectories in each directory (default: 8)\n"
+"    --hardlinks F, -l F fraction of files being hard links to other ones\n"
+"                        (default: 0)\n"
+"    --existing F, -x F  fraction of files existing in the destination\n"
+"                        already (default: 0.5)\n"
+"    --remove N, -r N    number of files on the removal list (default: 0)\n"
+"\n"
+"    --jobs N, -j N      use N threads for merge phases\n"
+"    --fast-replace, -F  replace all files in a single batch of renames\n"
+"    --runs N, -R N      repeat the benchmark N times (default: 1)\n"
+"    --seed N, -S N      random seed for the tree generator (default: 1)\n"
+"    --keep, -k          keep the trees of the last run\n"
+"", argv0);
+}
+
+/**
+ * bench_params
+ * @files: number of files in the source tree
+ * @size_min: minimal file size
+ * @size_max: maximal file size
+ * @depth: directory nesting level
+ * @width: number of subdirectories in each directory
+ * @hardlinks: fraction of source files being hard links
+ * @existing: fraction of source files existing in the destination
+ * @removal: number of files on the removal list
+ * @fastreplace: use ai_merge_replace_prepared()
+ * @opts: the merge options
+ *
+ * The benchmark parameters.
+ */
+struct bench_params {
+	unsigned long int files;
+	unsigned long long int size_min;
+	unsigned long long int size_max;
+	unsigned int depth;
+	unsigned int width;
+	double hardlinks;
+	double existing;
+	unsigned long int removal;
+	int fastreplace;
+	ai_merge_options_t opts;
+};
+
+/**
+ * bench_random
+ *
+ * Get a random number, wider than rand() on the systems with a small
+ * RAND_MAX.
+ *
+ * Returns: the random number
+ */
+static unsigned long long int bench_random(void) {
+	return (unsigned long long int) rand() << 31 ^ rand();
+}
+
+/**
+ * bench_chance
+ * @fraction: probability, in range 0 to 1
+ *
+ * Returns: non-zero with the probability of @fraction
+ */
+static int bench_chance(double fraction) {
+	return rand() < fraction * RAND_MAX;
+}
+
+/**
+ * bench_size
+ * @p: the benchmark parameters
+ *
+ * Choose a file size. The power of two is chosen first, so that small files
+ * are as common as large ones.
+ *
+ * Returns: the file size
+ */
+static unsigned long long int bench_size(const struct bench_params *p) {
+	unsigned int lo, hi, bit;
+	unsigned long long int min, max;
+
+	for (lo = 0; p->size_min >> lo > 1; lo++);
+	for (hi = lo; p->size_max >> hi > 1; hi++);
+
+	bit = lo + rand() % (hi - lo + 1);
+	min = bit ? 1ULL << bit : 0;
+	max = (2ULL << bit) - 1;
+	if (min < p->size_min)
+		min = p->size_min;
+	if (max > p->size_max)
+		max = p->size_max;
+
+	return min + bench_random() % (max - min + 1);
+}
+
+/**
+ * bench_mkdirs
+ * @path: path to the file
+ *
+ * Create the missing parent directories of @path.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_mkdirs(char *path) {
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return errno;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+/**
+ * bench_create
+ * @path: path to the new file
+ * @size: file size
+ *
+ * Create a new file of @size bytes, with the missing parent directories.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_create(char *path, unsigned long long int size) {
+	const int ret = bench_mkdirs(path);
+
+	return ret ? ret : bench_write(path, size);
+}
+
+/**
+ * bench_path
+ * @buf: buffer for the path, PATH_MAX long at least
+ * @root: tree root
+ * @p: the benchmark parameters
+ * @prefix: file name prefix
+ * @i: file number
+ *
+ * Put the path to the file number @i (prefixed with @prefix) into @buf.
+ * The subdirectories are chosen randomly.
+ *
+ * Returns: the part of @buf relative to @root
+ */
+static char *bench_path(char *buf, const char *root,
+		const struct bench_params *p, const char *prefix, unsigned long int i) {
+	char *rel = buf + sprintf(buf, "%s", root);
+	char *pos = rel;
+	unsigned int l;
+
+	for (l = 0; l < p->depth; l++)
+		pos += sprintf(pos, "/d%u", rand() % p->width);
+	sprintf(pos, "/%s%lu", prefix, i);
+
+	return rel;
+}
+
+/**
+ * bench_generate
+ * @source: source tree root
+ * @dest: destination tree root
+ * @p: the benchmark parameters
+ * @removal: removal list, @p->removal paths relative to @dest
+ * @bytes: location to store the source tree size
+ *
+ * Generate the source and destination trees.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_generate(const char *source, const char *dest,
+		const struct bench_params *p, char **removal,
+		unsigned long long int *bytes) {
+	char buf[PATH_MAX], other[PATH_MAX];
+	char **sources;
+	unsigned long int i;
+	int ret = 0;
+
+	*bytes = 0;
+	if (mkdir(source, 0755) || mkdir(dest, 0755))
+		return errno;
+
+	sources = malloc(p->files * sizeof(*sources));
+	if (!sources)
+		return errno;
+
+	for (i = 0; i < p->files; i++) {
+		char *rel = bench_path(buf, source, p, "f", i);
+
+		if (i > 0 && bench_chance(p->hardlinks)) {
+			ret = bench_mkdirs(buf);
+			if (!ret && link(sources[bench_random() % i], buf))
+				ret = errno;
+		} else {
+			const unsigned long long int size = bench_size(p);
+
+			ret = bench_create(buf, size);
+			*bytes += size;
+		}
+
+		if (!ret && bench_chance(p->existing)) {
+			snprintf(other, sizeof(other), "%s%s", dest, rel);
+			ret = bench_create(other, bench_size(p));
+		}
+
+		sources[i] = strdup(buf);
+		if (!ret && !sources[i])
+			ret = errno;
+		if (ret) {
+			i++;
+			break;
+		}
+	}
+
+	while (i > 0)
+		free(sources[--i]);
+	free(sources);
+
+	for (i = 0; !ret && i < p->removal; i++) {
+		char *rel = bench_path(buf, dest, p, "r", i);
+
+		ret = bench_create(buf, bench_size(p));
+		if (!ret) {
+			removal[i] = strdup(rel);
+			if (!removal[i])
+				ret = errno;
+		}
+	}
+
+#ifdef HAVE_SYNC
+	/* don't let the first merge phase flush our writes */
+	sync();
+#endif
+
+	return ret;
+}
+
+/**
+ * bench_run
+ * @dir: directory to run the benchmark in
+ * @p: the benchmark parameters
+ * @run: run number
+ *
+ * Generate the trees in @dir, merge them and print the step timings.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int bench_run(const char *dir, const struct bench_params *p,
+		unsigned int run) {
+	char source[PATH_MAX], dest[PATH_MAX], journal[PATH_MAX];
+	char **removal;
+	ai_journal_t j;
+	ai_merge_plan_t plan;
+	unsigned long long int bytes, start;
+	unsigned long int i;
+	int ret;
+
+	if (snprintf(source, sizeof(source), "%s/source", dir) >= sizeof(source)
+			|| snprintf(dest, sizeof(dest), "%s/dest", dir) >= sizeof(dest)
+			|| snprintf(journal, sizeof(journal), "%s/journal", dir)
+				>= sizeof(journal))
+		return ENAMETOOLONG;
+
+	removal = calloc(p->removal + 1, sizeof(*removal));
+	if (!removal)
+		return errno;
+
+	ret = bench_generate(source, dest, p, removal, &bytes);
+	if (ret) {
+		fprintf(stderr, "Tree generation failed: %s\n", strerror(ret));
+		goto fail;
+	}
+	printf("%u\tsource-bytes\t%llu\n", run, bytes);
+
+	start = bench_clock();
+	ret = ai_journal_create_start(journal, source, &j);
+	for (i = 0; !ret && i < p->removal; i++)
+		ret = ai_journal_create_append(j, removal[i], AI_MERGE_FILE_REMOVE);
+	if (!ret)
+		ret = ai_journal_create_finish(j);
+	if (ret) {
+		fprintf(stderr, "Journal creation failed: %s\n", strerror(ret));
+		goto fail;
+	}
+	printf("%u\tjournal-create\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	ret = ai_journal_open(journal, &j);
+	if (ret) {
+		fprintf(stderr, "Journal open failed: %s\n", strerror(ret));
+		goto fail;
+	}
+	printf("%u\tjournal-open\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	ret = ai_merge_plan(source, dest, j, &p->opts, &plan);
+	if (ret) {
+		fprintf(stderr, "Planning failed: %s\n", strerror(ret));
+		goto fail_close;
+	}
+	printf("%u\tplan\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	ret = ai_merge_copy_new(source, dest, j, &p->opts, NULL);
+	if (ret) {
+		fprintf(stderr, "Copying new failed: %s\n", strerror(ret));
+		goto fail_close;
+	}
+	printf("%u\tcopy-new\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	ret = ai_merge_backup_old(dest, j, &p->opts);
+	if (ret) {
+		fprintf(stderr, "Backing old up failed: %s\n", strerror(ret));
+		goto fail_close;
+	}
+	printf("%u\tbackup-old\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	if (p->fastreplace) {
+		unsigned long int window;
+
+		ret = ai_merge_replace_prepared(dest, j, &p->opts, &window);
+		if (!ret)
+			printf("%u\treplace-window\t%lu\n", run, window);
+	} else
+		ret = ai_merge_replace(dest, j, &p->opts);
+	if (ret) {
+		fprintf(stderr, "Replacement failed: %s\n", strerror(ret));
+		goto fail_close;
+	}
+	printf("%u\treplace\t%llu\n", run, bench_clock() - start);
+
+	start = bench_clock();
+	ret = ai_merge_cleanup(dest, j, &p->opts, NULL);
+	if (ret) {
+		fprintf(stderr, "Cleanup failed: %s\n", strerror(ret));
+		goto fail_close;
+	}
+	printf("%u\tcleanup\t%llu\n", run, bench_clock() - start);
+
+fail_close:
+	ai_journal_close(j);
+fail:
+	for (i = 0; i < p->removal; i++)
+		free(removal[i]);
+	free(removal);
+	return ret;
+}
+
+static int parse_size_range(const char *arg, struct bench_params *p) {
+	char *end;
+
+	if (bench_parse_size(arg, &end, &p->size_min))
+		return EINVAL;
+	if (*end != ':')
+		p->size_max = p->size_min;
+	else if (bench_parse_size(end + 1, &end, &p->size_max))
+		return EINVAL;
+
+	return *end || p->size_min > p->size_max ? EINVAL : 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int ret = 0, ret2;
+
+	struct bench_params p = { 1000, 0, 0x10000, 3, 8, 0, 0.5, 0, 0, { 1 } };
+	unsigned int runs = 1, run, seed = 1;
+	int keep = 0;
+	const char *tmpdir;
+	char dir[PATH_MAX];
+
+	while ((opt = getopt_long(argc, argv, "hVd:Fj:kl:n:r:R:s:S:w:x:", opts, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				p.files = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				if (parse_size_range(optarg, &p)) {
+					printf("Invalid size range: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'd':
+				p.depth = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				p.width = strtoul(optarg, NULL, 10);
+				if (!p.width)
+					p.width = 1;
+				break;
+			case 'l':
+				p.hardlinks = strtod(optarg, NULL);
+				break;
+			case 'x':
+				p.existing = strtod(optarg, NULL);
+				break;
+			case 'r':
+				p.removal = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				p.opts.jobs = strtoul(optarg, NULL, 10);
+				if (!p.opts.jobs || p.opts.jobs > AI_MERGE_MAX_JOBS) {
+					printf("Invalid job count: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'F':
+				p.fastreplace = 1;
+				break;
+			case 'R':
+				runs = strtoul(optarg, NULL, 10);
+				break;
+			case 'S':
+				seed = strtoul(optarg, NULL, 10);
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case 'V':
+				printf("%s\n", PACKAGE_STRING);
+				return 0;
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	if (argc - optind > 0)
+		tmpdir = argv[optind];
+	else {
+		tmpdir = getenv("TMPDIR");
+		if (!tmpdir)
+			tmpdir = "/tmp";
+	}
+
+	srand(seed);
+	bench_fill();
+
+	printf("# files=%lu size=%llu:%llu depth=%u width=%u hardlinks=%g"
+			" existing=%g remove=%lu fast-replace=%d seed=%u\n",
+			p.files, p.size_min, p.size_max, p.depth, p.width,
+			p.hardlinks, p.existing, p.removal, p.fastreplace, seed);
+	printf("# run\tstep\tusec\n");
+
+	for (run = 0; run < runs; run++) {
+		snprintf(dir, sizeof(dir), "%s/ai-bench.XXXXXX", tmpdir);
+		if (!mkdtemp(dir)) {
+			fprintf(stderr, "Temporary directory creation failed: %s\n",
+					strerror(errno));
+			return 1;
+		}
+
+		ret = bench_run(dir, &p, run);
+		fflush(stdout);
+
+		if (keep && run == runs - 1)
+			fprintf(stderr, "Trees kept in %s\n", dir);
+		else if ((ret2 = bench_rmtree(dir)))
+			fprintf(stderr, "Removing %s failed: %s\n", dir, strerror(ret2));
+
+		if (ret)
+			return 1;
+	}
+
+	return 0;
+}
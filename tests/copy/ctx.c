@@ -0,0 +1,450 @@
+/* atomic-install -- copying context tests
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "copy.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *tp(const char *rel) {
+	static char bufs[4][512];
+	static unsigned int n;
+	char *buf = bufs[n++ % 4];
+
+	snprintf(buf, sizeof(bufs[0]), "%s/%s", TEST_DIR, rel);
+	return buf;
+}
+
+static int rmtree_unlink(const char *path, const struct stat *st, int type,
+		struct FTW *ftw) {
+	return remove(path);
+}
+
+static void rmtree(const char *path) {
+	nftw(path, rmtree_unlink, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int make_file(const char *rel, const char *data, size_t len) {
+	FILE *f = fopen(tp(rel), "wb");
+	int ret;
+
+	if (!f)
+		return 0;
+	ret = fwrite(data, 1, len, f) == len;
+	return !fclose(f) && ret;
+}
+
+/* compare the contents of the two files */
+static int check_same(const char *rel, const char *orig) {
+	static char a[65536], b[65536];
+	FILE *f = fopen(tp(rel), "rb");
+	FILE *g = fopen(tp(orig), "rb");
+	size_t la, lb;
+	int ret = 1;
+
+	if (!f || !g) {
+		fprintf(stderr, "[%s] missing\n", f ? orig : rel);
+		ret = 0;
+	} else {
+		do {
+			la = fread(a, 1, sizeof(a), f);
+			lb = fread(b, 1, sizeof(b), g);
+		} while (la == lb && la && !memcmp(a, b, la));
+		if (la != lb || memcmp(a, b, la)) {
+			fprintf(stderr, "[%s] contents differ from %s\n", rel, orig);
+			ret = 0;
+		}
+	}
+
+	if (f)
+		fclose(f);
+	if (g)
+		fclose(g);
+	return ret;
+}
+
+static int check_stats(const char *what, ai_copy_ctx_t c,
+		unsigned long int files, unsigned long int links) {
+	ai_copy_stats_t st;
+
+	ai_copy_ctx_get_stats(c, &st);
+	if (st.files != files || st.links != links) {
+		fprintf(stderr, "[%s] %lu files, %lu links vs %lu, %lu expected\n",
+				what, st.files, st.links, files, links);
+		return 0;
+	}
+	return 1;
+}
+
+static int test_settings(void) {
+	char data[1000];
+	ai_copy_ctx_t limited, plain;
+	ai_copy_stats_t before;
+	ai_copy_throttle_t t;
+	size_t i;
+	int ret = 1;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7;
+	if (!make_file("input", data, sizeof(data))) {
+		perror("Input creation failed");
+		return 2;
+	}
+
+	if (ai_copy_ctx_new(&limited) || ai_copy_ctx_new(&plain)) {
+		perror("Context creation failed");
+		return 2;
+	}
+	ai_copy_ctx_get_stats(NULL, &before);
+
+	if (ai_copy_ctx_set_jobs(limited, 0) != EINVAL
+			|| ai_copy_ctx_set_jobs(limited, AI_COPY_MAX_JOBS + 1) != EINVAL
+			|| ai_copy_ctx_set_cache_policy(limited,
+				(ai_copy_cache_policy_t) 42) != EINVAL
+			|| ai_copy_ctx_set_strategy(limited,
+				(ai_copy_strategy_t) 42) != EINVAL) {
+		fprintf(stderr, "invalid settings accepted\n");
+		goto out;
+	}
+
+	/* a tiny buffer, and no linking for this context only */
+	if (ai_copy_ctx_set_strategy(limited, AI_COPY_READ_WRITE)
+			|| ai_copy_ctx_set_cache_policy(limited, AI_COPY_CACHE_DROP)
+			|| ai_copy_throttle_new(1 << 30, 0, &t)) {
+		fprintf(stderr, "valid settings rejected\n");
+		goto out;
+	}
+	ai_copy_ctx_set_bufsize(limited, 7);
+	ai_copy_ctx_set_throttle(limited, t);
+
+	if (ai_copy_ctx_cp_l(limited, tp("input"), tp("limited"))
+			|| ai_copy_ctx_cp_l(plain, tp("input"), tp("plain"))
+			|| ai_cp_l(tp("input"), tp("default"))) {
+		perror("Copying failed");
+		ret = 2;
+	} else if (check_stats("limited", limited, 1, 0)
+			&& check_stats("plain", plain, 0, 1)
+			&& check_stats("default", NULL, before.files, before.links + 1)
+			&& check_same("limited", "input") && check_same("plain", "input")
+			&& check_same("default", "input"))
+		ret = 0;
+
+	ai_copy_ctx_set_throttle(limited, NULL);
+	ai_copy_throttle_free(t);
+out:
+	ai_copy_ctx_free(limited);
+	ai_copy_ctx_free(plain);
+	return ret;
+}
+
+static unsigned int strategy_calls;
+
+static void count_strategy(dev_t source, dev_t dest,
+		ai_copy_strategy_t strategy) {
+	strategy_calls++;
+}
+
+/* copy the input using a new context */
+static int probe_cp(const char *rel, unsigned long int files,
+		unsigned long int links) {
+	ai_copy_ctx_t c;
+	int ret;
+
+	if (ai_copy_ctx_new(&c))
+		return 0;
+	ret = ai_copy_ctx_cp_l(c, tp("input"), tp(rel));
+	if (ret)
+		fprintf(stderr, "[%s] copying failed: %s\n", rel, strerror(ret));
+	ret = !ret && check_stats(rel, c, files, links) && check_same(rel, "input");
+
+	ai_copy_ctx_free(c);
+	return ret;
+}
+
+static int test_probes(void) {
+	ai_copy_probe_t probes[4], fake;
+	struct stat st;
+	size_t i, n;
+	int ret = 1;
+
+	if (!make_file("input", "data", 4) || stat(TEST_DIR, &st)) {
+		perror("Input creation failed");
+		return 2;
+	}
+	ai_copy_clear_probes();
+	ai_copy_set_strategy_callback(count_strategy);
+
+	if (ai_copy_get_probes(probes, 4)) {
+		fprintf(stderr, "probes left after clearing\n");
+		goto out;
+	}
+	strategy_calls = 0;
+	if (!probe_cp("probed", 0, 1))
+		goto out;
+	n = ai_copy_get_probes(probes, 4);
+	for (i = 0; i < n && i < 4; i++) {
+		if (probes[i].source == st.st_dev && probes[i].dest == st.st_dev)
+			break;
+	}
+	if (!strategy_calls || i == n || i == 4 || probes[i].link != 2) {
+		fprintf(stderr, "link not probed\n");
+		goto out;
+	}
+
+	/* the new contexts start with the probed strategies */
+	strategy_calls = 0;
+	if (!probe_cp("reused", 0, 1))
+		goto out;
+	if (strategy_calls) {
+		fprintf(stderr, "devices probed again\n");
+		goto out;
+	}
+
+	/* the added probes replace the known parts */
+	fake.source = fake.dest = st.st_dev;
+	fake.link = 3;
+	fake.strategy = AI_COPY_READ_WRITE;
+	if (ai_copy_add_probes(&fake, 1) != EINVAL) {
+		fprintf(stderr, "invalid probe accepted\n");
+		goto out;
+	}
+	fake.link = 0;
+	if (ai_copy_add_probes(&fake, 1) || !probe_cp("added", 1, 0))
+		goto out;
+
+	ai_copy_clear_probes();
+	if (!probe_cp("cleared", 0, 1))
+		goto out;
+	if (!strategy_calls) {
+		fprintf(stderr, "devices not probed after clearing\n");
+		goto out;
+	}
+	ret = 0;
+
+out:
+	ai_copy_set_strategy_callback(NULL);
+	ai_copy_clear_probes();
+	return ret;
+}
+
+/* larger than AI_COPY_CHUNKED_MIN, with a partial last chunk */
+#define CHUNKED_SIZE (67 * 1024 * 1024 + 123)
+
+/* write @size bytes of data differing between the chunks */
+static int make_big(const char *rel, size_t size) {
+	FILE *f = fopen(tp(rel), "wb");
+	unsigned long int x = 1;
+	char buf[65536];
+	size_t i, len;
+	int ret = 1;
+
+	if (!f)
+		return 0;
+	for (; size && ret; size -= len) {
+		len = size < sizeof(buf) ? size : sizeof(buf);
+		for (i = 0; i < len; i++) {
+			x = x * 1103515245 + 12345;
+			buf[i] = x >> 16;
+		}
+		ret = fwrite(buf, 1, len, f) == len;
+	}
+	return !fclose(f) && ret;
+}
+
+/* copy @orig to @rel using a new context with the given settings */
+static int big_cp(const char *rel, const char *orig, unsigned int jobs,
+		ai_copy_strategy_t strategy, ai_copy_cache_policy_t policy) {
+	ai_copy_ctx_t c;
+	ai_copy_stats_t st;
+	int ret;
+
+	if (ai_copy_ctx_new(&c))
+		return 0;
+	ret = ai_copy_ctx_set_jobs(c, jobs);
+	if (!ret)
+		ret = ai_copy_ctx_set_strategy(c, strategy);
+	if (!ret)
+		ret = ai_copy_ctx_set_cache_policy(c, policy);
+	if (!ret)
+		ret = ai_copy_ctx_cp_a(c, tp(orig), tp(rel));
+	if (ret)
+		fprintf(stderr, "[%s] copying failed: %s\n", rel, strerror(ret));
+
+	ai_copy_ctx_get_stats(c, &st);
+	ai_copy_ctx_free(c);
+	if (!ret && st.files != 1) {
+		fprintf(stderr, "[%s] %lu files copied\n", rel, st.files);
+		ret = 1;
+	}
+	return !ret && check_same(rel, orig);
+}
+
+static int test_chunked(void) {
+	if (ai_copy_ctx_set_jobs(NULL, 4) == ENOSYS)
+		return 77;
+	ai_copy_ctx_set_jobs(NULL, 1);
+	if (!make_big("input", CHUNKED_SIZE)) {
+		perror("Input creation failed");
+		return 2;
+	}
+
+	/* pread() and pwrite(), and the fastest strategy for the chunks */
+	if (!big_cp("rw", "input", 4, AI_COPY_READ_WRITE, AI_COPY_CACHE_KEEP)
+			|| !big_cp("fast", "input", 4, AI_COPY_NONE, AI_COPY_CACHE_KEEP))
+		return 1;
+	return 0;
+}
+
+/* larger than AI_COPY_DIRECT_MIN, with an unaligned tail */
+#define DIRECT_SIZE (17 * 1024 * 1024 + 321)
+
+static int test_cache(void) {
+	int direct;
+
+	if (!make_big("input", DIRECT_SIZE) || !make_big("small", 5000)) {
+		perror("Input creation failed");
+		return 2;
+	}
+	direct = ai_copy_ctx_set_cache_policy(NULL, AI_COPY_CACHE_DIRECT) != ENOSYS;
+	ai_copy_ctx_set_cache_policy(NULL, AI_COPY_CACHE_KEEP);
+
+	if (!big_cp("drop-rw", "input", 1, AI_COPY_READ_WRITE, AI_COPY_CACHE_DROP)
+			|| !big_cp("drop", "input", 1, AI_COPY_NONE, AI_COPY_CACHE_DROP)
+			|| !big_cp("drop-small", "small", 1, AI_COPY_NONE,
+				AI_COPY_CACHE_DROP))
+		return 1;
+
+	/* falls back to the page cache where O_DIRECT is not supported */
+	if (direct && (!big_cp("direct-rw", "input", 1, AI_COPY_READ_WRITE,
+					AI_COPY_CACHE_DIRECT)
+				|| !big_cp("direct", "input", 1, AI_COPY_NONE,
+					AI_COPY_CACHE_DIRECT)
+				|| !big_cp("direct-small", "small", 1, AI_COPY_NONE,
+					AI_COPY_CACHE_DIRECT)))
+		return 1;
+	return 0;
+}
+
+static double elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - start->tv_sec
+		+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int test_throttle(void) {
+	struct timespec start;
+	ai_copy_throttle_t t;
+	ai_copy_ctx_t c;
+	double secs;
+	int i, ret = 1;
+
+	if (!make_big("input", 300 * 1024)) {
+		perror("Input creation failed");
+		return 2;
+	}
+	if (ai_copy_ctx_new(&c) || ai_copy_throttle_new(1024 * 1024, 100, &t)) {
+		perror("Context creation failed");
+		return 2;
+	}
+
+	/* 0.1 s worth of a burst, and the rest at 1 MiB/s */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ai_copy_ctx_set_strategy(c, AI_COPY_READ_WRITE);
+	ai_copy_ctx_set_throttle(c, t);
+	if (ai_copy_ctx_cp_a(c, tp("input"), tp("output"))
+			|| !check_same("output", "input"))
+		goto out;
+	secs = elapsed(&start);
+	if (secs < 0.15) {
+		fprintf(stderr, "300 KiB copied in %.3f s at 1 MiB/s\n", secs);
+		goto out;
+	}
+
+	/* 10 operations of a burst, and the rest at 100 per second */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 40; i++)
+		ai_copy_throttle(t, 0, 1);
+	secs = elapsed(&start);
+	if (secs < 0.2) {
+		fprintf(stderr, "40 operations in %.3f s at 100 per second\n", secs);
+		goto out;
+	}
+
+	/* no limits, no sleeping */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 1000; i++)
+		ai_copy_throttle(NULL, 1 << 30, 1000);
+	secs = elapsed(&start);
+	if (secs > 0.1) {
+		fprintf(stderr, "no limits took %.3f s\n", secs);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	ai_copy_ctx_set_throttle(c, NULL);
+	ai_copy_throttle_free(t);
+	ai_copy_ctx_free(c);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*func)(void);
+} tests[] = {
+	{ "ctx-settings", test_settings },
+	{ "ctx-probes", test_probes },
+	{ "ctx-chunked", test_chunked },
+	{ "ctx-cache", test_cache },
+	{ "ctx-throttle", test_throttle },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+	const char *code = argv[1];
+	const char *slash;
+	int i, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Synopsis: %s test-name\n", argv[0]);
+		return 3;
+	}
+
+	/* stupid automake! */
+	slash = strrchr(code, '/');
+	if (slash)
+		code = slash + 1;
+
+	for (i = 0; tests[i].name; i++) {
+		if (!strcmp(tests[i].name, code))
+			break;
+	}
+	if (!tests[i].name) {
+		fprintf(stderr, "Invalid arg: [%s]\n", code);
+		return 3;
+	}
+
+	rmtree(TEST_DIR);
+	if (mkdir(TEST_DIR, 0755)) {
+		perror("Test directory creation failed");
+		return 2;
+	}
+
+	ret = tests[i].func();
+	if (!ret)
+		rmtree(TEST_DIR);
+	return ret;
+}
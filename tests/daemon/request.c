@@ -0,0 +1,225 @@
+/* atomic-install -- merge daemon tests
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "daemon.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* relative to TEST_DIR, the working directory of the tests */
+#define SOCKET_PATH "sock"
+#define OUTPUT_PATH "output"
+
+/* prints the request as seen by the worker */
+static int test_run(int argc, char *argv[]) {
+	char cwd[4096];
+	int i;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return 2;
+	printf("cwd=%s\n", strrchr(cwd, '/') + 1);
+	for (i = 0; i < argc; i++)
+		printf("argv[%d]=%s\n", i, argv[i]);
+	if (argv[argc])
+		printf("argv not terminated\n");
+	return 42;
+}
+
+static pid_t start_daemon(void) {
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid == 0) {
+		const int fd = open("/dev/null", O_WRONLY);
+
+		if (fd == -1 || dup2(fd, 1) == -1)
+			_exit(2);
+		_exit(daemon_serve(SOCKET_PATH, test_run));
+	} else if (pid == -1)
+		return -1;
+
+	/* wait for the socket */
+	for (i = 0; i < 500; i++) {
+		struct stat st;
+
+		if (!stat(SOCKET_PATH, &st))
+			return pid;
+		usleep(10000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void stop_daemon(pid_t pid) {
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* submits the request with the output redirected to OUTPUT_PATH */
+static int submit(int argc, char *argv[], char *out, size_t outsize) {
+	const int fd = open(OUTPUT_PATH, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	int saved, ret;
+	ssize_t rd;
+
+	fflush(stdout);
+	saved = dup(1);
+	if (fd == -1 || saved == -1 || dup2(fd, 1) == -1)
+		return -1;
+	ret = daemon_submit(SOCKET_PATH, argc, argv);
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+
+	rd = pread(fd, out, outsize - 1, 0);
+	close(fd);
+	if (rd == -1)
+		return -1;
+	out[rd] = 0;
+	return ret;
+}
+
+static int test_request(void) {
+	char *argv[] = { "atomic-install", "-x", "arg" };
+	const char *expected = "cwd=tmp\nargv[0]=atomic-install\nargv[1]=-x\n"
+		"argv[2]=arg\n";
+	char out[256];
+	pid_t pid;
+	int ret = 0, status;
+
+	pid = start_daemon();
+	if (pid == -1)
+		return 2;
+
+	status = submit(3, argv, out, sizeof(out));
+	if (status != 42) {
+		fprintf(stderr, "Request finished with %d instead of 42\n", status);
+		ret = 1;
+	}
+	if (strcmp(out, expected)) {
+		fprintf(stderr, "Unexpected output:\n%s", out);
+		ret = 1;
+	}
+
+	stop_daemon(pid);
+	return ret;
+}
+
+static int test_invalid(void) {
+	struct sockaddr_un addr;
+	char out[256];
+	uint32_t len = 0;
+	pid_t pid;
+	int fd, ret = 0, status;
+
+	pid = start_daemon();
+	if (pid == -1)
+		return 2;
+
+	/* the working directory only */
+	status = submit(0, NULL, out, sizeof(out));
+	if (status != 1 || strcmp(out, "Invalid daemon request.\n")) {
+		fprintf(stderr, "Empty request finished with %d:\n%s", status, out);
+		ret = 1;
+	}
+
+	/* no request at all, without the standard streams */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, SOCKET_PATH);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))
+			|| write(fd, &len, sizeof(len)) != sizeof(len)) {
+		stop_daemon(pid);
+		return 2;
+	}
+	if (read(fd, out, 1) != 0) {
+		fprintf(stderr, "Invalid request not rejected\n");
+		ret = 1;
+	}
+	close(fd);
+
+	/* the daemon still works */
+	{
+		char *argv[] = { "atomic-install", "ok" };
+
+		status = submit(2, argv, out, sizeof(out));
+		if (status != 42) {
+			fprintf(stderr, "Request finished with %d instead of 42\n", status);
+			ret = 1;
+		}
+	}
+
+	stop_daemon(pid);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*func)(void);
+} tests[] = {
+	{ "daemon-request", test_request },
+	{ "daemon-invalid", test_invalid },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+	const char *code = argv[1];
+	const char *slash;
+	char cwd[4096];
+	int i, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Synopsis: %s test-name\n", argv[0]);
+		return 3;
+	}
+
+	/* stupid automake! */
+	slash = strrchr(code, '/');
+	if (slash)
+		code = slash + 1;
+
+	for (i = 0; tests[i].name; i++) {
+		if (!strcmp(tests[i].name, code))
+			break;
+	}
+	if (!tests[i].name) {
+		fprintf(stderr, "Invalid arg: [%s]\n", code);
+		return 3;
+	}
+
+	if (!getcwd(cwd, sizeof(cwd)) || (mkdir(TEST_DIR, 0700) && errno != EEXIST)
+			|| chdir(TEST_DIR)) {
+		perror("Test directory creation failed");
+		return 2;
+	}
+
+	ret = tests[i].func();
+	unlink(SOCKET_PATH);
+	unlink(OUTPUT_PATH);
+	if (chdir(cwd))
+		return 2;
+	if (!ret)
+		rmdir(TEST_DIR);
+	return ret;
+}
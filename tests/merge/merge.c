@@ -0,0 +1,2065 @@
+/* atomic-install -- merge tests
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+#include "journal.h"
+#include "lock.h"
+#include "merge.h"
+#include "store.h"
+#include "tar.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+
+struct event_log {
+	ai_merge_event_t ev[MAX_EVENTS];
+	size_t n;
+};
+
+static const char *tp(const char *rel) {
+	static char bufs[4][512];
+	static unsigned int n;
+	char *buf = bufs[n++ % 4];
+
+	snprintf(buf, sizeof(bufs[0]), "%s/%s", TEST_DIR, rel);
+	return buf;
+}
+
+static int rmtree_unlink(const char *path, const struct stat *st, int type,
+		struct FTW *ftw) {
+	return remove(path);
+}
+
+static void rmtree(const char *path) {
+	nftw(path, rmtree_unlink, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int make_dirs(const char *path) {
+	char buf[512];
+	char *p;
+
+	strcpy(buf, path);
+	for (p = buf + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		if (mkdir(buf, 0755) && errno != EEXIST)
+			return 0;
+		*p = '/';
+	}
+
+	return !mkdir(buf, 0755) || errno == EEXIST;
+}
+
+/* NULL data creates a directory */
+static int make_file(const char *rel, const char *data) {
+	const char *path = tp(rel);
+	char dir[512];
+	FILE *f;
+	int ret;
+
+	strcpy(dir, path);
+	*strrchr(dir, '/') = 0;
+	if (!make_dirs(dir))
+		return 0;
+	if (!data)
+		return make_dirs(path);
+
+	f = fopen(path, "wb");
+	if (!f)
+		return 0;
+	ret = fputs(data, f) >= 0;
+	return !fclose(f) && ret;
+}
+
+/* NULL data expects the file to be missing */
+static int check_file(const char *rel, const char *data) {
+	char buf[256];
+	FILE *f = fopen(tp(rel), "rb");
+	size_t len;
+
+	if (!f) {
+		if (data)
+			fprintf(stderr, "[%s] missing\n", rel);
+		return !data;
+	} else if (!data) {
+		fprintf(stderr, "[%s] left behind\n", rel);
+		fclose(f);
+		return 0;
+	}
+
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[len] = 0;
+	fclose(f);
+
+	if (strcmp(buf, data)) {
+		fprintf(stderr, "[%s] contents differ: %s vs %s\n", rel, data, buf);
+		return 0;
+	}
+	return 1;
+}
+
+/* the temporary files are dot-prefixed */
+static int check_clean(const char *rel) {
+	DIR *d = opendir(tp(rel));
+	struct dirent *de;
+	int ret = 1;
+
+	if (!d)
+		return errno == ENOENT;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' && strcmp(de->d_name, ".")
+				&& strcmp(de->d_name, "..")) {
+			fprintf(stderr, "[%s] temporary file left: %s\n", rel, de->d_name);
+			ret = 0;
+		}
+	}
+
+	closedir(d);
+	return ret;
+}
+
+static int create_journal(const char *rel, const char *source,
+		const char *removed, ai_journal_t *j) {
+	ai_journal_t nj;
+	int ret;
+
+	ret = ai_journal_create_start(tp(rel), source ? tp(source) : NULL, &nj);
+	if (ret)
+		return ret;
+	if (removed)
+		ret = ai_journal_create_append(nj, removed, AI_MERGE_FILE_REMOVE);
+
+	if (ret) {
+		ai_journal_create_finish(nj);
+		return ret;
+	}
+	ret = ai_journal_create_finish(nj);
+	if (!ret)
+		ret = ai_journal_open(tp(rel), j);
+	return ret;
+}
+
+static int merge_sync(const char *source, const char *dest, ai_journal_t j) {
+	int ret;
+
+	ret = ai_merge_copy_new(tp(source), tp(dest), j, NULL, NULL);
+	if (!ret)
+		ret = ai_merge_backup_old(tp(dest), j, NULL);
+	if (!ret)
+		ret = ai_merge_replace(tp(dest), j, NULL);
+	if (!ret)
+		ret = ai_merge_cleanup(tp(dest), j, NULL, NULL);
+	return ret;
+}
+
+static void take_events(ai_merge_async_t a, struct event_log *l) {
+	ai_merge_event_t ev;
+
+	while (ai_merge_async_get_event(a, &ev)) {
+		if (l->n == MAX_EVENTS)
+			continue;
+		l->ev[l->n] = ev;
+		if (ev.path)
+			l->ev[l->n].path = strdup(ev.path);
+		l->n++;
+	}
+}
+
+static void free_events(struct event_log *l) {
+	size_t i;
+
+	for (i = 0; i < l->n; i++)
+		free((char *) l->ev[i].path);
+	l->n = 0;
+}
+
+/* returns the DONE error, or -1 if there was none */
+static int run_async(const char *source, const char *dest, ai_journal_t j,
+		unsigned int flags, struct event_log *l) {
+	ai_merge_async_t a;
+	int ret;
+
+	ret = ai_merge_async_start(tp(source), tp(dest), j, NULL, flags, &a);
+	if (ret) {
+		fprintf(stderr, "Async start failed: %s\n", strerror(ret));
+		return ret;
+	}
+
+	while (ai_merge_async_step(a, 4))
+		take_events(a, l);
+	take_events(a, l);
+	ai_merge_async_free(a);
+
+	if (!l->n || l->ev[l->n - 1].type != AI_MERGE_EVENT_DONE)
+		return -1;
+	return l->ev[l->n - 1].error;
+}
+
+static ai_merge_phase_t first_phase(ai_journal_t j, unsigned int flags) {
+	ai_merge_phase_t phase = AI_MERGE_PHASE_NONE;
+	ai_merge_async_t a;
+	ai_merge_event_t ev;
+
+	if (ai_merge_async_start(tp("src"), tp("dst"), j, NULL, flags, &a))
+		return AI_MERGE_PHASE_NONE;
+
+	/* start the phase, without processing any entries */
+	ai_merge_async_step(a, 0);
+	while (ai_merge_async_get_event(a, &ev)) {
+		if (ev.type == AI_MERGE_EVENT_PHASE && phase == AI_MERGE_PHASE_NONE)
+			phase = ev.phase;
+	}
+
+	ai_merge_async_free(a);
+	return phase;
+}
+
+static int expect_phase(ai_journal_t j, unsigned int flags,
+		ai_merge_phase_t expected) {
+	const ai_merge_phase_t phase = first_phase(j, flags);
+
+	if (phase != expected) {
+		fprintf(stderr, "Started %s instead of %s\n", ai_merge_phase_name(phase),
+				ai_merge_phase_name(expected));
+		return 0;
+	}
+	return 1;
+}
+
+static int test_async_phase(void) {
+	ai_journal_t j;
+	struct event_log l = { .n = 0 };
+	int ret;
+
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("dst/usr/bin/tool", "old")
+			|| create_journal("journal", "src", NULL, &j))
+		return 2;
+
+	ret = !expect_phase(j, 0, AI_MERGE_PHASE_COPY_NEW);
+	if (!ret && ai_merge_copy_new(tp("src"), tp("dst"), j, NULL, NULL))
+		ret = 2;
+	if (!ret)
+		ret = !expect_phase(j, 0, AI_MERGE_PHASE_BACKUP_OLD);
+	if (!ret && ai_merge_backup_old(tp("dst"), j, NULL))
+		ret = 2;
+	if (!ret)
+		ret = !expect_phase(j, 0, AI_MERGE_PHASE_REPLACE)
+			|| !expect_phase(j, AI_MERGE_ASYNC_NO_REPLACE, AI_MERGE_PHASE_NONE)
+			/* this one marks the rollback as started */
+			|| !expect_phase(j, AI_MERGE_ASYNC_ROLLBACK,
+					AI_MERGE_PHASE_ROLLBACK_REPLACE)
+			|| !expect_phase(j, 0, AI_MERGE_PHASE_ROLLBACK_REPLACE);
+
+	if (!ret && run_async("src", "dst", j, 0, &l)) {
+		fprintf(stderr, "Async rollback failed\n");
+		ret = 1;
+	}
+	if (!ret)
+		ret = !check_file("dst/usr/bin/tool", "old")
+			|| !check_clean("dst/usr/bin");
+
+	free_events(&l);
+	ai_journal_close(j);
+	return ret;
+}
+
+static int test_replace_rollback(void) {
+	ai_journal_t j;
+	struct event_log l = { .n = 0 };
+	char staged[64];
+	size_t i;
+	int failed = 0, ret;
+
+	if (!make_file("src/usr/bin/a", "new")
+			|| !make_file("src/usr/bin/b", "new")
+			|| !make_file("dst/usr/bin/a", "old")
+			|| !make_file("dst/usr/bin/b", "old")
+			|| create_journal("journal", "src", NULL, &j))
+		return 2;
+
+	if (run_async("src", "dst", j, AI_MERGE_ASYNC_NO_REPLACE, &l)) {
+		ai_journal_close(j);
+		return 2;
+	}
+	free_events(&l);
+
+	/* make replacing fail half-way */
+	sprintf(staged, "dst/usr/bin/.%s~b.new", ai_journal_get_filename_prefix(j));
+	if (unlink(tp(staged))) {
+		ai_journal_close(j);
+		return 2;
+	}
+
+	ret = run_async("src", "dst", j, 0, &l);
+	if (ret != ENOENT) {
+		fprintf(stderr, "Merge finished with %d instead of ENOENT\n", ret);
+		ret = 1;
+	} else
+		ret = 0;
+
+	for (i = 0; i < l.n; i++) {
+		if (l.ev[i].type == AI_MERGE_EVENT_FAILED) {
+			failed++;
+			if (l.ev[i].phase != AI_MERGE_PHASE_REPLACE) {
+				fprintf(stderr, "Unexpected failure in %s\n",
+						ai_merge_phase_name(l.ev[i].phase));
+				ret = 1;
+			}
+		}
+	}
+	if (failed != 1) {
+		fprintf(stderr, "%d failures reported\n", failed);
+		ret = 1;
+	}
+
+	if (!(ai_journal_get_flags(j) & AI_MERGE_ROLLBACK_STARTED)
+			|| (ai_journal_get_flags(j) & AI_MERGE_REPLACED)) {
+		fprintf(stderr, "Merge not rolled back\n");
+		ret = 1;
+	}
+	if (!check_file("dst/usr/bin/a", "old") || !check_file("dst/usr/bin/b", "old")
+			|| !check_clean("dst/usr/bin"))
+		ret = 1;
+
+	free_events(&l);
+	ai_journal_close(j);
+	return ret;
+}
+
+static int test_replace_resume(void) {
+	static const char *const dests[] = { "dst", "dst-prepared" };
+	ai_journal_t j;
+	char staged[64], journal[64], rel[64];
+	const char *dest;
+	size_t i;
+	int ret = 0, err;
+
+	if (!make_file("src/usr/bin/a", "new")
+			|| !make_file("src/usr/bin/b", "new")
+			|| !make_file("src/usr/bin/c", "new"))
+		return 2;
+
+	for (i = 0; i < sizeof(dests) / sizeof(*dests); i++) {
+		dest = dests[i];
+		sprintf(rel, "%s/usr/bin/a", dest);
+		if (!make_file(rel, "old"))
+			return 2;
+		sprintf(rel, "%s/usr/bin/b", dest);
+		if (!make_file(rel, "old"))
+			return 2;
+		sprintf(journal, "journal-%s", dest);
+		if (create_journal(journal, "src", NULL, &j))
+			return 2;
+
+		if (ai_merge_copy_new(tp("src"), tp(dest), j, NULL, NULL)
+				|| ai_merge_backup_old(tp(dest), j, NULL)) {
+			ai_journal_close(j);
+			return 2;
+		}
+
+		/* interrupt replacing after a and c */
+		sprintf(staged, "%s/usr/bin/.%s~a.new", dest,
+				ai_journal_get_filename_prefix(j));
+		sprintf(rel, "%s/usr/bin/a", dest);
+		err = rename(tp(staged), tp(rel));
+		sprintf(staged, "%s/usr/bin/.%s~c.new", dest,
+				ai_journal_get_filename_prefix(j));
+		sprintf(rel, "%s/usr/bin/c", dest);
+		if (err || rename(tp(staged), tp(rel))) {
+			ai_journal_close(j);
+			return 2;
+		}
+
+		if (i)
+			err = ai_merge_replace_prepared(tp(dest), j, NULL, NULL);
+		else
+			err = ai_merge_replace(tp(dest), j, NULL);
+		if (err == ENOSYS)
+			err = ai_merge_replace(tp(dest), j, NULL);
+		if (!err)
+			err = ai_merge_cleanup(tp(dest), j, NULL, NULL);
+		if (err) {
+			fprintf(stderr, "[%s] Resuming failed: %s\n", dest, strerror(err));
+			ret = 1;
+		}
+
+		sprintf(rel, "%s/usr/bin/a", dest);
+		if (!check_file(rel, "new"))
+			ret = 1;
+		sprintf(rel, "%s/usr/bin/b", dest);
+		if (!check_file(rel, "new"))
+			ret = 1;
+		sprintf(rel, "%s/usr/bin/c", dest);
+		if (!check_file(rel, "new"))
+			ret = 1;
+		sprintf(rel, "%s/usr/bin", dest);
+		if (!check_clean(rel))
+			ret = 1;
+
+		ai_journal_close(j);
+	}
+
+	return ret;
+}
+
+static int test_fast_replace(void) {
+	ai_journal_t j;
+	unsigned long int window = (unsigned long int) -1;
+	int ret;
+
+	if (!make_file("src/usr/bin/a", "new")
+			|| !make_file("src/usr/lib/b", "new")
+			|| !make_file("dst/usr/bin/a", "old")
+			|| !make_file("dst/usr/bin/gone", "old"))
+		return 2;
+
+	/* the directory of the second removed file does not exist */
+	ret = ai_journal_create_start(tp("journal"), tp("src"), &j);
+	if (!ret)
+		ret = ai_journal_create_append(j, "/usr/bin/gone", AI_MERGE_FILE_REMOVE);
+	if (!ret)
+		ret = ai_journal_create_append(j, "/gone/dir/file", AI_MERGE_FILE_REMOVE);
+	if (ret) {
+		ai_journal_create_finish(j);
+		return 2;
+	}
+	if (ai_journal_create_finish(j) || ai_journal_open(tp("journal"), &j))
+		return 2;
+
+	if (ai_merge_copy_new(tp("src"), tp("dst"), j, NULL, NULL)
+			|| ai_merge_backup_old(tp("dst"), j, NULL)) {
+		ai_journal_close(j);
+		return 2;
+	}
+
+	ret = ai_merge_replace_prepared(tp("dst"), j, NULL, &window);
+	if (ret == ENOSYS) {
+		ai_journal_close(j);
+		return 0;
+	}
+	if (!ret)
+		ret = ai_merge_cleanup(tp("dst"), j, NULL, NULL);
+	if (ret) {
+		fprintf(stderr, "Fast replace failed: %s\n", strerror(ret));
+		ret = 1;
+	} else {
+		ret = !check_file("dst/usr/bin/a", "new")
+			|| !check_file("dst/usr/lib/b", "new")
+			|| !check_file("dst/usr/bin/gone", NULL)
+			|| !check_clean("dst/usr/bin") || !check_clean("dst/usr/lib");
+		if (window == (unsigned long int) -1) {
+			fprintf(stderr, "Replace window not stored\n");
+			ret = 1;
+		}
+	}
+	if (!(ai_journal_get_flags(j) & AI_MERGE_REPLACED)) {
+		fprintf(stderr, "AI_MERGE_REPLACED not set\n");
+		ret = 1;
+	}
+
+	ai_journal_close(j);
+	return ret;
+}
+
+static int test_paths(void) {
+	static const char *const files[] = {
+		"usr/a", "usr/lib/b", "usr/lib/x/y/z/c", "usr/lib/d", NULL
+	};
+	char rel[512], name[256];
+	ai_journal_t j;
+	size_t i;
+	int ret;
+
+	/* the directories alternate between long and short paths */
+	memset(name, 'n', 200);
+	name[200] = 0;
+	for (i = 0; files[i]; i++) {
+		sprintf(rel, "src/%s", files[i]);
+		if (!make_file(rel, "new"))
+			return 2;
+		sprintf(rel, "dst/%s", files[i]);
+		if (!make_file(rel, "old"))
+			return 2;
+	}
+	sprintf(rel, "src/usr/lib/x/y/z/%s", name);
+	if (!make_file(rel, "long") || !make_file("dst/usr/lib/x/gone", "old")
+			|| !make_file("dst/usr/lib/x/y/z/kept", "old")
+			|| create_journal("journal", "src", "/usr/lib/x/gone", &j))
+		return 2;
+
+	ret = merge_sync("src", "dst", j);
+	ai_journal_close(j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	for (i = 0; files[i]; i++) {
+		sprintf(rel, "dst/%s", files[i]);
+		if (!check_file(rel, "new"))
+			ret = 1;
+	}
+	sprintf(rel, "dst/usr/lib/x/y/z/%s", name);
+	if (!check_file(rel, "long") || !check_file("dst/usr/lib/x/gone", NULL)
+			|| !check_file("dst/usr/lib/x/y/z/kept", "old")
+			|| !check_clean("dst/usr") || !check_clean("dst/usr/lib")
+			|| !check_clean("dst/usr/lib/x") || !check_clean("dst/usr/lib/x/y/z"))
+		ret = 1;
+
+	return ret;
+}
+
+static int test_subtree(void) {
+	ai_merge_stats_t st;
+	ai_journal_t j;
+	char staged[64];
+	int ret;
+
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("src/usr/share/pkg/a", "a")
+			|| !make_file("src/usr/share/pkg/sub/b", "b")
+			|| !make_file("dst/usr/bin/tool", "old")
+			|| create_journal("journal", "src", NULL, &j))
+		return 2;
+
+	if (ai_merge_copy_new(tp("src"), tp("dst"), j, NULL, NULL)) {
+		ai_journal_close(j);
+		return 2;
+	}
+
+	/* the missing directory is staged as a whole, with the final names */
+	sprintf(staged, "dst/usr/.%s~share.new/pkg/sub/b",
+			ai_journal_get_filename_prefix(j));
+	ret = !check_file(staged, "b") || !check_file("dst/usr/share", NULL);
+
+	memset(&st, 0, sizeof(st));
+	ai_merge_set_stats(&st);
+	if (!ret && (ai_merge_backup_old(tp("dst"), j, NULL)
+				|| ai_merge_replace(tp("dst"), j, NULL)))
+		ret = 2;
+	ai_merge_set_stats(NULL);
+
+	/* the tool, and the subtree in one go */
+	if (!ret && st.renamed != 2) {
+		fprintf(stderr, "%lu renames instead of 2\n", st.renamed);
+		ret = 1;
+	}
+	if (!ret && ai_merge_cleanup(tp("dst"), j, NULL, NULL))
+		ret = 2;
+	if (!ret)
+		ret = !check_file("dst/usr/bin/tool", "new")
+			|| !check_file("dst/usr/share/pkg/a", "a")
+			|| !check_file("dst/usr/share/pkg/sub/b", "b")
+			|| !check_clean("dst/usr") || !check_clean("dst/usr/bin")
+			|| !check_clean("dst/usr/share/pkg");
+
+	ai_journal_close(j);
+	return ret;
+}
+
+/* fill the source and destination trees of the parallel merge tests */
+static int make_parallel(const char *dest) {
+	char rel[64];
+	unsigned long int d, f;
+
+	for (d = 0; d < 8; d++) {
+		for (f = 0; f < 4; f++) {
+			sprintf(rel, "src/usr/d%lu/f%lu", d, f);
+			if (!make_file(rel, "new"))
+				return 0;
+			sprintf(rel, "%s/usr/d%lu/f%lu", dest, d, f);
+			if (f % 2 && !make_file(rel, "old"))
+				return 0;
+		}
+		sprintf(rel, "%s/usr/d%lu/gone", dest, d);
+		if (!make_file(rel, "old"))
+			return 0;
+	}
+	return 1;
+}
+
+static int check_parallel(const char *dest, const char *data) {
+	char rel[64];
+	unsigned long int d, f;
+	int ret = 1;
+
+	for (d = 0; d < 8; d++) {
+		for (f = 0; f < 4; f++) {
+			sprintf(rel, "%s/usr/d%lu/f%lu", dest, d, f);
+			if (!check_file(rel, data ? data : f % 2 ? "old" : NULL))
+				ret = 0;
+		}
+		sprintf(rel, "%s/usr/d%lu/gone", dest, d);
+		if (!check_file(rel, data ? NULL : "old"))
+			ret = 0;
+		sprintf(rel, "%s/usr/d%lu", dest, d);
+		if (!check_clean(rel))
+			ret = 0;
+	}
+	return ret;
+}
+
+static int parallel_journal(const char *rel, ai_journal_t *j) {
+	ai_journal_t nj;
+	char removed[64];
+	unsigned long int d;
+	int ret = 0;
+
+	ret = ai_journal_create_start(tp(rel), tp("src"), &nj);
+	if (ret)
+		return ret;
+	for (d = 0; d < 8 && !ret; d++) {
+		sprintf(removed, "/usr/d%lu/gone", d);
+		ret = ai_journal_create_append(nj, removed, AI_MERGE_FILE_REMOVE);
+	}
+
+	if (ret) {
+		ai_journal_create_finish(nj);
+		return ret;
+	}
+	ret = ai_journal_create_finish(nj);
+	if (!ret)
+		ret = ai_journal_open(tp(rel), j);
+	return ret;
+}
+
+static int test_parallel(void) {
+	ai_merge_options_t opts;
+	ai_journal_t j, k;
+	int ret = 0;
+
+	if (!make_parallel("dst") || !make_parallel("back")
+			|| parallel_journal("journal1", &j))
+		return 2;
+	if (parallel_journal("journal2", &k)) {
+		ai_journal_close(j);
+		return 2;
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = AI_MERGE_MAX_JOBS + 1;
+	if (ai_merge_backup_old(tp("dst"), j, &opts) != EINVAL) {
+		fprintf(stderr, "Too many jobs accepted\n");
+		ret = 1;
+	}
+
+	opts.jobs = 4;
+	ret = ai_merge_copy_new(tp("src"), tp("dst"), j, &opts, NULL);
+	if (!ret)
+		ret = ai_merge_backup_old(tp("dst"), j, &opts);
+	if (ret == ENOSYS)
+		ret = 77;
+	else if (!ret) {
+		ret = ai_merge_replace(tp("dst"), j, &opts);
+		if (!ret)
+			ret = ai_merge_cleanup(tp("dst"), j, &opts, NULL);
+		if (ret)
+			fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		else if (!check_parallel("dst", "new"))
+			ret = 1;
+	} else
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+
+	/* the second merge is rolled back after the backups */
+	if (!ret) {
+		ret = ai_merge_copy_new(tp("src"), tp("back"), k, &opts, NULL);
+		if (!ret)
+			ret = ai_merge_backup_old(tp("back"), k, &opts);
+		if (!ret)
+			ret = ai_merge_rollback_replace(tp("back"), k, &opts);
+		if (!ret)
+			ret = ai_merge_rollback_new(tp("back"), k, &opts);
+		if (ret)
+			fprintf(stderr, "Rollback failed: %s\n", strerror(ret));
+		else if (!check_parallel("back", NULL))
+			ret = 1;
+	}
+
+	ai_journal_close(j);
+	ai_journal_close(k);
+	return ret;
+}
+
+/* a tree with each kind of the planned operations */
+static int make_planned(ai_journal_t *j) {
+	return make_file("src/usr/bin/tool", "new")
+		&& !symlink("tool", tp("src/usr/bin/link"))
+		&& make_file("src/usr/share/new/f", "new")
+		&& make_file("dst/usr/bin/tool", "old")
+		&& make_file("dst/usr/share", NULL)
+		&& make_file("dst/usr/lib/gone", "old")
+		&& !create_journal("journal", "src", "/usr/lib/gone", j);
+}
+
+static int test_plan(void) {
+	ai_merge_plan_t plan;
+	ai_journal_t j;
+	int ret = 0;
+
+	if (!make_planned(&j))
+		return 2;
+
+	ret = ai_merge_plan(tp("src"), tp("dst"), j, NULL, &plan);
+	if (ret) {
+		fprintf(stderr, "Planning failed: %s\n", strerror(ret));
+		ret = 1;
+	} else if (plan.linked != 2 || plan.copied || plan.others != 1
+			|| plan.dirs != 1 || plan.removed != 1 || plan.backups != 1
+			|| plan.replace_ops != 4 || plan.inodes != 2) {
+		fprintf(stderr, "Unexpected plan: %lu linked, %lu copied, %lu others, "
+				"%lu dirs, %lu removed, %lu backups, %lu replace ops, "
+				"%llu inodes\n", plan.linked, plan.copied, plan.others,
+				plan.dirs, plan.removed, plan.backups, plan.replace_ops,
+				plan.inodes);
+		ret = 1;
+	} else if (!plan.avail_bytes || plan.bytes > plan.avail_bytes) {
+		fprintf(stderr, "No space available for %llu bytes\n", plan.bytes);
+		ret = 1;
+	}
+
+	/* nothing is modified until copying */
+	if (!check_file("dst/usr/share/new", NULL)
+			|| !check_file("dst/usr/lib/gone", "old") || !check_clean("dst/usr/bin"))
+		ret = 1;
+
+	if (!ret && ai_merge_copy_new(tp("src"), tp("dst"), j, NULL, NULL))
+		ret = 2;
+	if (!ret && ai_merge_plan(tp("src"), tp("dst"), j, NULL, &plan) != EINVAL) {
+		fprintf(stderr, "Planning accepted after copying\n");
+		ret = 1;
+	}
+
+	ai_journal_close(j);
+	return ret;
+}
+
+static int test_stats(void) {
+	ai_merge_stats_t st, before;
+	ai_journal_t j;
+	unsigned long long int n;
+	int op, b, ret;
+
+	if (!make_planned(&j))
+		return 2;
+
+	memset(&st, 0, sizeof(st));
+	ai_merge_set_stats(&st);
+	ret = merge_sync("src", "dst", j);
+	ai_merge_set_stats(NULL);
+	ai_journal_close(j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	/* the symlink is hardlinked as well */
+	if (st.linked != 3 || st.copied || st.bytes || st.renamed != 3) {
+		fprintf(stderr, "%lu linked, %lu copied, %llu bytes, %lu renamed\n",
+				st.linked, st.copied, st.bytes, st.renamed);
+		ret = 1;
+	}
+	if (!st.ops[AI_MERGE_OP_RENAME].count || !st.ops[AI_MERGE_OP_UNLINK].count) {
+		fprintf(stderr, "renames or unlinks not timed\n");
+		ret = 1;
+	}
+	for (op = 0; op < AI_MERGE_OPS; op++) {
+		for (n = 0, b = 0; b < AI_MERGE_STATS_BUCKETS; b++)
+			n += st.ops[op].histogram[b];
+		if (n != st.ops[op].count || st.ops[op].errors > n
+				|| st.ops[op].max_us > st.ops[op].total_us) {
+			fprintf(stderr, "inconsistent %s statistics\n",
+					ai_merge_op_name(op));
+			ret = 1;
+		}
+	}
+
+	/* nothing is collected afterwards */
+	before = st;
+	if (!make_file("src/usr/bin/more", "new")
+			|| create_journal("journal2", "src", NULL, &j))
+		return 2;
+	if (merge_sync("src", "dst", j))
+		ret = 2;
+	else if (memcmp(&st, &before, sizeof(st))) {
+		fprintf(stderr, "statistics collected after unsetting\n");
+		ret = 1;
+	}
+
+	ai_journal_close(j);
+	return ret;
+}
+
+static ai_merge_status_t *status_seen;
+static int status_progress;
+
+/* check the status published while copying */
+static void status_callback(const char *path, unsigned long int megs,
+		unsigned long int total) {
+	const ai_merge_status_t *st = status_seen;
+
+	if (st->phase != AI_MERGE_PHASE_COPY_NEW || st->sequence % 2
+			|| st->entries_done >= st->entries_total || strcmp(st->path, path)) {
+		fprintf(stderr, "[%s] status: phase %llu, entry %llu of %llu, %s\n",
+				path, st->phase, st->entries_done, st->entries_total,
+				st->path);
+		status_progress = -1;
+	} else if (status_progress >= 0)
+		status_progress++;
+}
+
+static int test_status(void) {
+	ai_merge_options_t opts;
+	ai_merge_status_t saved, stored;
+	ai_journal_file_t *pp;
+	ai_journal_t j;
+	unsigned long long int n = 0;
+	FILE *f;
+	int ret;
+
+	if (!make_planned(&j))
+		return 2;
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp))
+		n++;
+
+	memset(&opts, 0, sizeof(opts));
+	if (ai_merge_status_open(tp("status"), &opts.status)) {
+		ai_journal_close(j);
+		return 2;
+	}
+	status_seen = opts.status;
+	status_progress = 0;
+
+	ret = ai_merge_copy_new(tp("src"), tp("dst"), j, &opts, status_callback);
+	if (!ret)
+		ret = ai_merge_backup_old(tp("dst"), j, &opts);
+	if (!ret)
+		ret = ai_merge_replace(tp("dst"), j, &opts);
+	if (!ret)
+		ret = ai_merge_cleanup(tp("dst"), j, &opts, NULL);
+	ai_journal_close(j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		ret = 1;
+	} else if (status_progress <= 0) {
+		fprintf(stderr, "No valid status seen while copying\n");
+		ret = 1;
+	}
+
+	/* the last phase finished, all its entries done */
+	saved = *opts.status;
+	ai_merge_status_close(opts.status);
+	if (!ret && (saved.version != AI_MERGE_STATUS_VERSION
+				|| saved.phase != AI_MERGE_PHASE_NONE || saved.errors
+				|| saved.entries_done != n || saved.entries_total != n
+				|| !saved.sequence || saved.sequence % 2)) {
+		fprintf(stderr, "Final status: version %llu, phase %llu, %llu errors, "
+				"entry %llu of %llu, sequence %llu\n", saved.version,
+				saved.phase, saved.errors, saved.entries_done,
+				saved.entries_total, saved.sequence);
+		ret = 1;
+	}
+
+	/* and it is kept in the file */
+	f = fopen(tp("status"), "rb");
+	if (!f)
+		ret = 2;
+	else {
+		if (fread(&stored, sizeof(stored), 1, f) != 1
+				|| memcmp(&stored, &saved, sizeof(saved))) {
+			fprintf(stderr, "Status file differs from the mapped status\n");
+			ret = 1;
+		}
+		fclose(f);
+	}
+
+	return ret;
+}
+
+/* check a single per-thread buffer of the trace, -1 at the end of file,
+ * 2 if it was wrapped around */
+static int check_ring(FILE *f, unsigned int size) {
+	ai_merge_trace_ring_t rh;
+	ai_merge_trace_record_t rec;
+	unsigned long long int last = 0;
+	unsigned int i;
+
+	if (fread(&rh, sizeof(rh), 1, f) != 1)
+		return feof(f) ? -1 : 0;
+	if (rh.records > size || rh.records > rh.total
+			|| (rh.total >= size && rh.records != size)) {
+		fprintf(stderr, "Ring %u: %u records of %llu\n", rh.thread,
+				rh.records, rh.total);
+		return 0;
+	}
+
+	for (i = 0; i < rh.records; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			fprintf(stderr, "Ring %u: truncated\n", rh.thread);
+			return 0;
+		}
+		if (rec.start_us > rec.end_us || rec.start_us < last
+				|| rec.op >= AI_MERGE_OPS || rec.phase >= AI_MERGE_PHASES) {
+			fprintf(stderr, "Ring %u: invalid record %u\n", rh.thread, i);
+			return 0;
+		}
+		last = rec.start_us;
+	}
+	return rh.total > size ? 2 : 1;
+}
+
+static int test_trace(void) {
+	ai_merge_trace_header_t h;
+	ai_journal_t j;
+	FILE *f;
+	int fd, n, wrapped = 0, ret;
+
+	if (!make_planned(&j))
+		return 2;
+
+	/* small enough to wrap around */
+	ai_merge_set_trace(4);
+	ret = merge_sync("src", "dst", j);
+	ai_merge_set_trace(0);
+	ai_journal_close(j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	fd = open(tp("trace"), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		return 2;
+	ret = ai_merge_trace_dump(fd);
+	if (close(fd) || ret) {
+		fprintf(stderr, "Dump failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	f = fopen(tp("trace"), "rb");
+	if (!f)
+		return 2;
+	if (fread(&h, sizeof(h), 1, f) != 1
+			|| memcmp(h.magic, AI_MERGE_TRACE_MAGIC, sizeof(h.magic))
+			|| h.version != AI_MERGE_TRACE_VERSION
+			|| h.record_size != sizeof(ai_merge_trace_record_t)) {
+		fprintf(stderr, "Invalid trace header\n");
+		ret = 1;
+	}
+	while (!ret && (n = check_ring(f, 4)) != -1) {
+		if (!n)
+			ret = 1;
+		else if (n == 2)
+			wrapped = 1;
+	}
+	fclose(f);
+
+	if (!ret && !wrapped) {
+		fprintf(stderr, "No records overwritten\n");
+		ret = 1;
+	}
+	return ret;
+}
+
+static int test_copy_rollback(void) {
+	ai_journal_t j;
+	ai_merge_async_t a;
+	struct event_log l = { .n = 0 };
+	size_t i, progress = 0;
+	char name[64];
+	int ret = 0;
+
+	for (i = 0; i < 20; i++) {
+		sprintf(name, "src/usr/share/pkg/f%lu", (unsigned long int) i);
+		if (!make_file(name, "new"))
+			return 2;
+	}
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("dst/usr/bin/tool", "old")
+			|| create_journal("journal", "src", NULL, &j))
+		return 2;
+
+	if (ai_merge_async_start(tp("src"), tp("dst"), j, NULL, 0, &a)) {
+		ai_journal_close(j);
+		return 2;
+	}
+
+	/* abort in the middle of copying */
+	while (progress < 5 && ai_merge_async_step(a, 1)) {
+		take_events(a, &l);
+		for (progress = 0, i = 0; i < l.n; i++) {
+			if (l.ev[i].type == AI_MERGE_EVENT_PROGRESS)
+				progress++;
+		}
+	}
+	if (progress < 5) {
+		fprintf(stderr, "Copying finished too early\n");
+		ret = 1;
+	}
+
+	if (ai_merge_async_rollback(a) || ai_merge_async_rollback(a)) {
+		fprintf(stderr, "Rollback request failed\n");
+		ret = 1;
+	}
+	while (ai_merge_async_step(a, 1))
+		take_events(a, &l);
+	take_events(a, &l);
+
+	if (ai_merge_async_rollback(a) != EINVAL) {
+		fprintf(stderr, "Rollback accepted after finishing\n");
+		ret = 1;
+	}
+	ai_merge_async_free(a);
+
+	if (!l.n || l.ev[l.n - 1].type != AI_MERGE_EVENT_DONE
+			|| l.ev[l.n - 1].error) {
+		fprintf(stderr, "Rollback did not finish cleanly\n");
+		ret = 1;
+	}
+	for (i = 0; i < l.n; i++) {
+		if (l.ev[i].type == AI_MERGE_EVENT_PHASE
+				&& (l.ev[i].phase == AI_MERGE_PHASE_BACKUP_OLD
+					|| l.ev[i].phase == AI_MERGE_PHASE_REPLACE)) {
+			fprintf(stderr, "Merge proceeded with %s\n",
+					ai_merge_phase_name(l.ev[i].phase));
+			ret = 1;
+		}
+	}
+
+	if (!check_file("dst/usr/bin/tool", "old")
+			|| !check_file("dst/usr/share/pkg/f0", NULL)
+			|| !check_clean("dst/usr") || !check_clean("dst/usr/bin"))
+		ret = 1;
+
+	free_events(&l);
+	ai_journal_close(j);
+	return ret;
+}
+
+static int fd_ready(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static int test_events(void) {
+	static const ai_merge_phase_t phases[] = {
+		AI_MERGE_PHASE_COPY_NEW,
+		AI_MERGE_PHASE_BACKUP_OLD,
+		AI_MERGE_PHASE_REPLACE,
+		AI_MERGE_PHASE_CLEANUP
+	};
+
+	ai_journal_t j;
+	ai_journal_file_t *pp;
+	ai_merge_async_t a;
+	struct event_log l = { .n = 0 };
+	size_t i, step, phase = 0, progress = 0, copied = 0, removals = 0;
+	char name[64];
+	int ret = 0;
+
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "src/usr/lib/f%lu", (unsigned long int) i);
+		if (!make_file(name, "new"))
+			return 2;
+	}
+	if (!make_file("dst/usr/bin/stale", "old")
+			|| create_journal("journal", "src", "/usr/bin/stale", &j))
+		return 2;
+
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp)) {
+		if (!(ai_journal_file_flags(pp) & AI_MERGE_FILE_REMOVE))
+			copied++;
+	}
+
+	if (ai_merge_async_start(tp("src"), tp("dst"), j, NULL, 0, &a)) {
+		ai_journal_close(j);
+		return 2;
+	}
+	if (!fd_ready(ai_merge_async_get_fd(a))) {
+		fprintf(stderr, "Not ready before the first step\n");
+		ret = 1;
+	}
+
+	/* let the queue grow, and then reuse its space */
+	for (step = 0; ai_merge_async_step(a, 3); step++) {
+		if (step > 10 && step % 2)
+			take_events(a, &l);
+	}
+	if (!fd_ready(ai_merge_async_get_fd(a))) {
+		fprintf(stderr, "Not ready with events queued\n");
+		ret = 1;
+	}
+	take_events(a, &l);
+	if (fd_ready(ai_merge_async_get_fd(a)) || ai_merge_async_step(a, 3)) {
+		fprintf(stderr, "Still ready after finishing\n");
+		ret = 1;
+	}
+	ai_merge_async_free(a);
+
+	for (i = 0; i < l.n; i++) {
+		const ai_merge_event_t *ev = &l.ev[i];
+
+		switch (ev->type) {
+			case AI_MERGE_EVENT_PHASE:
+				if (phase == sizeof(phases) / sizeof(*phases)
+						|| ev->phase != phases[phase]) {
+					fprintf(stderr, "Unexpected phase %s\n",
+							ai_merge_phase_name(ev->phase));
+					ret = 1;
+				}
+				phase++;
+				break;
+			case AI_MERGE_EVENT_PROGRESS:
+				progress++;
+				if (ev->phase != AI_MERGE_PHASE_COPY_NEW || !ev->path) {
+					fprintf(stderr, "Invalid progress event\n");
+					ret = 1;
+				}
+				break;
+			case AI_MERGE_EVENT_REMOVAL:
+				removals++;
+				if (!ev->path || strcmp(ev->path, "/usr/bin/stale")
+						|| ev->error) {
+					fprintf(stderr, "Invalid removal event: %s\n", ev->path);
+					ret = 1;
+				}
+				break;
+			case AI_MERGE_EVENT_FAILED:
+				fprintf(stderr, "%s failed: %s\n",
+						ai_merge_phase_name(ev->phase), strerror(ev->error));
+				ret = 1;
+				break;
+			case AI_MERGE_EVENT_DONE:
+				if (i != l.n - 1 || ev->error) {
+					fprintf(stderr, "Invalid done event\n");
+					ret = 1;
+				}
+				break;
+		}
+	}
+
+	if (phase != sizeof(phases) / sizeof(*phases) || progress != copied
+			|| removals != 1) {
+		fprintf(stderr, "Got %lu phases, %lu of %lu files, %lu removals\n",
+				(unsigned long int) phase, (unsigned long int) progress,
+				(unsigned long int) copied, (unsigned long int) removals);
+		ret = 1;
+	}
+	if (!check_file("dst/usr/lib/f39", "new") || !check_file("dst/usr/bin/stale", NULL))
+		ret = 1;
+
+	free_events(&l);
+	ai_journal_close(j);
+	return ret;
+}
+
+static int test_layers(void) {
+	const char *sources[2];
+	ai_journal_t j;
+	int ret;
+
+	if (!make_file("src/usr/a", "1") || !make_file("src/usr/b", "1")
+			|| !make_file("src2/usr/a", "2")
+			|| !make_file("dst/usr/a", "old"))
+		return 2;
+
+	sources[0] = strdup(tp("src"));
+	sources[1] = strdup(tp("src2"));
+	ret = ai_journal_create_layers(tp("journal"), sources, 2, &j);
+	if (!ret)
+		ret = ai_journal_create_finish(j);
+	if (!ret)
+		ret = ai_journal_open(tp("journal"), &j);
+	if (ret)
+		return 2;
+
+	ret = merge_sync("src", "dst", j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		ret = 1;
+	} else
+		ret = !check_file("dst/usr/a", "2") || !check_file("dst/usr/b", "1")
+			|| !check_clean("dst/usr");
+
+	ai_journal_close(j);
+	free((char *) sources[0]);
+	free((char *) sources[1]);
+	return ret;
+}
+
+/* returns the ai_lock_acquire() result in another process */
+static int test_layers_override(void) {
+	const char *sources[3];
+	ai_journal_t j;
+	int i, ret;
+
+	if (!make_file("src/usr/lib/x", "1") || !make_file("src/usr/lib/sub/y", "1")
+			|| !make_file("src/usr/doc/a", "1") || !make_file("src/usr/keep", "1")
+			|| !make_file("src2/usr/lib", "2") || !make_file("src2/usr/doc", "2")
+			|| !make_file("src3/usr/doc/b", "3")
+			|| !make_file("dst/usr/keep", "old"))
+		return 2;
+
+	sources[0] = strdup(tp("src"));
+	sources[1] = strdup(tp("src2"));
+	sources[2] = strdup(tp("src3"));
+	ret = ai_journal_create_layers(tp("journal"), sources, 3, &j);
+	if (!ret)
+		ret = ai_journal_create_finish(j);
+	if (!ret)
+		ret = ai_journal_open(tp("journal"), &j);
+	for (i = 0; i < 3; i++)
+		free((char *) sources[i]);
+	if (ret)
+		return 2;
+
+	ret = merge_sync("src", "dst", j);
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		ret = 1;
+	} else
+		ret = !check_file("dst/usr/lib", "2") || !check_file("dst/usr/keep", "1")
+			|| !check_file("dst/usr/doc/a", NULL)
+			|| !check_file("dst/usr/doc/b", "3")
+			|| !check_clean("dst/usr") || !check_clean("dst/usr/doc");
+
+	ai_journal_close(j);
+	return ret;
+}
+
+static int lock_child(ai_journal_t j) {
+	pid_t pid = fork();
+	int status;
+
+	if (pid == -1)
+		return -1;
+	if (!pid) {
+		ai_lock_t l;
+		int ret = ai_lock_acquire(tp("lock"), tp("dst"), j, 0, &l);
+
+		if (!ret)
+			ai_lock_release(l);
+		_exit(ret == EAGAIN ? 1 : ret ? 2 : 0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	switch (WEXITSTATUS(status)) {
+		case 0:
+			return 0;
+		case 1:
+			return EAGAIN;
+		default:
+			return -1;
+	}
+}
+
+static int test_lock(void) {
+	ai_journal_t j1, j2, j3;
+	ai_lock_t l;
+	int ret;
+
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("src2/usr/bin/tool", "new")
+			|| !make_file("src3/usr/lib/other", "new")
+			|| !make_file("dst/usr/bin/tool", "old")
+			|| !make_file("dst/usr/lib", NULL)
+			|| create_journal("journal", "src", NULL, &j1)
+			|| create_journal("journal2", "src2", NULL, &j2)
+			|| create_journal("journal3", "src3", NULL, &j3))
+		return 2;
+
+	ret = ai_lock_acquire(tp("lock"), tp("dst"), j1, 0, &l);
+	if (ret) {
+		fprintf(stderr, "Locking failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	ret = 0;
+	if (lock_child(j2) != EAGAIN) {
+		fprintf(stderr, "Overlapping merge not locked out\n");
+		ret = 1;
+	}
+	if (lock_child(j3) != 0) {
+		fprintf(stderr, "Disjoint merge locked out\n");
+		ret = 1;
+	}
+
+	ai_lock_release(l);
+	if (lock_child(j2) != 0) {
+		fprintf(stderr, "Lock not released\n");
+		ret = 1;
+	}
+
+	ai_journal_close(j1);
+	ai_journal_close(j2);
+	ai_journal_close(j3);
+	return ret;
+}
+
+/* writes a ustar header, followed by the data padded to the block size */
+static void tar_checksum(char *hdr) {
+	unsigned int sum = 0;
+	int i;
+
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < 512; i++)
+		sum += (unsigned char) hdr[i];
+	sprintf(hdr + 148, "%06o", sum);
+}
+
+static int tar_member(FILE *f, const char *name, char type, const char *data,
+		const char *link) {
+	char hdr[512];
+	size_t size = data ? strlen(data) : 0;
+
+	memset(hdr, 0, sizeof(hdr));
+	strncpy(hdr, name, 100);
+	sprintf(hdr + 100, "%07o", type == '5' ? 0755 : 0644);
+	sprintf(hdr + 108, "%07o", (unsigned int) getuid());
+	sprintf(hdr + 116, "%07o", (unsigned int) getgid());
+	sprintf(hdr + 124, "%011lo", (unsigned long int) size);
+	sprintf(hdr + 136, "%011o", 1300000000);
+	hdr[156] = type;
+	if (link)
+		strncpy(hdr + 157, link, 100);
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	tar_checksum(hdr);
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1)
+		return 0;
+	if (size) {
+		memset(hdr, 0, sizeof(hdr));
+		if (fwrite(data, size, 1, f) != 1
+				|| fwrite(hdr, (512 - size % 512) % 512, 1, f) > 1)
+			return 0;
+	}
+	return 1;
+}
+
+static int tar_end(FILE *f) {
+	char blocks[1024];
+
+	memset(blocks, 0, sizeof(blocks));
+	return fwrite(blocks, sizeof(blocks), 1, f) == 1 && !fclose(f);
+}
+
+/* reads the archive into a new journal, like atomic-install --archive */
+static int tar_journal(const char *archive, ai_journal_t *j, int *fd) {
+	ai_journal_t nj;
+	int ret;
+
+	*fd = open(tp(archive), O_RDONLY);
+	if (*fd == -1)
+		return errno;
+
+	ret = ai_journal_create_start(tp("journal"), NULL, &nj);
+	if (ret) {
+		close(*fd);
+		return ret;
+	}
+	ret = ai_tar_journal_append(nj, *fd);
+	if (ret) {
+		ai_journal_create_finish(nj);
+		unlink(tp("journal"));
+		close(*fd);
+		return ret;
+	}
+
+	ret = ai_journal_create_finish(nj);
+	if (!ret)
+		ret = ai_journal_open(tp("journal"), j);
+	if (!ret && lseek(*fd, 0, SEEK_SET) == -1) {
+		ret = errno;
+		ai_journal_close(*j);
+	}
+	if (ret)
+		close(*fd);
+	return ret;
+}
+
+static int tar_merge(const char *archive) {
+	ai_journal_t j;
+	int fd, ret;
+
+	ret = tar_journal(archive, &j, &fd);
+	if (ret)
+		return ret;
+
+	ret = ai_tar_copy_new(fd, tp("dst"), j, NULL);
+	if (!ret)
+		ret = ai_merge_backup_old(tp("dst"), j, NULL);
+	if (!ret)
+		ret = ai_merge_replace(tp("dst"), j, NULL);
+	if (!ret)
+		ret = ai_merge_cleanup(tp("dst"), j, NULL, NULL);
+
+	ai_journal_close(j);
+	close(fd);
+	return ret;
+}
+
+static int test_tar_parse(void) {
+	char longname[256], pax[300];
+	struct stat st1, st2;
+	char link[16];
+	FILE *f;
+	ssize_t len;
+	int ret;
+
+	strcpy(longname, "usr/");
+	memset(longname + 4, 'n', 150);
+	longname[154] = 0;
+	/* the record length includes itself */
+	sprintf(pax, "%d path=%s\n", (int) strlen(longname) + 10, longname);
+
+	if (!make_file("dst/usr/a", "old"))
+		return 2;
+	f = fopen(tp("archive.tar"), "wb");
+	if (!f || !tar_member(f, "./", '5', NULL, NULL)
+			|| !tar_member(f, "./usr/", '5', NULL, NULL)
+			|| !tar_member(f, "./usr/a", '0', "data", NULL)
+			|| !tar_member(f, "usr/l", '2', NULL, "a")
+			|| !tar_member(f, "usr/h", '1', NULL, "./usr/a")
+			|| !tar_member(f, "PaxHeader", 'x', pax, NULL)
+			|| !tar_member(f, "truncated", '0', "long", NULL)
+			|| !tar_end(f))
+		return 2;
+
+	ret = tar_merge("archive.tar");
+	if (ret) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	ret = !check_file("dst/usr/a", "data") || !check_clean("dst/usr");
+	len = readlink(tp("dst/usr/l"), link, sizeof(link));
+	if (len != 1 || link[0] != 'a') {
+		fprintf(stderr, "Invalid symlink\n");
+		ret = 1;
+	}
+	if (stat(tp("dst/usr/a"), &st1) || stat(tp("dst/usr/h"), &st2)
+			|| st1.st_ino != st2.st_ino) {
+		fprintf(stderr, "Hardlink not preserved\n");
+		ret = 1;
+	}
+	sprintf(pax, "dst/%s", longname);
+	if (!check_file(pax, "long"))
+		ret = 1;
+	return ret;
+}
+
+static int test_tar_invalid(void) {
+	static const char *const names[] = { "../evil", "usr/../../evil", NULL };
+	const char *const *name;
+	ai_journal_t j;
+	FILE *f;
+	int fd, ret = 0;
+
+	for (name = names; *name; name++) {
+		f = fopen(tp("archive.tar"), "wb");
+		if (!f || !tar_member(f, *name, '0', "evil", NULL) || !tar_end(f))
+			return 2;
+
+		if (tar_journal("archive.tar", &j, &fd) != EINVAL) {
+			fprintf(stderr, "[%s] accepted\n", *name);
+			ret = 1;
+		}
+	}
+
+	/* a damaged header */
+	f = fopen(tp("archive.tar"), "wb");
+	if (!f || !tar_member(f, "usr/a", '0', "data", NULL))
+		return 2;
+	fseek(f, 148, SEEK_SET);
+	fputc('7', f);
+	if (fseek(f, 0, SEEK_END) || !tar_end(f))
+		return 2;
+	if (tar_journal("archive.tar", &j, &fd) != EINVAL) {
+		fprintf(stderr, "Invalid checksum accepted\n");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static int test_tar_size(void) {
+	static const char *const sizes[] = { "4", "-1", "12x", "",
+		"99999999999999999999999", NULL };
+	const char *const *size;
+	char pax[64], hdr[512];
+	ai_journal_t j;
+	FILE *f;
+	int fd, i, len, err, ret = 0;
+
+	for (size = sizes; *size; size++) {
+		/* the record length includes itself */
+		len = strlen(*size) + 8;
+		sprintf(pax, "%d size=%s\n", len < 10 ? len : len + 1, *size);
+		f = fopen(tp("archive.tar"), "wb");
+		if (!f || !tar_member(f, "PaxHeader", 'x', pax, NULL)
+				|| !tar_member(f, "usr/a", '0', "data", NULL)
+				|| !tar_end(f))
+			return 2;
+
+		/* the first one is valid */
+		err = tar_journal("archive.tar", &j, &fd);
+		if (size == sizes && !err) {
+			ai_journal_close(j);
+			close(fd);
+			unlink(tp("journal"));
+		} else if (size == sizes || err != EINVAL) {
+			fprintf(stderr, "[%s] pax size %s\n", *size,
+					size == sizes ? "rejected" : "accepted");
+			ret = 1;
+		}
+	}
+
+	/* a base-256 size whose padded length overflows off_t */
+	f = fopen(tp("archive.tar"), "w+b");
+	if (!f || !tar_member(f, "usr/a", '0', NULL, NULL) || fseek(f, 0, SEEK_SET)
+			|| fread(hdr, sizeof(hdr), 1, f) != 1)
+		return 2;
+	memset(hdr + 124, 0, 12);
+	hdr[124] = (char) 0x80;
+	hdr[136 - sizeof(off_t)] = 0x7f;
+	for (i = 137 - sizeof(off_t); i < 136; i++)
+		hdr[i] = (char) 0xff;
+	tar_checksum(hdr);
+	if (fseek(f, 0, SEEK_SET) || fwrite(hdr, sizeof(hdr), 1, f) != 1
+			|| fseek(f, 0, SEEK_END) || !tar_end(f))
+		return 2;
+	if (tar_journal("archive.tar", &j, &fd) != EINVAL) {
+		fprintf(stderr, "Overflowing size accepted\n");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static int test_tar_duplicate(void) {
+	ai_journal_t j;
+	ai_journal_file_t *pp;
+	FILE *f;
+	int fd, n = 0, ret = 0;
+
+	if (!make_file("dst/usr/a", "old"))
+		return 2;
+	f = fopen(tp("archive.tar"), "wb");
+	if (!f || !tar_member(f, "usr/", '5', NULL, NULL)
+			|| !tar_member(f, "usr/a", '0', "first", NULL)
+			|| !tar_member(f, "bin/", '5', NULL, NULL)
+			|| !tar_member(f, "usr/", '5', NULL, NULL)
+			|| !tar_member(f, "usr/a", '0', "last", NULL)
+			|| !tar_member(f, "usr/b", '0', "b", NULL)
+			|| !tar_end(f))
+		return 2;
+
+	/* every member is listed once */
+	if (tar_journal("archive.tar", &j, &fd))
+		return 2;
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp))
+		n++;
+	ai_journal_close(j);
+	close(fd);
+	unlink(tp("journal"));
+	if (n != 4) {
+		fprintf(stderr, "%d journal entries instead of 4\n", n);
+		ret = 1;
+	}
+
+	n = tar_merge("archive.tar");
+	if (n) {
+		fprintf(stderr, "Merge failed: %s\n", strerror(n));
+		return 1;
+	}
+	if (!check_file("dst/usr/a", "last") || !check_file("dst/usr/b", "b")
+			|| !check_clean("dst/usr"))
+		ret = 1;
+
+	/* a file turning into a directory */
+	f = fopen(tp("archive.tar"), "wb");
+	if (!f || !tar_member(f, "usr/c", '0', "file", NULL)
+			|| !tar_member(f, "usr/c/", '5', NULL, NULL)
+			|| !tar_end(f))
+		return 2;
+	if (tar_journal("archive.tar", &j, &fd) != EINVAL) {
+		fprintf(stderr, "Type change accepted\n");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static int same_inode(const char *a, const char *b) {
+	struct stat sa, sb;
+
+	return !lstat(tp(a), &sa) && !lstat(tp(b), &sb)
+		&& sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static int test_multi(void) {
+	char dst1[512], dst2[512], rel[32];
+	const char *const dests[] = { dst1, dst2 };
+	ai_journal_t js[2], other[2];
+	unsigned int i;
+	int ret = 0;
+
+	/* tp() reuses its buffers */
+	strcpy(dst1, tp("dst1"));
+	strcpy(dst2, tp("dst2"));
+
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("src/usr/lib/mod/a", "new")
+			|| !make_file("dst1/usr/bin/tool", "old")
+			|| !make_file("dst1/usr/lib/gone", "old")
+			|| !make_file("dst2/usr/lib/gone", "old")
+			|| create_journal("journal1", "src", "/usr/lib/gone", &js[0]))
+		return 2;
+	if (ai_journal_create_copy(tp("journal2"), js[0])
+			|| ai_journal_open(tp("journal2"), &js[1])) {
+		ai_journal_close(js[0]);
+		return 2;
+	}
+
+	/* the journals need to list the same files */
+	if (create_journal("journal3", "src", "/usr/lib/gone", &other[0]))
+		ret = 2;
+	else if (create_journal("journal4", "src", NULL, &other[1])) {
+		ai_journal_close(other[0]);
+		ret = 2;
+	} else {
+		ret = ai_merge_copy_new_multi(tp("src"), dests, other, 2, NULL, NULL);
+		if (ret != EINVAL) {
+			fprintf(stderr, "Mismatched journals accepted\n");
+			ret = 1;
+		} else if (ai_merge_rollback_new(dst1, other[0], NULL)
+				|| ai_merge_rollback_new(dst2, other[1], NULL)) {
+			fprintf(stderr, "Rollback failed\n");
+			ret = 1;
+		} else
+			ret = 0;
+		ai_journal_close(other[0]);
+		ai_journal_close(other[1]);
+	}
+
+	if (!ret) {
+		ret = ai_merge_copy_new_multi(tp("src"), dests, js, 2, NULL, NULL);
+		for (i = 0; i < 2 && !ret; i++) {
+			ret = ai_merge_backup_old(dests[i], js[i], NULL);
+			if (!ret)
+				ret = ai_merge_replace(dests[i], js[i], NULL);
+			if (!ret)
+				ret = ai_merge_cleanup(dests[i], js[i], NULL, NULL);
+		}
+		if (ret)
+			fprintf(stderr, "Merge failed: %s\n", strerror(ret));
+	}
+
+	for (i = 1; i <= 2 && !ret; i++) {
+		sprintf(rel, "dst%u/usr/bin/tool", i);
+		if (!check_file(rel, "new"))
+			ret = 1;
+		sprintf(rel, "dst%u/usr/lib/mod/a", i);
+		if (!check_file(rel, "new"))
+			ret = 1;
+		sprintf(rel, "dst%u/usr/lib/gone", i);
+		if (!check_file(rel, NULL))
+			ret = 1;
+		sprintf(rel, "dst%u/usr/lib", i);
+		if (!check_clean(rel))
+			ret = 1;
+	}
+	if (!ret && !same_inode("dst1/usr/lib/mod/a", "dst2/usr/lib/mod/a")) {
+		fprintf(stderr, "second destination not linked from the first\n");
+		ret = 1;
+	}
+
+	ai_journal_close(js[0]);
+	ai_journal_close(js[1]);
+	return ret;
+}
+
+static int switch_prepare(const char *journal, const char *root,
+		const ai_merge_options_t *opts, char *version, size_t size) {
+	ai_journal_t j;
+	int ret;
+
+	if (!make_dirs(tp(root)) || create_journal(journal, "src", NULL, &j))
+		return 2;
+
+	ret = ai_merge_switch_prepare(tp("src"), tp(root), j, opts, NULL);
+	if (ret)
+		fprintf(stderr, "Switch preparation failed: %s\n", strerror(ret));
+	snprintf(version, size, "%s/version-%s/usr/bin/tool", root,
+			ai_journal_get_filename_prefix(j));
+
+	ai_journal_close(j);
+	return ret ? 1 : 0;
+}
+
+/* the version tree 'current' points to, relative to TEST_DIR */
+static int check_current(const char *root, const char *version) {
+	char buf[256], want[256];
+	ssize_t len;
+
+	snprintf(want, sizeof(want), "%s/%s/current", TEST_DIR, root);
+	len = readlink(want, buf, sizeof(buf) - 1);
+	if (len == -1) {
+		fprintf(stderr, "[%s/current] unreadable: %s\n", root, strerror(errno));
+		return 0;
+	}
+	buf[len] = 0;
+
+	snprintf(want, sizeof(want), "%s/%s", TEST_DIR, version);
+	if (strcmp(buf, want) && strcmp(buf, strrchr(want, '/') + 1)) {
+		fprintf(stderr, "[%s/current] points to %s instead of %s\n",
+				root, buf, version);
+		return 0;
+	}
+	return 1;
+}
+
+static int switch_merge(const char *journal, const char *source,
+		const char *removed, int rollback, char *version, size_t size) {
+	ai_journal_t j;
+	int ret;
+
+	if (create_journal(journal, source, removed, &j))
+		return 2;
+	snprintf(version, size, "root/version-%s",
+			ai_journal_get_filename_prefix(j));
+
+	ret = ai_merge_switch_prepare(tp(source), tp("root"), j, NULL, NULL);
+	if (!ret && rollback)
+		ret = ai_merge_switch_rollback(tp("root"), j);
+	else if (!ret) {
+		ret = ai_merge_switch(tp("root"), j);
+		if (!ret)
+			ret = ai_merge_switch_cleanup(tp("root"), j);
+	}
+	if (ret)
+		fprintf(stderr, "Switching %s failed: %s\n", source, strerror(ret));
+
+	ai_journal_close(j);
+	return ret ? 1 : 0;
+}
+
+static int test_switch(void) {
+	char v1[64], v2[64], v3[64];
+	int ret;
+
+	if (!make_file("src1/usr/bin/tool", "v1")
+			|| !make_file("src1/usr/lib/keep", "v1")
+			|| !make_file("src1/usr/lib/gone", "v1")
+			|| !make_file("src2/usr/bin/tool", "v2")
+			|| !make_file("src3/usr/bin/tool", "v3")
+			|| !make_dirs(tp("root")))
+		return 2;
+
+	ret = switch_merge("journal1", "src1", NULL, 0, v1, sizeof(v1));
+	if (!ret && (!check_current("root", v1)
+				|| !check_file("root/current/usr/bin/tool", "v1")))
+		ret = 1;
+
+	/* the unchanged files are carried over, the old version removed */
+	if (!ret)
+		ret = switch_merge("journal2", "src2", "/usr/lib/gone", 0, v2, sizeof(v2));
+	if (!ret && (!check_current("root", v2)
+				|| !check_file("root/current/usr/bin/tool", "v2")
+				|| !check_file("root/current/usr/lib/keep", "v1")
+				|| !check_file("root/current/usr/lib/gone", NULL)
+				|| !check_file(v1, NULL) || !check_clean("root")))
+		ret = 1;
+
+	/* a rolled back version leaves the current one intact */
+	if (!ret)
+		ret = switch_merge("journal3", "src3", NULL, 1, v3, sizeof(v3));
+	if (!ret && (!check_current("root", v2)
+				|| !check_file("root/current/usr/bin/tool", "v2")
+				|| !check_file(v3, NULL) || !check_clean("root")))
+		ret = 1;
+
+	return ret;
+}
+
+static int test_switch_ctx(void) {
+	ai_merge_options_t opts;
+	char linked[128], copied[128];
+	int ret;
+
+	if (!make_file("src/usr/bin/tool", "new"))
+		return 2;
+
+	/* the copy settings apply to the versioned root too */
+	memset(&opts, 0, sizeof(opts));
+	opts.strategy = AI_COPY_READ_WRITE;
+
+	ret = switch_prepare("journal1", "root1", NULL, linked, sizeof(linked));
+	if (!ret)
+		ret = switch_prepare("journal2", "root2", &opts, copied, sizeof(copied));
+	if (!ret && (!check_file(linked, "new") || !check_file(copied, "new")))
+		ret = 1;
+	if (!ret && !same_inode("src/usr/bin/tool", linked)) {
+		fprintf(stderr, "[%s] not linked with the default options\n", linked);
+		ret = 1;
+	}
+	if (!ret && same_inode("src/usr/bin/tool", copied)) {
+		fprintf(stderr, "[%s] linked despite the strategy limit\n", copied);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* modify the file in place, keeping its size and mtime */
+static int tamper(const char *rel) {
+	struct timespec ts[2];
+	struct stat st;
+	FILE *f;
+
+	if (lstat(tp(rel), &st))
+		return 0;
+	f = fopen(tp(rel), "r+b");
+	if (!f)
+		return 0;
+	if (fputc('X', f) == EOF || fclose(f))
+		return 0;
+
+	ts[0] = st.st_atim;
+	ts[1] = st.st_mtim;
+	return !utimensat(AT_FDCWD, tp(rel), ts, 0);
+}
+
+static int store_cp(ai_store_t s, const char *source, const char *rel) {
+	const int ret = ai_store_cp(s, source, tp(rel));
+
+	if (ret)
+		fprintf(stderr, "[%s] store copy failed: %s\n", rel, strerror(ret));
+	return !ret;
+}
+
+static int nlink(const char *rel) {
+	struct stat st;
+
+	return lstat(tp(rel), &st) ? 0 : st.st_nlink;
+}
+
+static int test_store(void) {
+	char src[] = "/dev/shm/ai-store-test.XXXXXX";
+	char file[64];
+	struct stat sst, dst;
+	ai_store_t s;
+	FILE *f;
+	int ret;
+
+	/* the store is used only if the source can't be linked */
+	if (!mkdtemp(src))
+		return 77;
+	snprintf(file, sizeof(file), "%s/file", src);
+	if (stat(src, &sst) || stat(TEST_DIR, &dst) || sst.st_dev == dst.st_dev) {
+		rmdir(src);
+		return 77;
+	}
+
+	f = fopen(file, "wb");
+	ret = !f || fputs("contents", f) < 0;
+	if ((f && fclose(f)) || ret || !make_dirs(tp("d"))
+			|| ai_store_open(tp("store"), &s)) {
+		unlink(file);
+		rmdir(src);
+		return 2;
+	}
+
+	/* private copies by default */
+	ret = !store_cp(s, file, "d/a") || !store_cp(s, file, "d/b")
+		|| !check_file("d/a", "contents") || !check_file("d/b", "contents");
+	if (!ret && (nlink("d/a") != 1 || nlink("d/b") != 1)) {
+		fprintf(stderr, "installed files share the store objects\n");
+		ret = 1;
+	}
+
+	/* hardlinks on request, hashed again before reuse */
+	ai_store_set_link(s, 1);
+	if (!ret)
+		ret = !store_cp(s, file, "d/c") || !store_cp(s, file, "d/d");
+	if (!ret && !same_inode("d/c", "d/d")) {
+		fprintf(stderr, "store objects not linked\n");
+		ret = 1;
+	}
+	if (!ret && !tamper("d/c"))
+		ret = 2;
+	if (!ret)
+		ret = !store_cp(s, file, "d/e") || !check_file("d/e", "contents");
+	if (!ret && same_inode("d/c", "d/e")) {
+		fprintf(stderr, "modified store object reused\n");
+		ret = 1;
+	}
+
+	ai_store_close(s);
+	unlink(file);
+	rmdir(src);
+	return ret;
+}
+
+/* copy the files into dst, hashing them to the manifest */
+static int verify_copy(const char *journal, const char *manifest,
+		ai_journal_t *j) {
+	ai_merge_options_t opts;
+	char path[512];
+	int ret;
+
+	if (create_journal(journal, "src", NULL, j))
+		return 2;
+
+	/* the linked files are not listed */
+	memset(&opts, 0, sizeof(opts));
+	opts.strategy = AI_COPY_READ_WRITE;
+	strcpy(path, tp(manifest));
+	opts.manifest = path;
+
+	ret = ai_merge_copy_new(tp("src"), tp("dst"), *j, &opts, NULL);
+	if (ret) {
+		fprintf(stderr, "Copying failed: %s\n", strerror(ret));
+		ai_journal_close(*j);
+		return 1;
+	}
+	return 0;
+}
+
+static int test_verify(void) {
+	char staged[64];
+	ai_journal_t j;
+	int ret;
+
+	if (!make_file("src/usr/bin/tool", "new")
+			|| !make_file("src/usr/bin/other", "new")
+			|| !make_file("dst/usr/bin/tool", "old"))
+		return 2;
+
+	ret = verify_copy("journal1", "manifest1", &j);
+	if (ret)
+		return ret;
+	if (ai_merge_verify(tp("dst"), j, tp("missing")) != ENOENT) {
+		fprintf(stderr, "Missing manifest accepted\n");
+		ret = 1;
+	}
+	if (!ret && (ai_merge_verify(tp("dst"), j, tp("manifest1"))
+				|| !(ai_journal_get_flags(j) & AI_MERGE_VERIFIED))) {
+		fprintf(stderr, "Verification of the intact files failed\n");
+		ret = 1;
+	}
+	if (!ret && ai_merge_rollback_new(tp("dst"), j, NULL))
+		ret = 2;
+	ai_journal_close(j);
+	if (ret)
+		return ret;
+
+	/* modified in place, with the size and mtime kept */
+	ret = verify_copy("journal2", "manifest2", &j);
+	if (ret)
+		return ret;
+	sprintf(staged, "dst/usr/bin/.%s~tool.new", ai_journal_get_filename_prefix(j));
+	if (!tamper(staged))
+		ret = 2;
+	else if (ai_merge_verify(tp("dst"), j, tp("manifest2")) != EIO
+			|| (ai_journal_get_flags(j) & AI_MERGE_VERIFIED)) {
+		fprintf(stderr, "Modified file verified\n");
+		ret = 1;
+	}
+	if (!ret && (ai_merge_rollback_new(tp("dst"), j, NULL)
+				|| !check_file("dst/usr/bin/tool", "old")
+				|| !check_clean("dst/usr/bin")))
+		ret = 1;
+
+	ai_journal_close(j);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*func)(void);
+} tests[] = {
+	{ "merge-async-phase", test_async_phase },
+	{ "merge-replace-rollback", test_replace_rollback },
+	{ "merge-replace-resume", test_replace_resume },
+	{ "merge-fast-replace", test_fast_replace },
+	{ "merge-paths", test_paths },
+	{ "merge-subtree", test_subtree },
+	{ "merge-parallel", test_parallel },
+	{ "merge-verify", test_verify },
+	{ "merge-plan", test_plan },
+	{ "merge-stats", test_stats },
+	{ "merge-status", test_status },
+	{ "merge-trace", test_trace },
+	{ "merge-copy-rollback", test_copy_rollback },
+	{ "merge-events", test_events },
+	{ "merge-multi", test_multi },
+	{ "merge-layers", test_layers },
+	{ "merge-layers-override", test_layers_override },
+	{ "merge-lock", test_lock },
+	{ "merge-switch", test_switch },
+	{ "merge-switch-ctx", test_switch_ctx },
+	{ "store-share", test_store },
+	{ "tar-parse", test_tar_parse },
+	{ "tar-invalid", test_tar_invalid },
+	{ "tar-size", test_tar_size },
+	{ "tar-duplicate", test_tar_duplicate },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+	const char *code = argv[1];
+	const char *slash;
+	int i, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Synopsis: %s test-name\n", argv[0]);
+		return 3;
+	}
+
+	/* stupid automake! */
+	slash = strrchr(code, '/');
+	if (slash)
+		code = slash + 1;
+
+	for (i = 0; tests[i].name; i++) {
+		if (!strcmp(tests[i].name, code))
+			break;
+	}
+	if (!tests[i].name) {
+		fprintf(stderr, "Invalid arg: [%s]\n", code);
+		return 3;
+	}
+
+	rmtree(TEST_DIR);
+	if (!make_dirs(TEST_DIR)) {
+		perror("Test directory creation failed");
+		return 2;
+	}
+
+	ret = tests[i].func();
+	if (!ret)
+		rmtree(TEST_DIR);
+	return ret;
+}
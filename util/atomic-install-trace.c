@@ -0,0 +1,228 @@
+/* atomic-install -- flight recorder trace decoder
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <getopt.h>
+
+#include "lib/journal.h"
+#include "lib/merge.h"
+
+static const struct option opts[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+
+	{ "slowest", required_argument, NULL, 's' },
+	{ 0, 0, 0, 0 }
+};
+
+static void print_help(const char *argv0) {
+	printf("Usage: %s [options] trace-file [journal-file]\n"
+"\n"
+"Print the file operations recorded by atomic-install --flight-recorder,\n"
+"ordered by their start time. If the journal is still available, the entry\n"
+"indexes are resolved to paths.\n"
+"\n"
+"Options:\n"
+"    --help, -h          this help message\n"
+"    --version, -V       print program version\n"
+"\n"
+"    --slowest N, -s N   print only N slowest operations, slowest first\n"
+"", argv0);
+}
+
+/* a record along with the buffer it comes from */
+struct trace_op {
+	ai_merge_trace_record_t r;
+	unsigned int thread;
+};
+
+static int cmp_start(const void *a, const void *b) {
+	const struct trace_op *oa = a;
+	const struct trace_op *ob = b;
+
+	if (oa->r.start_us != ob->r.start_us)
+		return oa->r.start_us < ob->r.start_us ? -1 : 1;
+	return 0;
+}
+
+static int cmp_duration(const void *a, const void *b) {
+	const struct trace_op *oa = a;
+	const struct trace_op *ob = b;
+	const unsigned long long int da = oa->r.end_us - oa->r.start_us;
+	const unsigned long long int db = ob->r.end_us - ob->r.start_us;
+
+	if (da != db)
+		return da > db ? -1 : 1;
+	return 0;
+}
+
+static int read_trace(FILE *f, struct trace_op **ret, size_t *count) {
+	ai_merge_trace_header_t h;
+	ai_merge_trace_ring_t rh;
+	struct trace_op *ops = NULL;
+	size_t n = 0, i;
+
+	if (fread(&h, sizeof(h), 1, f) != 1
+			|| memcmp(h.magic, AI_MERGE_TRACE_MAGIC, sizeof(AI_MERGE_TRACE_MAGIC))
+			|| h.version != AI_MERGE_TRACE_VERSION
+			|| h.record_size != sizeof(ai_merge_trace_record_t))
+		return EINVAL;
+
+	while (fread(&rh, sizeof(rh), 1, f) == 1) {
+		struct trace_op *tmp = realloc(ops, (n + rh.records + 1) * sizeof(*ops));
+
+		if (!tmp) {
+			free(ops);
+			return errno;
+		}
+		ops = tmp;
+
+		for (i = 0; i < rh.records; i++, n++) {
+			if (fread(&ops[n].r, sizeof(ops[n].r), 1, f) != 1) {
+				free(ops);
+				return EINVAL;
+			}
+			ops[n].thread = rh.thread;
+		}
+		if (rh.total > rh.records)
+			printf("# thread %u: %llu older operations overwritten\n",
+					rh.thread, rh.total - rh.records);
+	}
+
+	if (ferror(f)) {
+		free(ops);
+		return EIO;
+	}
+
+	*ret = ops;
+	*count = n;
+	return 0;
+}
+
+static int read_paths(const char *journal_file, char ***ret, size_t *count) {
+	ai_journal_t j;
+	ai_journal_file_t *pp;
+	char **paths = NULL;
+	size_t n = 0;
+	int retval;
+
+	retval = ai_journal_open(journal_file, &j);
+	if (retval)
+		return retval;
+
+	for (pp = ai_journal_get_files(j); pp; pp = ai_journal_file_next(pp), n++) {
+		const char *path = ai_journal_file_path(pp);
+		const char *name = ai_journal_file_name(pp);
+		char **tmp = realloc(paths, (n + 1) * sizeof(*paths));
+
+		if (tmp) {
+			paths = tmp;
+			paths[n] = malloc(strlen(path) + strlen(name) + 1);
+		}
+		if (!tmp || !paths[n]) {
+			retval = errno;
+			while (n > 0)
+				free(paths[--n]);
+			free(paths);
+			ai_journal_close(j);
+			return retval;
+		}
+		sprintf(paths[n], "%s%s", path, name);
+	}
+
+	ai_journal_close(j);
+	*ret = paths;
+	*count = n;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int ret;
+
+	unsigned long int slowest = 0;
+	struct trace_op *ops = NULL;
+	size_t nops = 0, i;
+	char **paths = NULL;
+	size_t npaths = 0;
+	unsigned long long int base;
+	FILE *f;
+
+	while ((opt = getopt_long(argc, argv, "hVs:", opts, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				slowest = strtoul(optarg, NULL, 10);
+				break;
+			case 'V':
+				printf("%s\n", PACKAGE_STRING);
+				return 0;
+			default:
+				print_help(argv[0]);
+				return 0;
+		}
+	}
+
+	if (argc - optind < 1) {
+		printf("Synopsis: atomic-install-trace trace-file [journal-file]\n");
+		return 0;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		printf("Trace open failed: %s\n", strerror(errno));
+		return 1;
+	}
+	ret = read_trace(f, &ops, &nops);
+	fclose(f);
+	if (ret) {
+		printf("Trace read failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	if (argc - optind > 1) {
+		ret = read_paths(argv[optind + 1], &paths, &npaths);
+		if (ret)
+			printf("# journal open failed: %s, not resolving paths\n",
+					strerror(ret));
+	}
+
+	qsort(ops, nops, sizeof(*ops), cmp_start);
+	base = nops ? ops[0].r.start_us : 0;
+	if (slowest) {
+		qsort(ops, nops, sizeof(*ops), cmp_duration);
+		if (nops > slowest)
+			nops = slowest;
+	}
+
+	printf("# %10s %10s %6s %-16s %-7s %10s %-12s %s\n",
+			"start_us", "took_us", "thread", "phase", "op", "bytes",
+			"result", "entry");
+	for (i = 0; i < nops; i++) {
+		const ai_merge_trace_record_t *r = &ops[i].r;
+
+		printf("  %10llu %10llu %6u %-16s %-7s %10llu %-12s ",
+				r->start_us - base, r->end_us - r->start_us, ops[i].thread,
+				ai_merge_phase_name(r->phase), ai_merge_op_name(r->op),
+				r->bytes, r->result ? strerror(r->result) : "ok");
+		if (r->entry == (unsigned int) -1)
+			printf("-\n");
+		else if (r->entry < npaths)
+			printf("%s\n", paths[r->entry]);
+		else
+			printf("#%u\n", r->entry);
+	}
+
+	for (i = 0; i < npaths; i++)
+		free(paths[i]);
+	free(paths);
+	free(ops);
+	return 0;
+}
@@ -14,39 +14,120 @@
 #	include <stdint.h>
 #endif
 
+#include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <signal.h>
 
+#if defined(MAJOR_IN_MKDEV)
+#	include <sys/mkdev.h>
+#elif defined(MAJOR_IN_SYSMACROS)
+#	include <sys/sysmacros.h>
+#endif
+
+#include "lib/copy.h"
 #include "lib/journal.h"
+#include "lib/lock.h"
 #include "lib/merge.h"
+#include "lib/tar.h"
+
+#include "daemon.h"
 
 static const struct option opts[] = {
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 
+	{ "archive", no_argument, NULL, 'a' },
+	{ "batch", no_argument, NULL, 'b' },
+	{ "connect", required_argument, NULL, 'C' },
+	{ "daemon", required_argument, NULL, 'D' },
+	{ "fast-replace", no_argument, NULL, 'F' },
+	{ "flight-recorder", required_argument, NULL, 'f' },
 	{ "input-files", no_argument, NULL, 'i' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "lock", required_argument, NULL, 'L' },
+	{ "max-bandwidth", required_argument, NULL, 'B' },
+	{ "max-iops", required_argument, NULL, 'I' },
 	{ "no-replace", no_argument, NULL, 'n' },
 	{ "onestep", no_argument, NULL, '1' },
+	{ "page-cache", required_argument, NULL, 'P' },
+	{ "plan", no_argument, NULL, 'p' },
 	{ "resume", no_argument, NULL, 'r' },
 	{ "rollback", no_argument, NULL, 'R' },
+	{ "stats", no_argument, NULL, 't' },
+	{ "status", no_argument, NULL, 'T' },
+	{ "store", required_argument, NULL, 's' },
+	{ "store-link", no_argument, NULL, 'l' },
+	{ "versioned-root", no_argument, NULL, 'S' },
 	{ "verbose", no_argument, NULL, 'v' },
+	{ "verify", no_argument, NULL, 'c' },
 	{ 0, 0, 0, 0 }
 };
 
 static void print_help(const char *argv0) {
-	printf("Usage: %s [options] journal-file source dest\n"
+	printf("Usage: %s [options] journal-file source dest [dest...]\n"
+"\n"
+"With multiple destinations, the source is read once and copied to all\n"
+"of them. journal-file.N (and lock-file.N) is used for the N-th destination.\n"
 "\n"
 "Options:\n"
 "    --help, -h          this help message\n"
 "    --version, -V       print program version\n"
 "\n"
+"    --archive, -a       source is an uncompressed tar archive ('-' for stdin)\n"
+"    --batch, -b         source is a list of source trees to merge together,\n"
+"                        one per line, optionally followed by a tab\n"
+"                        and a file listing old paths; later trees override\n"
+"                        earlier ones\n"
+"    --connect SOCKET, -C SOCKET\n"
+"                        perform the merge through the daemon at SOCKET\n"
+"    --daemon SOCKET, -D SOCKET\n"
+"                        listen for merge requests at SOCKET; the other\n"
+"                        options are used as defaults for the requests\n"
+"    --fast-replace, -F  prepare all renames first, then replace files\n"
+"                        in a tight loop and report its duration\n"
+"    --flight-recorder N, -f N\n"
+"                        keep the last N file operations of each thread,\n"
+"                        and write them to journal-file.trace when done\n"
+"                        or interrupted (see atomic-install-trace)\n"
 "    --input-files, -i   read old paths from stdin (one per line)\n"
+"    --jobs N, -j N      use N parallel jobs for backup, replace, clean up\n"
+"                        & rollback, and for copying large files\n"
+"    --lock FILE, -L FILE\n"
+"                        lock the merged paths using FILE, in order to run\n"
+"                        concurrently with other merges into dest\n"
+"    --max-bandwidth RATE, -B RATE\n"
+"                        copy at most RATE bytes per second (with optional\n"
+"                        K, M or G suffix)\n"
+"    --max-iops N, -I N  perform at most N file operations per second;\n"
+"                        replacing files is not limited\n"
 "    --no-replace, -n    terminate before the replacement step\n"
 "    --onestep, -1       perform a smallest step possible\n"
+"    --page-cache MODE, -P MODE\n"
+"                        'keep' new files in the page cache (default),\n"
+"                        'drop' them behind the copy, or copy large files\n"
+"                        bypassing it ('direct')\n"
+"    --plan, -p          estimate the cost of the merge and check free space\n"
+"                        in dest, without merging\n"
 "    --resume, -r        resume existing merge, do not try creating new one\n"
 "    --rollback, -R      roll existing merge back\n"
+"    --stats, -t         print the time spent in each phase and the file\n"
+"                        operation latencies after merging\n"
+"    --status, -T        publish the live merge status for monitors\n"
+"                        in journal-file.status\n"
+"    --store DIR, -s DIR deduplicate new files through the object store\n"
+"                        at DIR (on the same filesystem as dest, reflinking\n"
+"                        the files)\n"
+"    --store-link, -l    hardlink the files to the store objects instead;\n"
+"                        modifying one of them in place modifies all the files\n"
+"                        with the same contents\n"
+"    --versioned-root, -S\n"
+"                        dest is a versioned root, prepare a new version\n"
+"                        and switch the 'current' symlink to it\n"
 "    --verbose, -v       report progress verbosely\n"
+"    --verify, -c        hash new files while copying, and verify them before\n"
+"                        replacing (using journal-file.manifest)\n"
 "", argv0);
 }
 
@@ -66,24 +147,218 @@ static void print_removal(const char *path, int result) {
 		printf("--- !EMPTY   %s\n", path);
 }
 
+static void print_strategy(dev_t source, dev_t dest, ai_copy_strategy_t strategy) {
+	printf("* Copying from device %u:%u to %u:%u using %s.\n",
+			(unsigned int) major(source), (unsigned int) minor(source),
+			(unsigned int) major(dest), (unsigned int) minor(dest),
+			ai_copy_strategy_name(strategy));
+}
+
+static void print_plan(const ai_merge_plan_t *p) {
+	printf("* Merge plan:\n"
+			"    files linked:       %lu\n"
+			"    files copied:       %lu\n"
+			"    other files:        %lu\n"
+			"    new directories:    %lu\n"
+			"    files removed:      %lu\n"
+			"    files backed up:    %lu\n"
+			"    replace operations: %lu\n"
+			"    space needed:       %llu bytes, %llu inodes\n",
+			p->linked, p->copied, p->others, p->dirs, p->removed,
+			p->backups, p->replace_ops, p->bytes, p->inodes);
+	if (p->avail_inodes == (unsigned long long int) -1)
+		printf("    space available:    %llu bytes\n", p->avail_bytes);
+	else
+		printf("    space available:    %llu bytes, %llu inodes\n",
+				p->avail_bytes, p->avail_inodes);
+}
+
+static void print_stats(const ai_merge_stats_t *st) {
+	unsigned int i, k;
+
+	printf("* Merge statistics:\n"
+			"    files linked:       %lu\n"
+			"    files copied:       %lu\n"
+			"    files renamed:      %lu\n"
+			"    bytes copied:       %llu\n",
+			st->linked, st->copied, st->renamed, st->bytes);
+
+	for (i = AI_MERGE_PHASE_COPY_NEW; i < AI_MERGE_PHASES; i++) {
+		if (st->phase_us[i])
+			printf("    %-20s%llu.%06llu s\n", ai_merge_phase_name(i),
+					st->phase_us[i] / 1000000, st->phase_us[i] % 1000000);
+	}
+
+	for (i = 0; i < AI_MERGE_OPS; i++) {
+		const ai_merge_op_stats_t *op = &st->ops[i];
+
+		if (!op->count)
+			continue;
+		printf("    %-7s %llu calls, %llu failed, %llu us total, %llu us max\n",
+				ai_merge_op_name(i), op->count, op->errors,
+				op->total_us, op->max_us);
+		for (k = 0; k < AI_MERGE_STATS_BUCKETS; k++) {
+			if (op->histogram[k])
+				printf("        < %-10lu us: %llu\n", 2UL << k,
+						op->histogram[k]);
+		}
+	}
+}
+
+static int preflight(const char *source, const char *dest, ai_journal_t j,
+		const ai_merge_options_t *opts) {
+	ai_merge_plan_t plan;
+	int ret;
+
+	ret = ai_merge_plan(source, dest, j, opts, &plan);
+	if (ret == ENOSPC) {
+		print_plan(&plan);
+		printf("Not enough space in %s.\n", dest);
+		return ret;
+	}
+
+	/* the other failures are reported when copying */
+	return 0;
+}
+
+static int parse_rate(const char *arg, unsigned long long int *rate) {
+	char *end;
+
+	*rate = strtoull(arg, &end, 10);
+	if (end == arg)
+		return EINVAL;
+
+	switch (*end) {
+		case 'G':
+			*rate *= 1024;
+			/* fallthrough */
+		case 'M':
+			*rate *= 1024;
+			/* fallthrough */
+		case 'K':
+			*rate *= 1024;
+			end++;
+	}
+
+	return *end ? EINVAL : 0;
+}
+
+static int parse_jobs(const char *arg, unsigned int *jobs) {
+	unsigned long int val;
+	char *end;
+
+	val = strtoul(arg, &end, 10);
+	if (end == arg || *end || val > AI_MERGE_MAX_JOBS)
+		return EINVAL;
+
+	*jobs = val;
+	return 0;
+}
+
 struct loop_data {
 	ai_journal_t j;
 
 	const char *source;
 	const char *dest;
 	const char *journal_file;
+	char *manifest_file;
+	char *status_file;
+	char *trace_file;
+	const char *lock_file;
+	int archive_fd;
+	ai_merge_options_t opts;
 
 	int rollback;
 	int noreplace;
+	int fastreplace;
+	int versioned;
 	int verbose;
+	int verify;
+	int status;
 	int onestep;
+
+	/* the destinations being copied to at once by loop_multi() */
+	unsigned int ncopy;
+	const char **copy_dests;
+	const char **copy_journals;
+	ai_journal_t *copy_js;
 };
 
 struct loop_data main_data;
 
+static int loop_versioned(struct loop_data *d) {
+	int ret = 0;
+
+	while (1) {
+		const uint32_t flags = ai_journal_get_flags(d->j);
+
+		if (flags & AI_MERGE_ROLLBACK_STARTED || d->rollback) {
+			if (flags & AI_MERGE_REPLACED) {
+				printf("! Switch complete, rollback impossible.\n");
+				ret = 1;
+				break;
+			}
+			printf("* Switching back...\n");
+			ret = ai_merge_switch_rollback(d->dest, d->j);
+			if (ret)
+				printf("* Rollback failed: %s\n", strerror(ret));
+			else {
+				printf("* Rollback successful.\n");
+				if (unlink(d->journal_file))
+					printf("Journal removal failed: %s\n", strerror(errno));
+			}
+			break;
+		} else if (flags & AI_MERGE_REPLACED) {
+			printf("* Removing old version...\n");
+			ret = ai_merge_switch_cleanup(d->dest, d->j);
+			if (ret)
+				printf("Cleanup failed: %s\n", strerror(ret));
+			else {
+				printf("* Install done.\n");
+				if (unlink(d->journal_file))
+					printf("Journal removal failed: %s\n", strerror(errno));
+			}
+			break;
+		} else if (flags & AI_MERGE_BACKED_OLD_UP && flags & AI_MERGE_COPIED_NEW) {
+			if (d->noreplace)
+				break;
+			printf("* Switching to new version...\n");
+			ret = ai_merge_switch(d->dest, d->j);
+			if (ret) {
+				printf("Switch failed: %s\n", strerror(ret));
+				d->rollback = 1;
+			}
+		} else {
+			printf("* Preparing new version...\n");
+			ret = ai_merge_switch_prepare(d->source, d->dest, d->j, &d->opts,
+					d->verbose ? print_progress : NULL);
+			if (ret) {
+				printf("Preparing new version failed: %s\n", strerror(ret));
+				break;
+			}
+		}
+
+		if (d->onestep)
+			break;
+	}
+
+	return ret;
+}
+
+static void remove_manifest(struct loop_data *d) {
+	if (d->manifest_file && unlink(d->manifest_file) && errno != ENOENT)
+		printf("Manifest removal failed: %s\n", strerror(errno));
+	/* the status file goes away along with the journal */
+	if (d->status && unlink(d->status_file) && errno != ENOENT)
+		printf("Status file removal failed: %s\n", strerror(errno));
+}
+
 static int loop(struct loop_data *d) {
 	int ret = 0;
 
+	if (d->versioned || ai_journal_get_flags(d->j) & AI_MERGE_VERSIONED_ROOT)
+		return loop_versioned(d);
+
 	while (1) {
 		const uint32_t flags = ai_journal_get_flags(d->j);
 
@@ -95,32 +370,33 @@ static int loop(struct loop_data *d) {
 				break;
 			} else if (flags & AI_MERGE_BACKED_OLD_UP) {
 				printf("* Rolling back replacement...\n");
-				ret = ai_merge_rollback_replace(d->dest, d->j);
+				ret = ai_merge_rollback_replace(d->dest, d->j, &d->opts);
 				if (ret) {
 					printf("* Replacement rollback failed: %s\n", strerror(ret));
 					break;
 				}
 			} else {
 				printf("* Rolling back old backup...\n");
-				ret = ai_merge_rollback_old(d->dest, d->j);
+				ret = ai_merge_rollback_old(d->dest, d->j, &d->opts);
 				if (ret) {
 					printf("* Old rollback failed: %s\n", strerror(ret));
 					break;
 				}
 			}
 			printf("* Rolling back new copying...\n");
-			ret = ai_merge_rollback_new(d->dest, d->j);
+			ret = ai_merge_rollback_new(d->dest, d->j, &d->opts);
 			if (ret)
 				printf("* New rollback failed: %s\n", strerror(ret));
 			else {
 				printf("* Rollback successful.\n");
 				if (unlink(d->journal_file))
 					printf("Journal removal failed: %s\n", strerror(errno));
+				remove_manifest(d);
 			}
 			break;
 		} else if (flags & AI_MERGE_REPLACED) {
 			printf("* Post-merge clean up...\n");
-			ret = ai_merge_cleanup(d->dest, d->j,
+			ret = ai_merge_cleanup(d->dest, d->j, &d->opts,
 					d->verbose ? print_removal : NULL);
 			if (ret)
 				printf("Cleanup failed: %s\n", strerror(ret));
@@ -128,28 +404,66 @@ static int loop(struct loop_data *d) {
 				printf("* Install done.\n");
 				if (unlink(d->journal_file))
 					printf("Journal removal failed: %s\n", strerror(errno));
+				remove_manifest(d);
 			}
 			break;
 		} else if (flags & AI_MERGE_BACKED_OLD_UP && flags & AI_MERGE_COPIED_NEW) {
 			if (d->noreplace)
 				break;
+			/* the staged files are gone once replacing has started */
+			if (d->verify && !(flags & AI_MERGE_VERIFIED)) {
+				printf("* Verifying new files...\n");
+				ret = ai_merge_verify(d->dest, d->j, d->manifest_file);
+				if (ret == ENOENT)
+					printf("* No manifest found, skipping verification.\n");
+				else if (ret) {
+					printf("Verification failed: %s\n", strerror(ret));
+					d->rollback = 1;
+					continue;
+				}
+			}
 			printf("* Replacing files...\n");
-			ret = ai_merge_replace(d->dest, d->j);
+			if (d->fastreplace) {
+				unsigned long int window;
+
+				ret = ai_merge_replace_prepared(d->dest, d->j, &d->opts,
+						&window);
+				if (!ret)
+					printf("* Replace window: %lu.%06lu s\n",
+							window / 1000000, window % 1000000);
+				else if (!(ai_journal_get_flags(d->j) & AI_MERGE_REPLACED)
+						&& (ret == EXDEV || ret == ENOSYS || ret == EMFILE)) {
+					printf("* Fast replace impossible (%s), falling back...\n",
+							strerror(ret));
+					ret = ai_merge_replace(d->dest, d->j, &d->opts);
+				}
+			} else
+				ret = ai_merge_replace(d->dest, d->j, &d->opts);
 			if (ret) {
 				printf("Replacement failed: %s\n", strerror(ret));
 				d->rollback = 1;
 			}
 		} else if (flags & AI_MERGE_COPIED_NEW) {
 			printf("* Backing up existing files...\n");
-			ret = ai_merge_backup_old(d->dest, d->j);
+			ret = ai_merge_backup_old(d->dest, d->j, &d->opts);
 			if (ret) {
 				printf("Backing old up failed: %s\n", strerror(ret));
 				break;
 			}
 		} else {
+			if (d->archive_fd == -1) {
+				ret = preflight(d->source, d->dest, d->j, &d->opts);
+				if (ret)
+					break;
+			}
+
 			printf("* Copying new files...\n");
-			ret = ai_merge_copy_new(d->source, d->dest, d->j,
-					d->verbose ? print_progress : NULL);
+			if (d->archive_fd != -1)
+				ret = ai_tar_copy_new(d->archive_fd, d->dest, d->j,
+						d->verbose ? print_progress : NULL);
+			else
+				ret = ai_merge_copy_new(d->source, d->dest, d->j, &d->opts,
+						d->verbose ? print_progress : NULL);
 			if (ret) {
 				printf("Copying new failed: %s\n", strerror(ret));
 				break;
@@ -163,39 +477,534 @@ static int loop(struct loop_data *d) {
 	return ret;
 }
 
+static void dump_trace(struct loop_data *d) {
+	int fd;
+
+	if (!d->trace_file)
+		return;
+
+	fd = open(d->trace_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		printf("Trace file creation failed: %s\n", strerror(errno));
+		return;
+	}
+	errno = ai_merge_trace_dump(fd);
+	if (errno)
+		printf("Trace write failed: %s\n", strerror(errno));
+	close(fd);
+}
+
 static void term_handler(int sig) {
+	/* the daemon group commit is not async-signal-safe */
+	if (daemon_serving)
+		ai_journal_set_sync_func(NULL);
+	/* before the rollback, in case it doesn't finish */
+	dump_trace(&main_data);
 	main_data.rollback = 1;
 	main_data.onestep = 1;
-	loop(&main_data);
+	if (main_data.j)
+		loop(&main_data);
+	else {
+		unsigned int i;
+
+		for (i = 0; i < main_data.ncopy; i++) {
+			printf("* Rolling back %s...\n", main_data.copy_dests[i]);
+			main_data.j = main_data.copy_js[i];
+			main_data.dest = main_data.copy_dests[i];
+			main_data.journal_file = main_data.copy_journals[i];
+			loop(&main_data);
+		}
+	}
 	exit(1);
 }
 
-int main(int argc, char *argv[]) {
+static void setup_signals(void) {
+	struct sigaction sa;
+
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	sa.sa_handler = &term_handler;
+	sigaddset(&sa.sa_mask, SIGINT);
+	sigaddset(&sa.sa_mask, SIGTERM);
+	sigaddset(&sa.sa_mask, SIGHUP);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+}
+
+static int read_input_files(ai_journal_t j, FILE *f) {
+	char buf[0x8000];
+	int ret;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		const int last = strlen(buf) - 1;
+
+		if (buf[last] == '\n')
+			buf[last] = 0;
+
+		ret = ai_journal_create_append(j, buf, AI_MERGE_FILE_REMOVE);
+		if (ret) {
+			printf("Journal append failed: %s\n", strerror(ret));
+			return ret;
+		}
+	}
+
+	if (ferror(f)) {
+		printf("File list read failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int create_batch_journal(const char *batch_file, ai_journal_t *ret_j) {
+	char buf[0x8000];
+	char **sources = NULL, **removals = NULL;
+	unsigned int i, count = 0;
+	FILE *f;
+	ai_journal_t j;
+	int ret = 0;
+
+	f = fopen(batch_file, "r");
+	if (!f) {
+		printf("Batch file open failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	while (!ret && fgets(buf, sizeof(buf), f)) {
+		const int last = strlen(buf) - 1;
+		char *tab, **tmp;
+
+		if (buf[last] == '\n')
+			buf[last] = 0;
+		if (!buf[0])
+			continue;
+
+		tab = strchr(buf, '\t');
+		if (tab)
+			*tab++ = 0;
+
+		tmp = realloc(sources, (count + 1) * sizeof(*sources));
+		if (!tmp) {
+			ret = errno;
+			break;
+		}
+		sources = tmp;
+		tmp = realloc(removals, (count + 1) * sizeof(*removals));
+		if (!tmp) {
+			ret = errno;
+			break;
+		}
+		removals = tmp;
+
+		sources[count] = strdup(buf);
+		removals[count] = tab ? strdup(tab) : NULL;
+		count++;
+		if (!sources[count - 1] || (tab && !removals[count - 1]))
+			ret = errno;
+	}
+
+	if (ret)
+		printf("Memory allocation failed: %s\n", strerror(ret));
+	else if (ferror(f)) {
+		printf("Batch file read failed: %s\n", strerror(errno));
+		ret = 1;
+	} else if (!count) {
+		printf("Batch file lists no source trees.\n");
+		ret = 1;
+	}
+	fclose(f);
+
+	if (!ret) {
+		ret = ai_journal_create_layers(main_data.journal_file,
+				(const char *const *) sources, count, &j);
+		if (ret)
+			printf("Journal creation failed: %s\n", strerror(ret));
+	}
+
+	/* the removals are appended after all the new files */
+	for (i = 0; !ret && i < count; i++) {
+		if (!removals[i])
+			continue;
+
+		f = fopen(removals[i], "r");
+		if (!f) {
+			printf("File list open failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		ret = read_input_files(j, f);
+		fclose(f);
+	}
+
+	for (i = 0; i < count; i++) {
+		free(sources[i]);
+		free(removals[i]);
+	}
+	free(sources);
+	free(removals);
+
+	if (!ret)
+		*ret_j = j;
+	return ret;
+}
+
+static int lock_dest(const char *lock_file, const char *dest, ai_journal_t j,
+		unsigned int flags, ai_lock_t *l) {
+	int ret;
+
+	ret = ai_lock_acquire(lock_file, dest, j, flags, l);
+	if (ret == EAGAIN) {
+		printf("* Waiting for concurrent merges into %s...\n", dest);
+		ret = ai_lock_acquire(lock_file, dest, j, flags | AI_LOCK_WAIT, l);
+	}
+
+	if (ret)
+		printf("Locking failed: %s\n", strerror(ret));
+	return ret;
+}
+
+static int lock_multi(unsigned int count, char *const *dests, ai_journal_t *js,
+		char **lock_files, ai_lock_t *locks) {
+	unsigned int i, k;
+	int ret, again;
+
+	do {
+		again = 0;
+
+		for (i = 0; !again && i < count; i++) {
+			if (!js[i])
+				continue;
+
+			ret = ai_lock_acquire(lock_files[i], dests[i], js[i], 0, &locks[i]);
+			if (!ret)
+				continue;
+
+			for (k = 0; k < i; k++) {
+				if (locks[k]) {
+					ai_lock_release(locks[k]);
+					locks[k] = NULL;
+				}
+			}
+
+			if (ret != EAGAIN) {
+				printf("Locking failed: %s\n", strerror(ret));
+				return ret;
+			}
+
+			/* never wait while holding locks, as the other merges could
+			 * be locking the destinations in a different order */
+			ret = lock_dest(lock_files[i], dests[i], js[i], 0, &locks[i]);
+			if (ret)
+				return ret;
+			ai_lock_release(locks[i]);
+			locks[i] = NULL;
+			again = 1;
+		}
+	} while (again);
+
+	return 0;
+}
+
+static int loop_multi(unsigned int count, char *const *dests, int input_files,
+		int resume) {
+	ai_journal_t *js = calloc(count, sizeof(*js));
+	char **journals = calloc(count, sizeof(*journals));
+	const char **cdests = calloc(count, sizeof(*cdests));
+	const char **cjournals = calloc(count, sizeof(*cjournals));
+	ai_journal_t *cjs = calloc(count, sizeof(*cjs));
+	char **lock_files = calloc(count, sizeof(*lock_files));
+	ai_lock_t *locks = calloc(count, sizeof(*locks));
+	ai_journal_t template = NULL;
+	unsigned int i, ncopy = 0;
+	int ret = 0, ret2;
+
+	if (!js || !journals || !cdests || !cjournals || !cjs || !lock_files
+			|| !locks) {
+		printf("Memory allocation failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* one journal per destination, all listing the same files */
+	for (i = 0; i < count; i++) {
+		journals[i] = malloc(strlen(main_data.journal_file) + 12);
+		if (!journals[i]) {
+			ret = errno;
+			printf("Memory allocation failed: %s\n", strerror(ret));
+			break;
+		}
+		sprintf(journals[i], "%s.%u", main_data.journal_file, i + 1);
+
+		ret = ai_journal_open(journals[i], &js[i]);
+		if (!ret)
+			printf("* Journal file %s open, %s.\n", journals[i],
+					main_data.rollback ? "rolling back" : "resuming");
+		else if (ret == ENOENT && (resume || main_data.rollback)) {
+			printf("* Journal file %s not found, skipping.\n", journals[i]);
+			js[i] = NULL;
+			ret = 0;
+			continue;
+		} else if (ret == ENOENT) {
+			printf("* Journal %s not found, creating...\n", journals[i]);
+			if (template)
+				ret = ai_journal_create_copy(journals[i], template);
+			else {
+				ai_journal_t j;
+
+				ret = ai_journal_create_start(journals[i], main_data.source, &j);
+				if (!ret && input_files)
+					ret = read_input_files(j, stdin);
+				if (!ret)
+					ret = ai_journal_create_finish(j);
+			}
+
+			if (!ret)
+				ret = ai_journal_open(journals[i], &js[i]);
+		}
+
+		if (ret) {
+			printf("Journal open failed: %s\n", strerror(ret));
+			break;
+		}
+		if (!template)
+			template = js[i];
+
+		if (main_data.lock_file) {
+			lock_files[i] = malloc(strlen(main_data.lock_file) + 12);
+			if (!lock_files[i]) {
+				ret = errno;
+				printf("Memory allocation failed: %s\n", strerror(ret));
+				break;
+			}
+			sprintf(lock_files[i], "%s.%u", main_data.lock_file, i + 1);
+		}
+	}
+
+	if (!ret && main_data.lock_file)
+		ret = lock_multi(count, dests, js, lock_files, locks);
+
+	setup_signals();
+
+	/* copy to all destinations at once */
+	for (i = 0; !ret && !main_data.rollback && i < count; i++) {
+		if (js[i] && !(ai_journal_get_flags(js[i])
+					& (AI_MERGE_COPIED_NEW | AI_MERGE_ROLLBACK_STARTED))) {
+			cdests[ncopy] = dests[i];
+			cjournals[ncopy] = journals[i];
+			cjs[ncopy++] = js[i];
+		}
+	}
+
+	for (i = 0; !ret && i < ncopy; i++)
+		ret = preflight(main_data.source, cdests[i], cjs[i],
+				&main_data.opts);
+
+	if (ncopy && !ret) {
+		printf("* Copying new files to %u destinations...\n", ncopy);
+		/* for the signal handler */
+		main_data.copy_dests = cdests;
+		main_data.copy_journals = cjournals;
+		main_data.copy_js = cjs;
+		main_data.ncopy = ncopy;
+		ret = ai_merge_copy_new_multi(main_data.source, cdests, cjs, ncopy,
+				&main_data.opts, main_data.verbose ? print_progress : NULL);
+		main_data.ncopy = 0;
+		if (ret)
+			printf("Copying new failed: %s\n", strerror(ret));
+	}
+
+	/* and then merge them one by one */
+	for (i = 0; !ret && !(ncopy && main_data.onestep) && i < count; i++) {
+		int lret;
+
+		if (!js[i])
+			continue;
+
+		printf("* Merging into %s...\n", dests[i]);
+		main_data.j = js[i];
+		main_data.dest = dests[i];
+		main_data.journal_file = journals[i];
+
+		lret = loop(&main_data);
+		main_data.j = NULL;
+		/* carry on with the remaining destinations */
+		ret2 = ai_journal_close(js[i]);
+		js[i] = NULL;
+		if (ret2)
+			printf("Journal close failed: %s\n", strerror(ret2));
+		if (lret || ret2)
+			ret = 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (js[i]) {
+			ret2 = ai_journal_close(js[i]);
+			if (ret2)
+				printf("Journal close failed: %s\n", strerror(ret2));
+		}
+		if (locks[i])
+			ai_lock_release(locks[i]);
+		free(journals[i]);
+		free(lock_files[i]);
+	}
+	free(js);
+	free(journals);
+	free(cdests);
+	free(cjournals);
+	free(cjs);
+	free(lock_files);
+	free(locks);
+
+	return ret != 0;
+}
+
+static int set_cache_policy(ai_copy_cache_policy_t policy) {
+	/* the default context hashes the files when verifying */
+	const int ret = ai_copy_ctx_set_cache_policy(NULL, policy);
+
+	if (!ret)
+		main_data.opts.cache_policy = policy;
+	return ret;
+}
+
+static int run(int argc, char *argv[]) {
 	int opt;
 	int ret, ret2;
 
-	struct sigaction sa;
-
 	int input_files = 0;
 	int resume = 0;
+	int plan = 0;
+	int stats = 0;
+	int created = 0;
+	int archive = 0;
+	int batch = 0;
+	int streaming = 0;
+	int store_link = 0;
+	unsigned long long int bandwidth = 0, iops = 0;
+	unsigned int trace = 0, jobs;
+	ai_merge_stats_t merge_stats;
+	ai_store_t store = NULL;
+	ai_lock_t lock = NULL;
+	const char *daemon_socket = NULL;
+	const char *connect_socket = NULL;
 
-	while ((opt = getopt_long(argc, argv, "hV1inrRv", opts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hV1abB:cC:D:Ff:iI:j:lL:npP:rRs:StTv", opts, NULL)) != -1) {
 		switch (opt) {
 			case '1':
 				main_data.onestep = 1;
 				break;
+			case 'a':
+				archive = 1;
+				break;
+			case 'b':
+				batch = 1;
+				break;
+			case 'B':
+				ret = parse_rate(optarg, &bandwidth);
+				if (ret) {
+					printf("Invalid bandwidth: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
+			case 'c':
+				main_data.verify = 1;
+				break;
+			case 'C':
+				connect_socket = optarg;
+				break;
+			case 'D':
+				daemon_socket = optarg;
+				break;
+			case 'F':
+				main_data.fastreplace = 1;
+				break;
+			case 'f':
+				trace = strtoul(optarg, NULL, 10);
+				if (!trace) {
+					printf("Invalid flight recorder size.\n");
+					return 1;
+				}
+				break;
 			case 'i':
 				input_files = 1;
 				break;
+			case 'I':
+				ret = parse_rate(optarg, &iops);
+				if (ret) {
+					printf("Invalid operation rate: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
+			case 'j':
+				ret = parse_jobs(optarg, &jobs);
+				if (!ret)
+					ret = ai_copy_ctx_set_jobs(NULL, jobs);
+				if (!ret) {
+					main_data.opts.jobs = jobs;
+					main_data.opts.copy_jobs = jobs;
+				}
+				if (ret) {
+					printf("Invalid job count: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
+			case 'l':
+				store_link = 1;
+				break;
+			case 'L':
+				main_data.lock_file = optarg;
+				break;
 			case 'n':
 				main_data.noreplace = 1;
 				break;
+			case 'p':
+				plan = 1;
+				break;
+			case 'P':
+				if (!strcmp(optarg, "keep"))
+					ret = set_cache_policy(AI_COPY_CACHE_KEEP);
+				else if (!strcmp(optarg, "drop"))
+					ret = set_cache_policy(AI_COPY_CACHE_DROP);
+				else if (!strcmp(optarg, "direct"))
+					ret = set_cache_policy(AI_COPY_CACHE_DIRECT);
+				else
+					ret = EINVAL;
+				if (ret) {
+					printf("Invalid page cache mode: %s\n", strerror(ret));
+					return 1;
+				}
+				break;
 			case 'r':
 				resume = 1;
 				break;
 			case 'R':
 				main_data.rollback = 1;
 				break;
+			case 's':
+				if (store)
+					ai_store_close(store);
+				ret = ai_store_open(optarg, &store);
+				if (ret) {
+					printf("Object store open failed: %s\n", strerror(ret));
+					return 1;
+				}
+				main_data.opts.store = store;
+				break;
+			case 'S':
+				main_data.versioned = 1;
+				break;
+			case 't':
+				stats = 1;
+				break;
+			case 'T':
+				main_data.status = 1;
+				break;
 			case 'v':
 				main_data.verbose = 1;
 				break;
@@ -210,14 +1019,125 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* the request arguments come from the client, with --connect */
+	if (daemon_serving)
+		connect_socket = NULL;
+
+	ai_copy_set_strategy_callback(main_data.verbose ? print_strategy : NULL);
+	/* the store may come from the daemon */
+	if (store_link && main_data.opts.store)
+		ai_store_set_link(main_data.opts.store, 1);
+	/* keep the daemon defaults unless overridden */
+	if (bandwidth || iops) {
+		ret = ai_copy_throttle_new(bandwidth, iops, &main_data.opts.throttle);
+		if (ret) {
+			printf("Throttle setup failed: %s\n", strerror(ret));
+			return 1;
+		}
+	}
+
+	if (daemon_socket && (daemon_serving || connect_socket)) {
+		printf("--daemon can't be used in a daemon request.\n");
+		return 1;
+	} else if (daemon_socket)
+		return daemon_serve(daemon_socket, run);
+
 	if (argc - optind < 3) {
 		printf("Synopsis: atomic-install journal source dest\n");
 		return 0;
 	}
 
+	if (connect_socket)
+		return daemon_submit(connect_socket, argc, argv);
+
 	main_data.journal_file = argv[optind];
 	main_data.source = argv[optind + 1];
 	main_data.dest = argv[optind + 2];
+	main_data.archive_fd = -1;
+
+	if (batch && (archive || main_data.versioned)) {
+		printf("Batches are not supported with archives and versioned roots.\n");
+		return 1;
+	}
+
+	if (plan && (archive || main_data.versioned || argc - optind > 3)) {
+		printf("Planning is not supported with archives, versioned roots\n"
+				"and multiple destinations.\n");
+		return 1;
+	}
+
+	if (main_data.verify && (archive || main_data.versioned
+				|| argc - optind > 3)) {
+		printf("Verification is not supported with archives, versioned roots\n"
+				"and multiple destinations.\n");
+		return 1;
+	}
+
+	if (main_data.status && (main_data.versioned || argc - optind > 3)) {
+		printf("Status file is not supported with versioned roots\n"
+				"and multiple destinations.\n");
+		return 1;
+	}
+
+	if (stats) {
+		memset(&merge_stats, 0, sizeof(merge_stats));
+		ai_merge_set_stats(&merge_stats);
+	}
+
+	if (trace) {
+		main_data.trace_file = malloc(strlen(main_data.journal_file) + 7);
+		if (!main_data.trace_file) {
+			printf("Memory allocation failed: %s\n", strerror(errno));
+			return 1;
+		}
+		sprintf(main_data.trace_file, "%s.trace", main_data.journal_file);
+		ai_merge_set_trace(trace);
+	}
+
+	if (argc - optind > 3) {
+		if (archive || batch || main_data.versioned) {
+			printf("Multiple destinations are not supported with archives,\n"
+					"batches and versioned roots.\n");
+			return 1;
+		}
+
+		ret = loop_multi(argc - optind - 2, &argv[optind + 2], input_files, resume);
+		if (stats) {
+			ai_merge_set_stats(NULL);
+			print_stats(&merge_stats);
+		}
+		dump_trace(&main_data);
+
+		if (store)
+			ai_store_close(store);
+		return ret;
+	}
+
+	if (archive) {
+		if (main_data.versioned) {
+			printf("Archives are not supported with versioned roots.\n");
+			return 1;
+		}
+
+		if (!strcmp(main_data.source, "-"))
+			main_data.archive_fd = 0;
+		else {
+			main_data.archive_fd = open(main_data.source, O_RDONLY);
+			if (main_data.archive_fd == -1) {
+				printf("Archive open failed: %s\n", strerror(errno));
+				return 1;
+			}
+		}
+	}
+
+	main_data.manifest_file = malloc(strlen(main_data.journal_file) + 10);
+	if (!main_data.manifest_file) {
+		printf("Memory allocation failed: %s\n", strerror(errno));
+		return 1;
+	}
+	sprintf(main_data.manifest_file, "%s.manifest", main_data.journal_file);
+	if (main_data.verify)
+		main_data.opts.manifest = main_data.manifest_file;
 
 	/* Try to open.
 	 * If it doesn't exist, try to create and then open. */
@@ -228,34 +1148,52 @@ int main(int argc, char *argv[]) {
 	else if (ret == ENOENT && !resume && !main_data.rollback) {
 		ai_journal_t j;
 		printf("* Journal not found, creating...\n");
+		created = 1;
 
-		ret = ai_journal_create_start(main_data.journal_file, main_data.source, &j);
-		if (ret) {
-			printf("Journal creation failed: %s\n", strerror(ret));
-			return ret;
+		if (batch) {
+			ret = create_batch_journal(main_data.source, &j);
+			if (ret)
+				return ret;
+		} else {
+			ret = ai_journal_create_start(main_data.journal_file,
+					archive ? NULL : main_data.source, &j);
+			if (ret) {
+				printf("Journal creation failed: %s\n", strerror(ret));
+				return ret;
+			}
 		}
 
-		if (input_files) {
-			char buf[0x8000];
-			int res;
+		if (archive) {
+			/* a pipe can be read only once, so copy the files while
+			 * reading the headers */
+			streaming = lseek(main_data.archive_fd, 0, SEEK_CUR) == -1;
 
-			while (fgets(buf, sizeof(buf), stdin)) {
-				const int last = strlen(buf) - 1;
+			if (streaming) {
+				if (input_files && main_data.archive_fd == 0) {
+					printf("Archive and file list can't be both read from stdin.\n");
+					return 1;
+				}
 
-				if (buf[last] == '\n')
-					buf[last] = 0;
+				/* the file list is not known until copied */
+				if (main_data.lock_file && lock_dest(main_data.lock_file,
+							main_data.dest, NULL, AI_LOCK_TREE, &lock))
+					return 1;
 
-				ret = ai_journal_create_append(j, buf, AI_MERGE_FILE_REMOVE);
-				if (ret) {
-					printf("Journal append failed: %s\n", strerror(ret));
-					return ret;
-				}
+				printf("* Copying new files...\n");
+				ret = ai_tar_journal_copy(j, main_data.archive_fd, main_data.dest,
+						main_data.verbose ? print_progress : NULL);
+			} else
+				ret = ai_tar_journal_append(j, main_data.archive_fd);
+			if (ret) {
+				printf("Archive read failed: %s\n", strerror(ret));
+				return ret;
 			}
+		}
 
-			if (ferror(stdin)) {
-				printf("File list read failed: %s\n", strerror(errno));
-				return 1;
-			}
+		if (input_files) {
+			ret = read_input_files(j, stdin);
+			if (ret)
+				return ret;
 		}
 
 		ret = ai_journal_create_finish(j);
@@ -265,33 +1203,85 @@ int main(int argc, char *argv[]) {
 		}
 
 		ret = ai_journal_open(main_data.journal_file, &main_data.j);
+		if (!ret && streaming) {
+			ret = ai_tar_copy_done(main_data.j);
+			if (ret) {
+				printf("Copying new failed: %s\n", strerror(ret));
+				return ret;
+			}
+		}
 	}
 	if (ret) {
 		printf("Journal open failed: %s\n", strerror(ret));
 		return ret;
 	}
 
-	sa.sa_handler = SIG_IGN;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
+	if (plan) {
+		ai_merge_plan_t p;
 
-	sigaction(SIGUSR1, &sa, NULL);
-	sigaction(SIGUSR2, &sa, NULL);
+		ret = ai_merge_plan(main_data.source, main_data.dest, main_data.j,
+				&main_data.opts, &p);
+		if (!ret || ret == ENOSPC)
+			print_plan(&p);
+		if (ret)
+			printf("Planning failed: %s\n", strerror(ret));
 
-	sa.sa_handler = &term_handler;
-	sigaddset(&sa.sa_mask, SIGINT);
-	sigaddset(&sa.sa_mask, SIGTERM);
-	sigaddset(&sa.sa_mask, SIGHUP);
+		ai_journal_close(main_data.j);
+		/* a dry run leaves nothing behind */
+		if (created && unlink(main_data.journal_file))
+			printf("Journal removal failed: %s\n", strerror(errno));
+		return ret != 0;
+	}
 
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGHUP, &sa, NULL);
+	if (main_data.status) {
+		main_data.status_file = malloc(strlen(main_data.journal_file) + 8);
+		if (!main_data.status_file) {
+			printf("Memory allocation failed: %s\n", strerror(errno));
+			return 1;
+		}
+		sprintf(main_data.status_file, "%s.status", main_data.journal_file);
+		ret = ai_merge_status_open(main_data.status_file,
+				&main_data.opts.status);
+		if (ret) {
+			printf("Status file creation failed: %s\n", strerror(ret));
+			return 1;
+		}
+	}
+
+	if (main_data.lock_file && !lock) {
+		/* versioned roots are switched as a whole */
+		ret = lock_dest(main_data.lock_file, main_data.dest, main_data.j,
+				main_data.versioned || ai_journal_get_flags(main_data.j)
+					& AI_MERGE_VERSIONED_ROOT ? AI_LOCK_TREE : 0, &lock);
+		if (ret)
+			return 1;
+	}
 
+	setup_signals();
 	ret = loop(&main_data);
+	if (stats) {
+		ai_merge_set_stats(NULL);
+		print_stats(&merge_stats);
+	}
+	dump_trace(&main_data);
 
 	ret2 = ai_journal_close(main_data.j);
 	if (ret2)
 		printf("Journal close failed: %s\n", strerror(ret));
+	if (lock)
+		ai_lock_release(lock);
+
+	if (store)
+		ai_store_close(store);
+	free(main_data.manifest_file);
+	ai_merge_status_close(main_data.opts.status);
+	ai_copy_throttle_free(main_data.opts.throttle);
+	free(main_data.status_file);
+	free(main_data.trace_file);
 
 	return ret || ret2;
 }
+
+int main(int argc, char *argv[]) {
+	return run(argc, argv);
+}
@@ -0,0 +1,640 @@
+/* atomic-install -- merge daemon
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "lib/copy.h"
+#include "lib/journal.h"
+#include "daemon.h"
+
+/**
+ * DAEMON_MAX_REQUEST
+ *
+ * Maximal length of the request arguments.
+ */
+#define DAEMON_MAX_REQUEST 0x100000
+
+/**
+ * DAEMON_MAX_PROBES
+ *
+ * Maximal number of the probed device pairs a worker reports, so that they
+ * are written to the pipe atomically.
+ */
+#define DAEMON_MAX_PROBES (PIPE_BUF / sizeof(ai_copy_probe_t))
+
+int daemon_serving = 0;
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYNC)
+/**
+ * daemon_sync_state
+ * @lock: mutex protecting the state
+ * @done: condition signalled when a sync() finishes
+ * @started: number of the last sync() started
+ * @completed: number of the last sync() finished
+ * @running: whether a sync() is running now
+ * @runner: the worker running sync()
+ *
+ * The group commit state, shared by all the workers.
+ */
+struct daemon_sync_state {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	unsigned long int started;
+	unsigned long int completed;
+	int running;
+	pid_t runner;
+};
+
+static struct daemon_sync_state *daemon_sync_state = NULL;
+
+/**
+ * daemon_sync_init
+ *
+ * Set up the group commit state, to be shared with the workers.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int daemon_sync_init(void) {
+	struct daemon_sync_state *s;
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+
+	s = mmap(NULL, sizeof(*s), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED)
+		return errno;
+
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	/* the workers can be killed while holding it */
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&s->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&s->done, &ca);
+	pthread_condattr_destroy(&ca);
+
+	s->started = s->completed = 0;
+	s->running = 0;
+
+	daemon_sync_state = s;
+	return 0;
+}
+
+/**
+ * daemon_sync_recover
+ * @s: the group commit state
+ * @ret: the value returned when locking the state
+ *
+ * Recover the state if the worker holding the lock has died. It could have
+ * been running sync(), so a new one is started by the next worker.
+ */
+static void daemon_sync_recover(struct daemon_sync_state *s, int ret) {
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&s->lock);
+		s->running = 0;
+	}
+#endif
+}
+
+/**
+ * daemon_sync
+ *
+ * Flush the filesystem changes to disk, sharing the sync() with the other
+ * workers. A sync() started after the call covers all the changes made before
+ * it, so the workers arriving while a sync() is running wait for it to finish
+ * and then one of them performs a single sync() for all of them.
+ *
+ * If the worker running sync() is gone, or doesn't finish in 5 seconds,
+ * the waiting worker takes over and starts a new sync().
+ *
+ * It is not async-signal-safe.
+ */
+static void daemon_sync(void) {
+	struct daemon_sync_state *s = daemon_sync_state;
+	const pid_t self = getpid();
+	unsigned long int needed;
+
+	daemon_sync_recover(s, pthread_mutex_lock(&s->lock));
+	needed = s->started + 1;
+
+	while (s->completed < needed) {
+		if (!s->running) {
+			const unsigned long int round = ++s->started;
+
+			s->running = 1;
+			s->runner = self;
+			pthread_mutex_unlock(&s->lock);
+			sync();
+			daemon_sync_recover(s, pthread_mutex_lock(&s->lock));
+			/* unless another worker has taken over */
+			if (s->runner == self)
+				s->running = 0;
+			if (s->completed < round)
+				s->completed = round;
+			pthread_cond_broadcast(&s->done);
+		} else if (kill(s->runner, 0) == -1 && errno == ESRCH) {
+			/* the worker running sync() has been killed */
+			s->running = 0;
+		} else {
+			struct timespec ts;
+			int ret;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 5;
+			ret = pthread_cond_timedwait(&s->done, &s->lock, &ts);
+			daemon_sync_recover(s, ret);
+			if (ret == ETIMEDOUT)
+				s->running = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+#endif
+
+/**
+ * daemon_read
+ * @fd: the socket
+ * @buf: buffer to read into
+ * @len: number of bytes to read
+ *
+ * Read exactly @len bytes from @fd.
+ *
+ * Returns: 0 on success, errno otherwise (EPIPE on premature EOF)
+ */
+static int daemon_read(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t rd = read(fd, buf, len);
+
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		} else if (rd == 0)
+			return EPIPE;
+
+		buf += rd;
+		len -= rd;
+	}
+
+	return 0;
+}
+
+/**
+ * daemon_write
+ * @fd: the socket
+ * @buf: data to write
+ * @len: data length
+ *
+ * Write exactly @len bytes to @fd.
+ *
+ * Returns: 0 on success, errno otherwise
+ */
+static int daemon_write(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t wr = write(fd, buf, len);
+
+		if (wr == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		buf += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+/**
+ * daemon_addr
+ * @socket_path: path to the socket
+ * @addr: the address to fill in
+ *
+ * Fill in the socket address for @socket_path.
+ *
+ * Returns: 0 on success, ENAMETOOLONG if the path does not fit
+ */
+static int daemon_addr(const char *socket_path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr->sun_path))
+		return ENAMETOOLONG;
+	strcpy(addr->sun_path, socket_path);
+	return 0;
+}
+
+#if defined(O_ASYNC) && defined(F_SETOWN)
+/**
+ * daemon_client
+ *
+ * The client connection of the worker.
+ */
+static int daemon_client = -1;
+
+/**
+ * daemon_hangup
+ * @sig: the signal number
+ *
+ * Terminate the request if the client has gone away (e.g. interrupted
+ * with Ctrl-C), so that it is rolled back by the SIGHUP handler.
+ */
+static void daemon_hangup(int sig) {
+	struct pollfd pfd;
+
+	pfd.fd = daemon_client;
+	pfd.events = POLLIN;
+	/* the client doesn't send anything after the request */
+	if (poll(&pfd, 1, 0) == 1)
+		raise(SIGHUP);
+}
+#endif
+
+/**
+ * daemon_report_probes
+ * @probes: the pipe to the daemon
+ *
+ * Pass the copying strategies probed by the worker to the daemon, so that
+ * the following workers don't need to probe the devices again.
+ */
+static void daemon_report_probes(int probes) {
+	ai_copy_probe_t buf[DAEMON_MAX_PROBES];
+	size_t count = ai_copy_get_probes(buf, DAEMON_MAX_PROBES);
+
+	if (count > DAEMON_MAX_PROBES)
+		count = DAEMON_MAX_PROBES;
+	if (count)
+		daemon_write(probes, (const char*) buf, count * sizeof(*buf));
+}
+
+/**
+ * daemon_read_probes
+ * @probes: the non-blocking pipe from the workers
+ *
+ * Add the copying strategies reported by the workers. They are inherited
+ * by the workers forked afterwards.
+ */
+static void daemon_read_probes(int probes) {
+	ai_copy_probe_t buf[DAEMON_MAX_PROBES];
+	ssize_t rd;
+
+	/* the reports are written atomically, so they are never split */
+	while ((rd = read(probes, buf, sizeof(buf))) > 0
+			|| (rd == -1 && errno == EINTR)) {
+		if (rd > 0)
+			ai_copy_add_probes(buf, rd / sizeof(*buf));
+	}
+}
+
+/**
+ * daemon_worker
+ * @fd: the client connection
+ * @probes: the pipe to the daemon
+ * @run: function performing the request
+ *
+ * Receive a request from the client, run it with the client's standard
+ * streams and working directory, and send back the exit status. If the client
+ * disconnects before the request finishes, it is terminated with SIGHUP.
+ *
+ * Returns: the exit status
+ */
+static int daemon_worker(int fd, int probes, daemon_run_func_t run) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *c;
+	uint32_t len = 0;
+	char *req, *p, **argv;
+	int argc = 0, i, ret;
+	unsigned char status;
+	ssize_t rd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	while ((rd = recvmsg(fd, &msg, 0)) != sizeof(len)) {
+		if (rd != -1 || errno != EINTR)
+			return 1;
+	}
+
+	c = CMSG_FIRSTHDR(&msg);
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+			|| c->cmsg_len != CMSG_LEN(3 * sizeof(int))
+			|| len == 0 || len > DAEMON_MAX_REQUEST)
+		return 1;
+
+	req = malloc(len + 1);
+	if (!req || daemon_read(fd, req, len))
+		return 1;
+	req[len] = 0;
+
+	/* the client's stdin, stdout and stderr */
+	for (i = 0; i < 3; i++) {
+		int cfd;
+
+		memcpy(&cfd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+		if (dup2(cfd, i) == -1)
+			return 1;
+		close(cfd);
+	}
+
+	/* working directory, then the arguments */
+	for (p = req; p < req + len; p += strlen(p) + 1)
+		argc++;
+	/* getopt_long() expects a null-terminated array, like main() gets */
+	argv = malloc((argc + 1) * sizeof(*argv));
+	if (!argv)
+		return 1;
+	for (p = req, i = 0; p < req + len; p += strlen(p) + 1)
+		argv[i++] = p;
+	argv[argc] = NULL;
+
+#if defined(O_ASYNC) && defined(F_SETOWN)
+	{
+		struct sigaction sa;
+		const int flags = fcntl(fd, F_GETFL);
+
+		sa.sa_handler = daemon_hangup;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGIO, &sa, NULL);
+
+		daemon_client = fd;
+		if (flags != -1 && !fcntl(fd, F_SETOWN, getpid()))
+			fcntl(fd, F_SETFL, flags | O_ASYNC);
+		/* the client could have gone away already */
+		daemon_hangup(SIGIO);
+	}
+#endif
+
+	/* the working directory and the program name are always sent */
+	if (argc < 2) {
+		printf("Invalid daemon request.\n");
+		ret = 1;
+	} else if (chdir(argv[0])) {
+		printf("Changing directory to %s failed: %s\n", argv[0], strerror(errno));
+		ret = 1;
+	} else {
+		/* reinitialize getopt() */
+		optind = 0;
+		ret = run(argc - 1, &argv[1]);
+	}
+
+#if defined(O_ASYNC) && defined(F_SETOWN)
+	/* the request is finished, there is nothing to roll back */
+	signal(SIGIO, SIG_IGN);
+#endif
+	daemon_report_probes(probes);
+
+	fflush(stdout);
+	fflush(stderr);
+	status = ret;
+	daemon_write(fd, (const char*) &status, 1);
+
+	free(argv);
+	free(req);
+	return ret;
+}
+
+int daemon_serve(const char *socket_path, daemon_run_func_t run) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t mask;
+	int fd, ret, probes[2];
+
+	ret = daemon_addr(socket_path, &addr);
+	if (ret) {
+		printf("Invalid socket path: %s\n", strerror(ret));
+		return 1;
+	}
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYNC)
+	ret = daemon_sync_init();
+	if (ret) {
+		printf("Group commit setup failed: %s\n", strerror(ret));
+		return 1;
+	}
+#endif
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		printf("Socket creation failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* remove the stale socket */
+	if (unlink(socket_path) && errno != ENOENT) {
+		printf("Stale socket removal failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* the requests are performed with the daemon privileges, so the socket
+	 * must not be accessible to the other users even for a moment */
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+	if (ret || listen(fd, 16)) {
+		printf("Socket setup failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* the workers report the probed copying strategies back */
+	if (pipe(probes) || fcntl(probes[0], F_SETFL, O_NONBLOCK)) {
+		printf("Pipe creation failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* let the workers be reaped automatically */
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDWAIT;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	printf("* Listening on %s...\n", socket_path);
+	fflush(stdout);
+
+	while (1) {
+		struct pollfd pfds[2];
+		pid_t pid;
+		int cfd;
+
+		pfds[0].fd = fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = probes[0];
+		pfds[1].events = POLLIN;
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			printf("Polling failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if (pfds[1].revents & POLLIN)
+			daemon_read_probes(probes[0]);
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+
+		cfd = accept(fd, NULL, NULL);
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("Accepting connection failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(fd);
+			close(probes[0]);
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			sigaction(SIGCHLD, &sa, NULL);
+
+			daemon_serving = 1;
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYNC)
+			ai_journal_set_sync_func(daemon_sync);
+#endif
+			_exit(daemon_worker(cfd, probes[1], run));
+		} else if (pid == -1)
+			printf("Worker fork failed: %s\n", strerror(errno));
+
+		close(cfd);
+	}
+}
+
+int daemon_submit(const char *socket_path, int argc, char *argv[]) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	const int fds[3] = { 0, 1, 2 };
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *c;
+	char cwd[4096];
+	char *req, *p;
+	size_t len;
+	uint32_t len32;
+	unsigned char status;
+	int fd, i, ret;
+
+	ret = daemon_addr(socket_path, &addr);
+	if (ret) {
+		printf("Invalid socket path: %s\n", strerror(ret));
+		return 1;
+	}
+
+	if (!getcwd(cwd, sizeof(cwd))) {
+		printf("Getting working directory failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	len = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > DAEMON_MAX_REQUEST) {
+		printf("Request too long.\n");
+		return 1;
+	}
+
+	req = malloc(len);
+	if (!req) {
+		printf("Memory allocation failed: %s\n", strerror(errno));
+		return 1;
+	}
+	p = req;
+	strcpy(p, cwd);
+	p += strlen(p) + 1;
+	for (i = 0; i < argc; i++) {
+		strcpy(p, argv[i]);
+		p += strlen(p) + 1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		printf("Connecting to daemon failed: %s\n", strerror(errno));
+		free(req);
+		return 1;
+	}
+
+	/* pass the standard streams along with the request length */
+	len32 = len;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len32;
+	iov.iov_len = sizeof(len32);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+	fflush(stdout);
+	if (sendmsg(fd, &msg, 0) != sizeof(len32))
+		ret = errno;
+	else
+		ret = daemon_write(fd, req, len);
+	free(req);
+
+	if (ret) {
+		printf("Sending request failed: %s\n", strerror(ret));
+		close(fd);
+		return 1;
+	}
+
+	ret = daemon_read(fd, (char*) &status, 1);
+	close(fd);
+	if (ret) {
+		printf("Daemon connection lost: %s\n", strerror(ret));
+		return 1;
+	}
+
+	return status;
+}
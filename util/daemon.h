@@ -0,0 +1,55 @@
+/* atomic-install -- merge daemon
+ * (c) 2011 Michał Górny
+ * 2-clause BSD-licensed
+ */
+
+#pragma once
+#ifndef _ATOMIC_INSTALL_DAEMON_H
+#define _ATOMIC_INSTALL_DAEMON_H
+
+/**
+ * daemon_run_func_t
+ *
+ * The type of function performing a single request, given its command-line
+ * arguments. It returns the exit status.
+ */
+typedef int (*daemon_run_func_t)(int argc, char *argv[]);
+
+/**
+ * daemon_serve
+ * @socket_path: path to the UNIX socket to listen on
+ * @run: function performing the requests
+ *
+ * Accept merge requests on @socket_path, and run each of them in a forked
+ * worker process, with the client's standard streams and working directory.
+ * The workers inherit the daemon state (e.g. the open object store), and share
+ * the journal sync()s of the requests running at the same time. The copying
+ * strategies probed by a worker are passed back to the daemon, and inherited
+ * by the following workers. If the client disconnects before its request
+ * finishes, the request is rolled back.
+ *
+ * Returns: exit status on failure, never returns otherwise
+ */
+int daemon_serve(const char *socket_path, daemon_run_func_t run);
+
+/**
+ * daemon_submit
+ * @socket_path: path to the daemon socket
+ * @argc: argument count
+ * @argv: arguments for the request
+ *
+ * Submit a request to the daemon listening on @socket_path, and wait for it
+ * to finish. The standard streams of the process are passed to the daemon.
+ *
+ * Returns: the exit status of the request
+ */
+int daemon_submit(const char *socket_path, int argc, char *argv[]);
+
+/**
+ * daemon_serving
+ *
+ * Set in the worker processes performing the requests.
+ */
+extern int daemon_serving;
+
+#endif /*_ATOMIC_INSTALL_DAEMON_H*/